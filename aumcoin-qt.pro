@@ -122,6 +122,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/db.h \
     src/walletdb.h \
     src/script.h \
+    src/stratum.h \
+    src/rpcjson.h \
     src/init.h \
     src/irc.h \
     src/mruset.h \
@@ -212,6 +214,8 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/bitcoinrpc.cpp \
     src/rpcdump.cpp \
     src/rpcnet.cpp \
+    src/stratum.cpp \
+    src/rpcjson.cpp \
     src/qt/overviewpage.cpp \
     src/qt/csvmodelwriter.cpp \
     src/crypter.cpp \
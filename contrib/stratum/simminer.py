@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2026 AumCoin Developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+# Simulated miner for the node's built-in stratum server (-stratum).
+#
+# It subscribes, authorizes, asks for a very low share difficulty and then
+# grinds scrypt shares in pure python, printing every notification and the
+# server's verdict on each submitted share.  Meant for local testing, not
+# for mining.
+#
+#   simminer.py [--host 127.0.0.1] [--port 19445] [--shares 10]
+#
+
+import argparse
+import hashlib
+import json
+import socket
+import struct
+import sys
+
+DIFF1_TARGET = 0x0000ffff << 208
+
+
+def sha256d(data):
+    return hashlib.sha256(hashlib.sha256(data).digest()).digest()
+
+
+def swap_words(data):
+    return b''.join(data[i:i+4][::-1] for i in range(0, len(data), 4))
+
+
+class StratumClient:
+    def __init__(self, host, port):
+        self.sock = socket.create_connection((host, port))
+        self.file = self.sock.makefile('r')
+        self.nextid = 1
+        self.pending = []
+
+    def call(self, method, params):
+        msgid = self.nextid
+        self.nextid += 1
+        self.sock.sendall((json.dumps({'id': msgid, 'method': method, 'params': params}) + '\n').encode())
+        while True:
+            msg = self.read()
+            if msg.get('id') == msgid:
+                return msg
+            self.pending.append(msg)
+
+    def read(self):
+        if self.pending:
+            return self.pending.pop(0)
+        line = self.file.readline()
+        if not line:
+            sys.exit('connection closed by server')
+        return json.loads(line)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Simulated stratum miner')
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=19445)
+    parser.add_argument('--user', default='simminer')
+    parser.add_argument('--password', default='x')
+    parser.add_argument('--difficulty', type=float, default=0.0001)
+    parser.add_argument('--shares', type=int, default=10)
+    args = parser.parse_args()
+
+    client = StratumClient(args.host, args.port)
+    sub = client.call('mining.subscribe', ['simminer/0.1'])
+    extranonce1 = bytes.fromhex(sub['result'][1])
+    extranonce2_size = sub['result'][2]
+    print('subscribed, extranonce1=%s extranonce2_size=%d' % (extranonce1.hex(), extranonce2_size))
+
+    auth = client.call('mining.authorize', [args.user, args.password])
+    if not auth['result']:
+        sys.exit('authorize failed: %s' % auth['error'])
+    client.call('mining.suggest_difficulty', [args.difficulty])
+
+    difficulty = args.difficulty
+    job = None
+    extranonce2 = 0
+    accepted = rejected = 0
+    while accepted + rejected < args.shares:
+        while job is None or client.pending:
+            msg = client.read()
+            if msg.get('method') == 'mining.set_difficulty':
+                difficulty = msg['params'][0]
+                print('difficulty %g' % difficulty)
+            elif msg.get('method') == 'mining.notify':
+                job = msg['params']
+                print('job %s prevhash=%s clean=%s' % (job[0], job[1], job[8]))
+
+        job_id, prevhash, coinb1, coinb2, branch, version, nbits, ntime = job[:8]
+        en2 = extranonce2.to_bytes(extranonce2_size, 'big')
+        extranonce2 += 1
+
+        coinbase = bytes.fromhex(coinb1) + extranonce1 + en2 + bytes.fromhex(coinb2)
+        merkle_root = sha256d(coinbase)
+        for h in branch:
+            merkle_root = sha256d(merkle_root + bytes.fromhex(h))
+
+        header = (struct.pack('<I', int(version, 16)) +
+                  swap_words(bytes.fromhex(prevhash)) +
+                  merkle_root +
+                  struct.pack('<II', int(ntime, 16), int(nbits, 16)))
+        target = int(DIFF1_TARGET / difficulty)
+
+        for nonce in range(0x100000):
+            full = header + struct.pack('<I', nonce)
+            pow_hash = hashlib.scrypt(full, salt=full, n=1024, r=1, p=1, dklen=32)
+            if int.from_bytes(pow_hash, 'little') <= target:
+                reply = client.call('mining.submit', [args.user, job_id, en2.hex(), ntime, '%08x' % nonce])
+                if reply['result']:
+                    accepted += 1
+                else:
+                    rejected += 1
+                print('share nonce=%08x: %s' % (nonce, reply['result'] or reply['error']))
+                break
+
+    print('%d accepted, %d rejected' % (accepted, rejected))
+
+
+if __name__ == '__main__':
+    main()
@@ -13,6 +13,7 @@
 #include "ui_interface.h"
 #include "base58.h"
 #include "bitcoinrpc.h"
+#include "rpcjson.h"
 
 #undef printf
 #include <boost/asio.hpp>
@@ -27,6 +28,9 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/tss.hpp>
+#include <deque>
 #include <list>
 
 #define printf OutputDebugStringF
@@ -51,6 +55,7 @@ extern Value getconnectioncount(const Array& params, bool fHelp);
 extern Value getpeerinfo(const Array& params, bool fHelp);
 extern Value dumpprivkey(const Array& params, bool fHelp);
 extern Value importprivkey(const Array& params, bool fHelp);
+extern Value getrescaninfo(const Array& params, bool fHelp);
 
 #ifdef ENABLE_MLDSA
 extern Value getnewmldsaaddress(const Array& params, bool fHelp);
@@ -65,6 +70,8 @@ extern Value signmldsatx(const Array& params, bool fHelp);
 const Object emptyobj;
 
 void ThreadRPCServer3(void* parg);
+Value getrpcstats(const Array& params, bool fHelp);
+Value getlockstats(const Array& params, bool fHelp);
 
 Object JSONRPCError(int code, const string& message)
 {
@@ -190,22 +197,30 @@ void WalletTxToJSON(const CWalletTx& wtx, Object& entry)
         entry.push_back(Pair(item.first, item.second));
 }
 
+// The output txin spends, null if it can't be found
+static CTxOut GetSpentTxOut(const CTxIn& txin)
+{
+    CTransaction txprev;
+    uint256 hashTxprevBlock;
+    if (!GetTransaction(txin.prevout.hash, txprev, hashTxprevBlock) || txin.prevout.n >= txprev.vout.size())
+        return CTxOut();
+    return txprev.vout[txin.prevout.n];
+}
+
 void
-ScriptSigToJSON(const CTxIn& txin, Object& out)
+ScriptSigToJSON(const CTxIn& txin, const CTxOut& txoutPrev, Object& out)
 {
     out.push_back(Pair("asm", txin.scriptSig.ToString()));
     out.push_back(Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
 
-    CTransaction txprev;
-    uint256 hashTxprevBlock;
-    if (!GetTransaction(txin.prevout.hash, txprev, hashTxprevBlock))
+    if (txoutPrev.IsNull())
         return;
 
     txnouttype type;
     vector<CTxDestination> addresses;
     int nRequired;
 
-    if (!ExtractDestinations(txprev.vout[txin.prevout.n].scriptPubKey, type,
+    if (!ExtractDestinations(txoutPrev.scriptPubKey, type,
                           addresses, nRequired))
     {
         out.push_back(Pair("type", GetTxnOutputType(TX_NONSTANDARD)));
@@ -250,7 +265,9 @@ ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out)
     out.push_back(Pair("addresses", a));
 }
 
-void TxToJSON(const CTransaction &tx, Object& entry, const Object& decompositions)
+// pvPrevOuts, if given, holds the outputs tx's inputs spend, so that
+// scriptSigs as objects don't need the chain
+void TxToJSON(const CTransaction &tx, Object& entry, const Object& decompositions, const vector<CTxOut>* pvPrevOuts = NULL)
 {
     entry.push_back(Pair("version", tx.nVersion));
     entry.push_back(Pair("locktime", (boost::int64_t)tx.nLockTime));
@@ -259,8 +276,9 @@ void TxToJSON(const CTransaction &tx, Object& entry, const Object& decomposition
     enum DecomposeMode decomposeScript = FindDecompose(decompositions, "script", "asm");
 
     Array vin;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
+        const CTxIn& txin = tx.vin[i];
         Object in;
         if (tx.IsCoinBase())
             in.push_back(Pair("coinbase", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
@@ -282,7 +300,7 @@ void TxToJSON(const CTransaction &tx, Object& entry, const Object& decomposition
             case DM_OBJ:
             {
                 Object o;
-                ScriptSigToJSON(txin, o);
+                ScriptSigToJSON(txin, pvPrevOuts ? (*pvPrevOuts)[i] : GetSpentTxOut(txin), o);
                 in.push_back(Pair("scriptSig", o));
                 break;
             }
@@ -324,6 +342,7 @@ void TxToJSON(const CTransaction &tx, Object& entry, const Object& decomposition
 }
 
 void AnyTxToJSON(const uint256 hash, const CTransaction* ptx, Object& entry, const Object& decompositions);
+static bool TxContextToJSON(const uint256& hash, const CTransaction*& ptx, CTransaction& txFound, Object& before, Object& after);
 
 string AccountFromValue(const Value& value)
 {
@@ -333,7 +352,7 @@ string AccountFromValue(const Value& value)
     return strAccount;
 }
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, const Object& decompositions)
+static Object blockHeaderToJSON(const CBlock& block, const CBlockIndex* blockindex)
 {
     Object result;
     result.push_back(Pair("hash", block.GetHash().GetHex()));
@@ -348,44 +367,170 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, const Obj
     result.push_back(Pair("nonce", (boost::uint64_t)block.nNonce));
     result.push_back(Pair("bits", HexBits(block.nBits)));
     result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
+    return result;
+}
 
+static enum DecomposeMode FindBlockTxDecompose(const Object& decompositions)
+{
     enum DecomposeMode decomposeTxn = FindDecompose(decompositions, "tx", "hash");
+    if (decomposeTxn == DM_ASM)
+        throw JSONRPCError(-18, "Invalid transaction decomposition");
+    if (decomposeTxn == DM_OBJ && FindDecompose(decompositions, "script", "asm") == DM_HASH)
+        throw JSONRPCError(-18, "Invalid script decomposition");
+    return decomposeTxn;
+}
+
+static Value blockTxToJSON(const CTransaction& tx, enum DecomposeMode decomposeTxn, const Object& decompositions)
+{
+    switch (decomposeTxn) {
+    case DM_OBJ:
+    {
+        Object entry;
+        AnyTxToJSON(tx.GetHash(), &tx, entry, decompositions);
+        return entry;
+    }
+    case DM_HEX:
+    {
+        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+        ssTx << tx;
+        return HexStr(ssTx.begin(), ssTx.end());
+    }
+    default:
+        return tx.GetHash().GetHex();
+    }
+}
+
+static void blockLinksToJSON(const CBlockIndex* blockindex, Object& result)
+{
+    if (blockindex->pprev)
+        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
+    if (blockindex->pnext)
+        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
+}
+
+Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, const Object& decompositions)
+{
+    enum DecomposeMode decomposeTxn = FindBlockTxDecompose(decompositions);
+    Object result = blockHeaderToJSON(block, blockindex);
     if (decomposeTxn)
     {
         Array txs;
-        switch (decomposeTxn) {
-        case DM_OBJ:
-            BOOST_FOREACH (const CTransaction&tx, block.vtx)
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            txs.push_back(blockTxToJSON(tx, decomposeTxn, decompositions));
+        result.push_back(Pair("tx", txs));
+    }
+    blockLinksToJSON(blockindex, result);
+    return result;
+}
+
+// Members of an object, written exactly as they appear inside one
+static void WriteJSONPairs(CRPCStream& stream, const Object& obj, bool fFirst)
+{
+    string str;
+    BOOST_FOREACH(const Pair& pair, obj)
+    {
+        if (!fFirst)
+            str += ',';
+        WriteJSON(Value(pair.name_), str);
+        str += ':';
+        WriteJSON(pair.value_, str);
+        fFirst = false;
+    }
+    stream.Write(str);
+}
+
+/**
+ * A block's JSON in two parts.  What needs the chain or the wallet is
+ * gathered when this is made: the header, the links and, for transactions
+ * as objects, a small record per transaction.  The rest is written from the
+ * transactions alone, one at a time.
+ */
+class CBlockJSONWriter : public CRPCStreamedResult
+{
+public:
+    /** Takes over blockIn's transactions */
+    CBlockJSONWriter(CBlock& blockIn, const CBlockIndex* blockindex, const Object& decompositionsIn)
+    {
+        // Reject bad decompositions before the first byte goes out
+        decomposeTxn = FindBlockTxDecompose(decompositionsIn);
+        decompositions = decompositionsIn;
+        header = blockHeaderToJSON(blockIn, blockindex);
+        blockLinksToJSON(blockindex, links);
+        vtx.swap(blockIn.vtx);
+        fPrevOuts = (decomposeTxn == DM_OBJ && FindDecompose(decompositions, "script", "asm") == DM_OBJ);
+        if (decomposeTxn == DM_OBJ)
+        {
+            vRecords.resize(vtx.size());
+            for (unsigned int i = 0; i < vtx.size(); i++)
             {
-                Object entry;
-                AnyTxToJSON(tx.GetHash(), &tx, entry, decompositions);
-                txs.push_back(entry);
+                CTxRecord& record = vRecords[i];
+                const CTransaction* ptx = &vtx[i];
+                CTransaction txFound;
+                TxContextToJSON(ptx->GetHash(), ptx, txFound, record.before, record.after);
+                if (fPrevOuts && !vtx[i].IsCoinBase())
+                {
+                    BOOST_FOREACH(const CTxIn& txin, vtx[i].vin)
+                        record.vPrevOuts.push_back(GetSpentTxOut(txin));
+                }
             }
-            break;
-        case DM_HEX:
-            BOOST_FOREACH (const CTransaction&tx, block.vtx)
-            {
-                CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-                ssTx << tx;
+        }
+    }
 
-                txs.push_back(HexStr(ssTx.begin(), ssTx.end()));
+    void Write(CRPCStream& stream) const
+    {
+        stream.Write("{");
+        WriteJSONPairs(stream, header, true);
+        if (decomposeTxn)
+        {
+            stream.Write(",\"tx\":[");
+            for (unsigned int i = 0; i < vtx.size(); i++)
+            {
+                string str = (i ? "," : "");
+                if (decomposeTxn == DM_OBJ)
+                {
+                    const CTxRecord& record = vRecords[i];
+                    Object entry(record.before);
+                    TxToJSON(vtx[i], entry, decompositions, fPrevOuts ? &record.vPrevOuts : NULL);
+                    entry.insert(entry.end(), record.after.begin(), record.after.end());
+                    WriteJSON(Value(entry), str);
+                }
+                else
+                    WriteJSON(blockTxToJSON(vtx[i], decomposeTxn, decompositions), str);
+                stream.Write(str);
             }
-            break;
-        case DM_HASH:
-            BOOST_FOREACH (const CTransaction&tx, block.vtx)
-                txs.push_back(tx.GetHash().GetHex());
-            break;
-        default:
-            throw JSONRPCError(-18, "Invalid transaction decomposition");
+            stream.Write("]");
         }
-        result.push_back(Pair("tx", txs));
+        WriteJSONPairs(stream, links, false);
+        stream.Write("}");
     }
 
-    if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
-    return result;
+private:
+    // What the wallet or the chain adds to one transaction's object
+    struct CTxRecord
+    {
+        Object before;
+        Object after;
+        vector<CTxOut> vPrevOuts;   // with fPrevOuts, the outputs its inputs spend
+    };
+
+    enum DecomposeMode decomposeTxn;
+    Object decompositions;
+    bool fPrevOuts;
+    Object header;
+    Object links;
+    vector<CTransaction> vtx;
+    vector<CTxRecord> vRecords;
+};
+
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, const Object& decompositions, CRPCStream& stream)
+{
+    CBlock blockCopy(block);
+    CBlockJSONWriter(blockCopy, blockindex, decompositions).Write(stream);
+}
+
+boost::shared_ptr<CRPCStreamedResult> blockJSONWriter(CBlock& block, const CBlockIndex* blockindex, const Object& decompositions)
+{
+    return boost::shared_ptr<CRPCStreamedResult>(new CBlockJSONWriter(block, blockindex, decompositions));
 }
 
 
@@ -493,9 +638,7 @@ int GetNetworkHashPS(int lookup) {
     if (lookup > pindexBest->nHeight)
         lookup = pindexBest->nHeight;
 
-    CBlockIndex* pindexPrev = pindexBest;
-    for (int i = 0; i < lookup; i++)
-        pindexPrev = pindexPrev->pprev;
+    CBlockIndex* pindexPrev = pindexBest->GetAncestor(pindexBest->nHeight - lookup);
 
     double timeDiff = pindexBest->GetBlockTime() - pindexPrev->GetBlockTime();
     double timePerBlock = timeDiff / lookup;
@@ -999,35 +1142,9 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 }
 
 
-int64 GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMinDepth)
-{
-    int64 nBalance = 0;
-
-    // Tally wallet transactions
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        const CWalletTx& wtx = (*it).second;
-        if (!wtx.IsFinal())
-            continue;
-
-        int64 nGenerated, nReceived, nSent, nFee;
-        wtx.GetAccountAmounts(strAccount, nGenerated, nReceived, nSent, nFee);
-
-        if (nReceived != 0 && wtx.GetDepthInMainChain() >= nMinDepth)
-            nBalance += nReceived;
-        nBalance += nGenerated - nSent - nFee;
-    }
-
-    // Tally internal accounting entries
-    nBalance += walletdb.GetAccountCreditDebit(strAccount);
-
-    return nBalance;
-}
-
 int64 GetAccountBalance(const string& strAccount, int nMinDepth)
 {
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-    return GetAccountBalance(walletdb, strAccount, nMinDepth);
+    return pwalletMain->GetAccountBalance(strAccount, nMinDepth);
 }
 
 
@@ -1046,35 +1163,11 @@ Value getbalance(const Array& params, bool fHelp)
     if (params.size() > 1)
         nMinDepth = params[1].get_int();
 
-    if (params[0].get_str() == "*") {
-        // Calculate total balance a different way from GetBalance()
-        // (GetBalance() sums up all unspent TxOuts)
-        // getbalance and getbalance '*' should always return the same number.
-        int64 nBalance = 0;
-        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-        {
-            const CWalletTx& wtx = (*it).second;
-            if (!wtx.IsFinal())
-                continue;
-
-            int64 allGeneratedImmature, allGeneratedMature, allFee;
-            allGeneratedImmature = allGeneratedMature = allFee = 0;
-            string strSentAccount;
-            list<pair<CTxDestination, int64> > listReceived;
-            list<pair<CTxDestination, int64> > listSent;
-            wtx.GetAmounts(allGeneratedImmature, allGeneratedMature, listReceived, listSent, allFee, strSentAccount);
-            if (wtx.GetDepthInMainChain() >= nMinDepth)
-            {
-                BOOST_FOREACH(const PAIRTYPE(CTxDestination,int64)& r, listReceived)
-                    nBalance += r.second;
-            }
-            BOOST_FOREACH(const PAIRTYPE(CTxDestination,int64)& r, listSent)
-                nBalance -= r.second;
-            nBalance -= allFee;
-            nBalance += allGeneratedMature;
-        }
-        return  ValueFromAmount(nBalance);
-    }
+    // Calculated a different way from GetBalance() (which sums up all
+    // unspent TxOuts), but getbalance and getbalance '*' should always
+    // return the same number.
+    if (params[0].get_str() == "*")
+        return ValueFromAmount(pwalletMain->GetAccountBalance("*", nMinDepth));
 
     string strAccount = AccountFromValue(params[0]);
 
@@ -1109,21 +1202,23 @@ Value movecmd(const Array& params, bool fHelp)
 
     // Debit
     CAccountingEntry debit;
+    debit.nOrderPos = pwalletMain->IncOrderPosNext(&walletdb);
     debit.strAccount = strFrom;
     debit.nCreditDebit = -nAmount;
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
+    pwalletMain->AddAccountingEntry(debit, walletdb);
 
     // Credit
     CAccountingEntry credit;
+    credit.nOrderPos = pwalletMain->IncOrderPosNext(&walletdb);
     credit.strAccount = strTo;
     credit.nCreditDebit = nAmount;
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
+    pwalletMain->AddAccountingEntry(credit, walletdb);
 
     if (!walletdb.TxnCommit())
         throw JSONRPCError(-20, "database error");
@@ -1549,29 +1644,10 @@ Value listtransactions(const Array& params, bool fHelp)
         throw JSONRPCError(-8, "Negative from");
 
     Array ret;
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-time multimap.
-    typedef pair<CWalletTx*, CAccountingEntry*> TxPair;
-    typedef multimap<int64, TxPair > TxItems;
-    TxItems txByTime;
-
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        CWalletTx* wtx = &((*it).second);
-        txByTime.insert(make_pair(wtx->GetTxTime(), TxPair(wtx, (CAccountingEntry*)0)));
-    }
-    list<CAccountingEntry> acentries;
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
-    {
-        txByTime.insert(make_pair(entry.nTime, TxPair((CWalletTx*)0, &entry)));
-    }
 
     // iterate backwards until we have nCount items to return:
-    for (TxItems::reverse_iterator it = txByTime.rbegin(); it != txByTime.rend(); ++it)
+    CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
+    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
@@ -1640,9 +1716,7 @@ Value listaccounts(const Array& params, bool fHelp)
         }
     }
 
-    list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
-    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(const CAccountingEntry& entry, pwalletMain->laccentries)
         mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
 
     Object ret;
@@ -1682,12 +1756,15 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    // Walk the ordered index so the result comes out oldest to newest
+    for (CWallet::TxItems::iterator it = pwalletMain->wtxOrdered.begin(); it != pwalletMain->wtxOrdered.end(); ++it)
     {
-        CWalletTx tx = (*it).second;
+        const CWalletTx *const pwtx = (*it).second.first;
+        if (pwtx == 0)
+            continue;
 
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
+        if (depth == -1 || pwtx->GetDepthInMainChain() < depth)
+            ListTransactions(*pwtx, "*", 0, true, transactions);
     }
 
     uint256 lastblock;
@@ -1700,11 +1777,7 @@ Value listsinceblock(const Array& params, bool fHelp)
     {
         int target_height = pindexBest->nHeight + 1 - target_confirms;
 
-        CBlockIndex *block;
-        for (block = pindexBest;
-             block && block->nHeight > target_height;
-             block = block->pprev)  { }
-
+        CBlockIndex *block = FindBlockByHeight(target_height);
         lastblock = block ? block->GetBlockHash() : 0;
     }
 
@@ -1715,62 +1788,70 @@ Value listsinceblock(const Array& params, bool fHelp)
     return ret;
 }
 
-void
-AnyTxToJSON(const uint256 hash, const CTransaction* ptx, Object& entry, const Object& decompositions)
+// What the wallet or the chain adds to a transaction's JSON, before and after
+// what TxToJSON writes.  ptx is set to the transaction: the wallet's, the one
+// given or else txFound; false if it isn't known.
+static bool TxContextToJSON(const uint256& hash, const CTransaction*& ptx, CTransaction& txFound, Object& before, Object& after)
 {
     if (pwalletMain->mapWallet.count(hash))
     {
         const CWalletTx& wtx = pwalletMain->mapWallet[hash];
-
-        TxToJSON(wtx, entry, decompositions);
+        ptx = &wtx;
 
         int64 nCredit = wtx.GetCredit();
         int64 nDebit = wtx.GetDebit();
         int64 nNet = nCredit - nDebit;
         int64 nFee = (wtx.IsFromMe() ? wtx.GetValueOut() - nDebit : 0);
 
-        entry.push_back(Pair("amount", ValueFromAmount(nNet - nFee)));
+        after.push_back(Pair("amount", ValueFromAmount(nNet - nFee)));
         if (wtx.IsFromMe())
-            entry.push_back(Pair("fee", ValueFromAmount(nFee)));
+            after.push_back(Pair("fee", ValueFromAmount(nFee)));
 
-        WalletTxToJSON(wtx, entry);
+        WalletTxToJSON(wtx, after);
 
         Array details;
         ListTransactions(pwalletMain->mapWallet[hash], "*", 0, false, details);
-        entry.push_back(Pair("details", details));
+        after.push_back(Pair("details", details));
+        return true;
     }
+
+    uint256 hashBlock = 0;
+    if ((!ptx) && GetTransaction(hash, txFound, hashBlock))
+        ptx = &txFound;
+    if (!ptx)
+        return false;
+    before.push_back(Pair("txid", hash.GetHex()));
+    if (hashBlock == 0)
+        after.push_back(Pair("confirmations", 0));
     else
     {
-        CTransaction tx;
-        uint256 hashBlock = 0;
-        if ((!ptx) && GetTransaction(hash, tx, hashBlock))
-            ptx = &tx;
-        if (ptx)
+        after.push_back(Pair("blockhash", hashBlock.GetHex()));
+        MapBlockIndex::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi != mapBlockIndex.end() && (*mi).second)
         {
-            entry.push_back(Pair("txid", hash.GetHex()));
-            TxToJSON(*ptx, entry, decompositions);
-            if (hashBlock == 0)
-                entry.push_back(Pair("confirmations", 0));
-            else
+            CBlockIndex* pindex = (*mi).second;
+            if (pindex->IsInMainChain())
             {
-                entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
-                if (mi != mapBlockIndex.end() && (*mi).second)
-                {
-                    CBlockIndex* pindex = (*mi).second;
-                    if (pindex->IsInMainChain())
-                    {
-                        entry.push_back(Pair("confirmations", 1 + nBestHeight - pindex->nHeight));
-                        entry.push_back(Pair("time", (boost::int64_t)pindex->nTime));
-                    }
-                    else
-                        entry.push_back(Pair("confirmations", 0));
-                }
+                after.push_back(Pair("confirmations", 1 + nBestHeight - pindex->nHeight));
+                after.push_back(Pair("time", (boost::int64_t)pindex->nTime));
             }
+            else
+                after.push_back(Pair("confirmations", 0));
         }
-        else
-            throw JSONRPCError(-5, "No information available about transaction");
     }
+    return true;
+}
+
+void
+AnyTxToJSON(const uint256 hash, const CTransaction* ptx, Object& entry, const Object& decompositions)
+{
+    CTransaction txFound;
+    Object before, after;
+    if (!TxContextToJSON(hash, ptx, txFound, before, after))
+        throw JSONRPCError(-5, "No information available about transaction");
+    entry.insert(entry.end(), before.begin(), before.end());
+    TxToJSON(*ptx, entry, decompositions);
+    entry.insert(entry.end(), after.begin(), after.end());
 }
 
 Value gettransaction(const Array& params, bool fHelp)
@@ -1825,11 +1906,6 @@ Value keypoolrefill(const Array& params, bool fHelp)
 }
 
 
-void ThreadTopUpKeyPool(void* parg)
-{
-    pwalletMain->TopUpKeyPool();
-}
-
 void ThreadCleanWalletPassphrase(void* parg)
 {
     int64 nMyWakeTime = GetTimeMillis() + *((int64*)parg) * 1000;
@@ -1902,7 +1978,7 @@ Value walletpassphrase(const Array& params, bool fHelp)
             "walletpassphrase <passphrase> <timeout>\n"
             "Stores the wallet decryption key in memory for <timeout> seconds.");
 
-    CreateThread(ThreadTopUpKeyPool, NULL);
+    pwalletMain->StartTopUpKeyPool();
     int64* pnSleepTime = new int64(params[1].get_int64());
     CreateThread(ThreadCleanWalletPassphrase, pnSleepTime);
 
@@ -2133,6 +2209,7 @@ Value getworkex(const Array& params, bool fHelp)
         std::vector<uint256> merkle = pblock->GetMerkleBranch(0);
 
         Object result;
+        result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate))));
         result.push_back(Pair("data",     HexStr(BEGIN(pdata), END(pdata))));
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
 
@@ -2196,10 +2273,13 @@ Value getwork(const Array& params, bool fHelp)
         throw runtime_error(
             "getwork [data]\n"
             "If [data] is not specified, returns formatted hash data to work on:\n"
-            "  \"midstate\" : precomputed hash state after hashing the first half of the data (DEPRECATED)\n" // deprecated
+            "  \"midstate\" : precomputed SHA-256 state of the first 64 bytes of the data, reusable for scrypt's HMAC key\n"
             "  \"data\" : block data\n"
             "  \"hash1\" : formatted hash buffer for second hash (DEPRECATED)\n" // deprecated
             "  \"target\" : little endian hash target\n"
+            "  \"longpollid\" : id to pass back as {\"longpollid\":id} to wait for new work\n"
+            "If [data] is {\"longpollid\":id}, waits until the best chain changes or enough fees\n"
+            "arrive in the memory pool, then returns new work.\n"
             "If [data] is specified, tries to solve the block and returns true if it was successful.");
 
     if (vNodes.empty())
@@ -2213,15 +2293,18 @@ Value getwork(const Array& params, bool fHelp)
     static vector<CBlock*> vNewBlock;
     static CReserveKey reservekey(pwalletMain);
 
-    if (params.size() == 0)
+    if (params.size() == 0 || params[0].type() == obj_type)
     {
+        // A long poll already waited for a reason to refresh
+        bool fLongPoll = (params.size() == 1);
+
         // Update block
         static unsigned int nTransactionsUpdatedLast;
         static CBlockIndex* pindexPrev;
         static int64 nStart;
         static CBlock* pblock;
         if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+            (nTransactionsUpdated != nTransactionsUpdatedLast && (fLongPoll || GetTime() - nStart > 60)))
         {
             if (pindexPrev != pindexBest)
             {
@@ -2262,10 +2345,11 @@ Value getwork(const Array& params, bool fHelp)
         uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
 
         Object result;
-        result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate)))); // deprecated
+        result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate))));
         result.push_back(Pair("data",     HexStr(BEGIN(pdata), END(pdata))));
         result.push_back(Pair("hash1",    HexStr(BEGIN(phash1), END(phash1)))); // deprecated
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
+        result.push_back(Pair("longpollid", GetTemplateLongPollId()));
         return result;
     }
     else
@@ -2310,9 +2394,12 @@ Value getmemorypool(const Array& params, bool fHelp)
             "  \"mintime\" : minimum timestamp appropriate for next block\n"
             "  \"curtime\" : current timestamp\n"
             "  \"bits\" : compressed target of next block\n"
+            "  \"longpollid\" : id to pass back as {\"longpollid\":id} to wait for a new template\n"
+            "If [data] is {\"longpollid\":id}, waits until the best chain changes or enough fees\n"
+            "arrive in the memory pool, then returns a new template.\n"
             "If [data] is specified, tries to solve the block and returns true if it was successful.");
 
-    if (params.size() == 0)
+    if (params.size() == 0 || params[0].type() == obj_type)
     {
         if (vNodes.empty())
             throw JSONRPCError(-9, "Litecoin is not connected!");
@@ -2327,8 +2414,9 @@ Value getmemorypool(const Array& params, bool fHelp)
         static CBlockIndex* pindexPrev;
         static int64 nStart;
         static CBlock* pblock;
+        bool fLongPoll = (params.size() == 1);
         if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+            (nTransactionsUpdated != nTransactionsUpdatedLast && (fLongPoll || GetTime() - nStart > 5)))
         {
             nTransactionsUpdatedLast = nTransactionsUpdated;
             pindexPrev = pindexBest;
@@ -2367,6 +2455,7 @@ Value getmemorypool(const Array& params, bool fHelp)
         result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
         result.push_back(Pair("curtime", (int64_t)GetAdjustedTime()));
         result.push_back(Pair("bits", HexBits(pblock->nBits)));
+        result.push_back(Pair("longpollid", GetTemplateLongPollId()));
 
         return result;
     }
@@ -2406,13 +2495,10 @@ Value getblockhash(const Array& params, bool fHelp)
             "Returns hash of block in best-block-chain at <index>.");
 
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > nBestHeight)
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    if (nHeight > nBestHeight || !pblockindex)
         throw runtime_error("Block number out of range.");
 
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
     return pblockindex->phashBlock->GetHex();
 }
 
@@ -2426,15 +2512,235 @@ Value getblock(const Array& params, bool fHelp)
     std::string strHash = params[0].get_str();
     uint256 hash(strHash);
 
-    if (mapBlockIndex.count(hash) == 0)
+    MapBlockIndex::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
         throw JSONRPCError(-5, "Block not found");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = (*mi).second;
     block.ReadFromDisk(pblockindex, true);
 
-    return blockToJSON(block, pblockindex,
-                       (params.size() > 1) ? params[1].get_obj() : emptyobj);
+    const Object& decompositions = (params.size() > 1) ? params[1].get_obj() : emptyobj;
+
+    // Big blocks decomposed to objects run to many megabytes of JSON; write
+    // them straight to the client when the transport allows it, once the
+    // locks this runs under are released
+    if (CanStreamRPCResult())
+    {
+        StreamRPCResult(blockJSONWriter(block, pblockindex, decompositions));
+        return Value::null;
+    }
+    return blockToJSON(block, pblockindex, decompositions);
+}
+
+// Totals of a script profile, and with fOpcodes the costliest opcodes first
+static void ScriptProfileToJSON(const CScriptProfile& profile, bool fOpcodes, Object& entry)
+{
+    entry.push_back(Pair("scripts", (int)profile.nScripts));
+    entry.push_back(Pair("ops",     (boost::int64_t)profile.GetOps()));
+    entry.push_back(Pair("ms",      profile.GetMicros() / 1000.0));
+    entry.push_back(Pair("bytes",   (boost::int64_t)profile.GetBytes()));
+    if (!fOpcodes)
+        return;
+
+    // Pushes of 1 to 75 bytes have an opcode each; count them together
+    CScriptProfile profileMerged = profile;
+    for (int i = 2; i < OP_PUSHDATA1; i++)
+    {
+        profileMerged.vCount[1] += profileMerged.vCount[i];
+        profileMerged.vMicros[1] += profileMerged.vMicros[i];
+        profileMerged.vBytes[1] += profileMerged.vBytes[i];
+        profileMerged.vCount[i] = 0;
+    }
+    vector<pair<int64, int> > vOpcodes;
+    for (int i = 0; i < 256; i++)
+        if (profileMerged.vCount[i])
+            vOpcodes.push_back(make_pair(profileMerged.vMicros[i], i));
+    sort(vOpcodes.rbegin(), vOpcodes.rend());
+
+    Array opcodes;
+    BOOST_FOREACH(const PAIRTYPE(int64, int)& item, vOpcodes)
+    {
+        int i = item.second;
+        Object obj;
+        obj.push_back(Pair("opcode", (i > 0 && i < OP_PUSHDATA1) ? "push" : GetOpName((opcodetype)i)));
+        obj.push_back(Pair("count",  (boost::int64_t)profileMerged.vCount[i]));
+        obj.push_back(Pair("ms",     profileMerged.vMicros[i] / 1000.0));
+        obj.push_back(Pair("bytes",  (boost::int64_t)profileMerged.vBytes[i]));
+        opcodes.push_back(obj);
+    }
+    entry.push_back(Pair("opcodes", opcodes));
+}
+
+// A transaction being spent, from the memory pool or the block chain
+static bool GetPrevTx(CTxDB& txdb, const uint256& hash, CTransaction& txPrev)
+{
+    {
+        LOCK(mempool.cs);
+        if (mempool.exists(hash))
+        {
+            txPrev = mempool.lookup(hash);
+            return true;
+        }
+    }
+    CTxIndex txindex;
+    return txPrev.ReadFromDisk(txdb, COutPoint(hash, 0), txindex);
+}
+
+// The transactions tx spends, read while cs_main is held so that its
+// scripts can be run again without it
+static void GetPrevTxs(CTxDB& txdb, const CTransaction& tx, map<uint256, CTransaction>& mapPrev)
+{
+    if (tx.IsCoinBase())
+        return;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (mapPrev.count(txin.prevout.hash))
+            continue;
+        CTransaction txPrev;
+        if (GetPrevTx(txdb, txin.prevout.hash, txPrev))
+            mapPrev[txin.prevout.hash] = txPrev;
+    }
+}
+
+// Runs every input script of tx with a meter, adding to profileRet; false
+// if an input's scripts failed or what it spends isn't in mapPrev
+static bool ProfileTransaction(const map<uint256, CTransaction>& mapPrev, const CTransaction& tx, CScriptProfile& profileRet, Array* pinputs)
+{
+    bool fValid = true;
+    if (tx.IsCoinBase())
+        return true;
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        Object entry;
+        entry.push_back(Pair("n", (int)i));
+        map<uint256, CTransaction>::const_iterator mi = mapPrev.find(tx.vin[i].prevout.hash);
+        if (mi == mapPrev.end())
+        {
+            fValid = false;
+            entry.push_back(Pair("error", "Spent transaction not found"));
+        }
+        else
+        {
+            CScriptProfile profile;
+            bool fInputValid = VerifySignature((*mi).second, tx, i, true, 0, &profile);
+            fValid = fValid && fInputValid;
+            profileRet.Add(profile);
+            entry.push_back(Pair("valid", fInputValid));
+            ScriptProfileToJSON(profile, false, entry);
+        }
+        if (pinputs)
+            pinputs->push_back(entry);
+    }
+    return fValid;
+}
+
+// profiletx and profileblock are run without execute's locks: they take
+// cs_main only to copy out what they verify
+Value profiletx(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "profiletx <txid>\n"
+            "Runs the scripts of a transaction in the memory pool or the block chain again,\n"
+            "and returns how many opcodes ran, the time in milliseconds and the bytes of\n"
+            "stack values made, for each input and for each opcode.");
+
+    uint256 hash;
+    hash.SetHex(params[0].get_str());
+
+    CTransaction tx;
+    uint256 hashBlock = 0;
+    map<uint256, CTransaction> mapPrev;
+    {
+        LOCK(cs_main);
+        if (!GetTransaction(hash, tx, hashBlock))
+            throw JSONRPCError(-5, "No information available about transaction");
+        CTxDB txdb("r");
+        GetPrevTxs(txdb, tx, mapPrev);
+    }
+
+    CScriptProfile profile;
+    Array inputs;
+    bool fValid = ProfileTransaction(mapPrev, tx, profile, &inputs);
+
+    Object result;
+    result.push_back(Pair("txid", hash.GetHex()));
+    if (hashBlock != 0)
+        result.push_back(Pair("blockhash", hashBlock.GetHex()));
+    result.push_back(Pair("valid", fValid));
+    ScriptProfileToJSON(profile, true, result);
+    result.push_back(Pair("inputs", inputs));
+    return result;
+}
+
+Value profileblock(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "profileblock <hash> [count=10]\n"
+            "Runs the scripts of a block again, and returns how many opcodes ran, the time\n"
+            "in milliseconds and the bytes of stack values made, for the block, for each\n"
+            "opcode and for the <count> transactions that took longest.");
+
+    uint256 hash(params[0].get_str());
+    int nCount = 10;
+    if (params.size() > 1)
+        nCount = params[1].get_int();
+    if (nCount < 0)
+        throw JSONRPCError(-8, "Negative count");
+
+    CBlock block;
+    int nHeight;
+    map<uint256, CTransaction> mapPrev;
+    {
+        LOCK(cs_main);
+        MapBlockIndex::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(-5, "Block not found");
+        CBlockIndex* pblockindex = (*mi).second;
+        nHeight = pblockindex->nHeight;
+        block.ReadFromDisk(pblockindex, true);
+        CTxDB txdb("r");
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            GetPrevTxs(txdb, tx, mapPrev);
+    }
+
+    CScriptProfile profileBlock, profileTx;
+    vector<pair<int64, Object> > vTxProfiles;
+    int nInvalid = 0;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        profileTx.SetNull();
+        bool fValid = ProfileTransaction(mapPrev, tx, profileTx, NULL);
+        if (!fValid)
+            nInvalid++;
+        profileBlock.Add(profileTx);
+
+        Object entry;
+        entry.push_back(Pair("txid", tx.GetHash().GetHex()));
+        entry.push_back(Pair("valid", fValid));
+        ScriptProfileToJSON(profileTx, false, entry);
+        vTxProfiles.push_back(make_pair(profileTx.GetMicros(), entry));
+    }
+
+    // Longest first, in block order among equals
+    vector<pair<int64, unsigned int> > vOrder;
+    for (unsigned int i = 0; i < vTxProfiles.size(); i++)
+        vOrder.push_back(make_pair(-vTxProfiles[i].first, i));
+    sort(vOrder.begin(), vOrder.end());
+    Array transactions;
+    for (unsigned int i = 0; i < vOrder.size() && i < (unsigned int)nCount; i++)
+        transactions.push_back(vTxProfiles[vOrder[i].second].second);
+
+    Object result;
+    result.push_back(Pair("hash", hash.GetHex()));
+    result.push_back(Pair("height", nHeight));
+    result.push_back(Pair("tx", (int)block.vtx.size()));
+    result.push_back(Pair("invalid", nInvalid));
+    ScriptProfileToJSON(profileBlock, true, result);
+    result.push_back(Pair("transactions", transactions));
+    return result;
 }
 
 Value sendrawtx(const Array& params, bool fHelp)
@@ -2487,67 +2793,72 @@ Value sendrawtx(const Array& params, bool fHelp)
 
 
 static const CRPCCommand vRPCCommands[] =
-{ //  name                      function                 safe mode?
-  //  ------------------------  -----------------------  ----------
-    { "help",                   &help,                   true },
-    { "stop",                   &stop,                   true },
-    { "getblockcount",          &getblockcount,          true },
-    { "getconnectioncount",     &getconnectioncount,     true },
-    { "getpeerinfo",            &getpeerinfo,            true },
-    { "getdifficulty",          &getdifficulty,          true },
-    { "getnetworkhashps",       &getnetworkhashps,       true },
-    { "getgenerate",            &getgenerate,            true },
-    { "setgenerate",            &setgenerate,            true },
-    { "gethashespersec",        &gethashespersec,        true },
-    { "getinfo",                &getinfo,                true },
-    { "getmininginfo",          &getmininginfo,          true },
-    { "getnewaddress",          &getnewaddress,          true },
-    { "getaccountaddress",      &getaccountaddress,      true },
-    { "setaccount",             &setaccount,             true },
-    { "getaccount",             &getaccount,             false },
-    { "getaddressesbyaccount",  &getaddressesbyaccount,  true },
-    { "sendtoaddress",          &sendtoaddress,          false },
-    { "getreceivedbyaddress",   &getreceivedbyaddress,   false },
-    { "getreceivedbyaccount",   &getreceivedbyaccount,   false },
-    { "listreceivedbyaddress",  &listreceivedbyaddress,  false },
-    { "listreceivedbyaccount",  &listreceivedbyaccount,  false },
-    { "backupwallet",           &backupwallet,           true },
-    { "keypoolrefill",          &keypoolrefill,          true },
-    { "walletpassphrase",       &walletpassphrase,       true },
-    { "walletpassphrasechange", &walletpassphrasechange, false },
-    { "walletlock",             &walletlock,             true },
-    { "encryptwallet",          &encryptwallet,          false },
-    { "validateaddress",        &validateaddress,        true },
-    { "getbalance",             &getbalance,             false },
-    { "move",                   &movecmd,                false },
-    { "sendfrom",               &sendfrom,               false },
-    { "sendmany",               &sendmany,               false },
-    { "addmultisigaddress",     &addmultisigaddress,     false },
-    { "getrawmempool",          &getrawmempool,          true },
-    { "getblock",               &getblock,               false },
-    { "getblockhash",           &getblockhash,           false },
-    { "gettransaction",         &gettransaction,         false },
-    { "listtransactions",       &listtransactions,       false },
-    { "signmessage",            &signmessage,            false },
-    { "verifymessage",          &verifymessage,          false },
-    { "getwork",                &getwork,                true },
-    { "getworkex",              &getworkex,              true },
-    { "listaccounts",           &listaccounts,           false },
-    { "settxfee",               &settxfee,               false },
-    { "setmininput",            &setmininput,            false },
-    { "getmemorypool",          &getmemorypool,          true },
-    { "listsinceblock",         &listsinceblock,         false },
-    { "dumpprivkey",            &dumpprivkey,            false },
-    { "importprivkey",          &importprivkey,          false },
-    { "sendrawtx",              &sendrawtx,              false },
+{ //  name                      function                 safe mode? read-only? chain only?
+  //  ------------------------  -----------------------  ---------- ---------- -----------
+    { "help",                   &help,                   true,     true,      false },
+    { "stop",                   &stop,                   true,     false,     false },
+    { "getblockcount",          &getblockcount,          true,     true,      true },
+    { "getconnectioncount",     &getconnectioncount,     true,     true,      false },
+    { "getpeerinfo",            &getpeerinfo,            true,     true,      false },
+    { "getdifficulty",          &getdifficulty,          true,     true,      true },
+    { "getnetworkhashps",       &getnetworkhashps,       true,     true,      true },
+    { "getgenerate",            &getgenerate,            true,     true,      false },
+    { "setgenerate",            &setgenerate,            true,     false,     false },
+    { "gethashespersec",        &gethashespersec,        true,     true,      false },
+    { "getinfo",                &getinfo,                true,     true,      false },
+    { "getmininginfo",          &getmininginfo,          true,     true,      false },
+    { "getnewaddress",          &getnewaddress,          true,     false,     false },
+    { "getaccountaddress",      &getaccountaddress,      true,     false,     false },
+    { "setaccount",             &setaccount,             true,     false,     false },
+    { "getaccount",             &getaccount,             false,    true,      false },
+    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,     true,      false },
+    { "sendtoaddress",          &sendtoaddress,          false,    false,     false },
+    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,    true,      false },
+    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,    true,      false },
+    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,    true,      false },
+    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,    true,      false },
+    { "backupwallet",           &backupwallet,           true,     false,     false },
+    { "keypoolrefill",          &keypoolrefill,          true,     false,     false },
+    { "walletpassphrase",       &walletpassphrase,       true,     false,     false },
+    { "walletpassphrasechange", &walletpassphrasechange, false,    false,     false },
+    { "walletlock",             &walletlock,             true,     false,     false },
+    { "encryptwallet",          &encryptwallet,          false,    false,     false },
+    { "validateaddress",        &validateaddress,        true,     true,      false },
+    { "getbalance",             &getbalance,             false,    true,      false },
+    { "move",                   &movecmd,                false,    false,     false },
+    { "sendfrom",               &sendfrom,               false,    false,     false },
+    { "sendmany",               &sendmany,               false,    false,     false },
+    { "addmultisigaddress",     &addmultisigaddress,     false,    false,     false },
+    { "getrawmempool",          &getrawmempool,          true,     true,      true },
+    { "getblock",               &getblock,               false,    true,      true },
+    { "getblockhash",           &getblockhash,           false,    true,      true },
+    { "profiletx",              &profiletx,              false,    true,      false },
+    { "profileblock",           &profileblock,           false,    true,      false },
+    { "gettransaction",         &gettransaction,         false,    true,      false },
+    { "listtransactions",       &listtransactions,       false,    true,      false },
+    { "signmessage",            &signmessage,            false,    false,     false },
+    { "verifymessage",          &verifymessage,          false,    true,      false },
+    { "getwork",                &getwork,                true,     false,     false },
+    { "getworkex",              &getworkex,              true,     false,     false },
+    { "listaccounts",           &listaccounts,           false,    true,      false },
+    { "settxfee",               &settxfee,               false,    false,     false },
+    { "setmininput",            &setmininput,            false,    false,     false },
+    { "getmemorypool",          &getmemorypool,          true,     false,     false },
+    { "listsinceblock",         &listsinceblock,         false,    true,      false },
+    { "dumpprivkey",            &dumpprivkey,            false,    false,     false },
+    { "importprivkey",          &importprivkey,          false,    false,     false },
+    { "getrescaninfo",          &getrescaninfo,          true,     true,      false },
+    { "sendrawtx",              &sendrawtx,              false,    false,     false },
+    { "getrpcstats",            &getrpcstats,            true,     true,      true },
+    { "getlockstats",           &getlockstats,           true,     true,      true },
 #ifdef ENABLE_MLDSA
-    { "getnewmldsaaddress",     &getnewmldsaaddress,     true },
-    { "signmessagemldsa",       &signmessagemldsa,       false },
-    { "verifymessagemldsa",     &verifymessagemldsa,     false },
-    { "gethybridkeyinfo",       &gethybridkeyinfo,       false },
-    { "addmultisigmldsaaddress", &addmultisigmldsaaddress, true },
-    { "createmultisigmldsatx",  &createmultisigmldsatx,  false },
-    { "signmldsatx",            &signmldsatx,            false },
+    { "getnewmldsaaddress",     &getnewmldsaaddress,     true,     false,     false },
+    { "signmessagemldsa",       &signmessagemldsa,       false,    false,     false },
+    { "verifymessagemldsa",     &verifymessagemldsa,     false,    true,      false },
+    { "gethybridkeyinfo",       &gethybridkeyinfo,       false,    true,      false },
+    { "addmultisigmldsaaddress", &addmultisigmldsaaddress, true,     false,     false },
+    { "createmultisigmldsatx",  &createmultisigmldsatx,  false,    false,     false },
+    { "signmldsatx",            &signmldsatx,            false,    false,     false },
 #endif
 };
 
@@ -2634,6 +2945,7 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
     else if (nStatus == 403) cStatus = "Forbidden";
     else if (nStatus == 404) cStatus = "Not Found";
     else if (nStatus == 500) cStatus = "Internal Server Error";
+    else if (nStatus == 503) cStatus = "Service Unavailable";
     else cStatus = "";
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
@@ -2653,6 +2965,21 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
         strMsg.c_str());
 }
 
+static string HTTPChunkedReplyHeader(bool keepalive)
+{
+    return strprintf(
+            "HTTP/1.1 200 OK\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Content-Type: application/json\r\n"
+            "Server: litecoin-json-rpc/%s\r\n"
+            "\r\n",
+        rfc1123Time().c_str(),
+        keepalive ? "keep-alive" : "close",
+        FormatFullVersion().c_str());
+}
+
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto)
 {
     string str;
@@ -2708,7 +3035,26 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
         return 500;
 
     // Read message
-    if (nLen > 0)
+    if (mapHeadersRet["transfer-encoding"] == "chunked")
+    {
+        loop
+        {
+            string str;
+            getline(stream, str);
+            int nChunk = strtol(str.c_str(), NULL, 16);
+            if (nChunk < 0 || nChunk > (int)MAX_SIZE || !stream)
+                return 500;
+            if (nChunk == 0)
+                break;
+            vector<char> vch(nChunk);
+            stream.read(&vch[0], nChunk);
+            strMessageRet.append(vch.begin(), vch.end());
+            getline(stream, str);
+        }
+        // Skip trailers
+        ReadHTTPHeader(stream, mapHeadersRet);
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
@@ -2754,10 +3100,10 @@ string JSONRPCRequest(const string& strMethod, const Array& params, const Value&
     request.push_back(Pair("method", strMethod));
     request.push_back(Pair("params", params));
     request.push_back(Pair("id", id));
-    return write_string(Value(request), false) + "\n";
+    return WriteJSON(Value(request)) + "\n";
 }
 
-string JSONRPCReply(const Value& result, const Value& error, const Value& id)
+Object JSONRPCReplyObj(const Value& result, const Value& error, const Value& id)
 {
     Object reply;
     if (error.type() != null_type)
@@ -2766,7 +3112,13 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
         reply.push_back(Pair("result", result));
     reply.push_back(Pair("error", error));
     reply.push_back(Pair("id", id));
-    return write_string(Value(reply), false) + "\n";
+    return reply;
+}
+
+string JSONRPCReply(const Value& result, const Value& error, const Value& id)
+{
+    Object reply = JSONRPCReplyObj(result, error, id);
+    return WriteJSON(Value(reply)) + "\n";
 }
 
 void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
@@ -2857,52 +3209,500 @@ private:
     asio::ssl::stream<typename Protocol::socket>& stream;
 };
 
-class AcceptedConnection
-{
-public:
-    virtual ~AcceptedConnection() {}
+//
+// Asynchronous HTTP/1.1 server
+//
+// ThreadRPCServer does all socket I/O through asio, so an idle keep-alive
+// client costs a buffer rather than a thread.  Complete requests go on a
+// bounded queue served by -rpcthreads worker threads; when the queue is full
+// the client is answered 503 at once instead of piling up more work.
+//
 
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
-};
+static const int RPC_IDLE_TIMEOUT = 30; // seconds a connection may take to send its next request
+static const int RPC_LONGPOLL_TIMEOUT = 5 * 60; // seconds a long poll is parked before it is answered anyway
+static const size_t RPC_MAX_UNSENT = 1024 * 1024; // bytes of a streamed reply buffered ahead of the client
+static const size_t RPC_CHUNK_SIZE = 64 * 1024;
 
-template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+class CRPCConnection : public boost::enable_shared_from_this<CRPCConnection>
 {
 public:
-    AcceptedConnectionImpl(
-            asio::io_service& io_service,
-            ssl::context &context,
-            bool fUseSSL) :
+    asio::ssl::stream<ip::tcp::socket> sslStream;
+    ip::tcp::endpoint peer;
+
+    CRPCConnection(asio::io_service& io_service, ssl::context& context, bool fUseSSLIn) :
         sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
+        timer(io_service),
+        timerLongPoll(io_service),
+        buf(MAX_SIZE + 0x10000)
     {
+        fUseSSL = fUseSSLIn;
+        nContentLength = 0;
+        nProto = 0;
+        nUnsent = 0;
+        fWriting = false;
+        fReplyDone = false;
+        fReplyKeepAlive = false;
+        fSendFailed = false;
+        nLongPoll = 0;
+        nLongPollParked = 0;
+        nLongPollWaiter = 0;
+        fLongPollReading = false;
+        fReadPending = false;
     }
 
-    virtual std::iostream& stream()
+    std::string peer_address_to_string() const
     {
-        return _stream;
+        return peer.address().to_string();
     }
 
-    virtual std::string peer_address_to_string() const
-    {
-        return peer.address().to_string();
+    /** Start reading requests (io thread) */
+    void Start();
+
+    /** Send the rest of the HTTP reply, then read the next request if
+     *  fKeepAlive.  Can be called from any thread. */
+    void Reply(const std::string& strReply, bool fKeepAlive);
+
+    /** Send part of a reply that is still being built.  Waits while more
+     *  than RPC_MAX_UNSENT bytes are queued; false if the client is gone or
+     *  stopped reading.  Worker threads only. */
+    bool Send(const std::string& str);
+
+    /** Hold fn, the work of a long poll, until WakeLongPoll, until
+     *  RPC_LONGPOLL_TIMEOUT passes or until the client hangs up; fn is then
+     *  queued, or dropped along with the connection.  nParkRet names this
+     *  park to WakeLongPoll and DropLongPoll.  False if -rpcmaxlongpolls are
+     *  parked already.  Worker threads only. */
+    bool ParkLongPoll(const boost::function<void()>& fn, unsigned int& nParkRet);
+
+    /** Queue the parked long poll's work now.  Can be called from any thread. */
+    void WakeLongPoll(unsigned int nPark);
+
+    /** Forget the parked long poll.  Can be called from any thread. */
+    void DropLongPoll(unsigned int nPark);
+
+    /** Cancel template waiter nWaiter when park nPark ends, so a poll that
+     *  times out or loses its client doesn't leave it behind.  Can be
+     *  called from any thread. */
+    void SetLongPollWaiter(unsigned int nPark, uint64 nWaiter);
+
+private:
+    bool fUseSSL;
+    asio::deadline_timer timer;
+    asio::deadline_timer timerLongPoll;
+    asio::streambuf buf;
+    map<string, string> mapHeaders;
+    int nContentLength;
+    int nProto;
+
+    // Outgoing data, written in order by the io thread
+    boost::mutex mutexSend;
+    boost::condition_variable condSend;
+    deque<string> dequeSend;
+    size_t nUnsent;
+    bool fWriting;          // the io thread owns the write side
+    bool fReplyDone;
+    bool fReplyKeepAlive;
+    bool fSendFailed;
+    std::string strWriteBuf;
+
+    // The parked long poll; all but nLongPoll belong to the io thread
+    unsigned int nLongPoll;         // parks so far, numbering them
+    unsigned int nLongPollParked;
+    boost::function<void()> fnLongPoll;
+    uint64 nLongPollWaiter;         // its NotifyOnTemplateChange handle
+    bool fLongPollReading;          // the read watching for a hang-up is pending
+    bool fReadPending;              // ReadRequest waits for that read to finish
+
+    void StartTimer();
+    void ReadRequest();
+    void HandleTimeout(const boost::system::error_code& error);
+    void HandleHandshake(const boost::system::error_code& error);
+    void HandleHeader(const boost::system::error_code& error);
+    void HandleBody(const boost::system::error_code& error);
+    void QueueSend(const std::string& str, bool fDone, bool fKeepAlive);
+    void StartWrite();
+    void HandleWrite(const boost::system::error_code& error);
+    void Close();
+    void StartLongPoll(const boost::function<void()>& fn, unsigned int nPark);
+    void EndLongPoll(unsigned int nPark, bool fRun);
+    void HoldLongPollWaiter(unsigned int nPark, uint64 nWaiter);
+    void HandleLongPollTimeout(const boost::system::error_code& error);
+    void HandleLongPollRead(const boost::system::error_code& error);
+};
+
+/** A complete HTTP request waiting for an RPC worker */
+class CRPCRequest
+{
+public:
+    boost::shared_ptr<CRPCConnection> conn;
+    map<string, string> mapHeaders;
+    string strRequest;
+    int nProto;
+    bool fLongPollWoken;
+
+    CRPCRequest()
+    {
+        nProto = 0;
+        fLongPollWoken = false;
     }
+};
 
-    virtual void close()
+static boost::mutex mutexRPCWork;
+static boost::condition_variable condRPCWork;
+static deque<boost::function<void()> > dequeRPCWork;
+static unsigned int nRPCWorkQueueMax = 64;
+static unsigned int nRPCWorkQueuePeak = 0;
+static uint64 nRPCWorkRejected = 0;
+static int nRPCWorkThreads = 0;
+static unsigned int nRPCMaxBatch = 1000;
+static unsigned int nRPCLongPolls = 0;
+static unsigned int nRPCLongPollsMax = 128;
+
+static void HandleRPCRequest(CRPCRequest req);
+
+/** Hand work to the worker pool.  Fails when the queue is full, unless
+ *  fForce (for work belonging to a request that was already accepted). */
+static bool QueueRPCWork(const boost::function<void()>& fn, bool fForce)
+{
+    boost::lock_guard<boost::mutex> lock(mutexRPCWork);
+    if (!fForce && dequeRPCWork.size() >= nRPCWorkQueueMax)
     {
-        _stream.close();
+        nRPCWorkRejected++;
+        return false;
     }
+    dequeRPCWork.push_back(fn);
+    nRPCWorkQueuePeak = max(nRPCWorkQueuePeak, (unsigned int)dequeRPCWork.size());
+    condRPCWork.notify_one();
+    return true;
+}
+
+void CRPCConnection::Start()
+{
+    StartTimer();
+    if (fUseSSL)
+        sslStream.async_handshake(ssl::stream_base::server,
+                boost::bind(&CRPCConnection::HandleHandshake, shared_from_this(), asio::placeholders::error));
+    else
+        ReadRequest();
+}
 
-    typename Protocol::endpoint peer;
-    asio::ssl::stream<typename Protocol::socket> sslStream;
+void CRPCConnection::StartTimer()
+{
+    timer.expires_from_now(posix_time::seconds(RPC_IDLE_TIMEOUT));
+    timer.async_wait(boost::bind(&CRPCConnection::HandleTimeout, shared_from_this(), asio::placeholders::error));
+}
 
-private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
-};
+void CRPCConnection::HandleTimeout(const boost::system::error_code& error)
+{
+    // The timer may have been re-armed after this expiry was queued
+    if (error != asio::error::operation_aborted && timer.expires_at() <= asio::deadline_timer::traits_type::now())
+        Close();
+}
+
+void CRPCConnection::HandleHandshake(const boost::system::error_code& error)
+{
+    if (error)
+        Close();
+    else
+        ReadRequest();
+}
+
+void CRPCConnection::ReadRequest()
+{
+    // Two reads can't be pending at once
+    if (fLongPollReading)
+    {
+        fReadPending = true;
+        return;
+    }
+    StartTimer();
+    if (fUseSSL)
+        asio::async_read_until(sslStream, buf, "\r\n\r\n",
+                boost::bind(&CRPCConnection::HandleHeader, shared_from_this(), asio::placeholders::error));
+    else
+        asio::async_read_until(sslStream.next_layer(), buf, "\r\n\r\n",
+                boost::bind(&CRPCConnection::HandleHeader, shared_from_this(), asio::placeholders::error));
+}
+
+void CRPCConnection::HandleHeader(const boost::system::error_code& error)
+{
+    if (error)
+    {
+        Close();
+        return;
+    }
+
+    std::istream stream(&buf);
+    nProto = 0;
+    ReadHTTPStatus(stream, nProto);
+    mapHeaders.clear();
+    nContentLength = ReadHTTPHeader(stream, mapHeaders);
+    if (nContentLength < 0 || nContentLength > (int)MAX_SIZE)
+    {
+        Close();
+        return;
+    }
+
+    // HTTP/1.1 connections stay open unless the client says otherwise
+    string sConHdr = mapHeaders["connection"];
+    if ((sConHdr != "close") && (sConHdr != "keep-alive"))
+        mapHeaders["connection"] = (nProto >= 1 ? "keep-alive" : "close");
+
+    if (buf.size() >= (size_t)nContentLength)
+        HandleBody(boost::system::error_code());
+    else if (fUseSSL)
+        asio::async_read(sslStream, buf, asio::transfer_exactly(nContentLength - buf.size()),
+                boost::bind(&CRPCConnection::HandleBody, shared_from_this(), asio::placeholders::error));
+    else
+        asio::async_read(sslStream.next_layer(), buf, asio::transfer_exactly(nContentLength - buf.size()),
+                boost::bind(&CRPCConnection::HandleBody, shared_from_this(), asio::placeholders::error));
+}
+
+void CRPCConnection::HandleBody(const boost::system::error_code& error)
+{
+    if (error)
+    {
+        Close();
+        return;
+    }
+    timer.cancel();
+
+    CRPCRequest req;
+    req.conn = shared_from_this();
+    req.mapHeaders.swap(mapHeaders);
+    req.nProto = nProto;
+    req.strRequest.resize(nContentLength);
+    if (nContentLength > 0)
+        buf.sgetn(&req.strRequest[0], nContentLength);
+
+    if (!QueueRPCWork(boost::bind(&HandleRPCRequest, req), false))
+    {
+        string strReply = JSONRPCReply(Value::null, JSONRPCError(-32603, "Work queue depth exceeded"), Value::null);
+        Reply(HTTPReply(503, strReply, false), false);
+    }
+}
+
+void CRPCConnection::Reply(const std::string& strReply, bool fKeepAlive)
+{
+    QueueSend(strReply, true, fKeepAlive);
+}
+
+bool CRPCConnection::Send(const std::string& str)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexSend);
+        boost::system_time deadline = boost::get_system_time() + posix_time::seconds(RPC_IDLE_TIMEOUT);
+        while (nUnsent > RPC_MAX_UNSENT && !fSendFailed)
+        {
+            if (!condSend.timed_wait(lock, deadline))
+            {
+                // Stalled client: drop it rather than keep the caller waiting
+                fSendFailed = true;
+                asio::post(sslStream.get_executor(), boost::bind(&CRPCConnection::Close, shared_from_this()));
+            }
+        }
+        if (fSendFailed)
+            return false;
+    }
+    QueueSend(str, false, false);
+    return true;
+}
+
+void CRPCConnection::QueueSend(const std::string& str, bool fDone, bool fKeepAlive)
+{
+    boost::lock_guard<boost::mutex> lock(mutexSend);
+    if (!str.empty())
+    {
+        dequeSend.push_back(str);
+        nUnsent += str.size();
+    }
+    if (fDone)
+    {
+        fReplyDone = true;
+        fReplyKeepAlive = fKeepAlive;
+    }
+    if (!fWriting)
+    {
+        fWriting = true;
+        asio::post(sslStream.get_executor(), boost::bind(&CRPCConnection::StartWrite, shared_from_this()));
+    }
+}
+
+void CRPCConnection::StartWrite()
+{
+    bool fKeepAlive;
+    {
+        boost::lock_guard<boost::mutex> lock(mutexSend);
+        if (fSendFailed)
+        {
+            dequeSend.clear();
+            nUnsent = 0;
+            fWriting = false;
+            fReplyDone = false;
+            condSend.notify_all();
+            fKeepAlive = false;
+        }
+        else if (!dequeSend.empty())
+        {
+            strWriteBuf.swap(dequeSend.front());
+            dequeSend.pop_front();
+            if (fUseSSL)
+                asio::async_write(sslStream, asio::buffer(strWriteBuf),
+                        boost::bind(&CRPCConnection::HandleWrite, shared_from_this(), asio::placeholders::error));
+            else
+                asio::async_write(sslStream.next_layer(), asio::buffer(strWriteBuf),
+                        boost::bind(&CRPCConnection::HandleWrite, shared_from_this(), asio::placeholders::error));
+            return;
+        }
+        else
+        {
+            // Everything queued is out; wait for more unless the reply is complete
+            fWriting = false;
+            if (!fReplyDone)
+                return;
+            fReplyDone = false;
+            fKeepAlive = fReplyKeepAlive;
+        }
+    }
+
+    if (!fKeepAlive || fShutdown)
+        Close();
+    else
+        ReadRequest();
+}
+
+void CRPCConnection::HandleWrite(const boost::system::error_code& error)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexSend);
+        nUnsent -= strWriteBuf.size();
+        if (error)
+            fSendFailed = true;
+        condSend.notify_all();
+    }
+    StartWrite();
+}
+
+void CRPCConnection::Close()
+{
+    EndLongPoll(nLongPollParked, false);
+    boost::system::error_code ec;
+    timer.cancel(ec);
+    sslStream.lowest_layer().close(ec);
+}
+
+bool CRPCConnection::ParkLongPoll(const boost::function<void()>& fn, unsigned int& nParkRet)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexRPCWork);
+        if (nRPCLongPolls >= nRPCLongPollsMax)
+            return false;
+        nRPCLongPolls++;
+    }
+    // Posted first, so it is in place before anything can wake it
+    nParkRet = ++nLongPoll;
+    asio::post(sslStream.get_executor(), boost::bind(&CRPCConnection::StartLongPoll, shared_from_this(), fn, nParkRet));
+    return true;
+}
+
+void CRPCConnection::WakeLongPoll(unsigned int nPark)
+{
+    asio::post(sslStream.get_executor(), boost::bind(&CRPCConnection::EndLongPoll, shared_from_this(), nPark, true));
+}
+
+void CRPCConnection::DropLongPoll(unsigned int nPark)
+{
+    asio::post(sslStream.get_executor(), boost::bind(&CRPCConnection::EndLongPoll, shared_from_this(), nPark, false));
+}
+
+void CRPCConnection::SetLongPollWaiter(unsigned int nPark, uint64 nWaiter)
+{
+    asio::post(sslStream.get_executor(), boost::bind(&CRPCConnection::HoldLongPollWaiter, shared_from_this(), nPark, nWaiter));
+}
+
+void CRPCConnection::StartLongPoll(const boost::function<void()>& fn, unsigned int nPark)
+{
+    nLongPollParked = nPark;
+    fnLongPoll = fn;
+    timerLongPoll.expires_from_now(posix_time::seconds(RPC_LONGPOLL_TIMEOUT));
+    timerLongPoll.async_wait(boost::bind(&CRPCConnection::HandleLongPollTimeout, shared_from_this(), asio::placeholders::error));
+
+    // The client has nothing to send until it has its reply, so this read
+    // only ends when it hangs up (or pipelines a request, which stays in buf)
+    fLongPollReading = true;
+    if (fUseSSL)
+        asio::async_read(sslStream, buf, asio::transfer_at_least(1),
+                boost::bind(&CRPCConnection::HandleLongPollRead, shared_from_this(), asio::placeholders::error));
+    else
+        asio::async_read(sslStream.next_layer(), buf, asio::transfer_at_least(1),
+                boost::bind(&CRPCConnection::HandleLongPollRead, shared_from_this(), asio::placeholders::error));
+}
+
+void CRPCConnection::EndLongPoll(unsigned int nPark, bool fRun)
+{
+    // Already ended, or a wake meant for an earlier park on this connection
+    if (fnLongPoll.empty() || nPark != nLongPollParked)
+        return;
+    boost::function<void()> fn;
+    fn.swap(fnLongPoll);
+    {
+        boost::lock_guard<boost::mutex> lock(mutexRPCWork);
+        nRPCLongPolls--;
+    }
+    // Nothing if the waiter is what woke us
+    if (nLongPollWaiter != 0)
+    {
+        CancelTemplateWaiter(nLongPollWaiter);
+        nLongPollWaiter = 0;
+    }
+    boost::system::error_code ec;
+    timerLongPoll.cancel(ec);
+    if (fLongPollReading)
+        sslStream.lowest_layer().cancel(ec);
+    // Parked work was accepted already, and -rpcmaxlongpolls bounds it
+    if (fRun)
+        QueueRPCWork(fn, true);
+}
+
+void CRPCConnection::HoldLongPollWaiter(unsigned int nPark, uint64 nWaiter)
+{
+    // The park may have ended while the waiter was being registered
+    if (fnLongPoll.empty() || nPark != nLongPollParked)
+        CancelTemplateWaiter(nWaiter);
+    else
+        nLongPollWaiter = nWaiter;
+}
+
+void CRPCConnection::HandleLongPollTimeout(const boost::system::error_code& error)
+{
+    // Answered with the template as it is now
+    if (error != asio::error::operation_aborted && timerLongPoll.expires_at() <= asio::deadline_timer::traits_type::now())
+        EndLongPoll(nLongPollParked, true);
+}
+
+void CRPCConnection::HandleLongPollRead(const boost::system::error_code& error)
+{
+    fLongPollReading = false;
+    if (error && error != asio::error::operation_aborted)
+    {
+        // Hung up: there is no one left to answer
+        Close();
+        return;
+    }
+    if (fReadPending)
+    {
+        fReadPending = false;
+        ReadRequest();
+    }
+}
+
+static void WakeParkedLongPoll(boost::weak_ptr<CRPCConnection> wpconn, unsigned int nPark)
+{
+    // The connection goes once its client hangs up, waiter or not
+    boost::shared_ptr<CRPCConnection> conn = wpconn.lock();
+    if (conn)
+        conn->WakeLongPoll(nPark);
+}
 
 void ThreadRPCServer(void* parg)
 {
@@ -2924,32 +3724,30 @@ void ThreadRPCServer(void* parg)
 }
 
 // Forward declaration required for RPCListen
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr<CRPCConnection> conn,
                              const boost::system::error_code& error);
 
 /**
  * Sets up I/O resources to accept and handle a new connection.
  */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCListen(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                    ssl::context& context,
                    const bool fUseSSL)
 {
     // Accept connection
     // Boost 1.70+: get_io_service() replaced with get_executor().context()
-    AcceptedConnectionImpl<Protocol>* conn = new AcceptedConnectionImpl<Protocol>(
-        static_cast<asio::io_context&>(acceptor->get_executor().context()), 
-        context, 
-        fUseSSL);
+    boost::shared_ptr<CRPCConnection> conn(new CRPCConnection(
+        static_cast<asio::io_context&>(acceptor->get_executor().context()),
+        context,
+        fUseSSL));
 
     acceptor->async_accept(
             conn->sslStream.lowest_layer(),
             conn->peer,
-            boost::bind(&RPCAcceptHandler<Protocol, SocketAcceptorService>,
+            boost::bind(&RPCAcceptHandler,
                 acceptor,
                 boost::ref(context),
                 fUseSSL,
@@ -2960,11 +3758,10 @@ static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketA
 /**
  * Accept and handle incoming connection.
  */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr<CRPCConnection> conn,
                              const boost::system::error_code& error)
 {
     vnThreadsRunning[THREAD_RPCLISTENER]++;
@@ -2974,35 +3771,37 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
      && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn);
-
     // TODO: Actually handle errors
-    if (error)
-    {
-        delete conn;
-    }
-
-    // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
-    // certain DoS and misbehaving clients.
-    else if (tcp_conn
-          && !ClientAllowed(tcp_conn->peer.address()))
+    if (!error)
     {
-        // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
-        if (!fUseSSL)
-            conn->stream() << HTTPReply(403, "", false) << std::flush;
-        delete conn;
-    }
-
-    // start HTTP client thread
-    else if (!CreateThread(ThreadRPCServer3, conn)) {
-        printf("Failed to create RPC server client thread\n");
-        delete conn;
+        // Restrict callers by IP.  It is important to
+        // do this before reading anything, to filter out
+        // certain DoS and misbehaving clients.
+        if (!ClientAllowed(conn->peer.address()))
+        {
+            // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
+            if (!fUseSSL)
+                conn->Reply(HTTPReply(403, "", false), false);
+        }
+        else
+            conn->Start();
     }
 
     vnThreadsRunning[THREAD_RPCLISTENER]--;
 }
 
+/**
+ * Keeps io_service.run_one() returning now and then so ThreadRPCServer2
+ * notices shutdown even when no client is talking to it.
+ */
+static void RPCShutdownCheck(boost::shared_ptr<asio::deadline_timer> timer, const boost::system::error_code& error)
+{
+    if (error || fShutdown)
+        return;
+    timer->expires_from_now(posix_time::seconds(1));
+    timer->async_wait(boost::bind(&RPCShutdownCheck, timer, asio::placeholders::error));
+}
+
 void ThreadRPCServer2(void* parg)
 {
     printf("ThreadRPCServer started\n");
@@ -3109,119 +3908,564 @@ void ThreadRPCServer2(void* parg)
         return;
     }
 
+    // Start the worker pool
+    nRPCWorkQueueMax = max((int)GetArg("-rpcworkqueue", 64), 1);
+    nRPCMaxBatch = max((int)GetArg("-rpcmaxbatch", 1000), 1);
+    nRPCLongPollsMax = max((int)GetArg("-rpcmaxlongpolls", 128), 1);
+    for (int i = 0; i < max((int)GetArg("-rpcthreads", 4), 1); i++)
+    {
+        if (!CreateThread(ThreadRPCServer3, NULL))
+            printf("Failed to create RPC worker thread\n");
+    }
+
+    boost::shared_ptr<asio::deadline_timer> timerShutdown(new asio::deadline_timer(io_service));
+    RPCShutdownCheck(timerShutdown, boost::system::error_code());
+
     vnThreadsRunning[THREAD_RPCLISTENER]--;
     while (!fShutdown)
         io_service.run_one();
     vnThreadsRunning[THREAD_RPCLISTENER]++;
     StopRequests();
+
+    // Keep delivering replies (such as the one to "stop") until the workers
+    // are gone; the connections they hold must not outlive io_service
+    while (vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+    {
+        io_service.poll();
+        Sleep(20);
+    }
+    io_service.poll();
+    {
+        boost::lock_guard<boost::mutex> lock(mutexRPCWork);
+        dequeRPCWork.clear();
+    }
 }
 
 static CCriticalSection cs_THREAD_RPCHANDLER;
 
-void ThreadRPCServer3(void* parg)
+class JSONRequest
 {
-    IMPLEMENT_RANDOMIZE_STACK(ThreadRPCServer3(parg));
+public:
+    Value id;
+    string strMethod;
+    Array params;
+
+    JSONRequest() { id = Value::null; }
+    void parse(const Value& valRequest);
+};
+
+void JSONRequest::parse(const Value& valRequest)
+{
+    // Parse request
+    if (valRequest.type() != obj_type)
+        throw JSONRPCError(-32600, "Invalid Request object");
+    const Object& request = valRequest.get_obj();
+
+    // Parse id now so errors from here on will have the id
+    id = find_value(request, "id");
+
+    // Parse method
+    Value valMethod = find_value(request, "method");
+    if (valMethod.type() == null_type)
+        throw JSONRPCError(-32600, "Missing method");
+    if (valMethod.type() != str_type)
+        throw JSONRPCError(-32600, "Method must be a string");
+    strMethod = valMethod.get_str();
+    if (strMethod != "getwork" && strMethod != "getmemorypool")
+        printf("ThreadRPCServer method=%s\n", strMethod.c_str());
+
+    // Parse params
+    Value valParams = find_value(request, "params");
+    if (valParams.type() == array_type)
+        params = valParams.get_array();
+    else if (valParams.type() == null_type)
+        params = Array();
+    else
+        throw JSONRPCError(-32600, "Params must be an array");
+}
+
+static bool IsLongPollRequest(const string& strMethod, const Array& params)
+{
+    return (strMethod == "getwork" || strMethod == "getmemorypool") &&
+        params.size() == 1 && params[0].type() == obj_type &&
+        find_value(params[0].get_obj(), "longpollid").type() == str_type;
+}
+
+/** Run one call of a batch; errors become part of its reply object */
+static string JSONRPCExecOne(const Value& req)
+{
+    Object reply;
+    JSONRequest jreq;
+    try
     {
-        LOCK(cs_THREAD_RPCHANDLER);
-        vnThreadsRunning[THREAD_RPCHANDLER]++;
+        jreq.parse(req);
+        // A parked long poll would hold up the whole batch's reply
+        if (IsLongPollRequest(jreq.strMethod, jreq.params))
+            throw JSONRPCError(-32600, "Long polling is not allowed in a batch");
+        Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+        reply = JSONRPCReplyObj(result, Value::null, jreq.id);
+    }
+    catch (Object& objError)
+    {
+        reply = JSONRPCReplyObj(Value::null, objError, jreq.id);
+    }
+    catch (std::exception& e)
+    {
+        reply = JSONRPCReplyObj(Value::null, JSONRPCError(-32700, e.what()), jreq.id);
     }
-    AcceptedConnection *conn = (AcceptedConnection *) parg;
+    return WriteJSON(Value(reply));
+}
 
-    bool fRun = true;
-    loop {
-        if (fShutdown || !fRun)
-        {
-            conn->close();
-            delete conn;
-            {
-                LOCK(cs_THREAD_RPCHANDLER);
-                --vnThreadsRunning[THREAD_RPCHANDLER];
-            }
+static bool IsReadOnlyRPC(const Value& req)
+{
+    if (req.type() != obj_type)
+        return false;
+    const Value& valMethod = find_value(req.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return false;
+    const CRPCCommand *pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && pcmd->readOnly;
+}
+
+/** Replies of a batch being filled in by several workers */
+class CRPCBatch
+{
+public:
+    boost::function<void(const string&)> fnReply;
+    vector<string> vReply;
+    unsigned int nPending;
+    boost::mutex mutex;
+};
+
+static void FinishBatchItem(boost::shared_ptr<CRPCBatch> batch, unsigned int nIndex, const string& strItemReply)
+{
+    // Each call owns its slot; the last one to finish sends the reply
+    batch->vReply[nIndex] = strItemReply;
+    {
+        boost::lock_guard<boost::mutex> lock(batch->mutex);
+        if (--batch->nPending > 0)
             return;
+    }
+    batch->fnReply("[" + boost::algorithm::join(batch->vReply, ",") + "]\n");
+}
+
+static void ExecBatchItem(boost::shared_ptr<CRPCBatch> batch, unsigned int nIndex, const Value& req)
+{
+    FinishBatchItem(batch, nIndex, JSONRPCExecOne(req));
+}
+
+/** Read-only calls are spread over the worker pool, the rest run here in order */
+void JSONRPCExecBatch(const Array& vReq, const boost::function<void(const string&)>& fnReply)
+{
+    if (vReq.empty())
+        throw JSONRPCError(-32600, "Empty batch");
+    if (vReq.size() > nRPCMaxBatch)
+        throw JSONRPCError(-32600, strprintf("Batch too large (%u calls, max %u)", (unsigned int)vReq.size(), nRPCMaxBatch));
+
+    boost::shared_ptr<CRPCBatch> batch(new CRPCBatch());
+    batch->fnReply = fnReply;
+    batch->vReply.resize(vReq.size());
+    batch->nPending = vReq.size();
+
+    // -rpcworkqueue refuses new requests, not calls of a batch already
+    // accepted: whatever the queue has no room for runs here too
+    vector<unsigned int> vInline;
+    for (unsigned int i = 0; i < vReq.size(); i++)
+    {
+        if (!IsReadOnlyRPC(vReq[i]) || !QueueRPCWork(boost::bind(&ExecBatchItem, batch, i, vReq[i]), false))
+            vInline.push_back(i);
+    }
+    BOOST_FOREACH(unsigned int i, vInline)
+        ExecBatchItem(batch, i, vReq[i]);
+}
+
+static void ReplyBatch(boost::shared_ptr<CRPCConnection> conn, bool fKeepAlive, const string& strReply)
+{
+    conn->Reply(HTTPReply(200, strReply, fKeepAlive), fKeepAlive);
+}
+
+/**
+ * Chunked HTTP reply that an RPC call writes its result into while it runs.
+ * Nothing is sent until the call first writes, so a call that fails early
+ * still gets an ordinary error reply.
+ */
+class CRPCChunkedStream : public CRPCStream
+{
+public:
+    CRPCChunkedStream(CRPCConnection* connIn, bool fKeepAliveIn)
+    {
+        conn = connIn;
+        fKeepAlive = fKeepAliveIn;
+        fStarted = false;
+        fInCall = false;
+    }
+
+    bool Started() const { return fStarted; }
+
+    /** Set while the call runs under execute's locks; nothing may be sent then */
+    bool fInCall;
+
+    /** Handed over by the call, to be written after it returns */
+    boost::shared_ptr<CRPCStreamedResult> streamed;
+
+    void Write(const std::string& str)
+    {
+        if (fInCall)
+            throw runtime_error("Result streamed while the call holds its locks");
+        if (!fStarted)
+        {
+            fStarted = true;
+            if (!conn->Send(HTTPChunkedReplyHeader(fKeepAlive)))
+                throw runtime_error("Client disconnected");
+            strBuf = "{\"result\":";
         }
-        map<string, string> mapHeaders;
-        string strRequest;
+        strBuf += str;
+        if (strBuf.size() >= RPC_CHUNK_SIZE)
+            Flush();
+    }
 
-        ReadHTTP(conn->stream(), mapHeaders, strRequest);
+    /** Close the JSON-RPC reply object and end the chunked body */
+    void End(const Value& id)
+    {
+        strBuf += ",\"error\":null,\"id\":" + WriteJSON(id) + "}\n";
+        Flush();
+        conn->Reply("0\r\n\r\n", fKeepAlive);
+    }
+
+private:
+    CRPCConnection* conn;
+    bool fKeepAlive;
+    bool fStarted;
+    string strBuf;
+
+    void Flush()
+    {
+        if (strBuf.empty())
+            return;
+        if (!conn->Send(strprintf("%x\r\n", (unsigned int)strBuf.size()) + strBuf + "\r\n"))
+            throw runtime_error("Client disconnected");
+        strBuf.clear();
+    }
+};
+
+static void NoCleanup(CRPCChunkedStream*) { }
+static boost::thread_specific_ptr<CRPCChunkedStream> ptsRPCStream(NoCleanup);
+
+bool CanStreamRPCResult()
+{
+    return ptsRPCStream.get() != NULL;
+}
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
+void StreamRPCResult(const boost::shared_ptr<CRPCStreamedResult>& result)
+{
+    CRPCChunkedStream* pstream = ptsRPCStream.get();
+    if (!pstream)
+        throw runtime_error("Result can't be streamed");
+    pstream->streamed = result;
+}
+
+static void HandleRPCRequest(CRPCRequest req)
+{
+    CRPCConnection* conn = req.conn.get();
+    map<string, string>& mapHeaders = req.mapHeaders;
+
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
+    {
+        conn->Reply(HTTPReply(401, "", false), false);
+        return;
+    }
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
+        /* Deter brute-forcing short passwords.
+           If this results in a DOS the user really
+           shouldn't have their RPC port exposed.*/
+        if (mapArgs["-rpcpassword"].size() < 20)
+            Sleep(250);
+
+        conn->Reply(HTTPReply(401, "", false), false);
+        return;
+    }
+    bool fKeepAlive = (mapHeaders["connection"] != "close");
+
+    JSONRequest jreq;
+    try
+    {
+        // Parse request
+        Value valRequest;
+        if (!ReadJSON(req.strRequest, valRequest))
+            throw JSONRPCError(-32700, "Parse error");
+
+        if (valRequest.type() == array_type)
         {
-            conn->stream() << HTTPReply(401, "", false) << std::flush;
-            break;
+            JSONRPCExecBatch(valRequest.get_array(), boost::bind(&ReplyBatch, req.conn, fKeepAlive, _1));
+            return;
         }
-        if (!HTTPAuthorized(mapHeaders))
+        jreq.parse(valRequest);
+
+        // Long polls don't occupy a worker while they wait: the request is
+        // parked and queued again once its template is stale
+        if (IsLongPollRequest(jreq.strMethod, jreq.params))
         {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                Sleep(250);
-
-            conn->stream() << HTTPReply(401, "", false) << std::flush;
-            break;
+            const Value& longpollid = find_value(jreq.params[0].get_obj(), "longpollid");
+            if (!req.fLongPollWoken)
+            {
+                req.fLongPollWoken = true;
+                unsigned int nPark;
+                if (!conn->ParkLongPoll(boost::bind(&HandleRPCRequest, req), nPark))
+                    throw JSONRPCError(-32603, "Too many long polls");
+                uint64 nWaiter;
+                if (!NotifyOnTemplateChange(longpollid.get_str(),
+                        boost::bind(&WakeParkedLongPoll, boost::weak_ptr<CRPCConnection>(req.conn), nPark), nWaiter))
+                {
+                    conn->DropLongPoll(nPark);
+                    throw JSONRPCError(-8, "Invalid longpollid");
+                }
+                if (nWaiter != 0)
+                    conn->SetLongPollWaiter(nPark, nWaiter);
+                return;
+            }
+            if (fShutdown)
+                throw JSONRPCError(-1, "Server is shutting down");
         }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
 
-        Value id = Value::null;
+        // HTTP/1.1 clients can take a result streamed as it is built
+        CRPCChunkedStream chunked(conn, fKeepAlive);
+        if (req.nProto >= 1)
+            ptsRPCStream.reset(&chunked);
+        Value result;
         try
         {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest) || valRequest.type() != obj_type)
-                throw JSONRPCError(-32700, "Parse error");
-            const Object& request = valRequest.get_obj();
-
-            // Parse id now so errors from here on will have the id
-            id = find_value(request, "id");
-
-            // Parse method
-            Value valMethod = find_value(request, "method");
-            if (valMethod.type() == null_type)
-                throw JSONRPCError(-32600, "Missing method");
-            if (valMethod.type() != str_type)
-                throw JSONRPCError(-32600, "Method must be a string");
-            string strMethod = valMethod.get_str();
-            if (strMethod != "getwork" && strMethod != "getmemorypool")
-                printf("ThreadRPCServer method=%s\n", strMethod.c_str());
-
-            // Parse params
-            Value valParams = find_value(request, "params");
-            Array params;
-            if (valParams.type() == array_type)
-                params = valParams.get_array();
-            else if (valParams.type() == null_type)
-                params = Array();
-            else
-                throw JSONRPCError(-32600, "Params must be an array");
-
-            Value result = tableRPC.execute(strMethod, params);
-
-            // Send reply
-            string strReply = JSONRPCReply(result, Value::null, id);
-            conn->stream() << HTTPReply(200, strReply, fRun) << std::flush;
+            chunked.fInCall = true;
+            result = tableRPC.execute(jreq.strMethod, jreq.params);
+            chunked.fInCall = false;
+            ptsRPCStream.reset();
+            // The call's locks are released by now; a slow client only
+            // holds up this worker
+            if (chunked.streamed)
+                chunked.streamed->Write(chunked);
         }
-        catch (Object& objError)
+        catch (...)
         {
-            ErrorReply(conn->stream(), objError, id);
-            break;
+            chunked.fInCall = false;
+            ptsRPCStream.reset();
+            // Too late for an error reply: cut the stream short instead
+            if (chunked.Started())
+            {
+                conn->Reply("", false);
+                return;
+            }
+            throw;
         }
-        catch (std::exception& e)
+        ptsRPCStream.reset();
+        if (chunked.Started())
         {
-            ErrorReply(conn->stream(), JSONRPCError(-32700, e.what()), id);
-            break;
+            chunked.End(jreq.id);
+            return;
         }
+
+        // Send reply
+        string strReply = JSONRPCReply(result, Value::null, jreq.id);
+        conn->Reply(HTTPReply(200, strReply, fKeepAlive), fKeepAlive);
+    }
+    catch (Object& objError)
+    {
+        ostringstream stream;
+        ErrorReply(stream, objError, jreq.id);
+        conn->Reply(stream.str(), false);
     }
+    catch (std::exception& e)
+    {
+        ostringstream stream;
+        ErrorReply(stream, JSONRPCError(-32700, e.what()), jreq.id);
+        conn->Reply(stream.str(), false);
+    }
+}
 
-    delete conn;
+void ThreadRPCServer3(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadRPCServer3(parg));
+    {
+        LOCK(cs_THREAD_RPCHANDLER);
+        vnThreadsRunning[THREAD_RPCHANDLER]++;
+    }
+    {
+        boost::lock_guard<boost::mutex> lock(mutexRPCWork);
+        nRPCWorkThreads++;
+    }
+
+    while (!fShutdown)
+    {
+        boost::function<void()> fn;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexRPCWork);
+            if (dequeRPCWork.empty())
+            {
+                // Wake up now and then to notice shutdown
+                condRPCWork.timed_wait(lock, posix_time::seconds(1));
+                continue;
+            }
+            fn.swap(dequeRPCWork.front());
+            dequeRPCWork.pop_front();
+        }
+        fn();
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutexRPCWork);
+        nRPCWorkThreads--;
+    }
     {
         LOCK(cs_THREAD_RPCHANDLER);
         vnThreadsRunning[THREAD_RPCHANDLER]--;
     }
 }
 
+//
+// Per-method call counters
+//
+
+class CRPCMethodStats
+{
+public:
+    uint64 nCalls;
+    uint64 nErrors;
+    int64 nTotalMicros;
+    int64 nMaxMicros;
+
+    CRPCMethodStats()
+    {
+        nCalls = 0;
+        nErrors = 0;
+        nTotalMicros = 0;
+        nMaxMicros = 0;
+    }
+};
+
+static CFastCriticalSection cs_mapRPCStats;
+static map<string, CRPCMethodStats> mapRPCStats;
+
+static void RecordRPCCall(const string& strMethod, int64 nMicros, bool fError)
+{
+    FAST_LOCK(cs_mapRPCStats);
+    CRPCMethodStats& stats = mapRPCStats[strMethod];
+    stats.nCalls++;
+    if (fError)
+        stats.nErrors++;
+    stats.nTotalMicros += nMicros;
+    stats.nMaxMicros = max(stats.nMaxMicros, nMicros);
+}
+
+Value getrpcstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcstats\n"
+            "Returns the RPC server's work queue state and, per method, the number of\n"
+            "calls and errors and the total, average and maximum time in milliseconds.");
+
+    Object queue;
+    {
+        boost::lock_guard<boost::mutex> lock(mutexRPCWork);
+        queue.push_back(Pair("threads",  nRPCWorkThreads));
+        queue.push_back(Pair("depth",    (int)dequeRPCWork.size()));
+        queue.push_back(Pair("maxdepth", (int)nRPCWorkQueueMax));
+        queue.push_back(Pair("peak",     (int)nRPCWorkQueuePeak));
+        queue.push_back(Pair("rejected", (boost::int64_t)nRPCWorkRejected));
+        queue.push_back(Pair("longpolls", (int)nRPCLongPolls));
+    }
+    queue.push_back(Pair("templatewaiters", (int)GetTemplateWaiterCount()));
+
+    Object methods;
+    {
+        FAST_LOCK(cs_mapRPCStats);
+        BOOST_FOREACH(const PAIRTYPE(string, CRPCMethodStats)& item, mapRPCStats)
+        {
+            const CRPCMethodStats& stats = item.second;
+            Object obj;
+            obj.push_back(Pair("calls",   (boost::int64_t)stats.nCalls));
+            obj.push_back(Pair("errors",  (boost::int64_t)stats.nErrors));
+            obj.push_back(Pair("totalms", stats.nTotalMicros / 1000.0));
+            obj.push_back(Pair("avgms",   stats.nTotalMicros / 1000.0 / stats.nCalls));
+            obj.push_back(Pair("maxms",   stats.nMaxMicros / 1000.0));
+            methods.push_back(Pair(item.first, obj));
+        }
+    }
+
+    Object result;
+    result.push_back(Pair("queue", queue));
+    result.push_back(Pair("methods", methods));
+    return result;
+}
+
+Value getlockstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getlockstats [reset=false]\n"
+            "Returns, for each lock by the name it is taken by, how often it was taken and\n"
+            "had to be waited for, the total and longest waits and holds in milliseconds, and\n"
+            "how many waits took under 1us, 10us, 100us, 1ms, 10ms, 100ms, 1s and longer.\n"
+            "Locks are only counted when started with -lockstats. With reset, starts over.");
+
+    map<string, CLockStats> mapStats;
+    GetLockStats(mapStats);
+    if (params.size() > 0 && params[0].get_bool())
+        ResetLockStats();
+
+    // Longest total wait first
+    vector<pair<int64, string> > vNames;
+    BOOST_FOREACH(const PAIRTYPE(string, CLockStats)& item, mapStats)
+        vNames.push_back(make_pair(-item.second.nWaitMicros, item.first));
+    sort(vNames.begin(), vNames.end());
+
+    Object locks;
+    BOOST_FOREACH(const PAIRTYPE(int64, string)& item, vNames)
+    {
+        const CLockStats& stats = mapStats[item.second];
+        Object obj;
+        obj.push_back(Pair("acquired",  (boost::int64_t)stats.nAcquired));
+        obj.push_back(Pair("contended", (boost::int64_t)stats.nContended));
+        obj.push_back(Pair("waitms",    stats.nWaitMicros / 1000.0));
+        obj.push_back(Pair("maxwaitms", stats.nMaxWaitMicros / 1000.0));
+        obj.push_back(Pair("holdms",    stats.nHoldMicros / 1000.0));
+        obj.push_back(Pair("maxholdms", stats.nMaxHoldMicros / 1000.0));
+        Array buckets;
+        for (int i = 0; i < CLockStats::WAIT_BUCKETS; i++)
+            buckets.push_back((boost::int64_t)stats.vWaitBuckets[i]);
+        obj.push_back(Pair("waits", buckets));
+        locks.push_back(Pair(item.second, obj));
+    }
+
+    Object result;
+    result.push_back(Pair("enabled", fLockStats));
+    result.push_back(Pair("locks", locks));
+    return result;
+}
+
+// Calls that only read the block chain go ahead while cs_main is held to
+// connect a block.  They run under cs_chainstate shared, so must not wait on
+// the client: a streamed result is written after execute releases it
+static bool IsChainOnlyCall(const CRPCCommand* pcmd, const Array& params)
+{
+    if (!pcmd->chainOnly)
+        return false;
+
+    // Transactions of a block decomposed to objects show what the wallet
+    // knows of them
+    if (pcmd->actor == &getblock && params.size() > 1 && params[1].type() == obj_type &&
+        FindDecompose(params[1].get_obj(), "tx", "hash") == DM_OBJ)
+        return false;
+    return true;
+}
+
+// Calls that take cs_main themselves, only for as long as they need it
+static bool IsUnlockedCall(const CRPCCommand* pcmd)
+{
+    return pcmd->actor == &profiletx || pcmd->actor == &profileblock;
+}
+
 json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
 {
     // Find method
@@ -3235,18 +4479,37 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         !pcmd->okSafeMode)
         throw JSONRPCError(-2, string("Safe mode: ") + strWarning);
 
+    // Long polls were parked by HandleRPCRequest until their template went
+    // stale; nothing waits for one here
+
+    int64 nStart = GetTimeMicros();
     try
     {
         // Execute
         Value result;
+        if (IsUnlockedCall(pcmd))
+            result = pcmd->actor(params, false);
+        else if (IsChainOnlyCall(pcmd, params))
+        {
+            SHARED_LOCK(cs_chainstate);
+            result = pcmd->actor(params, false);
+        }
+        else
         {
             LOCK2(cs_main, pwalletMain->cs_wallet);
             result = pcmd->actor(params, false);
         }
+        RecordRPCCall(strMethod, GetTimeMicros() - nStart, false);
         return result;
     }
+    catch (Object& objError)
+    {
+        RecordRPCCall(strMethod, GetTimeMicros() - nStart, true);
+        throw;
+    }
     catch (std::exception& e)
     {
+        RecordRPCCall(strMethod, GetTimeMicros() - nStart, true);
         throw JSONRPCError(-1, e.what());
     }
 }
@@ -3294,7 +4557,7 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     // Parse reply
     Value valReply;
-    if (!read_string(strReply, valReply))
+    if (!ReadJSON(strReply, valReply))
         throw runtime_error("couldn't parse reply from server");
     const Object& reply = valReply.get_obj();
     if (reply.empty())
@@ -3313,7 +4576,7 @@ void ConvertTo(Value& value)
     {
         // reinterpret string as unquoted json value
         Value value2;
-        if (!read_string(value.get_str(), value2))
+        if (!ReadJSON(value.get_str(), value2))
             throw runtime_error("type mismatch");
         value = value2.get_value<T>();
     }
@@ -3349,6 +4612,8 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "getbalance"             && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "getblock"               && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "getblockhash"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "profileblock"           && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getlockstats"           && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "gettransaction"         && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "move"                   && n > 2) ConvertTo<double>(params[2]);
     if (strMethod == "move"                   && n > 3) ConvertTo<boost::int64_t>(params[3]);
@@ -3399,7 +4664,7 @@ int CommandLineRPC(int argc, char *argv[])
         if (error.type() != null_type)
         {
             // Error
-            strPrint = "error: " + write_string(error, false);
+            strPrint = "error: " + WriteJSON(error);
             int code = find_value(error.get_obj(), "code").get_int();
             nRet = abs(code);
         }
@@ -3411,7 +4676,7 @@ int CommandLineRPC(int argc, char *argv[])
             else if (result.type() == str_type)
                 strPrint = result.get_str();
             else
-                strPrint = write_string(result, true);
+                strPrint = WriteJSON(result, true);
         }
     }
     catch (std::exception& e)
@@ -10,15 +10,25 @@
 #include <string>
 #include <map>
 
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_writer_template.h"
 #include "json/json_spirit_utils.h"
 
+class CBlock;
+class CBlockIndex;
+
 json_spirit::Object JSONRPCError(int code, const std::string& message);
 
 void ThreadRPCServer(void* parg);
 int CommandLineRPC(int argc, char *argv[]);
 
+/** Run a JSON-RPC batch.  fnReply gets the array of replies, in request
+ *  order, from whichever thread finishes the last call. */
+void JSONRPCExecBatch(const json_spirit::Array& vReq, const boost::function<void(const std::string&)>& fnReply);
+
 /** Convert parameter values for RPC call from strings to command-specific JSON objects. */
 json_spirit::Array RPCConvertValues(const std::string &strMethod, const std::vector<std::string> &strParams);
 
@@ -30,6 +40,8 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
+    bool readOnly;      // may run alongside other calls of a batch
+    bool chainOnly;     // reads the block chain but nothing cs_main guards
 };
 
 /**
@@ -56,4 +68,42 @@ public:
 
 extern const CRPCTable tableRPC;
 
+/**
+ * Receives a call's result as JSON text, a piece at a time, for results too
+ * big to build as one json_spirit::Value first.
+ */
+class CRPCStream
+{
+public:
+    virtual ~CRPCStream() { }
+
+    /** Append JSON text; throws if the reader has gone away */
+    virtual void Write(const std::string& str) = 0;
+};
+
+/**
+ * A call's result, gathered while the call holds its locks and written to
+ * the client only after it has returned and released them, so a slow
+ * reader never holds up the node.
+ */
+class CRPCStreamedResult
+{
+public:
+    virtual ~CRPCStreamedResult() { }
+
+    virtual void Write(CRPCStream& stream) const = 0;
+};
+
+/** Whether the running call may hand its result to StreamRPCResult rather than return a Value */
+bool CanStreamRPCResult();
+/** Make result the running call's reply; the call then returns Value::null */
+void StreamRPCResult(const boost::shared_ptr<CRPCStreamedResult>& result);
+
+json_spirit::Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, const json_spirit::Object& decompositions);
+/** Same JSON as write_string(blockToJSON(...)), holding at most one transaction's tree at a time */
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, const json_spirit::Object& decompositions, CRPCStream& stream);
+/** The same, to be written later: gathers what needs the chain or the wallet
+ *  now, under the caller's locks, and takes over block's transactions */
+boost::shared_ptr<CRPCStreamedResult> blockJSONWriter(CBlock& block, const CBlockIndex* blockindex, const json_spirit::Object& decompositions);
+
 #endif
@@ -13,6 +13,9 @@
 
 #ifndef WIN32
 #include "sys/stat.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 using namespace std;
@@ -432,8 +435,16 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+// Counts block index writes, so a snapshot written outside cs_main can tell
+// whether it is still current
+static unsigned int nBlockIndexWrites = 0;
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
+    // Any block index snapshot is out of date now
+    nBlockIndexWrites++;
+    if (!Erase(string("blockindexsnapshot")))
+        return false;
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
@@ -457,20 +468,35 @@ bool CTxDB::WriteBestInvalidWork(CBigNum bnBestInvalidWork)
     return Write(string("bnBestInvalidWork"), bnBestInvalidWork);
 }
 
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    // Call with cs_main held; the id only goes in once the file is in place
+    CBlockIndexSnapshot snapshot;
+    if (!snapshot.Write(GetRand(~(uint64)0)))
+        return false;
+    return WriteBlockIndexSnapshotId(snapshot);
+}
+
+bool CTxDB::WriteBlockIndexSnapshotId(const CBlockIndexSnapshot& snapshot)
+{
+    // Call with cs_main held, once the snapshot's file is in place
+    if (!snapshot.IsCurrent())
+        return false;
+    return Write(string("blockindexsnapshot"), snapshot.GetId());
+}
+
 CBlockIndex static * InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    MapBlockIndex::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (AllocBlockIndex()) CBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -479,25 +505,39 @@ CBlockIndex static * InsertBlockIndex(uint256 hash)
 
 bool CTxDB::LoadBlockIndex()
 {
-    if (!LoadBlockIndexGuts())
-        return false;
-
-    if (fRequestShutdown)
-        return true;
-
-    // Calculate bnChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    // Take the snapshot if it is still current, chain work and all
+    uint256 hashBestChainDB;
+    uint64 nSnapshotId;
+    int64 nStart = GetTimeMillis();
+    if (ReadHashBestChain(hashBestChainDB) && Read(string("blockindexsnapshot"), nSnapshotId) &&
+        CBlockIndexSnapshot().Read(hashBestChainDB, nSnapshotId))
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        printf("LoadBlockIndex(): %d entries from snapshot in %"PRI64d"ms\n", (int)mapBlockIndex.size(), GetTimeMillis() - nStart);
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    else
     {
-        CBlockIndex* pindex = item.second;
-        pindex->bnChainWork = (pindex->pprev ? pindex->pprev->bnChainWork : 0) + pindex->GetBlockWork();
+        if (!LoadBlockIndexGuts())
+            return false;
+
+        if (fRequestShutdown)
+            return true;
+
+        // Calculate bnChainWork
+        vector<pair<int, CBlockIndex*> > vSortedByHeight;
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        {
+            CBlockIndex* pindex = item.second;
+            pindex->bnChainWork = (pindex->pprev ? pindex->pprev->bnChainWork : 0) + pindex->GetBlockWork();
+            pindex->BuildSkip();
+        }
+        printf("LoadBlockIndex(): %d entries from blkindex.dat in %"PRI64d"ms\n", (int)mapBlockIndex.size(), GetTimeMillis() - nStart);
     }
 
     // Load hashBestChain pointer to end of best chain
@@ -512,6 +552,9 @@ bool CTxDB::LoadBlockIndex()
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
     bnBestChainWork = pindexBest->bnChainWork;
+    vBlockIndexByHeight.resize(nBestHeight + 1);
+    for (CBlockIndex* pindex = pindexBest; pindex; pindex = pindex->pprev)
+        vBlockIndexByHeight[pindex->nHeight] = pindex;
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight);
 
     // Load bnBestInvalidWork, OK if it doesn't exist
@@ -815,3 +858,242 @@ bool CAddrDB::Read(CAddrMan& addr)
     return true;
 }
 
+
+
+
+
+//
+// CBlockIndexSnapshot
+//
+
+static const int BLOCKINDEX_SNAPSHOT_VERSION = 1;
+
+// Laid out as it is in memory, so a mapped file can be read in place
+struct CBlockIndexSnapshotHeader
+{
+    unsigned char pchMagic[8];
+    int nVersion;
+    unsigned int nCount;
+    uint64 nSnapshotId;
+    uint256 hashBestChain;
+    uint256 hashChecksum;
+};
+
+// One per block index entry, parents before children; links are record
+// numbers, -1 for none
+struct CBlockIndexSnapshotRecord
+{
+    uint256 hashBlock;
+    uint256 hashMerkleRoot;
+    uint256 nChainWork;
+    int nPrev;
+    int nNext;
+    unsigned int nFile;
+    unsigned int nBlockPos;
+    int nHeight;
+    int nVersion;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+};
+
+static void GetSnapshotMagic(unsigned char pchMagic[8])
+{
+    memcpy(pchMagic, pchMessageStart, 4);
+    memcpy(pchMagic + 4, "bidx", 4);
+}
+
+CBlockIndexSnapshot::CBlockIndexSnapshot()
+{
+    pathSnapshot = GetDataDir() / "blkindex.snap";
+    nSnapshotId = 0;
+    nGeneration = 0;
+}
+
+CBlockIndexSnapshot::CBlockIndexSnapshot(const boost::filesystem::path& pathIn)
+{
+    pathSnapshot = pathIn;
+    nSnapshotId = 0;
+    nGeneration = 0;
+}
+
+void CBlockIndexSnapshot::Gather(uint64 nSnapshotIdIn)
+{
+    // Parents before children, so loading can link each entry as it goes
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    boost::unordered_map<const CBlockIndex*, int> mapRecord;
+    for (unsigned int i = 0; i < vSortedByHeight.size(); i++)
+        mapRecord[vSortedByHeight[i].second] = i;
+
+    // The header, then the records, as the file will hold them
+    vchData.assign(sizeof(CBlockIndexSnapshotHeader) + vSortedByHeight.size() * sizeof(CBlockIndexSnapshotRecord), 0);
+    CBlockIndexSnapshotRecord* pRecords = (CBlockIndexSnapshotRecord*)&vchData[sizeof(CBlockIndexSnapshotHeader)];
+    for (unsigned int i = 0; i < vSortedByHeight.size(); i++)
+    {
+        CBlockIndex* pindex = vSortedByHeight[i].second;
+        CBlockIndexSnapshotRecord& record = pRecords[i];
+        boost::unordered_map<const CBlockIndex*, int>::const_iterator mi;
+        record.hashBlock      = pindex->GetBlockHash();
+        record.hashMerkleRoot = pindex->hashMerkleRoot;
+        record.nChainWork     = pindex->bnChainWork.getuint256();
+        record.nPrev          = (pindex->pprev && (mi = mapRecord.find(pindex->pprev)) != mapRecord.end()) ? mi->second : -1;
+        record.nNext          = (pindex->pnext && (mi = mapRecord.find(pindex->pnext)) != mapRecord.end()) ? mi->second : -1;
+        record.nFile          = pindex->nFile;
+        record.nBlockPos      = pindex->nBlockPos;
+        record.nHeight        = pindex->nHeight;
+        record.nVersion       = pindex->nVersion;
+        record.nTime          = pindex->nTime;
+        record.nBits          = pindex->nBits;
+        record.nNonce         = pindex->nNonce;
+    }
+
+    CBlockIndexSnapshotHeader* pheader = (CBlockIndexSnapshotHeader*)&vchData[0];
+    GetSnapshotMagic(pheader->pchMagic);
+    pheader->nVersion = BLOCKINDEX_SNAPSHOT_VERSION;
+    pheader->nCount = vSortedByHeight.size();
+    pheader->nSnapshotId = nSnapshotIdIn;
+    pheader->hashBestChain = hashBestChain;
+
+    nSnapshotId = nSnapshotIdIn;
+    nGeneration = nBlockIndexWrites;
+}
+
+bool CBlockIndexSnapshot::Commit()
+{
+    if (vchData.size() < sizeof(CBlockIndexSnapshotHeader))
+        return error("CBlockIndexSnapshot::Commit() : nothing gathered");
+    CBlockIndexSnapshotHeader* pheader = (CBlockIndexSnapshotHeader*)&vchData[0];
+    const CBlockIndexSnapshotRecord* pbegin = (const CBlockIndexSnapshotRecord*)&vchData[sizeof(CBlockIndexSnapshotHeader)];
+    pheader->hashChecksum = Hash(pbegin, pbegin + pheader->nCount);
+
+    // Write to a temporary file and rename it into place, as peers.dat does
+    unsigned short randv = 0;
+    RAND_bytes((unsigned char *)&randv, sizeof(randv));
+    boost::filesystem::path pathTmp = pathSnapshot.parent_path() / strprintf("blkindex.snap.%04x", randv);
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("CBlockIndexSnapshot::Commit() : open failed");
+    bool fOk = fwrite(&vchData[0], 1, vchData.size(), file) == vchData.size();
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk)
+    {
+        boost::filesystem::remove(pathTmp);
+        return error("CBlockIndexSnapshot::Commit() : I/O error");
+    }
+    if (!RenameOver(pathTmp, pathSnapshot))
+        return error("CBlockIndexSnapshot::Commit() : Rename-into-place failed");
+
+    printf("CBlockIndexSnapshot::Commit() : %u entries\n", pheader->nCount);
+    return true;
+}
+
+bool CBlockIndexSnapshot::IsCurrent() const
+{
+    return !vchData.empty() && nGeneration == nBlockIndexWrites;
+}
+
+static bool ReadSnapshotData(const unsigned char* pbegin, size_t nSize, const uint256& hashBestChainIn, uint64 nSnapshotId)
+{
+    // Check everything before touching mapBlockIndex
+    const CBlockIndexSnapshotHeader* pheader = (const CBlockIndexSnapshotHeader*)pbegin;
+    unsigned char pchMagic[8];
+    GetSnapshotMagic(pchMagic);
+    if (nSize < sizeof(*pheader) || memcmp(pheader->pchMagic, pchMagic, sizeof(pchMagic)) != 0)
+        return error("CBlockIndexSnapshot::Read() : invalid magic number");
+    if (pheader->nVersion != BLOCKINDEX_SNAPSHOT_VERSION)
+        return error("CBlockIndexSnapshot::Read() : unknown version %d", pheader->nVersion);
+    if (pheader->nSnapshotId != nSnapshotId || pheader->hashBestChain != hashBestChainIn)
+        return error("CBlockIndexSnapshot::Read() : snapshot is out of date");
+    unsigned int nCount = pheader->nCount;
+    if (nSize != sizeof(*pheader) + (uint64)nCount * sizeof(CBlockIndexSnapshotRecord))
+        return error("CBlockIndexSnapshot::Read() : wrong file size");
+    const CBlockIndexSnapshotRecord* pbeginRecords = (const CBlockIndexSnapshotRecord*)(pbegin + sizeof(*pheader));
+    const CBlockIndexSnapshotRecord* pendRecords = pbeginRecords + nCount;
+    if (Hash(pbeginRecords, pendRecords) != pheader->hashChecksum)
+        return error("CBlockIndexSnapshot::Read() : checksum mismatch; data corrupted");
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        const CBlockIndexSnapshotRecord& record = pbeginRecords[i];
+        if (record.nPrev < -1 || record.nPrev >= (int)i || record.nNext < -1 || record.nNext >= (int)nCount ||
+            (record.nPrev >= 0 && pbeginRecords[record.nPrev].nHeight + 1 != record.nHeight))
+            return error("CBlockIndexSnapshot::Read() : bad link at %u", i);
+    }
+
+    // Entries first, so that pnext can point forward
+    vector<CBlockIndex*> vIndex(nCount);
+    for (unsigned int i = 0; i < nCount; i++)
+        vIndex[i] = new (AllocBlockIndex()) CBlockIndex();
+    mapBlockIndex.rehash(nCount);
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        const CBlockIndexSnapshotRecord& record = pbeginRecords[i];
+        CBlockIndex* pindexNew = vIndex[i];
+        pair<MapBlockIndex::iterator, bool> ret = mapBlockIndex.insert(make_pair(record.hashBlock, pindexNew));
+        if (!ret.second)
+        {
+            // The arena keeps what was allocated; the BDB walk starts over
+            mapBlockIndex.clear();
+            pindexGenesisBlock = NULL;
+            return error("CBlockIndexSnapshot::Read() : duplicate entry %s", record.hashBlock.ToString().substr(0,20).c_str());
+        }
+        pindexNew->phashBlock     = &(ret.first->first);
+        pindexNew->pprev          = record.nPrev >= 0 ? vIndex[record.nPrev] : NULL;
+        pindexNew->pnext          = record.nNext >= 0 ? vIndex[record.nNext] : NULL;
+        pindexNew->nFile          = record.nFile;
+        pindexNew->nBlockPos      = record.nBlockPos;
+        pindexNew->nHeight        = record.nHeight;
+        pindexNew->bnChainWork.setuint256(record.nChainWork);
+        pindexNew->nVersion       = record.nVersion;
+        pindexNew->hashMerkleRoot = record.hashMerkleRoot;
+        pindexNew->nTime          = record.nTime;
+        pindexNew->nBits          = record.nBits;
+        pindexNew->nNonce         = record.nNonce;
+        pindexNew->BuildSkip();
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && record.hashBlock == hashGenesisBlock)
+            pindexGenesisBlock = pindexNew;
+    }
+
+    return true;
+}
+
+bool CBlockIndexSnapshot::Read(const uint256& hashBestChainIn, uint64 nSnapshotId)
+{
+    if (!boost::filesystem::exists(pathSnapshot))
+        return false;
+
+#ifndef WIN32
+    // Map the file rather than copying it in
+    int fd = open(pathSnapshot.string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return error("CBlockIndexSnapshot::Read() : open failed");
+    struct stat st;
+    void* pmap = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        pmap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pmap == MAP_FAILED)
+        return error("CBlockIndexSnapshot::Read() : mmap failed");
+    bool fRet = ReadSnapshotData((const unsigned char*)pmap, st.st_size, hashBestChainIn, nSnapshotId);
+    munmap(pmap, st.st_size);
+    return fRet;
+#else
+    FILE *file = fopen(pathSnapshot.string().c_str(), "rb");
+    if (!file)
+        return error("CBlockIndexSnapshot::Read() : open failed");
+    vector<unsigned char> vchData(boost::filesystem::file_size(pathSnapshot));
+    bool fOk = !vchData.empty() && fread(&vchData[0], 1, vchData.size(), file) == vchData.size();
+    fclose(file);
+    if (!fOk)
+        return error("CBlockIndexSnapshot::Read() : I/O error");
+    return ReadSnapshotData(&vchData[0], vchData.size(), hashBestChainIn, nSnapshotId);
+#endif
+}
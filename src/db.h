@@ -16,6 +16,7 @@
 
 class CAddress;
 class CAddrMan;
+class CBlockIndexSnapshot;
 class CBlockLocator;
 class CDiskBlockIndex;
 class CDiskTxPos;
@@ -317,6 +318,8 @@ public:
     bool WriteHashBestChain(uint256 hashBestChain);
     bool ReadBestInvalidWork(CBigNum& bnBestInvalidWork);
     bool WriteBestInvalidWork(CBigNum bnBestInvalidWork);
+    bool WriteBlockIndexSnapshot();
+    bool WriteBlockIndexSnapshotId(const CBlockIndexSnapshot& snapshot);
     bool LoadBlockIndex();
 private:
     bool LoadBlockIndexGuts();
@@ -336,4 +339,29 @@ public:
     bool Read(CAddrMan& addr);
 };
 
+/** Flat copy of the block index (blkindex.snap), loaded at startup in place
+ *  of walking every "blockindex" record in blkindex.dat. It is only used
+ *  while its id is still the one recorded in blkindex.dat; any block index
+ *  write erases that. */
+class CBlockIndexSnapshot
+{
+private:
+    boost::filesystem::path pathSnapshot;
+    std::vector<unsigned char> vchData;
+    uint64 nSnapshotId;
+    unsigned int nGeneration;
+public:
+    CBlockIndexSnapshot();
+    explicit CBlockIndexSnapshot(const boost::filesystem::path& pathIn);
+    /** Copy the block index to be written; call with cs_main held */
+    void Gather(uint64 nSnapshotIdIn);
+    /** Write what Gather copied to the file; needs no lock */
+    bool Commit();
+    /** Whether no block index write has happened since Gather; call with cs_main held */
+    bool IsCurrent() const;
+    uint64 GetId() const { return nSnapshotId; }
+    bool Write(uint64 nSnapshotIdIn) { Gather(nSnapshotIdIn); return Commit(); }
+    bool Read(const uint256& hashBestChainIn, uint64 nSnapshotId);
+};
+
 #endif // BITCOIN_DB_H
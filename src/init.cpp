@@ -11,6 +11,7 @@
 #include "init.h"
 #include "util.h"
 #include "ui_interface.h"
+#include "stratum.h"
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/convenience.hpp>
@@ -69,8 +70,18 @@ void Shutdown(void* parg)
     {
         fShutdown = true;
         nTransactionsUpdated++;
+        NotifyTemplateChange();
         bitdb.Flush(false);
         StopNode();
+        // Before the databases close; the wallet is deleted below
+        if (pwalletMain)
+            pwalletMain->WaitForThreads();
+        if (pindexBest != NULL && GetArg("-indexsnapshot", 60) > 0)
+        {
+            LOCK(cs_main);
+            CTxDB txdb;
+            txdb.WriteBlockIndexSnapshot();
+        }
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -220,6 +231,7 @@ std::string HelpMessage()
         "  -gen=0                 " + _("Don't generate coins") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -scriptcachesize=<n>   " + _("Set the cache of decoded scripts in megabytes (default: 32)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout (in milliseconds)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
@@ -262,6 +274,8 @@ std::string HelpMessage()
         "  -debug                 " + _("Output extra debugging information. Implies all other -debug* options") + "\n" +
         "  -debugnet              " + _("Output extra network debugging information") + "\n" +
         "  -logtimestamps         " + _("Prepend debug output with timestamp") + "\n" +
+        "  -scriptprofile         " + _("Log what the scripts in each connected block cost to run") + "\n" +
+        "  -lockstats             " + _("Count how long locks are waited for and held, for getlockstats") + "\n" +
         "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n" +
 #ifdef WIN32
         "  -printtodebugger       " + _("Send trace/debug info to debugger") + "\n" +
@@ -270,13 +284,27 @@ std::string HelpMessage()
         "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n" +
         "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 9442)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
+        "  -rpcthreads=<n>        " + _("Number of threads serving JSON-RPC requests (default: 4)") + "\n" +
+        "  -rpcworkqueue=<n>      " + _("Queued JSON-RPC requests before new ones are refused with 503 (default: 64)") + "\n" +
+        "  -rpcmaxbatch=<n>       " + _("Maximum number of calls in one JSON-RPC batch (default: 1000)") + "\n" +
+        "  -rpcmaxlongpolls=<n>   " + _("Maximum number of parked JSON-RPC long polls (default: 128)") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
+        "  -stratum               " + _("Accept stratum mining connections") + "\n" +
+        "  -stratumport=<port>    " + _("Listen for stratum connections on <port> (default: 9445 or testnet: 19445)") + "\n" +
+        "  -stratumallowip=<ip>   " + _("Allow stratum connections from specified IP address") + "\n" +
+        "  -stratumpassword=<pw>  " + _("Password stratum workers must authorize with") + "\n" +
+        "  -stratumdifficulty=<n> " + _("Lowest share difficulty for stratum workers, who may suggest a higher one (default: 1)") + "\n" +
+        "  -stratumjobinterval=<n> " + _("Seconds between stratum jobs for memory pool changes (default: 30)") + "\n" +
+        "  -stratummaxclients=<n> " + _("Maximum number of stratum connections (default: 256)") + "\n" +
+        "  -longpollfeedelta=<amt> " + _("New fees in the memory pool that end a getwork/getmemorypool long poll (default: 1)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
+        "  -rescanthreads=<n>     " + _("Number of threads reading blocks during a rescan (default: number of cores)") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
+        "  -indexsnapshot=<n>     " + _("Minutes between block index snapshots for fast startup (default: 60, 0 = off)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
         "  -?                     " + _("This help message") + "\n";
 
@@ -392,6 +420,8 @@ bool AppInit2()
     fPrintToConsole = GetBoolArg("-printtoconsole");
     fPrintToDebugger = GetBoolArg("-printtodebugger");
     fLogTimestamps = GetBoolArg("-logtimestamps");
+    fScriptProfile = GetBoolArg("-scriptprofile");
+    fLockStats = GetBoolArg("-lockstats");
 
     if (mapArgs.count("-timeout"))
     {
@@ -603,7 +633,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (MapBlockIndex::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -687,7 +717,8 @@ bool AppInit2()
     {
         CWalletDB walletdb("wallet.dat");
         CBlockLocator locator;
-        if (walletdb.ReadBestBlock(locator))
+        // An unfinished rescan picks up where it stopped
+        if (walletdb.ReadRescanBlock(locator) || walletdb.ReadBestBlock(locator))
             pindexRescan = locator.GetBlockIndex();
     }
     if (pindexBest != pindexRescan)
@@ -746,6 +777,9 @@ bool AppInit2()
     if (fServer)
         CreateThread(ThreadRPCServer, NULL);
 
+    if (GetBoolArg("-stratum"))
+        StartStratumServer();
+
     // ********************************************************* Step 11: finished
 
     uiInterface.InitMessage(_("Done loading"));
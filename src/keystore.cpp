@@ -7,6 +7,8 @@
 #include "keystore.h"
 #include "script.h"
 
+#include <boost/thread.hpp>
+
 bool CKeyStore::GetPubKey(const CKeyID &address, CPubKey &vchPubKeyOut) const
 {
     CKey key;
@@ -16,22 +18,43 @@ bool CKeyStore::GetPubKey(const CKeyID &address, CPubKey &vchPubKeyOut) const
     return true;
 }
 
+void CBasicKeyStore::AddToFilter(const uint160& hash)
+{
+    filter.insert(hash);
+    if (filter.full())
+    {
+        // Size it for twice what we hold now, so rebuilds stay rare
+        std::set<CKeyID> setKeys;
+        GetKeys(setKeys);
+        filter.reset(2 * (setKeys.size() + mapScripts.size()));
+        BOOST_FOREACH(const CKeyID& keyID, setKeys)
+            filter.insert(keyID);
+        BOOST_FOREACH(const PAIRTYPE(CScriptID, CScript)& item, mapScripts)
+            filter.insert(item.first);
+        filter.insert(hash);
+    }
+}
+
 bool CBasicKeyStore::AddKey(const CKey& key)
 {
     bool fCompressed = false;
     CSecret secret = key.GetSecret(fCompressed);
+    CKeyID keyID = key.GetPubKey().GetID();
     {
         LOCK(cs_KeyStore);
-        mapKeys[key.GetPubKey().GetID()] = make_pair(secret, fCompressed);
+        mapKeys[keyID] = make_pair(secret, fCompressed);
+        AddToFilter(keyID);
     }
     return true;
 }
 
 bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
 {
+    CScriptID scriptID = redeemScript.GetID();
     {
         LOCK(cs_KeyStore);
-        mapScripts[redeemScript.GetID()] = redeemScript;
+        mapScripts[scriptID] = redeemScript;
+        AddToFilter(scriptID);
     }
     return true;
 }
@@ -82,6 +105,7 @@ bool CCryptoKeyStore::Lock()
     {
         LOCK(cs_KeyStore);
         vMasterKey.clear();
+        mapDecryptedKeys.clear();
     }
 
     NotifyStatusChanged(this);
@@ -148,7 +172,9 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<
         if (!SetCrypted())
             return false;
 
-        mapCryptedKeys[vchPubKey.GetID()] = make_pair(vchPubKey, vchCryptedSecret);
+        CKeyID keyID = vchPubKey.GetID();
+        mapCryptedKeys[keyID] = make_pair(vchPubKey, vchCryptedSecret);
+        AddToFilter(keyID);
     }
     return true;
 }
@@ -159,6 +185,16 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
         LOCK(cs_KeyStore);
         if (!IsCrypted())
             return CBasicKeyStore::GetKey(address, keyOut);
+        if (IsLocked())
+            return false;
+
+        KeyMap::const_iterator mk = mapDecryptedKeys.find(address);
+        if (mk != mapDecryptedKeys.end())
+        {
+            keyOut.Reset();
+            keyOut.SetSecret((*mk).second.first, (*mk).second.second);
+            return true;
+        }
 
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
         if (mi != mapCryptedKeys.end())
@@ -172,6 +208,7 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
                 return false;
             keyOut.SetPubKey(vchPubKey);
             keyOut.SetSecret(vchSecret);
+            mapDecryptedKeys[address] = make_pair(vchSecret, keyOut.IsCompressed());
             return true;
         }
     }
@@ -195,6 +232,31 @@ bool CCryptoKeyStore::GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) co
     return false;
 }
 
+// One slice of the keys EncryptKeys works through; each worker takes every
+// nStride'th key, starting at nFirst
+struct CKeyEncryptBatch
+{
+    CKeyingMaterial* pvMasterKey;
+    std::vector<const KeyMap::value_type*> vKeys;
+    std::vector<CPubKey> vPubKeys;
+    std::vector<std::vector<unsigned char> > vCryptedSecrets;
+    std::vector<char> vfOk;
+};
+
+static void EncryptKeysWorker(CKeyEncryptBatch* pbatch, unsigned int nFirst, unsigned int nStride)
+{
+    for (unsigned int i = nFirst; i < pbatch->vKeys.size(); i += nStride)
+    {
+        const KeyMap::value_type& mKey = *pbatch->vKeys[i];
+        CKey key;
+        if (!key.SetSecret(mKey.second.first, mKey.second.second))
+            continue;
+        pbatch->vPubKeys[i] = key.GetPubKey();
+        bool fCompressed;
+        pbatch->vfOk[i] = EncryptSecret(*pbatch->pvMasterKey, key.GetSecret(fCompressed), pbatch->vPubKeys[i].GetHash(), pbatch->vCryptedSecrets[i]);
+    }
+}
+
 bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
 {
     {
@@ -202,18 +264,29 @@ bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
         if (!mapCryptedKeys.empty() || IsCrypted())
             return false;
 
+        // The EC and AES work is spread over the cores; the crypted keys
+        // are then added one by one, as AddCryptedKey may write them out
+        CKeyEncryptBatch batch;
+        batch.pvMasterKey = &vMasterKeyIn;
+        BOOST_FOREACH(const KeyMap::value_type& mKey, mapKeys)
+            batch.vKeys.push_back(&mKey);
+        batch.vPubKeys.resize(batch.vKeys.size());
+        batch.vCryptedSecrets.resize(batch.vKeys.size());
+        batch.vfOk.resize(batch.vKeys.size(), false);
+
+        unsigned int nThreads = std::max(1U, std::min(boost::thread::hardware_concurrency(), (unsigned int)batch.vKeys.size() / 64));
+        boost::thread_group workers;
+        for (unsigned int i = 1; i < nThreads; i++)
+            workers.create_thread(boost::bind(&EncryptKeysWorker, &batch, i, nThreads));
+        EncryptKeysWorker(&batch, 0, nThreads);
+        workers.join_all();
+
         fUseCrypto = true;
-        BOOST_FOREACH(KeyMap::value_type& mKey, mapKeys)
+        for (unsigned int i = 0; i < batch.vKeys.size(); i++)
         {
-            CKey key;
-            if (!key.SetSecret(mKey.second.first, mKey.second.second))
-                return false;
-            const CPubKey vchPubKey = key.GetPubKey();
-            std::vector<unsigned char> vchCryptedSecret;
-            bool fCompressed;
-            if (!EncryptSecret(vMasterKeyIn, key.GetSecret(fCompressed), vchPubKey.GetHash(), vchCryptedSecret))
+            if (!batch.vfOk[i])
                 return false;
-            if (!AddCryptedKey(vchPubKey, vchCryptedSecret))
+            if (!AddCryptedKey(batch.vPubKeys[i], batch.vCryptedSecrets[i]))
                 return false;
         }
         mapKeys.clear();
@@ -12,6 +12,65 @@
 
 class CScript;
 
+/** Bloom filter over the key IDs and script IDs of a key store, probed
+ * before running Solver on a scriptPubKey.  The IDs are hashes already, so
+ * the bit positions are taken straight from their words.  A miss means the
+ * ID is certainly not in the store; a hit has to be confirmed.
+ */
+class CKeyIDFilter
+{
+private:
+    std::vector<unsigned char> vData;
+    unsigned int nElements;
+    unsigned int nCapacity;
+
+public:
+    CKeyIDFilter(unsigned int nCapacityIn = 0)
+    {
+        reset(nCapacityIn);
+    }
+
+    // Empty the filter and size it for nCapacityIn IDs at 16 bits each,
+    // about a 0.25% false positive rate with four probes
+    void reset(unsigned int nCapacityIn)
+    {
+        nCapacity = std::max(nCapacityIn, 256U);
+        unsigned int nBits = 4096;
+        while (nBits < 16 * nCapacity)
+            nBits <<= 1;
+        vData.assign(nBits / 8, 0);
+        nElements = 0;
+    }
+
+    bool full() const { return nElements >= nCapacity; }
+
+    void insert(const uint160& hash)
+    {
+        unsigned int nMask = vData.size() * 8 - 1;
+        for (int i = 0; i < 2; i++)
+        {
+            uint64 n = hash.Get64(i);
+            unsigned int n1 = (unsigned int)n & nMask, n2 = (unsigned int)(n >> 32) & nMask;
+            vData[n1 >> 3] |= 1 << (n1 & 7);
+            vData[n2 >> 3] |= 1 << (n2 & 7);
+        }
+        nElements++;
+    }
+
+    bool contains(const uint160& hash) const
+    {
+        unsigned int nMask = vData.size() * 8 - 1;
+        for (int i = 0; i < 2; i++)
+        {
+            uint64 n = hash.Get64(i);
+            unsigned int n1 = (unsigned int)n & nMask, n2 = (unsigned int)(n >> 32) & nMask;
+            if (!(vData[n1 >> 3] & (1 << (n1 & 7))) || !(vData[n2 >> 3] & (1 << (n2 & 7))))
+                return false;
+        }
+        return true;
+    }
+};
+
 /** A virtual base class for key stores */
 class CKeyStore
 {
@@ -35,6 +94,10 @@ public:
     virtual bool HaveCScript(const CScriptID &hash) const =0;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const =0;
 
+    // False if no key or script with this ID can be in the store.  Used by
+    // IsMine to turn away scriptPubKeys before running Solver on them.
+    virtual bool MayHave(const uint160& hash) const { return true; }
+
     virtual bool GetSecret(const CKeyID &address, CSecret& vchSecret, bool &fCompressed) const
     {
         CKey key;
@@ -54,6 +117,10 @@ class CBasicKeyStore : public CKeyStore
 protected:
     KeyMap mapKeys;
     ScriptMap mapScripts;
+    CKeyIDFilter filter;
+
+    // Add hash to the filter, rebuilding it larger once it fills; cs_KeyStore must be held
+    void AddToFilter(const uint160& hash);
 
 public:
     bool AddKey(const CKey& key);
@@ -96,6 +163,11 @@ public:
     virtual bool AddCScript(const CScript& redeemScript);
     virtual bool HaveCScript(const CScriptID &hash) const;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const;
+    bool MayHave(const uint160& hash) const
+    {
+        LOCK(cs_KeyStore);
+        return filter.contains(hash);
+    }
 };
 
 typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
@@ -114,6 +186,10 @@ private:
     // if fUseCrypto is false, vMasterKey must be empty
     bool fUseCrypto;
 
+    // Secrets decrypted by GetKey since the last unlock, so each key is
+    // decrypted once; wiped by Lock()
+    mutable KeyMap mapDecryptedKeys;
+
 protected:
     bool SetCrypted();
 
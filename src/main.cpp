@@ -24,11 +24,17 @@ CCriticalSection cs_setpwalletRegistered;
 set<CWallet*> setpwalletRegistered;
 
 CCriticalSection cs_main;
+CSharedCriticalSection cs_chainstate;
 
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+uint64 CBlockIndexHasher::vSalt[4] = {
+    GetRand(~(uint64)0) | 1, GetRand(~(uint64)0) | 1,
+    GetRand(~(uint64)0) | 1, GetRand(~(uint64)0) | 1,
+};
+MapBlockIndex mapBlockIndex;
+vector<CBlockIndex*> vBlockIndexByHeight;
 uint256 hashGenesisBlock("0x5828800007714e96f32995e76076b990a1211cf264f2eae74b5ac8be32222950");
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); // Litecoin: starting difficulty is 1 / 2^12
 CBlockIndex* pindexGenesisBlock = NULL;
@@ -55,9 +61,14 @@ const string strMessageMagic = "AumCoin Signed Message:\n";
 double dHashesPerSec;
 int64 nHPSTimerStart;
 
+// Long-poll notifications, defined with the miner below
+static void TemplateBestChainChanged(const uint256& hashNewBest);
+static void TemplateFeesAdded(int64 nFees);
+
 // Settings
 int64 nTransactionFee = 0;
 int64 nMinimumInputValue = CENT / 100;
+bool fScriptProfile = false;
 
 
 
@@ -361,7 +372,7 @@ CTransaction::GetLegacySigOpCount() const
     }
     BOOST_FOREACH(const CTxOut& txout, vout)
     {
-        nSigOps += txout.scriptPubKey.GetSigOpCount(false);
+        nSigOps += txout.scriptPubKey.GetSigOpCount(false, true);
     }
     return nSigOps;
 }
@@ -408,7 +419,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    MapBlockIndex::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -506,6 +517,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
 
     // Check for conflicts with in-memory transactions
     CTransaction* ptxOld = NULL;
+    int64 nFees = 0;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         COutPoint outpoint = tx.vin[i].prevout;
@@ -554,7 +566,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         // you should add code here to check that the transaction does a
         // reasonable number of ECDSA signature verifications.
 
-        int64 nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+        nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
         unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
         // Don't accept it if it can't get into a block
@@ -602,7 +614,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(tx);
+        addUnchecked(tx, nFees);
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
@@ -621,7 +633,7 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     return mempool.accept(txdb, *this, fCheckInputs, pfMissingInputs);
 }
 
-bool CTxMemPool::addUnchecked(CTransaction &tx)
+bool CTxMemPool::addUnchecked(CTransaction &tx, int64 nFees)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
@@ -633,6 +645,7 @@ bool CTxMemPool::addUnchecked(CTransaction &tx)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
         nTransactionsUpdated++;
     }
+    TemplateFeesAdded(nFees);
     return true;
 }
 
@@ -673,7 +686,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    MapBlockIndex::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -756,7 +769,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    MapBlockIndex::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -902,9 +915,7 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
         blockstogoback = nInterval;
 
     // Go back by what we want to be 14 days worth of blocks
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < blockstogoback; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - blockstogoback);
     assert(pindexFirst);
 
     // Limit adjustment step
@@ -1158,7 +1169,8 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 
 bool CTransaction::ConnectInputs(MapPrevTx inputs,
                                  map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash)
+                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash,
+                                 CScriptProfile* pprofile)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1212,7 +1224,7 @@ bool CTransaction::ConnectInputs(MapPrevTx inputs,
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
+                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0, pprofile))
                 {
                     // only during transition phase for P2SH: do not invoke anti-DoS code for
                     // potentially old clients relaying bad P2SH transactions
@@ -1357,6 +1369,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     map<uint256, CTxIndex> mapQueuedChanges;
     int64 nFees = 0;
     unsigned int nSigOps = 0;
+    // What the scripts cost, in all and for each transaction, for -scriptprofile
+    CScriptProfile profileBlock, profileTx;
+    vector<pair<int64, uint256> > vTxMicros;
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         nSigOps += tx.GetLegacySigOpCount();
@@ -1385,8 +1400,16 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 
             nFees += tx.GetValueIn(mapInputs)-tx.GetValueOut();
 
-            if (!tx.ConnectInputs(mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash))
+            if (fScriptProfile)
+                profileTx.SetNull();
+            if (!tx.ConnectInputs(mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash,
+                                  fScriptProfile ? &profileTx : NULL))
                 return false;
+            if (fScriptProfile)
+            {
+                profileBlock.Add(profileTx);
+                vTxMicros.push_back(make_pair(profileTx.GetMicros(), tx.GetHash()));
+            }
         }
 
         mapQueuedChanges[tx.GetHash()] = CTxIndex(posThisTx, tx.vout.size());
@@ -1402,6 +1425,16 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     if (vtx[0].GetValueOut() > GetBlockValue(pindex->nHeight, nFees))
         return false;
 
+    if (fScriptProfile && profileBlock.nScripts > 0)
+    {
+        printf("ScriptProfile: block %s height %d: %u scripts, %"PRI64u" ops, %"PRI64d"us, %"PRI64u" bytes\n",
+               pindex->GetBlockHash().ToString().substr(0,20).c_str(), pindex->nHeight, profileBlock.nScripts,
+               profileBlock.GetOps(), profileBlock.GetMicros(), profileBlock.GetBytes());
+        sort(vTxMicros.rbegin(), vTxMicros.rend());
+        for (unsigned int i = 0; i < vTxMicros.size() && i < 3; i++)
+            printf("ScriptProfile:   tx %s %"PRI64d"us\n", vTxMicros[i].second.ToString().c_str(), vTxMicros[i].first);
+    }
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1419,23 +1452,47 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+void SetBestChainTip(CBlockIndex* pindexNew)
+{
+    EXCLUSIVE_LOCK(cs_chainstate);
+
+    // Walk back to where pindexNew meets the current best chain
+    vector<CBlockIndex*> vConnect;
+    CBlockIndex* pfork = pindexNew;
+    while (pfork && !(pfork->nHeight < (int)vBlockIndexByHeight.size() && vBlockIndexByHeight[pfork->nHeight] == pfork))
+    {
+        vConnect.push_back(pfork);
+        pfork = pfork->pprev;
+    }
+
+    // Unlink the old branch above it, then link the new one
+    unsigned int nKeep = pfork ? pfork->nHeight + 1 : 0;
+    if (pfork)
+        pfork->pnext = NULL;
+    for (unsigned int i = nKeep; i < vBlockIndexByHeight.size(); i++)
+        vBlockIndexByHeight[i]->pnext = NULL;
+    vBlockIndexByHeight.resize(nKeep);
+    BOOST_REVERSE_FOREACH(CBlockIndex* pindex, vConnect)
+    {
+        if (pindex->pprev)
+            pindex->pprev->pnext = pindex;
+        vBlockIndexByHeight.push_back(pindex);
+    }
+
+    hashBestChain = pindexNew->GetBlockHash();
+    pindexBest = pindexNew;
+    nBestHeight = pindexNew->nHeight;
+    bnBestChainWork = pindexNew->bnChainWork;
+}
+
 bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 {
     printf("REORGANIZE\n");
 
     // Find the fork
-    CBlockIndex* pfork = pindexBest;
-    CBlockIndex* plonger = pindexNew;
-    while (pfork != plonger)
-    {
-        while (plonger->nHeight > pfork->nHeight)
-            if (!(plonger = plonger->pprev))
-                return error("Reorganize() : plonger->pprev is null");
-        if (pfork == plonger)
-            break;
-        if (!(pfork = pfork->pprev))
-            return error("Reorganize() : pfork->pprev is null");
-    }
+    CBlockIndex* pfork = LastCommonAncestor(pindexBest, pindexNew);
+    if (!pfork)
+        return error("Reorganize() : no common ancestor with the new branch");
 
     // List of what to disconnect
     vector<CBlockIndex*> vDisconnect;
@@ -1492,15 +1549,8 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     if (!txdb.TxnCommit())
         return error("Reorganize() : TxnCommit failed");
 
-    // Disconnect shorter branch
-    BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
-        if (pindex->pprev)
-            pindex->pprev->pnext = NULL;
-
-    // Connect longer branch
-    BOOST_FOREACH(CBlockIndex* pindex, vConnect)
-        if (pindex->pprev)
-            pindex->pprev->pnext = pindex;
+    // Disconnect shorter branch and connect longer branch
+    SetBestChainTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
@@ -1532,7 +1582,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
         return error("SetBestChain() : TxnCommit failed");
 
     // Add to current best branch
-    pindexNew->pprev->pnext = pindexNew;
+    SetBestChainTip(pindexNew);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -1541,6 +1591,24 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
     return true;
 }
 
+// Writes a block index snapshot gathered by SetBestChain, then records its
+// id if no block index write has made it stale in the meantime
+static void ThreadBlockIndexSnapshot(void* parg)
+{
+    CBlockIndexSnapshot* psnapshot = (CBlockIndexSnapshot*)parg;
+    if (psnapshot->Commit())
+    {
+        LOCK(cs_main);
+        if (!fShutdown)
+        {
+            CTxDB txdb;
+            txdb.WriteBlockIndexSnapshotId(*psnapshot);
+        }
+    }
+    delete psnapshot;
+    vnThreadsRunning[THREAD_INDEXSNAPSHOT]--;
+}
+
 bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 {
     uint256 hash = GetHash();
@@ -1553,7 +1621,11 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         txdb.WriteHashBestChain(hash);
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
-        pindexGenesisBlock = pindexNew;
+        {
+            EXCLUSIVE_LOCK(cs_chainstate);
+            pindexGenesisBlock = pindexNew;
+        }
+        SetBestChainTip(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -1606,23 +1678,40 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         }
     }
 
-    // Update best block in wallet (so we can detect restored wallets)
+    // Update best block in wallet (so we can detect restored wallets); the
+    // new best block was published as each block was connected
     bool fIsInitialDownload = IsInitialBlockDownload();
     if (!fIsInitialDownload)
     {
-        const CBlockLocator locator(pindexNew);
+        const CBlockLocator locator(pindexBest);
         ::SetBestChain(locator);
     }
 
-    // New best block
-    hashBestChain = hash;
-    pindexBest = pindexNew;
-    nBestHeight = pindexBest->nHeight;
-    bnBestChainWork = pindexNew->bnChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    TemplateBestChainChanged(hashBestChain);
     printf("SetBestChain: new best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str());
 
+    // Refresh the block index snapshot every -indexsnapshot minutes once
+    // caught up; only the copy is made here, the file is written by a thread
+    static int64 nLastIndexSnapshot = GetTime();
+    int64 nIndexSnapshotInterval = GetArg("-indexsnapshot", 60) * 60;
+    if (!fIsInitialDownload && !fShutdown && nIndexSnapshotInterval > 0 &&
+        GetTime() - nLastIndexSnapshot >= nIndexSnapshotInterval && vnThreadsRunning[THREAD_INDEXSNAPSHOT] == 0)
+    {
+        nLastIndexSnapshot = GetTime();
+        CBlockIndexSnapshot* psnapshot = new CBlockIndexSnapshot();
+        psnapshot->Gather(GetRand(~(uint64)0));
+        // Counted here, under cs_main, so StopNode can't miss it
+        vnThreadsRunning[THREAD_INDEXSNAPSHOT]++;
+        if (!CreateThread(ThreadBlockIndexSnapshot, psnapshot))
+        {
+            printf("Error: CreateThread(ThreadBlockIndexSnapshot) failed\n");
+            vnThreadsRunning[THREAD_INDEXSNAPSHOT]--;
+            delete psnapshot;
+        }
+    }
+
     std::string strCmd = GetArg("-blocknotify", "");
 
     if (!fIsInitialDownload && !strCmd.empty())
@@ -1643,18 +1732,20 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
-    if (miPrev != mapBlockIndex.end())
+    CBlockIndex* pindexNew = new (AllocBlockIndex()) CBlockIndex(nFile, nBlockPos, *this);
     {
-        pindexNew->pprev = (*miPrev).second;
-        pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        EXCLUSIVE_LOCK(cs_chainstate);
+        MapBlockIndex::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+        pindexNew->phashBlock = &((*mi).first);
+        MapBlockIndex::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+        if (miPrev != mapBlockIndex.end())
+        {
+            pindexNew->pprev = (*miPrev).second;
+            pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+            pindexNew->BuildSkip();
+        }
+        pindexNew->bnChainWork = (pindexNew->pprev ? pindexNew->pprev->bnChainWork : 0) + pindexNew->GetBlockWork();
     }
-    pindexNew->bnChainWork = (pindexNew->pprev ? pindexNew->pprev->bnChainWork : 0) + pindexNew->GetBlockWork();
 
     CTxDB txdb;
     if (!txdb.TxnBegin())
@@ -1747,7 +1838,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    MapBlockIndex::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -1806,7 +1897,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     if (!pblock->CheckBlock())
         return error("ProcessBlock() : CheckBlock FAILED");
 
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
     if (pcheckpoint && pblock->hashPrevBlock != hashBestChain)
     {
         // Extra checks to prevent "fill up memory by spamming with bogus blocks"
@@ -1937,6 +2028,89 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
+// CBlockIndex entries are carved out of chunks this many at a time
+static const unsigned int BLOCKINDEX_CHUNK_SIZE = 4096;
+static vector<char*> vBlockIndexChunks;
+static unsigned int nBlockIndexChunkUsed = BLOCKINDEX_CHUNK_SIZE;
+
+void* AllocBlockIndex()
+{
+    if (nBlockIndexChunkUsed == BLOCKINDEX_CHUNK_SIZE)
+    {
+        char* pchunk = (char*)malloc(sizeof(CBlockIndex) * BLOCKINDEX_CHUNK_SIZE);
+        if (!pchunk)
+            throw std::bad_alloc();
+        vBlockIndexChunks.push_back(pchunk);
+        nBlockIndexChunkUsed = 0;
+    }
+    return vBlockIndexChunks.back() + sizeof(CBlockIndex) * nBlockIndexChunkUsed++;
+}
+
+CBlockIndex* FindBlockByHeight(int nHeight)
+{
+    if (nHeight < 0 || nHeight >= (int)vBlockIndexByHeight.size())
+        return NULL;
+    return vBlockIndexByHeight[nHeight];
+}
+
+// Where pskip of a block at nHeight points: nHeight with its lowest set bit
+// cleared, or for odd heights nHeight - 1 with its two lowest set bits
+// cleared, plus one.  Runs of skips then reach far back, and there are
+// short ones to finish with.
+static inline int GetSkipHeight(int nHeight)
+{
+    if (nHeight < 2)
+        return 0;
+    if (nHeight & 1)
+    {
+        int n = (nHeight - 1) & (nHeight - 2);
+        return (n & (n - 1)) + 1;
+    }
+    return nHeight & (nHeight - 1);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn) const
+{
+    if (nHeightIn < 0 || nHeightIn > nHeight)
+        return NULL;
+
+    const CBlockIndex* pindex = this;
+    while (pindex && pindex->nHeight > nHeightIn)
+    {
+        // Take the skip unless it overshoots, or the one from pprev gets
+        // there in fewer steps
+        int nSkip = GetSkipHeight(pindex->nHeight);
+        int nSkipPrev = GetSkipHeight(pindex->nHeight - 1);
+        if (pindex->pskip && (nSkip == nHeightIn ||
+            (nSkip > nHeightIn && !(nSkipPrev < nSkip - 2 && nSkipPrev >= nHeightIn))))
+            pindex = pindex->pskip;
+        else
+            pindex = pindex->pprev;
+    }
+    return pindex;
+}
+
+CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb)
+{
+    if (pa->nHeight > pb->nHeight)
+        pa = pa->GetAncestor(pb->nHeight);
+    else if (pb->nHeight > pa->nHeight)
+        pb = pb->GetAncestor(pa->nHeight);
+
+    while (pa && pb && pa != pb)
+    {
+        pa = pa->pprev;
+        pb = pb->pprev;
+    }
+    return (pa == pb ? pa : NULL);
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
     if (fTestNet)
@@ -2058,7 +2232,7 @@ void PrintBlockTree()
 {
     // precompute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (MapBlockIndex::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2633,7 +2807,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                MapBlockIndex::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
                     CBlock block;
@@ -2714,7 +2888,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            MapBlockIndex::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3559,8 +3733,9 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
     for (unsigned int i = 0; i < sizeof(tmp)/4; i++)
         ((unsigned int*)&tmp)[i] = ByteReverse(((unsigned int*)&tmp)[i]);
 
-    // Precalc the first half of the first hash, which stays constant
-    SHA256Transform(pmidstate, &tmp.block, pSHA256InitState);
+    // Precalc the first half of the first hash, which stays constant.
+    // This is the same SHA-256 state scrypt needs to derive its HMAC key.
+    scrypt_1024_1_1_256_midstate(BEGIN(pblock->nVersion), (uint32_t*)pmidstate);
 
     memcpy(pdata, &tmp.block, 128);
     memcpy(phash1, &tmp.hash1, 64);
@@ -3604,6 +3779,141 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
+
+//
+// Template long polling
+//
+// getwork/getmemorypool callers can hand back the longpollid of their last
+// template and wait until it is worth fetching a new one.  Waiters are kept
+// in one map ordered by fee target: SetBestChain releases all of them and
+// CTxMemPool::addUnchecked only the ones whose -longpollfeedelta has been
+// reached, so nobody is woken just to go back to sleep.
+//
+
+class CTemplateWaiter
+{
+public:
+    uint64 nId;
+    boost::function<void()> fn;
+
+    CTemplateWaiter(uint64 nIdIn, const boost::function<void()>& fnIn) : nId(nIdIn), fn(fnIn) { }
+};
+
+typedef multimap<int64, CTemplateWaiter> mapTemplateWaiters_t;
+
+static boost::mutex mutexTemplate;
+static uint256 hashTemplateBest = 0;
+static int64 nTemplateFees = 0;     // fees of all transactions ever added to the memory pool
+static mapTemplateWaiters_t mapTemplateWaiters;
+// Handles given out by NotifyOnTemplateChange, for CancelTemplateWaiter
+static map<uint64, mapTemplateWaiters_t::iterator> mapTemplateWaiterIds;
+static uint64 nTemplateWaiterLastId = 0;
+
+// Caller holds mutexTemplate
+static void TakeTemplateWaiters(mapTemplateWaiters_t::iterator itBegin, mapTemplateWaiters_t::iterator itEnd,
+                                vector<boost::function<void()> >& vWaiters)
+{
+    for (mapTemplateWaiters_t::iterator it = itBegin; it != itEnd; ++it)
+    {
+        vWaiters.push_back(it->second.fn);
+        mapTemplateWaiterIds.erase(it->second.nId);
+    }
+    mapTemplateWaiters.erase(itBegin, itEnd);
+}
+
+static void RunTemplateWaiters(vector<boost::function<void()> >& vWaiters)
+{
+    BOOST_FOREACH(boost::function<void()>& fn, vWaiters)
+        fn();
+}
+
+static void TemplateBestChainChanged(const uint256& hashNewBest)
+{
+    vector<boost::function<void()> > vWaiters;
+    {
+        boost::lock_guard<boost::mutex> lock(mutexTemplate);
+        hashTemplateBest = hashNewBest;
+        TakeTemplateWaiters(mapTemplateWaiters.begin(), mapTemplateWaiters.end(), vWaiters);
+    }
+    RunTemplateWaiters(vWaiters);
+}
+
+static void TemplateFeesAdded(int64 nFees)
+{
+    if (nFees <= 0)
+        return;
+    vector<boost::function<void()> > vWaiters;
+    {
+        boost::lock_guard<boost::mutex> lock(mutexTemplate);
+        nTemplateFees += nFees;
+        TakeTemplateWaiters(mapTemplateWaiters.begin(), mapTemplateWaiters.upper_bound(nTemplateFees), vWaiters);
+    }
+    RunTemplateWaiters(vWaiters);
+}
+
+void NotifyTemplateChange()
+{
+    vector<boost::function<void()> > vWaiters;
+    {
+        boost::lock_guard<boost::mutex> lock(mutexTemplate);
+        TakeTemplateWaiters(mapTemplateWaiters.begin(), mapTemplateWaiters.end(), vWaiters);
+    }
+    RunTemplateWaiters(vWaiters);
+}
+
+std::string GetTemplateLongPollId()
+{
+    // Caller holds cs_main; the chain loaded at startup never went through
+    // SetBestChain, so pick it up here
+    boost::lock_guard<boost::mutex> lock(mutexTemplate);
+    hashTemplateBest = hashBestChain;
+    return hashTemplateBest.GetHex() + strprintf("%"PRI64d, nTemplateFees);
+}
+
+bool NotifyOnTemplateChange(const std::string& strLongPollId, const boost::function<void()>& fn, uint64& nWaiterRet)
+{
+    nWaiterRet = 0;
+    if (strLongPollId.size() <= 64)
+        return false;
+    uint256 hashBest;
+    hashBest.SetHex(strLongPollId.substr(0, 64));
+    int64 nFees = atoi64(strLongPollId.substr(64));
+
+    int64 nFeeDelta = 0;
+    if (!ParseMoney(GetArg("-longpollfeedelta", "1"), nFeeDelta) || nFeeDelta <= 0)
+        nFeeDelta = COIN;
+    int64 nFeeTarget = nFees + nFeeDelta;
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutexTemplate);
+        if (!fShutdown && hashBest == hashTemplateBest && nTemplateFees < nFeeTarget)
+        {
+            nWaiterRet = ++nTemplateWaiterLastId;
+            mapTemplateWaiterIds[nWaiterRet] = mapTemplateWaiters.insert(make_pair(nFeeTarget, CTemplateWaiter(nWaiterRet, fn)));
+            return true;
+        }
+    }
+    // Already stale
+    fn();
+    return true;
+}
+
+void CancelTemplateWaiter(uint64 nWaiter)
+{
+    boost::lock_guard<boost::mutex> lock(mutexTemplate);
+    map<uint64, mapTemplateWaiters_t::iterator>::iterator mi = mapTemplateWaiterIds.find(nWaiter);
+    if (mi == mapTemplateWaiterIds.end())
+        return;
+    mapTemplateWaiters.erase(mi->second);
+    mapTemplateWaiterIds.erase(mi);
+}
+
+unsigned int GetTemplateWaiterCount()
+{
+    boost::lock_guard<boost::mutex> lock(mutexTemplate);
+    return mapTemplateWaiters.size();
+}
+
 void static ThreadBitcoinMiner(void* parg);
 
 static bool fGenerateBitcoins = false;
@@ -3675,7 +3985,9 @@ void static BitcoinMiner(CWallet *pwallet)
             char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
             loop
             {
-                scrypt_1024_1_1_256_sp(BEGIN(pblock->nVersion), BEGIN(thash), scratchpad);
+                // Only nTime and nNonce change inside the loop, both of which
+                // are past the first 64 bytes covered by pmidstate
+                scrypt_1024_1_1_256_sp_midstate(BEGIN(pblock->nVersion), (const uint32_t*)pmidstate, BEGIN(thash), scratchpad);
 
                 if (thash <= hashTarget)
                 {
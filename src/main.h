@@ -15,6 +15,8 @@
 #include "scrypt.h"
 
 #include <list>
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
 
 class CWallet;
 class CBlock;
@@ -56,7 +58,37 @@ extern CScript COINBASE_FLAGS;
 
 
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+/** Lets mapBlockIndex, the links between its entries and the best chain be
+ *  read without cs_main.  Whoever changes them holds cs_main and takes this
+ *  exclusively just for the change; whoever holds it shared must not wait
+ *  for cs_main, nor on anything slower, such as an RPC client. */
+extern CSharedCriticalSection cs_chainstate;
+
+/** Buckets block hashes by all of their bits, weighted by factors drawn at
+ *  startup, so no one can pick hashes that share a bucket */
+class CBlockIndexHasher
+{
+public:
+    static uint64 vSalt[4];
+
+    size_t operator()(const uint256& hash) const
+    {
+        uint64 n = hash.Get64(0) * vSalt[0] + hash.Get64(1) * vSalt[1] +
+                   hash.Get64(2) * vSalt[2] + hash.Get64(3) * vSalt[3];
+        return (size_t)(n ^ (n >> 32));
+    }
+};
+
+typedef boost::unordered_map<uint256, CBlockIndex*, CBlockIndexHasher> MapBlockIndex;
+
+extern MapBlockIndex mapBlockIndex;
+/** The best chain by height, as linked by pnext; guarded like mapBlockIndex */
+extern std::vector<CBlockIndex*> vBlockIndexByHeight;
+/** Make pindexNew the best block: relink pnext and vBlockIndexByHeight back to
+ *  where it meets the old best chain and set pindexBest, nBestHeight,
+ *  hashBestChain and bnBestChainWork, all in one exclusive section of
+ *  cs_chainstate.  Call with cs_main held. */
+void SetBestChainTip(CBlockIndex* pindexNew);
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
@@ -78,6 +110,7 @@ extern unsigned char pchMessageStart[4];
 // Settings
 extern int64 nTransactionFee;
 extern int64 nMinimumInputValue;
+extern bool fScriptProfile;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64 nMinDiskSpace = 52428800;
@@ -95,6 +128,13 @@ bool CheckDiskSpace(uint64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
+/** Room for one more CBlockIndex, next to the ones before it; construct it
+ *  with placement new.  They are never freed.  Call with cs_main held. */
+void* AllocBlockIndex();
+/** The block at nHeight on the best chain, or NULL */
+CBlockIndex* FindBlockByHeight(int nHeight);
+/** The last block on both branches, or NULL if they don't meet */
+CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb);
 void PrintBlockTree();
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
@@ -104,6 +144,19 @@ CBlock* CreateNewBlock(CReserveKey& reservekey);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
+/** Long-poll id for the current best chain and memory pool fees (call with cs_main held) */
+std::string GetTemplateLongPollId();
+/** Call fn once the best chain changes or -longpollfeedelta of fees entered the
+ *  memory pool since strLongPollId was handed out (right away if that already
+ *  happened).  fn runs on the notifying thread and must be quick.  While fn
+ *  waits, nWaiterRet is its handle for CancelTemplateWaiter, otherwise 0. */
+bool NotifyOnTemplateChange(const std::string& strLongPollId, const boost::function<void()>& fn, uint64& nWaiterRet);
+/** Forget a waiter nobody is waiting on any more (nothing if it already ran) */
+void CancelTemplateWaiter(uint64 nWaiter);
+/** Number of waiters NotifyOnTemplateChange is holding */
+unsigned int GetTemplateWaiterCount();
+/** Release every long-poll waiter (on shutdown) */
+void NotifyTemplateChange();
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int ComputeMinWork(unsigned int nBase, int64 nTime);
 int GetNumBlocksOfPeers();
@@ -342,7 +395,7 @@ public:
         scriptPubKey.clear();
     }
 
-    bool IsNull()
+    bool IsNull() const
     {
         return (nValue == -1);
     }
@@ -681,11 +734,13 @@ public:
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
         @param[in] fStrictPayToScriptHash	true if fully validating p2sh transactions
+        @param[out] pprofile	if not NULL, what the input scripts cost is added to it
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true,
+                       CScriptProfile* pprofile=NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -1048,7 +1103,8 @@ private:
  * candidates to be the next block.  pprev and pnext link a path through the
  * main/longest chain.  A blockindex may have multiple pprev pointing back
  * to it, but pnext will only point forward to the longest branch, or will
- * be null if the block is not part of the longest chain.
+ * be null if the block is not part of the longest chain.  pskip points
+ * further back along pprev, so GetAncestor takes O(log n) steps.
  */
 class CBlockIndex
 {
@@ -1056,6 +1112,7 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip;
     unsigned int nFile;
     unsigned int nBlockPos;
     int nHeight;
@@ -1074,6 +1131,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
@@ -1091,6 +1149,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
@@ -1140,6 +1199,16 @@ public:
         return (pnext || this == pindexBest);
     }
 
+    /** Set pskip, once pprev and nHeight are and pprev has its own */
+    void BuildSkip();
+
+    /** The block at nHeight on the branch leading here, or NULL */
+    const CBlockIndex* GetAncestor(int nHeightIn) const;
+    CBlockIndex* GetAncestor(int nHeightIn)
+    {
+        return const_cast<CBlockIndex*>(static_cast<const CBlockIndex*>(this)->GetAncestor(nHeightIn));
+    }
+
     bool CheckIndex() const
     {
         return true; // CheckProofOfWork(GetBlockHash(), nBits);
@@ -1287,7 +1356,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        MapBlockIndex::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1322,9 +1391,11 @@ public:
         {
             vHave.push_back(pindex->GetBlockHash());
 
-            // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            // Exponentially larger steps back, in one on the best chain
+            if (pindex == FindBlockByHeight(pindex->nHeight))
+                pindex = FindBlockByHeight(pindex->nHeight - nStep);
+            else
+                pindex = pindex->GetAncestor(pindex->nHeight - nStep);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1338,7 +1409,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            MapBlockIndex::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1357,7 +1428,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            MapBlockIndex::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1373,7 +1444,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            MapBlockIndex::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1615,7 +1686,7 @@ public:
 
     bool accept(CTxDB& txdb, CTransaction &tx,
                 bool fCheckInputs, bool* pfMissingInputs);
-    bool addUnchecked(CTransaction &tx);
+    bool addUnchecked(CTransaction &tx, int64 nFees = 0);
     bool remove(CTransaction &tx);
     void queryHashes(std::vector<uint256>& vtxid);
 
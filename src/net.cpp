@@ -1864,7 +1864,14 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_DNSSEED] > 0) printf("ThreadDNSAddressSeed still running\n");
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+    if (vnThreadsRunning[THREAD_STRATUM] > 0) printf("ThreadStratumServer still running\n");
+    if (vnThreadsRunning[THREAD_INDEXSNAPSHOT] > 0) printf("ThreadBlockIndexSnapshot still running\n");
+    // These use the wallet, which Shutdown deletes next
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 ||
+           vnThreadsRunning[THREAD_STRATUM] > 0)
+        Sleep(20);
+    // Writes blkindex.dat, which Shutdown closes
+    while (vnThreadsRunning[THREAD_INDEXSNAPSHOT] > 0)
         Sleep(20);
     Sleep(50);
     DumpAddresses();
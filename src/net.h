@@ -107,6 +107,8 @@ enum threadId
     THREAD_ADDEDCONNECTIONS,
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
+    THREAD_STRATUM,
+    THREAD_INDEXSNAPSHOT,
 
     THREAD_MAX
 };
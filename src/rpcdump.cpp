@@ -38,7 +38,8 @@ Value importprivkey(const Array& params, bool fHelp)
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
             "importprivkey <litecoinprivkey> [label]\n"
-            "Adds a private key (as returned by dumpprivkey) to your wallet.");
+            "Adds a private key (as returned by dumpprivkey) to your wallet.\n"
+            "The block chain is rescanned for its transactions in the background.");
 
     string strSecret = params[0].get_str();
     string strLabel = "";
@@ -63,13 +64,42 @@ Value importprivkey(const Array& params, bool fHelp)
         if (!pwalletMain->AddKey(key))
             throw JSONRPCError(-4,"Error adding key to wallet");
 
-        pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-        pwalletMain->ReacceptWalletTransactions();
+        // Runs in the background; getrescaninfo reports how far it has got
+        pwalletMain->StartRescan(pindexGenesisBlock);
     }
 
     return Value::null;
 }
 
+Value getrescaninfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrescaninfo\n"
+            "Returns the progress of the running or last wallet rescan.");
+
+    // Written by the rescan thread under cs_wallet
+    CRescanProgress progress;
+    bool fQueued;
+    {
+        LOCK(pwalletMain->cs_wallet);
+        progress = pwalletMain->rescanProgress;
+        fQueued = (pwalletMain->pindexRescanNext != NULL);
+    }
+    Object obj;
+    obj.push_back(Pair("running", progress.fRunning));
+    obj.push_back(Pair("queued", fQueued));
+    obj.push_back(Pair("startheight", progress.nStartHeight));
+    obj.push_back(Pair("height", progress.nHeight));
+    obj.push_back(Pair("stopheight", progress.nStopHeight));
+    int nTotal = progress.nStopHeight - progress.nStartHeight;
+    double dProgress = nTotal > 0 ? (double)(progress.nHeight - progress.nStartHeight) / nTotal : (progress.nStartHeight >= 0 ? 1.0 : 0.0);
+    obj.push_back(Pair("progress", dProgress));
+    obj.push_back(Pair("found", progress.nFound));
+    obj.push_back(Pair("starttime", (boost::int64_t)progress.nStartTime));
+    return obj;
+}
+
 Value dumpprivkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -0,0 +1,574 @@
+// Copyright (c) 2026 AumCoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcjson.h"
+
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cwctype>
+#include <new>
+#include <vector>
+
+using namespace std;
+using namespace json_spirit;
+
+//
+// Reader
+//
+
+class CJSONReader
+{
+public:
+    CJSONReader(const string& str)
+    {
+        p = str.data();
+        pend = p + str.size();
+        nContainer = 0;
+    }
+
+    void CountElements();
+    bool ReadValue(Value& val, unsigned int nDepth);
+
+private:
+    const char* p;
+    const char* pend;
+
+    // Element count of every object and array, in order of their opening
+    // bracket.  json_spirit::Value has no move constructor, so growing a
+    // vector of them deep-copies everything read so far; reserving the
+    // right size up front avoids that.
+    vector<unsigned int> vCount;
+    unsigned int nContainer;
+
+    string strScratch; // reused for string values, which get copied into a Value anyway
+
+    unsigned int NextCount()
+    {
+        return nContainer < vCount.size() ? vCount[nContainer++] : 0;
+    }
+
+    void SkipSpace()
+    {
+        while (p < pend && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t' || *p == '\v' || *p == '\f'))
+            p++;
+    }
+
+    bool Literal(const char* psz)
+    {
+        size_t n = strlen(psz);
+        if ((size_t)(pend - p) < n || memcmp(p, psz, n) != 0)
+            return false;
+        p += n;
+        return true;
+    }
+
+    bool ReadString(string& str);
+    bool ReadNumber(Value& val);
+    bool ReadObject(Value& val, unsigned int nDepth);
+    bool ReadArray(Value& val, unsigned int nDepth);
+};
+
+static int HexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool ReadHex4(const char* p, const char* pend, unsigned int& n)
+{
+    if (pend - p < 4)
+        return false;
+    n = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int d = HexDigit(p[i]);
+        if (d < 0)
+            return false;
+        n = (n << 4) | d;
+    }
+    return true;
+}
+
+void CJSONReader::CountElements()
+{
+    // Only a sizing hint: malformed input just gives useless counts
+    vector<pair<unsigned int, bool> > vStack; // (index in vCount, seen an element)
+    for (const char* pch = p; pch < pend; pch++)
+    {
+        char c = *pch;
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f')
+            continue;
+        if (c == ']' || c == '}')
+        {
+            if (!vStack.empty())
+            {
+                if (vStack.back().second)
+                    vCount[vStack.back().first]++;
+                vStack.pop_back();
+            }
+            continue;
+        }
+        if (!vStack.empty())
+        {
+            if (c == ',')
+            {
+                vCount[vStack.back().first]++;
+                continue;
+            }
+            vStack.back().second = true;
+        }
+        if (c == '[' || c == '{')
+        {
+            vStack.push_back(make_pair((unsigned int)vCount.size(), false));
+            vCount.push_back(0);
+        }
+        else if (c == '"')
+        {
+            for (pch++; pch < pend && *pch != '"'; pch++)
+                if (*pch == '\\')
+                    pch++;
+        }
+    }
+}
+
+// Value has no swap or move, and operator= copies its argument once more
+// (for objects and arrays that's another heap allocation); construct straight
+// into the slot instead
+template<typename T>
+static void Assign(Value& val, const T& t)
+{
+    val.~Value();
+    try
+    {
+        new (&val) Value(t);
+    }
+    catch (...)
+    {
+        new (&val) Value();
+        throw;
+    }
+}
+
+bool CJSONReader::ReadString(string& str)
+{
+    // Caller has seen the opening quote
+    p++;
+    const char* pstart = p;
+    while (p < pend && *p != '"' && *p != '\\')
+        p++;
+    str.assign(pstart, p);
+
+    while (p < pend)
+    {
+        char c = *p++;
+        if (c == '"')
+            return true;
+        if (c != '\\')
+        {
+            str += c;
+            continue;
+        }
+        if (p == pend)
+            return false;
+        c = *p++;
+        switch (c)
+        {
+        case 't':  str += '\t'; break;
+        case 'b':  str += '\b'; break;
+        case 'f':  str += '\f'; break;
+        case 'n':  str += '\n'; break;
+        case 'r':  str += '\r'; break;
+        case '\\': str += '\\'; break;
+        case '/':  str += '/';  break;
+        case '"':  str += '"';  break;
+        case 'x':
+        {
+            if (pend - p < 2 || HexDigit(p[0]) < 0 || HexDigit(p[1]) < 0)
+                return false;
+            str += (char)((HexDigit(p[0]) << 4) | HexDigit(p[1]));
+            p += 2;
+            break;
+        }
+        case 'u':
+        {
+            unsigned int n;
+            if (!ReadHex4(p, pend, n))
+                return false;
+            p += 4;
+            // One byte per escape, the inverse of how the writer escapes
+            // non-printable bytes (and what json_spirit always did)
+            str += (char)n;
+            break;
+        }
+        default:
+            // json_spirit drops unknown escapes
+            break;
+        }
+    }
+    return false;
+}
+
+bool CJSONReader::ReadNumber(Value& val)
+{
+    const char* pstart = p;
+    bool fNegative = false;
+    if (*p == '-' || *p == '+')
+        fNegative = (*p++ == '-');
+
+    const char* pdigits = p;
+    while (p < pend && *p >= '0' && *p <= '9')
+        p++;
+    int nIntDigits = p - pdigits;
+    bool fReal = false;
+    int nFracDigits = 0;
+    if (p < pend && *p == '.')
+    {
+        fReal = true;
+        const char* pfrac = ++p;
+        while (p < pend && *p >= '0' && *p <= '9')
+            p++;
+        nFracDigits = p - pfrac;
+    }
+    if (nIntDigits == 0 && nFracDigits == 0)
+        return false;
+    if (p < pend && (*p == 'e' || *p == 'E'))
+    {
+        const char* pexp = p++;
+        if (p < pend && (*p == '-' || *p == '+'))
+            p++;
+        if (p < pend && *p >= '0' && *p <= '9')
+        {
+            fReal = true;
+            while (p < pend && *p >= '0' && *p <= '9')
+                p++;
+        }
+        else
+            p = pexp;
+    }
+
+    if (fReal)
+    {
+        // strtod follows LC_NUMERIC, JSON always uses '.'
+        char buf[64];
+        size_t nLen = p - pstart;
+        if (nLen >= sizeof(buf))
+        {
+            string str(pstart, p);
+            Assign(val, strtod(str.c_str(), NULL));
+            return true;
+        }
+        memcpy(buf, pstart, nLen);
+        buf[nLen] = 0;
+        char chPoint = localeconv()->decimal_point[0];
+        if (chPoint != '.')
+            if (char* pch = strchr(buf, '.'))
+                *pch = chPoint;
+        Assign(val, strtod(buf, NULL));
+        return true;
+    }
+
+    // int64 if it fits, else uint64, as json_spirit does
+    boost::uint64_t n = 0;
+    for (const char* pch = pdigits; pch < p; pch++)
+    {
+        unsigned int d = *pch - '0';
+        if (n > (~(boost::uint64_t)0 - d) / 10)
+            return false;
+        n = n * 10 + d;
+    }
+    if (fNegative)
+    {
+        if (n > (boost::uint64_t)1 << 63)
+            return false;
+        Assign(val, (boost::int64_t)(0 - n));
+    }
+    else if (n > (boost::uint64_t)0x7FFFFFFFFFFFFFFFULL)
+        Assign(val, n);
+    else
+        Assign(val, (boost::int64_t)n);
+    return true;
+}
+
+bool CJSONReader::ReadObject(Value& val, unsigned int nDepth)
+{
+    p++;
+    Assign(val, Object());
+    Object& obj = val.get_obj();
+    obj.reserve(NextCount());
+    SkipSpace();
+    if (p < pend && *p == '}')
+    {
+        p++;
+        return true;
+    }
+    for (;;)
+    {
+        SkipSpace();
+        if (p == pend || *p != '"')
+            return false;
+        obj.push_back(Pair("", Value()));
+        Pair& pair = obj.back();
+        if (!ReadString(pair.name_))
+            return false;
+        SkipSpace();
+        if (p == pend || *p++ != ':')
+            return false;
+        if (!ReadValue(pair.value_, nDepth + 1))
+            return false;
+        SkipSpace();
+        if (p == pend)
+            return false;
+        char c = *p++;
+        if (c == '}')
+            return true;
+        if (c != ',')
+            return false;
+    }
+}
+
+bool CJSONReader::ReadArray(Value& val, unsigned int nDepth)
+{
+    p++;
+    Assign(val, Array());
+    Array& arr = val.get_array();
+    arr.reserve(NextCount());
+    SkipSpace();
+    if (p < pend && *p == ']')
+    {
+        p++;
+        return true;
+    }
+    for (;;)
+    {
+        arr.push_back(Value());
+        if (!ReadValue(arr.back(), nDepth + 1))
+            return false;
+        SkipSpace();
+        if (p == pend)
+            return false;
+        char c = *p++;
+        if (c == ']')
+            return true;
+        if (c != ',')
+            return false;
+    }
+}
+
+bool CJSONReader::ReadValue(Value& val, unsigned int nDepth)
+{
+    if (nDepth > MAX_JSON_DEPTH)
+        return false;
+    SkipSpace();
+    if (p == pend)
+        return false;
+    switch (*p)
+    {
+    case '"':
+    {
+        if (!ReadString(strScratch))
+            return false;
+        Assign(val, strScratch);
+        return true;
+    }
+    case '{':
+        return ReadObject(val, nDepth);
+    case '[':
+        return ReadArray(val, nDepth);
+    case 't':
+        if (!Literal("true"))
+            return false;
+        Assign(val, true);
+        return true;
+    case 'f':
+        if (!Literal("false"))
+            return false;
+        Assign(val, false);
+        return true;
+    case 'n':
+        if (!Literal("null"))
+            return false;
+        Assign(val, Value::null);
+        return true;
+    default:
+        return ReadNumber(val);
+    }
+}
+
+bool ReadJSON(const string& strJSON, Value& valRet)
+{
+    CJSONReader reader(strJSON);
+    reader.CountElements();
+    return reader.ReadValue(valRet, 0);
+}
+
+//
+// Writer
+//
+
+static const char pszHexUpper[] = "0123456789ABCDEF";
+
+static void WriteString(const string& str, string& strRet)
+{
+    strRet += '"';
+    const char* p = str.data();
+    const char* pend = p + str.size();
+    while (p < pend)
+    {
+        // Copy runs of plain printable ASCII in one go
+        const char* pstart = p;
+        while (p < pend && *p >= 0x20 && *p < 0x7F && *p != '"' && *p != '\\')
+            p++;
+        strRet.append(pstart, p);
+        if (p == pend)
+            break;
+
+        char c = *p++;
+        switch (c)
+        {
+        case '"':  strRet += "\\\""; continue;
+        case '\\': strRet += "\\\\"; continue;
+        case '\b': strRet += "\\b";  continue;
+        case '\f': strRet += "\\f";  continue;
+        case '\n': strRet += "\\n";  continue;
+        case '\r': strRet += "\\r";  continue;
+        case '\t': strRet += "\\t";  continue;
+        }
+        // Same test json_spirit applies to every other byte
+        unsigned int uc = (unsigned char)c;
+        if (iswprint(uc))
+            strRet += c;
+        else
+        {
+            char buf[7] = { '\\', 'u', '0', '0', pszHexUpper[uc >> 4], pszHexUpper[uc & 0xF], 0 };
+            strRet += buf;
+        }
+    }
+    strRet += '"';
+}
+
+static void WriteInt(const Value& value, string& strRet)
+{
+    char buf[24];
+    char* pend = buf + sizeof(buf);
+    char* p = pend;
+    boost::uint64_t n;
+    bool fNegative = false;
+    if (value.is_uint64())
+        n = value.get_uint64();
+    else
+    {
+        boost::int64_t i = value.get_int64();
+        fNegative = (i < 0);
+        n = fNegative ? 0 - (boost::uint64_t)i : (boost::uint64_t)i;
+    }
+    do
+    {
+        *--p = '0' + (n % 10);
+        n /= 10;
+    } while (n);
+    if (fNegative)
+        *--p = '-';
+    strRet.append(p, pend);
+}
+
+static void WriteReal(double d, string& strRet)
+{
+    // json_spirit writes reals as std::fixed with precision 8
+    char buf[400];
+    int n = snprintf(buf, sizeof(buf), "%.8f", d);
+    if (n < 0 || n >= (int)sizeof(buf))
+        n = strlen(buf);
+    char chPoint = localeconv()->decimal_point[0];
+    if (chPoint != '.')
+        if (char* pch = strchr(buf, chPoint))
+            *pch = '.';
+    strRet.append(buf, n);
+}
+
+static void WriteIndent(string& strRet, int nIndent)
+{
+    strRet.append(nIndent * 4, ' ');
+}
+
+static void WriteValue(const Value& value, string& strRet, bool fPretty, int nIndent)
+{
+    switch (value.type())
+    {
+    case obj_type:
+    {
+        const Object& obj = value.get_obj();
+        strRet += '{';
+        if (fPretty)
+            strRet += '\n';
+        for (Object::const_iterator it = obj.begin(); it != obj.end(); ++it)
+        {
+            if (fPretty)
+                WriteIndent(strRet, nIndent + 1);
+            WriteString(it->name_, strRet);
+            strRet += fPretty ? " : " : ":";
+            WriteValue(it->value_, strRet, fPretty, nIndent + 1);
+            if (it + 1 != obj.end())
+                strRet += ',';
+            if (fPretty)
+                strRet += '\n';
+        }
+        if (fPretty)
+            WriteIndent(strRet, nIndent);
+        strRet += '}';
+        break;
+    }
+    case array_type:
+    {
+        const Array& arr = value.get_array();
+        strRet += '[';
+        if (fPretty)
+            strRet += '\n';
+        for (Array::const_iterator it = arr.begin(); it != arr.end(); ++it)
+        {
+            if (fPretty)
+                WriteIndent(strRet, nIndent + 1);
+            WriteValue(*it, strRet, fPretty, nIndent + 1);
+            if (it + 1 != arr.end())
+                strRet += ',';
+            if (fPretty)
+                strRet += '\n';
+        }
+        if (fPretty)
+            WriteIndent(strRet, nIndent);
+        strRet += ']';
+        break;
+    }
+    case str_type:
+        WriteString(value.get_str(), strRet);
+        break;
+    case bool_type:
+        strRet += value.get_bool() ? "true" : "false";
+        break;
+    case int_type:
+        WriteInt(value, strRet);
+        break;
+    case real_type:
+        WriteReal(value.get_real(), strRet);
+        break;
+    case null_type:
+        strRet += "null";
+        break;
+    }
+}
+
+void WriteJSON(const Value& value, string& strRet, bool fPretty)
+{
+    WriteValue(value, strRet, fPretty, 0);
+}
+
+string WriteJSON(const Value& value, bool fPretty)
+{
+    string strRet;
+    WriteValue(value, strRet, fPretty, 0);
+    return strRet;
+}
@@ -0,0 +1,38 @@
+// Copyright (c) 2026 AumCoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef AUMCOIN_RPCJSON_H
+#define AUMCOIN_RPCJSON_H
+
+#include <string>
+
+#include "json/json_spirit_value.h"
+
+/**
+ * Hand-written JSON reader and writer for the RPC and stratum paths.
+ *
+ * They work on the same json_spirit::Value trees the RPC handlers build, but
+ * skip Boost.Spirit's parser and the ostream machinery: the reader is a
+ * single pass over the input, the writer appends into one string.  Output is
+ * byte-for-byte what json_spirit::write_string gives (reals in fixed notation
+ * with 8 decimals, as ValueFromAmount expects).  Well-formed input is read
+ * as json_spirit::read_string reads it.  Malformed input is not always
+ * treated alike: nesting deeper than MAX_JSON_DEPTH is refused instead of
+ * exhausting the stack, a \u or \x escape with too few hex digits is
+ * refused where json_spirit lets it through mangled, and a top-level number
+ * with a dangling exponent ("1.e", "1.5e") is read up to the 'e' where
+ * json_spirit falls back to its integer part.
+ */
+
+static const unsigned int MAX_JSON_DEPTH = 512;
+
+/** Parse the first JSON value in strJSON.  Like json_spirit, text after it is ignored. */
+bool ReadJSON(const std::string& strJSON, json_spirit::Value& valRet);
+
+/** Append value as JSON text to strRet */
+void WriteJSON(const json_spirit::Value& value, std::string& strRet, bool fPretty = false);
+
+std::string WriteJSON(const json_spirit::Value& value, bool fPretty = false);
+
+#endif
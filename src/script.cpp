@@ -5,6 +5,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/tuple/tuple.hpp>
 
 using namespace std;
@@ -26,7 +27,7 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
 uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 
 #ifdef ENABLE_MLDSA
-bool CheckMLDSASig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, uint256 sighash);
+bool CheckMLDSASig(const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey, uint256 sighash);
 #endif
 
 
@@ -35,20 +36,11 @@ typedef vector<unsigned char> valtype;
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
 static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
-
-// SECURITY: Limit BigNum size for expensive operations (OP_MUL, OP_DIV, OP_MOD)
-// to prevent CPU DOS attacks. 4096 bits = 512 bytes is reasonable.
-static const size_t nMaxBigNumBits = 4096;
 
 
 CBigNum CastToBigNum(const valtype& vch)
 {
-    if (vch.size() > nMaxNumSize)
+    if (vch.size() > CScriptNum::nMaxNumSize)
         throw runtime_error("CastToBigNum() : overflow");
     // Get rid of extra leading zeros
     return CBigNum(CBigNum(vch).getvch());
@@ -86,13 +78,266 @@ void MakeSameSize(valtype& vch1, valtype& vch2)
 //
 #define stacktop(i)  (stack.at(stack.size()+(i)))
 #define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+template<typename T>
+static inline void popstack(vector<T>& stack)
 {
     if (stack.empty())
         throw runtime_error("popstack() : stack empty");
     stack.pop_back();
 }
 
+// OP_1NEGATE and OP_1..OP_16 as script numbers, indexed by value
+static const unsigned char pchSmallInts[17] = { 0x81, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+
+//
+// The interpreter doesn't copy stack values around.  A CStackValue is only
+// a pointer and a size: pushes point into the script being run, constants
+// point at static data, and whatever an opcode computes is written once into
+// the CScriptArena of the evaluation.  Bytes are never changed after they
+// are on the stack, so any number of entries may share them.
+//
+class CStackValue
+{
+public:
+    const unsigned char* pbegin;
+    unsigned int nSize;
+
+    CStackValue() : pbegin(pchSmallInts), nSize(0) { }
+    CStackValue(const unsigned char* pbeginIn, unsigned int nSizeIn) : pbegin(pbeginIn), nSize(nSizeIn) { }
+    explicit CStackValue(const valtype& vch) : pbegin(vch.empty() ? pchSmallInts : &vch[0]), nSize(vch.size()) { }
+
+    const unsigned char* begin() const { return pbegin; }
+    const unsigned char* end() const { return pbegin + nSize; }
+    unsigned int size() const { return nSize; }
+    valtype GetVch() const { return valtype(begin(), end()); }
+
+    friend bool operator==(const CStackValue& a, const CStackValue& b)
+    {
+        return a.nSize == b.nSize && memcmp(a.pbegin, b.pbegin, a.nSize) == 0;
+    }
+};
+
+static const CStackValue valFalse(pchSmallInts, 0);
+static const CStackValue valTrue(pchSmallInts + 1, 1);
+
+/** Append-only storage for the values one evaluation computes.  The first
+ *  block is part of the object, so most scripts never touch the heap, and
+ *  blocks never move, so CStackValues into them stay valid until the arena
+ *  goes away. */
+class CScriptArena
+{
+private:
+    unsigned char pchFirst[4096];
+    unsigned char* pchBlock;
+    size_t nBlockSize;
+    size_t nBlockUsed;
+    size_t nAllocated;
+    vector<unsigned char*> vBlocks;
+
+    CScriptArena(const CScriptArena&);
+    CScriptArena& operator=(const CScriptArena&);
+
+public:
+    CScriptArena() : pchBlock(pchFirst), nBlockSize(sizeof(pchFirst)), nBlockUsed(0), nAllocated(0) { }
+
+    ~CScriptArena()
+    {
+        BOOST_FOREACH(unsigned char* pch, vBlocks)
+            delete[] pch;
+    }
+
+    unsigned char* Alloc(size_t nSize)
+    {
+        if (nSize > nBlockSize - nBlockUsed)
+        {
+            vBlocks.push_back(NULL);
+            nBlockSize = std::max(nSize, (size_t)65536);
+            pchBlock = vBlocks.back() = new unsigned char[nBlockSize];
+            nBlockUsed = 0;
+        }
+        unsigned char* pch = pchBlock + nBlockUsed;
+        nBlockUsed += nSize;
+        nAllocated += nSize;
+        return pch;
+    }
+
+    size_t GetAllocated() const { return nAllocated; }
+
+    CStackValue Store(const valtype& vch)
+    {
+        unsigned char* pch = Alloc(vch.size());
+        if (!vch.empty())
+            memcpy(pch, &vch[0], vch.size());
+        return CStackValue(pch, vch.size());
+    }
+
+    CStackValue Store(const CScriptNum& num)
+    {
+        unsigned char pchNum[CScriptNum::nMaxEncodedSize];
+        unsigned int nSize = num.GetBytes(pchNum);
+        unsigned char* pch = Alloc(nSize);
+        memcpy(pch, pchNum, nSize);
+        return CStackValue(pch, nSize);
+    }
+};
+
+void CScriptProfile::Add(const CScriptProfile& profile)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        vCount[i] += profile.vCount[i];
+        vMicros[i] += profile.vMicros[i];
+        vBytes[i] += profile.vBytes[i];
+    }
+    nScripts += profile.nScripts;
+}
+
+uint64 CScriptProfile::GetOps() const
+{
+    uint64 nOps = 0;
+    for (int i = 0; i < 256; i++)
+        nOps += vCount[i];
+    return nOps;
+}
+
+int64 CScriptProfile::GetMicros() const
+{
+    int64 nMicros = 0;
+    for (int i = 0; i < 256; i++)
+        nMicros += vMicros[i];
+    return nMicros;
+}
+
+uint64 CScriptProfile::GetBytes() const
+{
+    uint64 nBytes = 0;
+    for (int i = 0; i < 256; i++)
+        nBytes += vBytes[i];
+    return nBytes;
+}
+
+/** Charges each instruction of one evaluation to a CScriptProfile, from
+ *  the clock and the arena, when there is one.  An instruction's time runs
+ *  until the next one starts or the evaluation ends; the clock only ticks in
+ *  microseconds, but the differences add up right over many instructions. */
+class CScriptMeter
+{
+private:
+    CScriptProfile* pprofile;
+    const CScriptArena& arena;
+    int opcodeLast;
+    int64 nTimeLast;
+    size_t nAllocatedLast;
+
+    void Charge(int opcodeNext)
+    {
+        int64 nTime = GetTimeMicros();
+        size_t nAllocated = arena.GetAllocated();
+        if (opcodeLast >= 0)
+        {
+            pprofile->vCount[opcodeLast]++;
+            pprofile->vMicros[opcodeLast] += std::max(nTime - nTimeLast, (int64)0);
+            pprofile->vBytes[opcodeLast] += nAllocated - nAllocatedLast;
+        }
+        opcodeLast = opcodeNext;
+        nTimeLast = nTime;
+        nAllocatedLast = nAllocated;
+    }
+
+public:
+    CScriptMeter(CScriptProfile* pprofileIn, const CScriptArena& arenaIn) : pprofile(pprofileIn), arena(arenaIn), opcodeLast(-1),
+                                                                             nTimeLast(0), nAllocatedLast(0)
+    {
+        if (pprofile)
+        {
+            pprofile->nScripts++;
+            Charge(-1);
+        }
+    }
+
+    ~CScriptMeter()
+    {
+        if (pprofile)
+            Charge(-1);
+    }
+
+    void Next(opcodetype opcode)
+    {
+        if (pprofile)
+            Charge(opcode);
+    }
+};
+
+static CScriptNum CastToNum(const CStackValue& val)
+{
+    return CScriptNum(val.begin(), val.end());
+}
+
+static bool CastToBool(const CStackValue& val)
+{
+    for (unsigned int i = 0; i < val.size(); i++)
+    {
+        if (val.pbegin[i] != 0)
+        {
+            // Can be negative zero
+            if (i == val.size()-1 && val.pbegin[i] == 0x80)
+                return false;
+            return true;
+        }
+    }
+    return false;
+}
+
+// CScript::GetOp without the copy: push data is returned as a view of the
+// script's own bytes.  Fails in exactly the cases GetOp does.
+static bool GetScriptOp(const CScript& script, CScript::const_iterator& pc, opcodetype& opcodeRet, CStackValue& valRet)
+{
+    CScript::const_iterator pend = script.end();
+    opcodeRet = OP_INVALIDOPCODE;
+    valRet = CStackValue();
+    if (pc >= pend)
+        return false;
+    unsigned int opcode = *pc++;
+
+    // Immediate operand
+    if (opcode <= OP_PUSHDATA4)
+    {
+        unsigned int nSize;
+        if (opcode < OP_PUSHDATA1)
+        {
+            nSize = opcode;
+        }
+        else if (opcode == OP_PUSHDATA1)
+        {
+            if (pend - pc < 1)
+                return false;
+            nSize = *pc++;
+        }
+        else if (opcode == OP_PUSHDATA2)
+        {
+            if (pend - pc < 2)
+                return false;
+            nSize = 0;
+            memcpy(&nSize, &pc[0], 2);
+            pc += 2;
+        }
+        else
+        {
+            if (pend - pc < 4)
+                return false;
+            memcpy(&nSize, &pc[0], 4);
+            pc += 4;
+        }
+        if ((size_t)(pend - pc) < nSize)
+            return false;
+        valRet = CStackValue(&script[0] + (pc - script.begin()), nSize);
+        pc += nSize;
+    }
+
+    opcodeRet = (opcodetype)opcode;
+    return true;
+}
+
 
 const char* GetTxnOutputType(txnouttype t)
 {
@@ -251,16 +496,286 @@ const char* GetOpName(opcodetype opcode)
     }
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+static bool MatchTemplates(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsigned char> >& vSolutionsRet);
+
+// Scripts shorter than this, which takes in every single-key template, are
+// cheaper to decode again than to look up
+static const unsigned int nMinCachedScriptSize = 80;
+
+/** One instruction of a CCompiledScript */
+class CCompiledOp
+{
+public:
+    opcodetype opcode;
+    // Push data, as an offset into the script
+    unsigned int nPushBegin;
+    unsigned int nPushSize;
+    // Offset of the next instruction
+    unsigned int nNext;
+    // For IF, NOTIF and ELSE: where to go when the branch they open isn't
+    // taken (the matching ELSE or ENDIF), how many counted opcodes that
+    // skips, and whether anything skipped fails the script even unexecuted
+    unsigned int nJump;
+    unsigned int nJumpOps;
+    bool fJumpFails;
+};
+
+/** A script decoded once, so it can be evaluated, matched against the
+ *  templates and have its sigops counted without being parsed again */
+class CCompiledScript
 {
-    CAutoBN_CTX pctx;
+public:
+    vector<CCompiledOp> vOps;
+    // Decoding stopped at a malformed instruction after the last of vOps
+    bool fParseError;
+    unsigned int nScriptSize;
+    unsigned int nSigOps;
+    unsigned int nSigOpsAccurate;
+    // What Solver() makes of the script, filled in for cached scripts
+    bool fSolved;
+    txnouttype typeSolved;
+    vector<valtype> vSolutions;
+
+    explicit CCompiledScript(const CScript& script);
+
+    size_t GetUsage() const
+    {
+        size_t nUsage = sizeof(*this) + nScriptSize + vOps.capacity() * sizeof(CCompiledOp);
+        BOOST_FOREACH(const valtype& vch, vSolutions)
+            nUsage += sizeof(vch) + vch.capacity();
+        return nUsage;
+    }
+};
+
+CCompiledScript::CCompiledScript(const CScript& script) : fParseError(false), nScriptSize(script.size()), nSigOps(0), nSigOpsAccurate(0),
+                                                          fSolved(false), typeSolved(TX_NONSTANDARD)
+{
+    // IF, NOTIF and ELSE still waiting for their ELSE or ENDIF
+    vector<unsigned int> vOpen;
     CScript::const_iterator pc = script.begin();
-    CScript::const_iterator pend = script.end();
-    CScript::const_iterator pbegincodehash = script.begin();
+    opcodetype opcodeLast = OP_INVALIDOPCODE;
+    CStackValue valPush;
+    while (pc < script.end())
+    {
+        CCompiledOp op;
+        if (!GetScriptOp(script, pc, op.opcode, valPush))
+        {
+            fParseError = true;
+            break;
+        }
+        op.nPushBegin = (valPush.size() ? valPush.begin() - &script[0] : 0);
+        op.nPushSize = valPush.size();
+        op.nNext = pc - script.begin();
+        op.nJump = 0;
+        op.nJumpOps = 0;
+        op.fJumpFails = false;
+
+        // Counted as CScript::GetSigOpCount counts them
+        if (op.opcode == OP_CHECKSIG || op.opcode == OP_CHECKSIGVERIFY)
+        {
+            nSigOps++;
+            nSigOpsAccurate++;
+        }
+        else if (op.opcode == OP_CHECKMULTISIG || op.opcode == OP_CHECKMULTISIGVERIFY)
+        {
+            nSigOps += 20;
+            nSigOpsAccurate += (opcodeLast >= OP_1 && opcodeLast <= OP_16) ? CScript::DecodeOP_N(opcodeLast) : 20;
+        }
+        opcodeLast = op.opcode;
+
+        if ((op.opcode == OP_ELSE || op.opcode == OP_ENDIF) && !vOpen.empty())
+        {
+            vOps[vOpen.back()].nJump = vOps.size();
+            vOpen.pop_back();
+        }
+        if (op.opcode == OP_IF || op.opcode == OP_NOTIF || op.opcode == OP_ELSE)
+            vOpen.push_back(vOps.size());
+        vOps.push_back(op);
+    }
+    // A branch that is never closed runs to the end, and fails there
+    BOOST_FOREACH(unsigned int i, vOpen)
+        vOps[i].nJump = vOps.size();
+
+    // Running totals of what unexecuted instructions still count for: the
+    // op limit, oversized pushes and VERIF/VERNOTIF
+    vector<unsigned int> vCounted(vOps.size() + 1, 0), vFailing(vOps.size() + 1, 0);
+    for (unsigned int i = 0; i < vOps.size(); i++)
+    {
+        const CCompiledOp& op = vOps[i];
+        vCounted[i+1] = vCounted[i] + (op.opcode > OP_16);
+        vFailing[i+1] = vFailing[i] + (op.nPushSize > 10240 || op.opcode == OP_VERIF || op.opcode == OP_VERNOTIF);
+    }
+    for (unsigned int i = 0; i < vOps.size(); i++)
+    {
+        CCompiledOp& op = vOps[i];
+        if (op.opcode != OP_IF && op.opcode != OP_NOTIF && op.opcode != OP_ELSE)
+            continue;
+        op.nJumpOps = vCounted[op.nJump] - vCounted[i+1];
+        op.fJumpFails = (vFailing[op.nJump] != vFailing[i+1] || op.nJump == vOps.size());
+    }
+}
+
+/** Compiled scripts by SHA256 of the script, bounded by -scriptcachesize */
+class CScriptCache
+{
+private:
+    map<uint256, boost::shared_ptr<const CCompiledScript> > mapScripts;
+    size_t nUsage;
+    CFastCriticalSection cs_scriptcache;
+
+public:
+    CScriptCache() : nUsage(0) { }
+
+    boost::shared_ptr<const CCompiledScript> Get(const CScript& script)
+    {
+        uint256 hash;
+        SHA256(&script[0], script.size(), (unsigned char*)&hash);
+        {
+            FAST_LOCK(cs_scriptcache);
+            map<uint256, boost::shared_ptr<const CCompiledScript> >::iterator mi = mapScripts.find(hash);
+            if (mi != mapScripts.end())
+                return mi->second;
+        }
+
+        CCompiledScript* pcompiled = new CCompiledScript(script);
+        boost::shared_ptr<const CCompiledScript> compiled(pcompiled);
+        pcompiled->fSolved = MatchTemplates(script, pcompiled->typeSolved, pcompiled->vSolutions);
+        size_t nSize = compiled->GetUsage();
+        size_t nMaxUsage = GetArg("-scriptcachesize", 32) * 1000000;
+
+        FAST_LOCK(cs_scriptcache);
+        if (mapScripts.count(hash))
+            return compiled;
+        while (nUsage + nSize > nMaxUsage && !mapScripts.empty())
+        {
+            // Evict a random entry, as the signature cache does
+            map<uint256, boost::shared_ptr<const CCompiledScript> >::iterator it = mapScripts.lower_bound(GetRandHash());
+            if (it == mapScripts.end())
+                it = mapScripts.begin();
+            nUsage -= it->second->GetUsage();
+            mapScripts.erase(it);
+        }
+        if (nUsage + nSize <= nMaxUsage)
+        {
+            mapScripts.insert(make_pair(hash, compiled));
+            nUsage += nSize;
+        }
+        return compiled;
+    }
+};
+
+static boost::shared_ptr<const CCompiledScript> GetCachedScript(const CScript& script)
+{
+    static CScriptCache scriptCache;
+    return scriptCache.Get(script);
+}
+
+// Move past a branch that isn't taken, charging for what it holds
+static inline bool SkipBranch(const CCompiledOp& op, unsigned int& iOp, int& nOpCount)
+{
+    nOpCount += op.nJumpOps;
+    if (nOpCount > 201 || op.fJumpFails)
+        return false;
+    iOp = op.nJump - 1;
+    return true;
+}
+
+class CScriptCode;
+static uint256 SignatureHash(const CScriptCode& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+static bool CheckSig(const CStackValue& valSig, const CStackValue& valPubKey, const CScriptCode& scriptCode,
+                     const CTransaction& txTo, unsigned int nIn, int nHashType);
+
+// Whether op pushes exactly what CScript(vch) would, byte for byte
+static bool IsPushOf(const CScript& script, const CCompiledOp& op, const CStackValue& val)
+{
+    unsigned int nSize = val.size();
+    opcodetype opcodePush = (nSize < OP_PUSHDATA1 ? (opcodetype)nSize :
+                             nSize <= 0xff ? OP_PUSHDATA1 : nSize <= 0xffff ? OP_PUSHDATA2 : OP_PUSHDATA4);
+    return (op.opcode == opcodePush && op.nPushSize == nSize &&
+            (nSize == 0 || memcmp(&script[op.nPushBegin], val.begin(), nSize) == 0));
+}
+
+/** What a signature commits to: the script from just after the last
+ *  executed OP_CODESEPARATOR, without code separators or the signatures
+ *  being checked. It points into the script and is only copied when
+ *  something has to be taken out. Signature hashes are remembered per
+ *  hash type, so must all be for the same transaction input. */
+class CScriptCode
+{
+private:
+    const unsigned char* pbegin;
+    const unsigned char* pend;
+    valtype vchOwned;
+    mutable vector<pair<int, uint256> > vSigHashes;
+
+    // pbegin may point into vchOwned
+    CScriptCode(const CScriptCode&);
+    void operator=(const CScriptCode&);
+
+public:
+    CScriptCode(const unsigned char* pbeginIn, const unsigned char* pendIn) : pbegin(pbeginIn), pend(pendIn) { }
+    CScriptCode(const CScript& script, const CCompiledScript& compiled, unsigned int iBegin,
+                const CStackValue* psigBegin, const CStackValue* psigEnd);
+
+    const unsigned char* begin() const { return pbegin; }
+    const unsigned char* end() const { return pend; }
+    unsigned int size() const { return pend - pbegin; }
+
+    uint256 GetSigHash(const CTransaction& txTo, unsigned int nIn, int nHashType) const
+    {
+        for (unsigned int i = 0; i < vSigHashes.size(); i++)
+            if (vSigHashes[i].first == nHashType)
+                return vSigHashes[i].second;
+        uint256 hash = SignatureHash(*this, txTo, nIn, nHashType);
+        vSigHashes.push_back(make_pair(nHashType, hash));
+        return hash;
+    }
+};
+
+CScriptCode::CScriptCode(const CScript& script, const CCompiledScript& compiled, unsigned int iBegin,
+                         const CStackValue* psigBegin, const CStackValue* psigEnd)
+{
+    const unsigned char* pscript = (script.empty() ? NULL : &script[0]);
+    unsigned int nCopied = (iBegin == 0 ? 0 : compiled.vOps[iBegin-1].nNext);
+    bool fDropped = false;
+    for (unsigned int i = iBegin; i < compiled.vOps.size(); i++)
+    {
+        const CCompiledOp& op = compiled.vOps[i];
+        bool fDrop = (op.opcode == OP_CODESEPARATOR);
+        for (const CStackValue* psig = psigBegin; psig != psigEnd && !fDrop; psig++)
+            fDrop = IsPushOf(script, op, *psig);
+        if (!fDrop)
+            continue;
+        if (!fDropped)
+            vchOwned.reserve(script.size() - nCopied);
+        fDropped = true;
+        unsigned int nStart = (i == 0 ? 0 : compiled.vOps[i-1].nNext);
+        vchOwned.insert(vchOwned.end(), pscript + nCopied, pscript + nStart);
+        nCopied = op.nNext;
+    }
+    if (!fDropped)
+    {
+        pbegin = pscript + nCopied;
+        pend = pscript + script.size();
+        return;
+    }
+    // Anything after a malformed instruction is kept as it is
+    vchOwned.insert(vchOwned.end(), pscript + nCopied, pscript + script.size());
+    pbegin = (vchOwned.empty() ? NULL : &vchOwned[0]);
+    pend = pbegin + vchOwned.size();
+}
+
+static bool EvalScript(vector<CStackValue>& stack, CScriptArena& arena, const CScript& script, const CCompiledScript& compiled,
+                       const CTransaction& txTo, unsigned int nIn, int nHashType, CScriptProfile* pprofile)
+{
+    CScriptMeter meter(pprofile, arena);
+    // First instruction of what signatures commit to
+    unsigned int iBeginCodeHash = 0;
     opcodetype opcode;
-    valtype vchPushValue;
+    // Branches of the enclosing IF/NOTIFs, and how many of them are false
     vector<bool> vfExec;
-    vector<valtype> altstack;
+    int nExecFalse = 0;
+    vector<CStackValue> altstack;
     // SATOSHI VISION: Removed 10KB script size limit
     // Original Bitcoin had no such limit - enables complex smart contracts
     // if (script.size() > 10000)
@@ -270,17 +785,18 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
     try
     {
-        while (pc < pend)
+        for (unsigned int iOp = 0; iOp < compiled.vOps.size(); iOp++)
         {
-            bool fExec = !count(vfExec.begin(), vfExec.end(), false);
+            bool fExec = (nExecFalse == 0);
 
             //
             // Read instruction
             //
-            if (!script.GetOp(pc, opcode, vchPushValue))
-                return false;
+            const CCompiledOp& op = compiled.vOps[iOp];
+            opcode = op.opcode;
+            meter.Next(opcode);
             // SATOSHI VISION: Increased push value size from 520 bytes to 10KB
-            if (vchPushValue.size() > 10240)
+            if (op.nPushSize > 10240)
                 return false;
             if (opcode > OP_16 && ++nOpCount > 201)
                 return false;
@@ -293,7 +809,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
             // All implementations remain intact below in the switch statement.
 
             if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4)
-                stack.push_back(vchPushValue);
+                stack.push_back(CStackValue(&script[0] + op.nPushBegin, op.nPushSize));
             else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
             switch (opcode)
             {
@@ -319,8 +835,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    int n = (opcode == OP_1NEGATE ? 0 : (int)opcode - (int)(OP_1 - 1));
+                    stack.push_back(CStackValue(pchSmallInts + n, 1));
                 }
                 break;
 
@@ -343,13 +859,16 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     {
                         if (stack.size() < 1)
                             return false;
-                        valtype& vch = stacktop(-1);
-                        fValue = CastToBool(vch);
+                        fValue = CastToBool(stacktop(-1));
                         if (opcode == OP_NOTIF)
                             fValue = !fValue;
                         popstack(stack);
                     }
                     vfExec.push_back(fValue);
+                    if (!fValue)
+                        nExecFalse++;
+                    if (nExecFalse > 0 && !SkipBranch(op, iOp, nOpCount))
+                        return false;
                 }
                 break;
 
@@ -357,7 +876,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     if (vfExec.empty())
                         return false;
+                    nExecFalse += (vfExec.back() ? 1 : -1);
                     vfExec.back() = !vfExec.back();
+                    if (nExecFalse > 0 && !SkipBranch(op, iOp, nOpCount))
+                        return false;
                 }
                 break;
 
@@ -365,6 +887,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     if (vfExec.empty())
                         return false;
+                    if (!vfExec.back())
+                        nExecFalse--;
                     vfExec.pop_back();
                 }
                 break;
@@ -426,10 +950,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    CStackValue val1 = stacktop(-2);
+                    CStackValue val2 = stacktop(-1);
+                    stack.push_back(val1);
+                    stack.push_back(val2);
                 }
                 break;
 
@@ -438,12 +962,12 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
-                    stack.push_back(vch3);
+                    CStackValue val1 = stacktop(-3);
+                    CStackValue val2 = stacktop(-2);
+                    CStackValue val3 = stacktop(-1);
+                    stack.push_back(val1);
+                    stack.push_back(val2);
+                    stack.push_back(val3);
                 }
                 break;
 
@@ -452,10 +976,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    CStackValue val1 = stacktop(-4);
+                    CStackValue val2 = stacktop(-3);
+                    stack.push_back(val1);
+                    stack.push_back(val2);
                 }
                 break;
 
@@ -464,11 +988,11 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
+                    CStackValue val1 = stacktop(-6);
+                    CStackValue val2 = stacktop(-5);
                     stack.erase(stack.end()-6, stack.end()-4);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    stack.push_back(val1);
+                    stack.push_back(val2);
                 }
                 break;
 
@@ -487,17 +1011,16 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    if (CastToBool(vch))
-                        stack.push_back(vch);
+                    CStackValue val = stacktop(-1);
+                    if (CastToBool(val))
+                        stack.push_back(val);
                 }
                 break;
 
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    stack.push_back(arena.Store(CScriptNum(stack.size())));
                 }
                 break;
 
@@ -515,8 +1038,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.push_back(vch);
+                    CStackValue val = stacktop(-1);
+                    stack.push_back(val);
                 }
                 break;
 
@@ -534,8 +1057,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
-                    stack.push_back(vch);
+                    CStackValue val = stacktop(-2);
+                    stack.push_back(val);
                 }
                 break;
 
@@ -546,14 +1069,14 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CastToNum(stacktop(-1)).getint();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
+                    CStackValue val = stacktop(-n-1);
                     if (opcode == OP_ROLL)
                         stack.erase(stack.end()-n-1);
-                    stack.push_back(vch);
+                    stack.push_back(val);
                 }
                 break;
 
@@ -583,8 +1106,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.insert(stack.end()-2, vch);
+                    CStackValue val = stacktop(-1);
+                    stack.insert(stack.end()-2, val);
                 }
                 break;
 
@@ -597,12 +1120,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
+                    CStackValue& val1 = stacktop(-2);
+                    CStackValue& val2 = stacktop(-1);
                     // SECURITY: Check size BEFORE concatenating to prevent allocation failures
-                    if (vch1.size() + vch2.size() > 10240)
+                    if (val1.size() + val2.size() > 10240)
                         return false;
-                    vch1.insert(vch1.end(), vch2.begin(), vch2.end());
+                    unsigned char* pch = arena.Alloc(val1.size() + val2.size());
+                    memcpy(pch, val1.begin(), val1.size());
+                    memcpy(pch + val1.size(), val2.begin(), val2.size());
+                    val1 = CStackValue(pch, val1.size() + val2.size());
                     popstack(stack);
                 }
                 break;
@@ -612,17 +1138,16 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in begin size -- out)
                     if (stack.size() < 3)
                         return false;
-                    valtype& vch = stacktop(-3);
-                    int nBegin = CastToBigNum(stacktop(-2)).getint();
-                    int nEnd = nBegin + CastToBigNum(stacktop(-1)).getint();
+                    CStackValue& val = stacktop(-3);
+                    int nBegin = CastToNum(stacktop(-2)).getint();
+                    int nEnd = nBegin + CastToNum(stacktop(-1)).getint();
                     if (nBegin < 0 || nEnd < nBegin)
                         return false;
-                    if (nBegin > (int)vch.size())
-                        nBegin = vch.size();
-                    if (nEnd > (int)vch.size())
-                        nEnd = vch.size();
-                    vch.erase(vch.begin() + nEnd, vch.end());
-                    vch.erase(vch.begin(), vch.begin() + nBegin);
+                    if (nBegin > (int)val.size())
+                        nBegin = val.size();
+                    if (nEnd > (int)val.size())
+                        nEnd = val.size();
+                    val = CStackValue(val.begin() + nBegin, nEnd - nBegin);
                     popstack(stack);
                     popstack(stack);
                 }
@@ -634,16 +1159,16 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in size -- out)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch = stacktop(-2);
-                    int nSize = CastToBigNum(stacktop(-1)).getint();
+                    CStackValue& val = stacktop(-2);
+                    int nSize = CastToNum(stacktop(-1)).getint();
                     if (nSize < 0)
                         return false;
-                    if (nSize > (int)vch.size())
-                        nSize = vch.size();
+                    if (nSize > (int)val.size())
+                        nSize = val.size();
                     if (opcode == OP_LEFT)
-                        vch.erase(vch.begin() + nSize, vch.end());
+                        val = CStackValue(val.begin(), nSize);
                     else
-                        vch.erase(vch.begin(), vch.end() - nSize);
+                        val = CStackValue(val.end() - nSize, nSize);
                     popstack(stack);
                 }
                 break;
@@ -653,8 +1178,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    stack.push_back(arena.Store(CScriptNum(stacktop(-1).size())));
                 }
                 break;
 
@@ -667,9 +1191,11 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in - out)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
-                    for (unsigned int i = 0; i < vch.size(); i++)
-                        vch[i] = ~vch[i];
+                    CStackValue& val = stacktop(-1);
+                    unsigned char* pch = arena.Alloc(val.size());
+                    for (unsigned int i = 0; i < val.size(); i++)
+                        pch[i] = ~val.pbegin[i];
+                    val = CStackValue(pch, val.size());
                 }
                 break;
 
@@ -680,24 +1206,23 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - out)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
-                    MakeSameSize(vch1, vch2);
-                    if (opcode == OP_AND)
+                    CStackValue& val1 = stacktop(-2);
+                    CStackValue& val2 = stacktop(-1);
+                    // The shorter one is taken as zero-padded
+                    unsigned int nSize = std::max(val1.size(), val2.size());
+                    unsigned char* pch = arena.Alloc(nSize);
+                    for (unsigned int i = 0; i < nSize; i++)
                     {
-                        for (unsigned int i = 0; i < vch1.size(); i++)
-                            vch1[i] &= vch2[i];
-                    }
-                    else if (opcode == OP_OR)
-                    {
-                        for (unsigned int i = 0; i < vch1.size(); i++)
-                            vch1[i] |= vch2[i];
-                    }
-                    else if (opcode == OP_XOR)
-                    {
-                        for (unsigned int i = 0; i < vch1.size(); i++)
-                            vch1[i] ^= vch2[i];
+                        unsigned char ch1 = (i < val1.size() ? val1.pbegin[i] : 0);
+                        unsigned char ch2 = (i < val2.size() ? val2.pbegin[i] : 0);
+                        if (opcode == OP_AND)
+                            pch[i] = ch1 & ch2;
+                        else if (opcode == OP_OR)
+                            pch[i] = ch1 | ch2;
+                        else
+                            pch[i] = ch1 ^ ch2;
                     }
+                    val1 = CStackValue(pch, nSize);
                     popstack(stack);
                 }
                 break;
@@ -709,9 +1234,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - bool)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
-                    bool fEqual = (vch1 == vch2);
+                    CStackValue& val1 = stacktop(-2);
+                    CStackValue& val2 = stacktop(-1);
+                    bool fEqual = (val1 == val2);
                     // OP_NOTEQUAL is disabled because it would be too easy to say
                     // something like n != 1 and have some wiseguy pass in 1 with extra
                     // zero bytes after it (numerically, 0x01 == 0x0001 == 0x000001)
@@ -719,7 +1244,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     //    fEqual = !fEqual;
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fEqual ? vchTrue : vchFalse);
+                    stack.push_back(fEqual ? valTrue : valFalse);
                     if (opcode == OP_EQUALVERIFY)
                     {
                         if (fEqual)
@@ -746,21 +1271,23 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    int64 n = CastToNum(stacktop(-1)).GetInt64();
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
-                    case OP_2MUL:       bn <<= 1; break;
-                    case OP_2DIV:       bn >>= 1; break;
-                    case OP_NEGATE:     bn = -bn; break;
-                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_1ADD:       n += 1; break;
+                    case OP_1SUB:       n -= 1; break;
+                    case OP_2MUL:       n *= 2; break;
+                    // CBigNum's >>= gives zero for anything below 2^shift, which
+                    // includes every negative number
+                    case OP_2DIV:       n = (n < 0 ? 0 : n >> 1); break;
+                    case OP_NEGATE:     n = -n; break;
+                    case OP_ABS:        if (n < 0) n = -n; break;
+                    case OP_NOT:        n = (n == 0); break;
+                    case OP_0NOTEQUAL:  n = (n != 0); break;
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(arena.Store(CScriptNum(n)));
                 }
                 break;
 
@@ -786,70 +1313,81 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
-                    
-                    // SECURITY: Check operand sizes for expensive operations
-                    // to prevent CPU DOS attacks (OP_MUL, OP_DIV, OP_MOD)
-                    if (opcode == OP_MUL || opcode == OP_DIV || opcode == OP_MOD) {
-                        if (bn1.bitSize() > nMaxBigNumBits || bn2.bitSize() > nMaxBigNumBits)
-                            return false;
-                    }
-                    
+                    // Operands are at most 4 bytes, so none of this can overflow
+                    int64 n1 = CastToNum(stacktop(-2)).GetInt64();
+                    int64 n2 = CastToNum(stacktop(-1)).GetInt64();
+                    int64 n = 0;
+                    CStackValue valBig;
+                    bool fBig = false;
+
                     switch (opcode)
                     {
                     case OP_ADD:
-                        bn = bn1 + bn2;
+                        n = n1 + n2;
                         break;
 
                     case OP_SUB:
-                        bn = bn1 - bn2;
+                        n = n1 - n2;
                         break;
 
                     case OP_MUL:
-                        if (!BN_mul(bn.bn, bn1.bn, bn2.bn, pctx))
-                            return false;
+                        n = n1 * n2;
                         break;
 
                     case OP_DIV:
-                        if (!BN_div(bn.bn, NULL, bn1.bn, bn2.bn, pctx))
+                        // Truncates toward zero, as BN_div does
+                        if (n2 == 0)
                             return false;
+                        n = n1 / n2;
                         break;
 
                     case OP_MOD:
-                        if (!BN_mod(bn.bn, bn1.bn, bn2.bn, pctx))
+                        // Takes the sign of the dividend, as BN_mod does
+                        if (n2 == 0)
                             return false;
+                        n = n1 % n2;
                         break;
 
                     case OP_LSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
+                        if (n2 < 0 || n2 > 2048)
                             return false;
-                        bn = bn1 << bn2.getulong();
+                        // Zero stays zero however far it goes; shifting an
+                        // int64 by its width or more is undefined
+                        if (n1 == 0)
+                            n = 0;
+                        else if (n2 <= 31)
+                            n = (n1 < 0 ? -(-n1 << n2) : n1 << n2);
+                        else
+                        {
+                            // Too wide for 64 bits
+                            valBig = arena.Store((CBigNum(n1) << (unsigned int)n2).getvch());
+                            fBig = true;
+                        }
                         break;
 
                     case OP_RSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
+                        if (n2 < 0 || n2 > 2048)
                             return false;
-                        bn = bn1 >> bn2.getulong();
+                        // Negative numbers go to zero, as with OP_2DIV
+                        n = (n1 < 0 || n2 >= 63 ? 0 : n1 >> n2);
                         break;
 
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
-                    case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
-                    case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+                    case OP_BOOLAND:             n = (n1 != 0 && n2 != 0); break;
+                    case OP_BOOLOR:              n = (n1 != 0 || n2 != 0); break;
+                    case OP_NUMEQUAL:            n = (n1 == n2); break;
+                    case OP_NUMEQUALVERIFY:      n = (n1 == n2); break;
+                    case OP_NUMNOTEQUAL:         n = (n1 != n2); break;
+                    case OP_LESSTHAN:            n = (n1 < n2); break;
+                    case OP_GREATERTHAN:         n = (n1 > n2); break;
+                    case OP_LESSTHANOREQUAL:     n = (n1 <= n2); break;
+                    case OP_GREATERTHANOREQUAL:  n = (n1 >= n2); break;
+                    case OP_MIN:                 n = (n1 < n2 ? n1 : n2); break;
+                    case OP_MAX:                 n = (n1 > n2 ? n1 : n2); break;
                     default:                     assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(fBig ? valBig : arena.Store(CScriptNum(n)));
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -866,14 +1404,14 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
-                    bool fValue = (bn2 <= bn1 && bn1 < bn3);
+                    int64 n1 = CastToNum(stacktop(-3)).GetInt64();
+                    int64 n2 = CastToNum(stacktop(-2)).GetInt64();
+                    int64 n3 = CastToNum(stacktop(-1)).GetInt64();
+                    bool fValue = (n2 <= n1 && n1 < n3);
                     popstack(stack);
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fValue ? vchTrue : vchFalse);
+                    stack.push_back(fValue ? valTrue : valFalse);
                 }
                 break;
 
@@ -890,33 +1428,34 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- hash)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    CStackValue& val = stacktop(-1);
+                    unsigned int nHashSize = ((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    unsigned char* pchHash = arena.Alloc(nHashSize);
                     if (opcode == OP_RIPEMD160)
-                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                        RIPEMD160(val.begin(), val.size(), pchHash);
                     else if (opcode == OP_SHA1)
-                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                        SHA1(val.begin(), val.size(), pchHash);
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        SHA256(val.begin(), val.size(), pchHash);
                     else if (opcode == OP_HASH160)
                     {
-                        uint160 hash160 = Hash160(vch);
-                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                        uint256 hash1;
+                        SHA256(val.begin(), val.size(), (unsigned char*)&hash1);
+                        RIPEMD160((unsigned char*)&hash1, sizeof(hash1), pchHash);
                     }
                     else if (opcode == OP_HASH256)
                     {
-                        uint256 hash = Hash(vch.begin(), vch.end());
-                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                        uint256 hash = Hash(val.begin(), val.end());
+                        memcpy(pchHash, &hash, sizeof(hash));
                     }
-                    popstack(stack);
-                    stack.push_back(vchHash);
+                    val = CStackValue(pchHash, nHashSize);
                 }
                 break;
 
                 case OP_CODESEPARATOR:
                 {
                     // Hash starts after the code separator
-                    pbegincodehash = pc;
+                    iBeginCodeHash = iOp + 1;
                 }
                 break;
 
@@ -927,24 +1466,18 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
 
-                    valtype& vchSig    = stacktop(-2);
-                    valtype& vchPubKey = stacktop(-1);
-
-                    ////// debug print
-                    //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
-                    //PrintHex(vchPubKey.begin(), vchPubKey.end(), "pubkey: %s\n");
-
-                    // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
+                    const CStackValue& valSig    = stacktop(-2);
+                    const CStackValue& valPubKey = stacktop(-1);
 
-                    // Drop the signature, since there's no way for a signature to sign itself
-                    scriptCode.FindAndDelete(CScript(vchSig));
+                    // Subset of script starting at the most recent codeseparator,
+                    // without the signature, since there's no way for a signature to sign itself
+                    CScriptCode scriptCode(script, compiled, iBeginCodeHash, &valSig, &valSig + 1);
 
-                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                    bool fSuccess = CheckSig(valSig, valPubKey, scriptCode, txTo, nIn, nHashType);
 
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    stack.push_back(fSuccess ? valTrue : valFalse);
                     if (opcode == OP_CHECKSIGVERIFY)
                     {
                         if (fSuccess)
@@ -965,45 +1498,43 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
 
-                    valtype& vchSig    = stacktop(-2);  // ML-DSA signature (3309 bytes)
-                    valtype& vchPubKey = stacktop(-1);  // ML-DSA public key (1952 bytes)
+                    const CStackValue& valSig    = stacktop(-2);  // ML-DSA signature (3309 bytes)
+                    const CStackValue& valPubKey = stacktop(-1);  // ML-DSA public key (1952 bytes)
 
                     // Validate sizes for ML-DSA-65
-                    if (vchPubKey.size() != 1952) {
+                    if (valPubKey.size() != 1952) {
                         // Invalid public key size
                         popstack(stack);
                         popstack(stack);
-                        stack.push_back(vchFalse);
+                        stack.push_back(valFalse);
                         if (opcode == OP_CHECKMLDSASIGVERIFY)
                             return false;
                         break;
                     }
 
-                    if (vchSig.size() != 3309) {
+                    if (valSig.size() != 3309) {
                         // Invalid signature size
                         popstack(stack);
                         popstack(stack);
-                        stack.push_back(vchFalse);
+                        stack.push_back(valFalse);
                         if (opcode == OP_CHECKMLDSASIGVERIFY)
                             return false;
                         break;
                     }
 
-                    // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
-
-                    // Drop the signature (same as ECDSA)
-                    scriptCode.FindAndDelete(CScript(vchSig));
+                    // Subset of script starting at the most recent codeseparator,
+                    // without the signature (same as ECDSA)
+                    CScriptCode scriptCode(script, compiled, iBeginCodeHash, &valSig, &valSig + 1);
 
                     // Calculate the signature hash (same as ECDSA)
-                    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+                    uint256 sighash = scriptCode.GetSigHash(txTo, nIn, nHashType);
 
                     // Verify ML-DSA signature
-                    bool fSuccess = CheckMLDSASig(vchSig, vchPubKey, sighash);
+                    bool fSuccess = CheckMLDSASig(valSig.GetVch(), valPubKey.GetVch(), sighash);
 
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    stack.push_back(fSuccess ? valTrue : valFalse);
                     if (opcode == OP_CHECKMLDSASIGVERIFY)
                     {
                         if (fSuccess)
@@ -1029,7 +1560,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = CastToNum(stacktop(-i)).getint();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -1040,7 +1571,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = CastToNum(stacktop(-i)).getint();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -1048,24 +1579,17 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
-
-                    // Drop the signatures, since there's no way for a signature to sign itself
-                    for (int k = 0; k < nSigsCount; k++)
-                    {
-                        valtype& vchSig = stacktop(-isig-k);
-                        scriptCode.FindAndDelete(CScript(vchSig));
-                    }
+                    // Subset of script starting at the most recent codeseparator,
+                    // without the signatures, since there's no way for a signature to sign itself.
+                    // They lie together on the stack, the first of them deepest.
+                    const CStackValue* psigBegin = &stack[stack.size() - isig - nSigsCount + 1];
+                    CScriptCode scriptCode(script, compiled, iBeginCodeHash, psigBegin, psigBegin + nSigsCount);
 
                     bool fSuccess = true;
                     while (fSuccess && nSigsCount > 0)
                     {
-                        valtype& vchSig    = stacktop(-isig);
-                        valtype& vchPubKey = stacktop(-ikey);
-
                         // Check signature
-                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType))
+                        if (CheckSig(stacktop(-isig), stacktop(-ikey), scriptCode, txTo, nIn, nHashType))
                         {
                             isig++;
                             nSigsCount--;
@@ -1081,7 +1605,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                     while (i-- > 0)
                         popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    stack.push_back(fSuccess ? valTrue : valFalse);
 
                     if (opcode == OP_CHECKMULTISIGVERIFY)
                     {
@@ -1108,12 +1632,39 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
     }
 
 
-    if (!vfExec.empty())
+    if (!vfExec.empty() || compiled.fParseError)
         return false;
 
     return true;
 }
 
+static bool EvalScript(vector<CStackValue>& stack, CScriptArena& arena, const CScript& script, bool fCache,
+                       const CTransaction& txTo, unsigned int nIn, int nHashType, CScriptProfile* pprofile)
+{
+    if (fCache && script.size() >= nMinCachedScriptSize)
+        return EvalScript(stack, arena, script, *GetCachedScript(script), txTo, nIn, nHashType, pprofile);
+    return EvalScript(stack, arena, script, CCompiledScript(script), txTo, nIn, nHashType, pprofile);
+}
+
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    CScriptArena arena;
+    vector<CStackValue> stackEval;
+    stackEval.reserve(stack.size());
+    BOOST_FOREACH(const valtype& vch, stack)
+        stackEval.push_back(CStackValue(vch));
+
+    bool fResult = EvalScript(stackEval, arena, script, false, txTo, nIn, nHashType, NULL);
+
+    // Values may still point into the old stack, so build the new one aside
+    vector<valtype> stackResult;
+    stackResult.reserve(stackEval.size());
+    BOOST_FOREACH(const CStackValue& val, stackEval)
+        stackResult.push_back(val.GetVch());
+    stack.swap(stackResult);
+    return fResult;
+}
+
 
 
 
@@ -1122,68 +1673,84 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+static uint256 SignatureHash(const CScriptCode& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     if (nIn >= txTo.vin.size())
     {
         printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
         return 1;
     }
-    CTransaction txTmp(txTo);
-
-    // In case concatenating two scripts ends up with two codeseparators,
-    // or an extra one at the end, this prevents all those possible incompatibilities.
-    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
-
-    // Blank out other inputs' signatures
-    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
 
     // Blank out some of the outputs
+    unsigned int nOuts = txTo.vout.size();
+    bool fOthersUpdate = false;
     if ((nHashType & 0x1f) == SIGHASH_NONE)
     {
         // Wildcard payee
-        txTmp.vout.clear();
+        nOuts = 0;
 
         // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+        fOthersUpdate = true;
     }
     else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
     {
         // Only lockin the txout payee at same index as txin
         unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
+        if (nOut >= txTo.vout.size())
         {
             printf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
             return 1;
         }
-        txTmp.vout.resize(nOut+1);
-        for (unsigned int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
+        nOuts = nOut + 1;
 
         // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+        fOthersUpdate = true;
     }
 
     // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
-    {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
-    }
+    bool fAnyoneCanPay = (nHashType & SIGHASH_ANYONECANPAY);
+    unsigned int nInputs = (fAnyoneCanPay ? 1 : txTo.vin.size());
 
-    // Serialize and hash
+    // Serialize the transaction as it would be with the changes above and
+    // the other inputs' signatures blanked out, without making that copy
     CDataStream ss(SER_GETHASH, 0);
     ss.reserve(10000);
-    ss << txTmp << nHashType;
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, nInputs);
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        unsigned int iIn = (fAnyoneCanPay ? nIn : i);
+        const CTxIn& txin = txTo.vin[iIn];
+        ss << txin.prevout;
+        if (iIn == nIn)
+        {
+            WriteCompactSize(ss, scriptCode.size());
+            ss.write((const char*)scriptCode.begin(), scriptCode.size());
+        }
+        else
+            WriteCompactSize(ss, 0);
+        ss << ((fOthersUpdate && iIn != nIn) ? 0 : txin.nSequence);
+    }
+    WriteCompactSize(ss, nOuts);
+    for (unsigned int i = 0; i < nOuts; i++)
+    {
+        if ((nHashType & 0x1f) == SIGHASH_SINGLE && i != nIn)
+            ss << CTxOut();
+        else
+            ss << txTo.vout[i];
+    }
+    ss << txTo.nLockTime << nHashType;
     return Hash(ss.begin(), ss.end());
 }
 
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    // In case concatenating two scripts ends up with two codeseparators,
+    // or an extra one at the end, this prevents all those possible incompatibilities.
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+    const unsigned char* pbegin = (scriptCode.empty() ? NULL : &scriptCode[0]);
+    return SignatureHash(CScriptCode(pbegin, pbegin + scriptCode.size()), txTo, nIn, nHashType);
+}
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
@@ -1195,13 +1762,13 @@ private:
      // sigdata_type is (signature hash, signature, public key):
     typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
     std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
+    CFastCriticalSection cs_sigcache;
 
 public:
     bool
     Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
     {
-        LOCK(cs_sigcache);
+        FAST_LOCK(cs_sigcache);
 
         sigdata_type k(hash, vchSig, pubKey);
         std::set<sigdata_type>::iterator mi = setValid.find(k);
@@ -1220,7 +1787,7 @@ public:
         int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
         if (nMaxCacheSize <= 0) return;
 
-        LOCK(cs_sigcache);
+        FAST_LOCK(cs_sigcache);
 
         while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
         {
@@ -1242,21 +1809,22 @@ public:
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+static bool CheckSig(const CStackValue& valSig, const CStackValue& valPubKey, const CScriptCode& scriptCode,
+                     const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     static CSignatureCache signatureCache;
 
     // Hash type is one byte tacked on to the end of the signature
-    if (vchSig.empty())
+    if (valSig.size() == 0)
         return false;
     if (nHashType == 0)
-        nHashType = vchSig.back();
-    else if (nHashType != vchSig.back())
+        nHashType = valSig.end()[-1];
+    else if (nHashType != valSig.end()[-1])
         return false;
-    vchSig.pop_back();
+    valtype vchSig(valSig.begin(), valSig.end() - 1);
+    valtype vchPubKey = valPubKey.GetVch();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = scriptCode.GetSigHash(txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, vchPubKey))
         return true;
@@ -1272,6 +1840,15 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
     return true;
 }
 
+bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+    const unsigned char* pbegin = (scriptCode.empty() ? NULL : &scriptCode[0]);
+    CScriptCode code(pbegin, pbegin + scriptCode.size());
+    return CheckSig(CStackValue(vchSig), CStackValue(vchPubKey), code, txTo, nIn, nHashType);
+}
+
 #ifdef ENABLE_MLDSA
 /**
  * Check ML-DSA-65 post-quantum signature
@@ -1287,7 +1864,7 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
  * Note: ML-DSA signatures are deterministic and quantum-resistant.
  * They are ~10x larger than ECDSA but ~3.6x faster to verify.
  */
-bool CheckMLDSASig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, uint256 sighash)
+bool CheckMLDSASig(const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey, uint256 sighash)
 {
     // Validate input sizes (already checked in opcode handler, but double-check)
     if (vchPubKey.size() != MLDSA::PUBLIC_KEY_BYTES) {
@@ -1316,6 +1893,19 @@ bool CheckMLDSASig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey
 // Return public keys or hashes from scriptPubKey, for 'standard' transaction types.
 //
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsigned char> >& vSolutionsRet)
+{
+    // Big scripts are matched once and the answer kept with the compiled script
+    if (scriptPubKey.size() >= nMinCachedScriptSize)
+    {
+        boost::shared_ptr<const CCompiledScript> compiled = GetCachedScript(scriptPubKey);
+        typeRet = compiled->typeSolved;
+        vSolutionsRet = compiled->vSolutions;
+        return compiled->fSolved;
+    }
+    return MatchTemplates(scriptPubKey, typeRet, vSolutionsRet);
+}
+
+static bool MatchTemplates(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsigned char> >& vSolutionsRet)
 {
     // Templates
     static map<txnouttype, CScript> mTemplates;
@@ -1574,8 +2164,42 @@ bool IsMine(const CKeyStore &keystore, const CTxDestination &dest)
     return boost::apply_visitor(CKeyStoreIsMineVisitor(&keystore), dest);
 }
 
+// Look the IDs a scriptPubKey pays to up in the keystore's filter, without
+// running Solver.  Returns false only if the script cannot be ours: the
+// common templates are matched byte for byte, and anything else that Solver
+// could still match ends in OP_CHECKSIG or OP_CHECKMULTISIG.
+static bool MayBeMine(const CKeyStore &keystore, const CScript& scriptPubKey)
+{
+    unsigned int nSize = scriptPubKey.size();
+    if (nSize == 0)
+        return false;
+    const unsigned char* p = &scriptPubKey[0];
+    uint160 hash;
+
+    // OP_DUP OP_HASH160 <20 bytes> OP_EQUALVERIFY OP_CHECKSIG
+    if (nSize == 25 && p[0] == OP_DUP && p[1] == OP_HASH160 && p[2] == 20 && p[23] == OP_EQUALVERIFY && p[24] == OP_CHECKSIG)
+    {
+        memcpy(hash.begin(), p + 3, 20);
+        return keystore.MayHave(hash);
+    }
+    // OP_HASH160 <20 bytes> OP_EQUAL
+    if (scriptPubKey.IsPayToScriptHash())
+    {
+        memcpy(hash.begin(), p + 2, 20);
+        return keystore.MayHave(hash);
+    }
+    // <33 or 65 byte pubkey> OP_CHECKSIG
+    if (((nSize == 35 && p[0] == 33) || (nSize == 67 && p[0] == 65)) && p[nSize - 1] == OP_CHECKSIG)
+        return keystore.MayHave(Hash160(valtype(p + 1, p + nSize - 1)));
+
+    return p[nSize - 1] == OP_CHECKSIG || p[nSize - 1] == OP_CHECKMULTISIG;
+}
+
 bool IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
 {
+    if (!MayBeMine(keystore, scriptPubKey))
+        return false;
+
     vector<valtype> vSolutions;
     txnouttype whichType;
     if (!Solver(scriptPubKey, whichType, vSolutions))
@@ -1668,15 +2292,18 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
     return true;
 }
 
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  bool fValidatePayToScriptHash, int nHashType)
+static bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                         bool fValidatePayToScriptHash, int nHashType, CScriptProfile* pprofile)
 {
-    vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
+    // One arena for all three evaluations, as the stacks are handed on.
+    // scriptSigs are seldom seen twice, so only the other two are cached.
+    CScriptArena arena;
+    vector<CStackValue> stack, stackCopy;
+    if (!EvalScript(stack, arena, scriptSig, false, txTo, nIn, nHashType, pprofile))
         return false;
     if (fValidatePayToScriptHash)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+    if (!EvalScript(stack, arena, scriptPubKey, true, txTo, nIn, nHashType, pprofile))
         return false;
     if (stack.empty())
         return false;
@@ -1690,11 +2317,11 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         if (!scriptSig.IsPushOnly()) // scriptSig must be literals-only
             return false;            // or validation fails
 
-        const valtype& pubKeySerialized = stackCopy.back();
-        CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
+        const CStackValue& valPubKeySerialized = stackCopy.back();
+        CScript pubKey2(valPubKeySerialized.begin(), valPubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType))
+        if (!EvalScript(stackCopy, arena, pubKey2, true, txTo, nIn, nHashType, pprofile))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1704,6 +2331,12 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
     return true;
 }
 
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                  bool fValidatePayToScriptHash, int nHashType)
+{
+    return VerifyScript(scriptSig, scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType, NULL);
+}
+
 
 bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
 {
@@ -1745,7 +2378,8 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
 }
 
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType)
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType,
+                     CScriptProfile* pprofile)
 {
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
@@ -1756,14 +2390,20 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    if (!VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType))
+    if (!VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType, pprofile))
         return false;
 
     return true;
 }
 
-unsigned int CScript::GetSigOpCount(bool fAccurate) const
+unsigned int CScript::GetSigOpCount(bool fAccurate, bool fCache) const
 {
+    if (fCache && size() >= nMinCachedScriptSize)
+    {
+        boost::shared_ptr<const CCompiledScript> compiled = GetCachedScript(*this);
+        return fAccurate ? compiled->nSigOpsAccurate : compiled->nSigOps;
+    }
+
     unsigned int n = 0;
     const_iterator pc = begin();
     opcodetype lastOpcode = OP_INVALIDOPCODE;
@@ -1789,7 +2429,7 @@ unsigned int CScript::GetSigOpCount(bool fAccurate) const
 unsigned int CScript::GetSigOpCount(const CScript& scriptSig) const
 {
     if (!IsPayToScriptHash())
-        return GetSigOpCount(true);
+        return GetSigOpCount(true, true);
 
     // This is a pay-to-script-hash scriptPubKey;
     // get the last item that the scriptSig
@@ -1807,7 +2447,7 @@ unsigned int CScript::GetSigOpCount(const CScript& scriptSig) const
 
     /// ... and return it's opcount:
     CScript subscript(data.begin(), data.end());
-    return subscript.GetSigOpCount(true);
+    return subscript.GetSigOpCount(true, true);
 }
 
 bool CScript::IsPayToScriptHash() const
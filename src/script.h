@@ -225,6 +225,86 @@ inline std::string StackString(const std::vector<std::vector<unsigned char> >& v
     return str;
 }
 
+/** Numeric operand of a script opcode: at most nMaxNumSize bytes, little
+ * endian, with the sign in the top bit of the last byte.  Operands that
+ * small leave room in an int64 for the sum, difference or product of any
+ * two, so EvalScript does its arithmetic here and only falls back to
+ * CBigNum for left shifts that outgrow 64 bits.  Values are encoded exactly
+ * as CBigNum::getvch() encodes them.
+ */
+class CScriptNum
+{
+public:
+    static const unsigned int nMaxNumSize = 4;
+
+    // Longest encoding of an int64
+    static const unsigned int nMaxEncodedSize = 9;
+
+    explicit CScriptNum(int64 nValueIn) : nValue(nValueIn) { }
+
+    CScriptNum(const unsigned char* pbegin, const unsigned char* pend)
+    {
+        SetBytes(pbegin, pend - pbegin);
+    }
+
+    explicit CScriptNum(const std::vector<unsigned char>& vch)
+    {
+        SetBytes(vch.empty() ? NULL : &vch[0], vch.size());
+    }
+
+    int64 GetInt64() const { return nValue; }
+
+    int getint() const
+    {
+        if (nValue > std::numeric_limits<int>::max())
+            return std::numeric_limits<int>::max();
+        if (nValue < std::numeric_limits<int>::min())
+            return std::numeric_limits<int>::min();
+        return nValue;
+    }
+
+    /** Write the encoding to pch, which has room for nMaxEncodedSize bytes, and return its length */
+    unsigned int GetBytes(unsigned char* pch) const
+    {
+        if (nValue == 0)
+            return 0;
+        bool fNegative = (nValue < 0);
+        uint64 nAbs = fNegative ? -(uint64)nValue : nValue;
+        unsigned int nSize = 0;
+        while (nAbs)
+        {
+            pch[nSize++] = nAbs & 0xff;
+            nAbs >>= 8;
+        }
+        if (pch[nSize-1] & 0x80)
+            pch[nSize++] = fNegative ? 0x80 : 0;
+        else if (fNegative)
+            pch[nSize-1] |= 0x80;
+        return nSize;
+    }
+
+    std::vector<unsigned char> getvch() const
+    {
+        unsigned char pch[nMaxEncodedSize];
+        return std::vector<unsigned char>(pch, pch + GetBytes(pch));
+    }
+
+private:
+    int64 nValue;
+
+    void SetBytes(const unsigned char* pch, unsigned int nSize)
+    {
+        if (nSize > nMaxNumSize)
+            throw std::runtime_error("CScriptNum() : overflow");
+        nValue = 0;
+        for (unsigned int i = 0; i < nSize; i++)
+            nValue |= (int64)pch[i] << (8 * i);
+        // Negative zero is zero
+        if (nSize > 0 && (pch[nSize-1] & 0x80))
+            nValue = -(nValue & ~((int64)0x80 << (8 * (nSize-1))));
+    }
+};
+
 
 
 
@@ -515,7 +595,9 @@ public:
     // CHECKMULTISIGs serialized in scriptSigs are
     // counted more accurately, assuming they are of the form
     //  ... OP_N CHECKMULTISIG ...
-    unsigned int GetSigOpCount(bool fAccurate) const;
+    // With fCache, a long script is counted from its cached decoding; pass
+    // it only for scripts that come back, not for one-time scriptSigs.
+    unsigned int GetSigOpCount(bool fAccurate, bool fCache = false) const;
 
     // Accurately count sigOps, including sigOps in
     // pay-to-script-hash transactions:
@@ -584,7 +666,36 @@ public:
 
 
 
+/** What evaluating scripts cost, opcode by opcode: how many ran, how long
+ *  they took and how many bytes of stack values they made.  Filled in by
+ *  VerifySignature when given one, for -scriptprofile and the profiletx and
+ *  profileblock RPCs. */
+class CScriptProfile
+{
+public:
+    uint64 vCount[256];
+    int64 vMicros[256];
+    uint64 vBytes[256];
+    unsigned int nScripts;
+
+    CScriptProfile()
+    {
+        SetNull();
+    }
 
+    void SetNull()
+    {
+        memset(vCount, 0, sizeof(vCount));
+        memset(vMicros, 0, sizeof(vMicros));
+        memset(vBytes, 0, sizeof(vBytes));
+        nScripts = 0;
+    }
+
+    void Add(const CScriptProfile& profile);
+    uint64 GetOps() const;
+    int64 GetMicros() const;
+    uint64 GetBytes() const;
+};
 
 bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
@@ -595,7 +706,8 @@ bool IsMine(const CKeyStore& keystore, const CTxDestination &dest);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType);
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType,
+                     CScriptProfile* pprofile=NULL);
 
 #ifdef ENABLE_MLDSA
 // Phase 4.1: Quantum-resistant multisignature support
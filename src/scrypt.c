@@ -260,16 +260,59 @@ static inline void xor_salsa8(uint32_t B[16], const uint32_t Bx[16])
 	B[15] += x15;
 }
 
-void scrypt_1024_1_1_256_sp(const char *input, char *output, char *scratchpad)
+/**
+ * PBKDF2_SHA256_1(keyctx, salt, saltlen, buf, dkLen):
+ * Compute PBKDF2(passwd, salt, 1, dkLen) where keyctx is an HMAC-SHA256
+ * context already initialized with passwd.  This lets callers that hash the
+ * same password twice (as scrypt does) pay for the key setup only once.
+ */
+static void
+PBKDF2_SHA256_1(const HMAC_SHA256_CTX *keyctx, const uint8_t *salt,
+    size_t saltlen, uint8_t *buf, size_t dkLen)
+{
+	HMAC_SHA256_CTX PShctx, hctx;
+	size_t i;
+	uint8_t ivec[4];
+	uint8_t U[32];
+	size_t clen;
+
+	/* Compute HMAC state after processing P and S. */
+	memcpy(&PShctx, keyctx, sizeof(HMAC_SHA256_CTX));
+	HMAC_SHA256_Update(&PShctx, salt, saltlen);
+
+	/* Iterate through the blocks. */
+	for (i = 0; i * 32 < dkLen; i++) {
+		/* Generate INT(i + 1). */
+		be32enc(ivec, (uint32_t)(i + 1));
+
+		/* Compute U_1 = PRF(P, S || INT(i)); with c = 1, T_i = U_1. */
+		memcpy(&hctx, &PShctx, sizeof(HMAC_SHA256_CTX));
+		HMAC_SHA256_Update(&hctx, ivec, 4);
+		HMAC_SHA256_Final(U, &hctx);
+
+		/* Copy as many bytes as necessary into buf. */
+		clen = dkLen - i * 32;
+		if (clen > 32)
+			clen = 32;
+		memcpy(&buf[i * 32], U, clen);
+	}
+
+	/* Clean PShctx, since we never called _Final on it. */
+	memset(&PShctx, 0, sizeof(HMAC_SHA256_CTX));
+}
+
+/**
+ * scrypt_core(B, scratchpad):
+ * Run the ROMix(1024) core of scrypt in place over the 128-byte buffer B.
+ */
+static void
+scrypt_core(uint8_t B[128], char *scratchpad)
 {
-	uint8_t B[128];
 	uint32_t X[32];
 	uint32_t *V;
 	uint32_t i, j, k;
 
 	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
-	
-	PBKDF2_SHA256((const uint8_t *)input, 80, (const uint8_t *)input, 80, 1, B, 128);
 
 	for (k = 0; k < 32; k++)
 		X[k] = le32dec(&B[4 * k]);
@@ -289,10 +332,70 @@ void scrypt_1024_1_1_256_sp(const char *input, char *output, char *scratchpad)
 
 	for (k = 0; k < 32; k++)
 		le32enc(&B[4 * k], X[k]);
+}
+
+void scrypt_1024_1_1_256_sp(const char *input, char *output, char *scratchpad)
+{
+	uint8_t B[128];
+
+	PBKDF2_SHA256((const uint8_t *)input, 80, (const uint8_t *)input, 80, 1, B, 128);
+
+	scrypt_core(B, scratchpad);
 
 	PBKDF2_SHA256((const uint8_t *)input, 80, B, 128, 1, (uint8_t *)output, 32);
 }
 
+/*
+ * The 80-byte block header is longer than the SHA-256 block size, so HMAC
+ * replaces it with K = SHA256(header).  The first 64 bytes of the header
+ * (nVersion, hashPrevBlock and most of hashMerkleRoot) don't change while
+ * scanning nonces, so the SHA-256 state after that first block is the same
+ * for every nonce.  This is also the "midstate" handed out by getwork.
+ */
+void scrypt_1024_1_1_256_midstate(const char *input, uint32_t midstate[8])
+{
+	SHA256_CTX ctx;
+	int i;
+
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, input, 64);
+	for (i = 0; i < 8; i++)
+		midstate[i] = ctx.h[i];
+
+	memset(&ctx, 0, sizeof(ctx));
+}
+
+void scrypt_1024_1_1_256_sp_midstate(const char *input, const uint32_t midstate[8], char *output, char *scratchpad)
+{
+	HMAC_SHA256_CTX keyctx;
+	SHA256_CTX ctx;
+	uint8_t khash[32];
+	uint8_t B[128];
+	int i;
+
+	/* Finish K = SHA256(header) from the midstate and the last 16 bytes. */
+	SHA256_Init(&ctx);
+	for (i = 0; i < 8; i++)
+		ctx.h[i] = midstate[i];
+	ctx.Nl = 64 * 8;
+	ctx.Nh = 0;
+	SHA256_Update(&ctx, input + 64, 16);
+	SHA256_Final(khash, &ctx);
+
+	/* Both PBKDF2 passes use the header as password: set up HMAC once. */
+	HMAC_SHA256_Init(&keyctx, khash, 32);
+
+	PBKDF2_SHA256_1(&keyctx, (const uint8_t *)input, 80, B, 128);
+
+	scrypt_core(B, scratchpad);
+
+	PBKDF2_SHA256_1(&keyctx, B, 128, (uint8_t *)output, 32);
+
+	/* Clean the stack. */
+	memset(&keyctx, 0, sizeof(keyctx));
+	memset(khash, 0, 32);
+}
+
 void scrypt_1024_1_1_256(const char *input, char *output)
 {
 	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
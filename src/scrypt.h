@@ -1,6 +1,8 @@
 #ifndef SCRYPT_H
 #define SCRYPT_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -10,6 +12,11 @@ const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 void scrypt_1024_1_1_256_sp(const char *input, char *output, char *scratchpad);
 void scrypt_1024_1_1_256(const char *input, char *output);
 
+/* Mining interface: hash many nonces of the same 80-byte header using the
+ * SHA-256 state of its first 64 bytes, which only has to be computed once. */
+void scrypt_1024_1_1_256_midstate(const char *input, uint32_t midstate[8]);
+void scrypt_1024_1_1_256_sp_midstate(const char *input, const uint32_t midstate[8], char *output, char *scratchpad);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,763 @@
+// Copyright (c) 2026 AumCoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+#include "wallet.h"
+#include "net.h"
+#include "init.h"
+#include "ui_interface.h"
+#include "bitcoinrpc.h"
+#include "rpcjson.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+#include <deque>
+#include <boost/math/special_functions/fpclassify.hpp>
+
+using namespace std;
+using namespace json_spirit;
+
+// Jobs older than this many notifications are forgotten; shares for them are stale
+static const unsigned int MAX_STRATUM_JOBS = 16;
+// A client that sends this much without a newline is not speaking stratum
+static const unsigned int MAX_STRATUM_LINE = 16 * 1024;
+// Every client is in the select() sets, so leave room for the node's own sockets and files
+static const int DEFAULT_STRATUM_MAX_CLIENTS = 256;
+
+// The operator's -stratumdifficulty, which workers can't go below
+static double GetStratumMinDifficulty()
+{
+    double dMinimum;
+    if (!StratumClampDifficulty(atof(GetArg("-stratumdifficulty", "1").c_str()), 1.0 / 65536, dMinimum))
+        dMinimum = 1;
+    return dMinimum;
+}
+
+class CStratumClient
+{
+public:
+    SOCKET hSocket;
+    CService addr;
+    string strRecv;
+    string strSend;
+    vector<unsigned char> vchExtraNonce1;
+    string strWorker;
+    double dDifficulty;
+    bool fSubscribed;
+    bool fAuthorized;
+    bool fDisconnect;
+    int64 nLastRecv;
+    int nAccepted;
+    int nRejected;
+
+    CStratumClient(SOCKET hSocketIn, const CService& addrIn, unsigned int nExtraNonce1)
+    {
+        hSocket = hSocketIn;
+        addr = addrIn;
+        vchExtraNonce1.resize(STRATUM_EXTRANONCE1_SIZE);
+        for (unsigned int i = 0; i < STRATUM_EXTRANONCE1_SIZE; i++)
+            vchExtraNonce1[i] = (nExtraNonce1 >> (8 * (STRATUM_EXTRANONCE1_SIZE - 1 - i))) & 0xff;
+        dDifficulty = GetStratumMinDifficulty();
+        fSubscribed = false;
+        fAuthorized = false;
+        fDisconnect = false;
+        nLastRecv = GetTime();
+        nAccepted = 0;
+        nRejected = 0;
+    }
+
+    ~CStratumClient()
+    {
+        if (hSocket != INVALID_SOCKET)
+            closesocket(hSocket);
+    }
+};
+
+static vector<SOCKET> vhStratumListenSocket;
+static vector<CStratumClient*> vStratumClients;
+static deque<CStratumJob*> vStratumJobs;
+static unsigned int nStratumJobId = 0;
+static unsigned int nStratumExtraNonce1 = 0;
+
+static CReserveKey& StratumReserveKey()
+{
+    static CReserveKey reservekey(pwalletMain);
+    return reservekey;
+}
+
+
+//
+// Work units
+//
+
+bool CStratumJob::SetTemplate(const CBlock& blockIn, CBlockIndex* pindexPrevIn, const string& strJobIdIn)
+{
+    block = blockIn;
+    pindexPrev = pindexPrevIn;
+    strJobId = strJobIdIn;
+    setSubmitted.clear();
+
+    // Coinbase scriptSig is nTime followed by a push reserved for
+    // extranonce1 || extranonce2, then the usual coinbase flags
+    const unsigned int nExtraNonceSize = STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE;
+    CScript scriptPrefix = CScript() << block.nTime << vector<unsigned char>(nExtraNonceSize, 0);
+    CTransaction& txCoinbase = block.vtx[0];
+    txCoinbase.vin[0].scriptSig = scriptPrefix + COINBASE_FLAGS;
+    if (txCoinbase.vin[0].scriptSig.size() > 100)
+        return error("CStratumJob::SetTemplate() : coinbase scriptSig too large");
+
+    CDataStream ssCoinbase(SER_NETWORK, PROTOCOL_VERSION);
+    ssCoinbase << txCoinbase;
+
+    // nVersion, vin count, prevout and the scriptSig length come before the script
+    unsigned int nOffset = sizeof(txCoinbase.nVersion)
+                         + GetSizeOfCompactSize(txCoinbase.vin.size())
+                         + ::GetSerializeSize(txCoinbase.vin[0].prevout, SER_NETWORK, PROTOCOL_VERSION)
+                         + GetSizeOfCompactSize(txCoinbase.vin[0].scriptSig.size())
+                         + scriptPrefix.size() - nExtraNonceSize;
+    vchCoinbase1.assign(ssCoinbase.begin(), ssCoinbase.begin() + nOffset);
+    vchCoinbase2.assign(ssCoinbase.begin() + nOffset + nExtraNonceSize, ssCoinbase.end());
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    vMerkleBranch = block.GetMerkleBranch(0);
+    return true;
+}
+
+bool CStratumJob::BuildCoinbase(const vector<unsigned char>& vchExtraNonce1,
+                                const vector<unsigned char>& vchExtraNonce2,
+                                CTransaction& txCoinbaseRet) const
+{
+    if (vchExtraNonce1.size() != STRATUM_EXTRANONCE1_SIZE || vchExtraNonce2.size() != STRATUM_EXTRANONCE2_SIZE)
+        return false;
+
+    vector<unsigned char> vch(vchCoinbase1);
+    vch.insert(vch.end(), vchExtraNonce1.begin(), vchExtraNonce1.end());
+    vch.insert(vch.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+    vch.insert(vch.end(), vchCoinbase2.begin(), vchCoinbase2.end());
+
+    try
+    {
+        CDataStream ssCoinbase(vch, SER_NETWORK, PROTOCOL_VERSION);
+        ssCoinbase >> txCoinbaseRet;
+    }
+    catch (std::exception& e)
+    {
+        return false;
+    }
+    return txCoinbaseRet.IsCoinBase();
+}
+
+bool CStratumJob::BuildBlock(const vector<unsigned char>& vchExtraNonce1,
+                             const vector<unsigned char>& vchExtraNonce2,
+                             unsigned int nTime, unsigned int nNonce, CBlock& blockRet) const
+{
+    CTransaction txCoinbase;
+    if (!BuildCoinbase(vchExtraNonce1, vchExtraNonce2, txCoinbase))
+        return false;
+
+    blockRet.SetNull();
+    blockRet.nVersion       = block.nVersion;
+    blockRet.hashPrevBlock  = block.hashPrevBlock;
+    blockRet.hashMerkleRoot = CBlock::CheckMerkleBranch(txCoinbase.GetHash(), vMerkleBranch, 0);
+    blockRet.nTime          = nTime;
+    blockRet.nBits          = block.nBits;
+    blockRet.nNonce         = nNonce;
+    blockRet.vtx            = block.vtx;
+    blockRet.vtx[0]         = txCoinbase;
+    return true;
+}
+
+uint256 StratumDifficultyToTarget(double dDifficulty)
+{
+    // Scale by 2^16 so fractional difficulties keep their precision
+    if (!(dDifficulty >= 1.0 / 65536))
+        dDifficulty = 1.0 / 65536;
+    if (dDifficulty > MAX_STRATUM_DIFFICULTY)
+        dDifficulty = MAX_STRATUM_DIFFICULTY;
+    CBigNum bnTarget;
+    bnTarget.SetCompact(0x1f00ffff);
+    bnTarget = bnTarget * CBigNum(65536) / CBigNum((uint64)(dDifficulty * 65536));
+    return bnTarget.getuint256();
+}
+
+bool StratumClampDifficulty(double dSuggested, double dMinimum, double& dRet)
+{
+    if (!boost::math::isfinite(dSuggested))
+        return false;
+    dRet = min(max(dSuggested, dMinimum), MAX_STRATUM_DIFFICULTY);
+    return true;
+}
+
+
+//
+// Protocol
+//
+
+static Array StratumError(int nCode, const string& strMessage)
+{
+    Array error;
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+    return error;
+}
+
+static void StratumSend(CStratumClient* pclient, const Object& msg)
+{
+    pclient->strSend += WriteJSON(Value(msg)) + "\n";
+}
+
+static void StratumNotifyMethod(CStratumClient* pclient, const string& strMethod, const Array& params)
+{
+    Object msg;
+    msg.push_back(Pair("id", Value::null));
+    msg.push_back(Pair("method", strMethod));
+    msg.push_back(Pair("params", params));
+    StratumSend(pclient, msg);
+}
+
+// Stratum sends the previous block hash with each 32-bit word byte swapped
+static string StratumHexPrevHash(const uint256& hash)
+{
+    uint256 hashSwapped = hash;
+    for (unsigned int i = 0; i < sizeof(hashSwapped) / 4; i++)
+        ((uint32_t*)&hashSwapped)[i] = ByteReverse(((uint32_t*)&hashSwapped)[i]);
+    return HexStr(BEGIN(hashSwapped), END(hashSwapped));
+}
+
+static void StratumSendDifficulty(CStratumClient* pclient)
+{
+    Array params;
+    params.push_back(pclient->dDifficulty);
+    StratumNotifyMethod(pclient, "mining.set_difficulty", params);
+}
+
+static void StratumSendJob(CStratumClient* pclient, const CStratumJob& job, bool fClean)
+{
+    Array params;
+    params.push_back(job.strJobId);
+    params.push_back(StratumHexPrevHash(job.block.hashPrevBlock));
+    params.push_back(HexStr(job.vchCoinbase1));
+    params.push_back(HexStr(job.vchCoinbase2));
+    Array branch;
+    BOOST_FOREACH(const uint256& hash, job.vMerkleBranch)
+        branch.push_back(HexStr(BEGIN(hash), END(hash)));
+    params.push_back(branch);
+    params.push_back(strprintf("%08x", job.block.nVersion));
+    params.push_back(strprintf("%08x", job.block.nBits));
+    params.push_back(strprintf("%08x", job.block.nTime));
+    params.push_back(fClean);
+    StratumNotifyMethod(pclient, "mining.notify", params);
+}
+
+static CStratumJob* StratumFindJob(const string& strJobId)
+{
+    BOOST_FOREACH(CStratumJob* pjob, vStratumJobs)
+        if (pjob->strJobId == strJobId)
+            return pjob;
+    return NULL;
+}
+
+static bool StratumUpdateJob(bool fClean)
+{
+    CBlockIndex* pindexPrev;
+    auto_ptr<CBlock> pblock;
+    {
+        LOCK(cs_main);
+        pindexPrev = pindexBest;
+        pblock.reset(CreateNewBlock(StratumReserveKey()));
+    }
+    if (!pblock.get())
+        return false;
+
+    CStratumJob* pjob = new CStratumJob();
+    if (!pjob->SetTemplate(*pblock, pindexPrev, strprintf("%x", ++nStratumJobId)))
+    {
+        delete pjob;
+        return false;
+    }
+
+    if (fClean)
+    {
+        BOOST_FOREACH(CStratumJob* pjobOld, vStratumJobs)
+            delete pjobOld;
+        vStratumJobs.clear();
+    }
+    while (vStratumJobs.size() >= MAX_STRATUM_JOBS)
+    {
+        delete vStratumJobs.front();
+        vStratumJobs.pop_front();
+    }
+    vStratumJobs.push_back(pjob);
+
+    BOOST_FOREACH(CStratumClient* pclient, vStratumClients)
+        if (pclient->fSubscribed)
+            StratumSendJob(pclient, *pjob, fClean);
+    return true;
+}
+
+static Value StratumSubmit(CStratumClient* pclient, const Array& params)
+{
+    // params: worker, job id, extranonce2, ntime, nonce
+    if (!pclient->fAuthorized)
+        throw StratumError(24, "Unauthorized worker");
+    if (params.size() < 5)
+        throw StratumError(20, "Invalid parameters");
+
+    CStratumJob* pjob = StratumFindJob(params[1].get_str());
+    if (!pjob || pjob->pindexPrev != pindexBest)
+        throw StratumError(21, "Job not found");
+
+    vector<unsigned char> vchExtraNonce2 = ParseHex(params[2].get_str());
+    if (vchExtraNonce2.size() != STRATUM_EXTRANONCE2_SIZE)
+        throw StratumError(20, "Invalid extranonce2 size");
+    unsigned int nTime = strtoul(params[3].get_str().c_str(), NULL, 16);
+    unsigned int nNonce = strtoul(params[4].get_str().c_str(), NULL, 16);
+    if (nTime <= pjob->pindexPrev->GetMedianTimePast() || nTime > GetAdjustedTime() + 2 * 60 * 60)
+        throw StratumError(20, "ntime out of range");
+
+    CBlock block;
+    if (!pjob->BuildBlock(pclient->vchExtraNonce1, vchExtraNonce2, nTime, nNonce, block))
+        throw StratumError(20, "Invalid coinbase");
+    if (!pjob->setSubmitted.insert(block.GetHash()).second)
+        throw StratumError(22, "Duplicate share");
+
+    uint256 hash = block.GetPoWHash();
+    if (hash > StratumDifficultyToTarget(pclient->dDifficulty))
+        throw StratumError(23, "Low difficulty share");
+
+    uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+    if (hash <= hashTarget)
+    {
+        printf("Stratum: block found by %s (%s)\n", pclient->strWorker.c_str(), pclient->addr.ToString().c_str());
+        CheckWork(&block, *pwalletMain, StratumReserveKey());
+    }
+    return true;
+}
+
+static void StratumProcessMessage(CStratumClient* pclient, const string& strLine)
+{
+    Value id = Value::null;
+    try
+    {
+        Value valRequest;
+        if (!ReadJSON(strLine, valRequest) || valRequest.type() != obj_type)
+        {
+            pclient->fDisconnect = true;
+            return;
+        }
+        const Object& request = valRequest.get_obj();
+        id = find_value(request, "id");
+        Value valMethod = find_value(request, "method");
+        if (valMethod.type() != str_type)
+            throw StratumError(20, "Method must be a string");
+        string strMethod = valMethod.get_str();
+        Array params;
+        Value valParams = find_value(request, "params");
+        if (valParams.type() == array_type)
+            params = valParams.get_array();
+
+        Value result;
+        bool fSendJob = false;
+        if (strMethod == "mining.subscribe")
+        {
+            Array subscriptions;
+            const char* pszSubscriptions[] = {"mining.set_difficulty", "mining.notify"};
+            BOOST_FOREACH(const char* pszMethod, pszSubscriptions)
+            {
+                Array subscription;
+                subscription.push_back(pszMethod);
+                subscription.push_back(HexStr(pclient->vchExtraNonce1));
+                subscriptions.push_back(subscription);
+            }
+            Array ret;
+            ret.push_back(subscriptions);
+            ret.push_back(HexStr(pclient->vchExtraNonce1));
+            ret.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+            result = ret;
+            pclient->fSubscribed = true;
+            fSendJob = true;
+        }
+        else if (strMethod == "mining.authorize")
+        {
+            if (params.size() < 1 || params[0].type() != str_type)
+                throw StratumError(20, "Invalid parameters");
+            if (mapArgs.count("-stratumpassword") &&
+                (params.size() < 2 || params[1].type() != str_type || params[1].get_str() != mapArgs["-stratumpassword"]))
+                throw StratumError(24, "Unauthorized worker");
+            pclient->strWorker = params[0].get_str();
+            pclient->fAuthorized = true;
+            result = true;
+        }
+        else if (strMethod == "mining.submit")
+        {
+            try
+            {
+                result = StratumSubmit(pclient, params);
+                pclient->nAccepted++;
+            }
+            catch (Array& error)
+            {
+                pclient->nRejected++;
+                throw;
+            }
+        }
+        else if (strMethod == "mining.suggest_difficulty")
+        {
+            if (params.size() < 1 || (params[0].type() != real_type && params[0].type() != int_type))
+                throw StratumError(20, "Invalid parameters");
+            // Workers may ask for harder shares, not easier ones
+            if (!StratumClampDifficulty(params[0].get_real(), GetStratumMinDifficulty(), pclient->dDifficulty))
+                throw StratumError(20, "Invalid parameters");
+            StratumSendDifficulty(pclient);
+            result = true;
+        }
+        else if (strMethod == "mining.extranonce.subscribe")
+        {
+            // Extranonce1 is fixed for the life of the connection
+            result = true;
+        }
+        else
+            throw StratumError(20, "Method not found");
+
+        Object reply;
+        reply.push_back(Pair("id", id));
+        reply.push_back(Pair("result", result));
+        reply.push_back(Pair("error", Value::null));
+        StratumSend(pclient, reply);
+
+        if (fSendJob)
+        {
+            StratumSendDifficulty(pclient);
+            if (!vStratumJobs.empty())
+                StratumSendJob(pclient, *vStratumJobs.back(), true);
+        }
+    }
+    catch (Array& error)
+    {
+        Object reply;
+        reply.push_back(Pair("id", id));
+        reply.push_back(Pair("result", Value::null));
+        reply.push_back(Pair("error", error));
+        StratumSend(pclient, reply);
+    }
+    catch (std::exception& e)
+    {
+        Object reply;
+        reply.push_back(Pair("id", id));
+        reply.push_back(Pair("result", Value::null));
+        reply.push_back(Pair("error", StratumError(20, e.what())));
+        StratumSend(pclient, reply);
+    }
+}
+
+
+//
+// Server thread
+//
+
+static bool StratumClientAllowed(const CNetAddr& addr)
+{
+    if (addr.IsLocal())
+        return true;
+    const string strAddress = addr.ToStringIP();
+    BOOST_FOREACH(string strAllow, mapMultiArgs["-stratumallowip"])
+        if (WildcardMatch(strAddress, strAllow))
+            return true;
+    return false;
+}
+
+static bool StratumBindListenPort(const CService& addrBind)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    if (!addrBind.GetSockAddr((struct sockaddr*)&sockaddr, &len))
+        return false;
+
+    SOCKET hListenSocket = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (hListenSocket == INVALID_SOCKET)
+        return false;
+
+    int nOne = 1;
+#ifdef SO_NOSIGPIPE
+    setsockopt(hListenSocket, SOL_SOCKET, SO_NOSIGPIPE, (void*)&nOne, sizeof(int));
+#endif
+#ifndef WIN32
+    setsockopt(hListenSocket, SOL_SOCKET, SO_REUSEADDR, (void*)&nOne, sizeof(int));
+#endif
+#ifdef WIN32
+    if (ioctlsocket(hListenSocket, FIONBIO, (u_long*)&nOne) == SOCKET_ERROR)
+#else
+    if (fcntl(hListenSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
+#endif
+    {
+        closesocket(hListenSocket);
+        return false;
+    }
+#if defined(USE_IPV6) && defined(IPV6_V6ONLY)
+    if (addrBind.IsIPv6())
+        setsockopt(hListenSocket, IPPROTO_IPV6, IPV6_V6ONLY, (void*)&nOne, sizeof(int));
+#endif
+
+    if (::bind(hListenSocket, (struct sockaddr*)&sockaddr, len) == SOCKET_ERROR ||
+        listen(hListenSocket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        printf("Stratum: unable to bind to %s (error %d)\n", addrBind.ToString().c_str(), WSAGetLastError());
+        closesocket(hListenSocket);
+        return false;
+    }
+    printf("Stratum: listening on %s\n", addrBind.ToString().c_str());
+    vhStratumListenSocket.push_back(hListenSocket);
+    return true;
+}
+
+static void StratumAccept(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    if (hSocket == INVALID_SOCKET)
+        return;
+
+    CService addr;
+    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr) || !StratumClientAllowed(addr))
+    {
+        closesocket(hSocket);
+        return;
+    }
+    if ((int)vStratumClients.size() >= GetArg("-stratummaxclients", DEFAULT_STRATUM_MAX_CLIENTS))
+    {
+        printf("Stratum: too many clients, dropping %s\n", addr.ToString().c_str());
+        closesocket(hSocket);
+        return;
+    }
+#ifndef WIN32
+    // FD_SET on a descriptor past FD_SETSIZE writes outside the fd_set
+    if (hSocket >= FD_SETSIZE)
+    {
+        printf("Stratum: out of selectable sockets, dropping %s\n", addr.ToString().c_str());
+        closesocket(hSocket);
+        return;
+    }
+#endif
+
+    if (fDebug)
+        printf("Stratum: accepted connection %s\n", addr.ToString().c_str());
+    vStratumClients.push_back(new CStratumClient(hSocket, addr, nStratumExtraNonce1++));
+}
+
+static void StratumReceive(CStratumClient* pclient)
+{
+    char pchBuf[0x4000];
+    int nBytes = recv(pclient->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes == 0)
+    {
+        pclient->fDisconnect = true;
+        return;
+    }
+    if (nBytes < 0)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            pclient->fDisconnect = true;
+        return;
+    }
+
+    pclient->nLastRecv = GetTime();
+    pclient->strRecv.append(pchBuf, nBytes);
+
+    string::size_type nPos;
+    while (!pclient->fDisconnect && (nPos = pclient->strRecv.find('\n')) != string::npos)
+    {
+        string strLine = pclient->strRecv.substr(0, nPos);
+        pclient->strRecv.erase(0, nPos + 1);
+        if (!strLine.empty() && strLine[strLine.size()-1] == '\r')
+            strLine.erase(strLine.size()-1);
+        if (!strLine.empty())
+            StratumProcessMessage(pclient, strLine);
+    }
+    if (pclient->strRecv.size() > MAX_STRATUM_LINE)
+        pclient->fDisconnect = true;
+}
+
+static void StratumSendPending(CStratumClient* pclient)
+{
+    int nBytes = send(pclient->hSocket, pclient->strSend.data(), pclient->strSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (nBytes > 0)
+        pclient->strSend.erase(0, nBytes);
+    else if (nBytes < 0)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            pclient->fDisconnect = true;
+    }
+}
+
+static void ThreadStratumServer2(void* parg)
+{
+    printf("ThreadStratumServer started\n");
+
+    int nPort = GetArg("-stratumport", fTestNet ? 19445 : 9445);
+    bool fBound = false;
+    if (mapMultiArgs["-stratumallowip"].empty())
+    {
+        fBound |= StratumBindListenPort(CService(CNetAddr("127.0.0.1"), nPort));
+#ifdef USE_IPV6
+        fBound |= StratumBindListenPort(CService(CNetAddr("::1"), nPort));
+#endif
+    }
+    else
+    {
+        struct in_addr inaddr_any;
+        inaddr_any.s_addr = INADDR_ANY;
+        fBound |= StratumBindListenPort(CService(inaddr_any, nPort));
+#ifdef USE_IPV6
+        fBound |= StratumBindListenPort(CService(in6addr_any, nPort));
+#endif
+    }
+    if (!fBound)
+    {
+        uiInterface.ThreadSafeMessageBox(strprintf(_("Unable to bind stratum port %d"), nPort),
+                                         _("Error"), CClientUIInterface::OK | CClientUIInterface::MODAL);
+        return;
+    }
+
+    int64 nJobInterval = GetArg("-stratumjobinterval", 30);
+    CBlockIndex* pindexPrevJob = NULL;
+    unsigned int nTransactionsUpdatedLast = 0;
+    int64 nJobTime = 0;
+
+    while (!fShutdown)
+    {
+        //
+        // Push new work when the chain tip moves, or periodically when the
+        // memory pool has changed
+        //
+        if (!IsInitialBlockDownload() && !vNodes.empty())
+        {
+            if (pindexPrevJob != pindexBest ||
+                (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nJobTime > nJobInterval))
+            {
+                bool fClean = (pindexPrevJob != pindexBest);
+                pindexPrevJob = pindexBest;
+                nTransactionsUpdatedLast = nTransactionsUpdated;
+                nJobTime = GetTime();
+                StratumUpdateJob(fClean);
+            }
+        }
+
+        //
+        // Disconnect clients
+        //
+        for (vector<CStratumClient*>::iterator it = vStratumClients.begin(); it != vStratumClients.end();)
+        {
+            CStratumClient* pclient = *it;
+            if (pclient->fDisconnect || GetTime() - pclient->nLastRecv > 15 * 60)
+            {
+                if (fDebug)
+                    printf("Stratum: disconnecting %s (%d accepted, %d rejected)\n", pclient->addr.ToString().c_str(),
+                           pclient->nAccepted, pclient->nRejected);
+                delete pclient;
+                it = vStratumClients.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        //
+        // Find which sockets have data to receive
+        //
+        struct timeval timeout;
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = 50000; // frequency to check for new work
+
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        SOCKET hSocketMax = 0;
+
+        BOOST_FOREACH(SOCKET hListenSocket, vhStratumListenSocket)
+        {
+            FD_SET(hListenSocket, &fdsetRecv);
+            hSocketMax = max(hSocketMax, hListenSocket);
+        }
+        BOOST_FOREACH(CStratumClient* pclient, vStratumClients)
+        {
+            FD_SET(pclient->hSocket, &fdsetRecv);
+            if (!pclient->strSend.empty())
+                FD_SET(pclient->hSocket, &fdsetSend);
+            hSocketMax = max(hSocketMax, pclient->hSocket);
+        }
+
+        vnThreadsRunning[THREAD_STRATUM]--;
+        int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, NULL, &timeout);
+        vnThreadsRunning[THREAD_STRATUM]++;
+        if (fShutdown)
+            break;
+        if (nSelect == SOCKET_ERROR)
+        {
+            printf("Stratum: socket select error %d\n", WSAGetLastError());
+            Sleep(timeout.tv_usec/1000);
+            continue;
+        }
+
+        BOOST_FOREACH(SOCKET hListenSocket, vhStratumListenSocket)
+            if (FD_ISSET(hListenSocket, &fdsetRecv))
+                StratumAccept(hListenSocket);
+
+        BOOST_FOREACH(CStratumClient* pclient, vStratumClients)
+        {
+            if (FD_ISSET(pclient->hSocket, &fdsetRecv))
+                StratumReceive(pclient);
+            if (!pclient->strSend.empty() && !pclient->fDisconnect)
+                StratumSendPending(pclient);
+        }
+    }
+
+    BOOST_FOREACH(CStratumClient* pclient, vStratumClients)
+        delete pclient;
+    vStratumClients.clear();
+    BOOST_FOREACH(CStratumJob* pjob, vStratumJobs)
+        delete pjob;
+    vStratumJobs.clear();
+    BOOST_FOREACH(SOCKET hListenSocket, vhStratumListenSocket)
+        closesocket(hListenSocket);
+    vhStratumListenSocket.clear();
+}
+
+static void ThreadStratumServer(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadStratumServer(parg));
+    try
+    {
+        vnThreadsRunning[THREAD_STRATUM]++;
+        ThreadStratumServer2(parg);
+        vnThreadsRunning[THREAD_STRATUM]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_STRATUM]--;
+        PrintException(&e, "ThreadStratumServer()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_STRATUM]--;
+        PrintException(NULL, "ThreadStratumServer()");
+    }
+    printf("ThreadStratumServer exited\n");
+}
+
+void StartStratumServer()
+{
+    if (!CreateThread(ThreadStratumServer, NULL))
+        printf("Error: CreateThread(ThreadStratumServer) failed\n");
+}
@@ -0,0 +1,76 @@
+// Copyright (c) 2026 AumCoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef AUMCOIN_STRATUM_H
+#define AUMCOIN_STRATUM_H
+
+#include "main.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * Built-in stratum mining server.
+ *
+ * Miners keep one TCP connection open and receive "mining.notify" jobs as
+ * soon as the best chain or the memory pool changes, instead of polling
+ * getwork.  The coinbase is split around an extranonce so miners roll
+ * extranonce2 and rebuild the merkle root themselves; the node only checks
+ * submitted shares against the connection's difficulty and hands full
+ * solutions to ProcessBlock.
+ *
+ * Enabled with -stratum, listening on -stratumport.
+ */
+
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+
+/** One unit of work handed out with mining.notify */
+class CStratumJob
+{
+public:
+    std::string strJobId;
+    CBlock block;
+    CBlockIndex* pindexPrev;
+    std::vector<unsigned char> vchCoinbase1;
+    std::vector<unsigned char> vchCoinbase2;
+    std::vector<uint256> vMerkleBranch;
+    std::set<uint256> setSubmitted;
+
+    CStratumJob()
+    {
+        pindexPrev = NULL;
+    }
+
+    /** Split blockIn's coinbase around an extranonce placeholder and take
+     *  the merkle branch of the coinbase.  blockIn's coinbase scriptSig is
+     *  replaced. */
+    bool SetTemplate(const CBlock& blockIn, CBlockIndex* pindexPrevIn, const std::string& strJobIdIn);
+
+    /** Reassemble the coinbase a miner used from its extranonces */
+    bool BuildCoinbase(const std::vector<unsigned char>& vchExtraNonce1,
+                       const std::vector<unsigned char>& vchExtraNonce2,
+                       CTransaction& txCoinbaseRet) const;
+
+    /** Reconstruct the full block for a submitted share */
+    bool BuildBlock(const std::vector<unsigned char>& vchExtraNonce1,
+                    const std::vector<unsigned char>& vchExtraNonce2,
+                    unsigned int nTime, unsigned int nNonce, CBlock& blockRet) const;
+};
+
+/** Highest share difficulty a stratum worker can be given */
+static const double MAX_STRATUM_DIFFICULTY = 1e12;
+
+/** Share target for a stratum difficulty (scrypt difficulty 1 = 0x0000ffff...) */
+uint256 StratumDifficultyToTarget(double dDifficulty);
+
+/** Share difficulty for a worker that suggested dSuggested: no lower than
+ *  dMinimum (-stratumdifficulty), no higher than MAX_STRATUM_DIFFICULTY;
+ *  false if dSuggested isn't a finite number */
+bool StratumClampDifficulty(double dSuggested, double dMinimum, double& dRet);
+
+void StartStratumServer();
+
+#endif
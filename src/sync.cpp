@@ -8,6 +8,129 @@
 
 #include <boost/foreach.hpp>
 
+bool fLockStats = false;
+
+void CLockStats::SetNull()
+{
+    nAcquired = 0;
+    nContended = 0;
+    nWaitMicros = 0;
+    nMaxWaitMicros = 0;
+    nHoldMicros = 0;
+    nMaxHoldMicros = 0;
+    memset(vWaitBuckets, 0, sizeof(vWaitBuckets));
+}
+
+void CLockStats::Add(const CLockStats& stats)
+{
+    nAcquired += stats.nAcquired;
+    nContended += stats.nContended;
+    nWaitMicros += stats.nWaitMicros;
+    nMaxWaitMicros = std::max(nMaxWaitMicros, stats.nMaxWaitMicros);
+    nHoldMicros += stats.nHoldMicros;
+    nMaxHoldMicros = std::max(nMaxHoldMicros, stats.nMaxHoldMicros);
+    for (int i = 0; i < WAIT_BUCKETS; i++)
+        vWaitBuckets[i] += stats.vWaitBuckets[i];
+}
+
+/** The CLockStats of one lock.  Its own mutex only guards against
+ *  GetLockStats, as the lock it counts is held while it changes. */
+class CLockStatsEntry
+{
+public:
+    std::string strName;
+    CLockStats stats;
+    boost::mutex mutex;
+
+    CLockStatsEntry(const char* pszName) : strName(pszName) {}
+};
+
+/** Every lock that has kept stats, and what those that are gone kept */
+struct CLockStatsRegistry
+{
+    boost::mutex mutex;
+    std::set<CLockStatsEntry*> setEntries;
+    std::map<std::string, CLockStats> mapRetired;
+};
+
+static CLockStatsRegistry& GetLockStatsRegistry()
+{
+    // Never destroyed, as global locks may go away after it would be
+    static CLockStatsRegistry* pregistry = new CLockStatsRegistry();
+    return *pregistry;
+}
+
+int64_t GetLockStatsTime()
+{
+    return GetTimeMicros();
+}
+
+void LockStatsAcquired(CLockStatsEntry*& pstats, const char* pszName, int64_t nWaitMicros, bool fContended)
+{
+    if (!pstats)
+    {
+        pstats = new CLockStatsEntry(pszName);
+        CLockStatsRegistry& registry = GetLockStatsRegistry();
+        boost::lock_guard<boost::mutex> lock(registry.mutex);
+        registry.setEntries.insert(pstats);
+    }
+
+    int nBucket = 0;
+    for (int64_t n = nWaitMicros; n > 0 && nBucket < CLockStats::WAIT_BUCKETS - 1; n /= 10)
+        nBucket++;
+
+    boost::lock_guard<boost::mutex> lock(pstats->mutex);
+    CLockStats& stats = pstats->stats;
+    stats.nAcquired++;
+    if (fContended)
+        stats.nContended++;
+    stats.nWaitMicros += nWaitMicros;
+    stats.nMaxWaitMicros = std::max(stats.nMaxWaitMicros, nWaitMicros);
+    stats.vWaitBuckets[nBucket]++;
+}
+
+void LockStatsReleased(CLockStatsEntry* pstats, int64_t nHoldMicros)
+{
+    boost::lock_guard<boost::mutex> lock(pstats->mutex);
+    pstats->stats.nHoldMicros += nHoldMicros;
+    pstats->stats.nMaxHoldMicros = std::max(pstats->stats.nMaxHoldMicros, nHoldMicros);
+}
+
+void LockStatsRetired(CLockStatsEntry* pstats)
+{
+    CLockStatsRegistry& registry = GetLockStatsRegistry();
+    {
+        boost::lock_guard<boost::mutex> lock(registry.mutex);
+        registry.mapRetired[pstats->strName].Add(pstats->stats);
+        registry.setEntries.erase(pstats);
+    }
+    delete pstats;
+}
+
+void GetLockStats(std::map<std::string, CLockStats>& mapStatsRet)
+{
+    CLockStatsRegistry& registry = GetLockStatsRegistry();
+    boost::lock_guard<boost::mutex> lock(registry.mutex);
+    mapStatsRet = registry.mapRetired;
+    BOOST_FOREACH(CLockStatsEntry* pstats, registry.setEntries)
+    {
+        boost::lock_guard<boost::mutex> lockEntry(pstats->mutex);
+        mapStatsRet[pstats->strName].Add(pstats->stats);
+    }
+}
+
+void ResetLockStats()
+{
+    CLockStatsRegistry& registry = GetLockStatsRegistry();
+    boost::lock_guard<boost::mutex> lock(registry.mutex);
+    registry.mapRetired.clear();
+    BOOST_FOREACH(CLockStatsEntry* pstats, registry.setEntries)
+    {
+        boost::lock_guard<boost::mutex> lockEntry(pstats->mutex);
+        pstats->stats.SetNull();
+    }
+}
+
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 {
@@ -8,18 +8,70 @@
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
 
+#include <map>
+#include <string>
+#include <stdint.h>
 
+/** Keep CLockStats on every lock taken with LOCK (-lockstats) */
+extern bool fLockStats;
 
+/** How one named lock has been used while fLockStats was on */
+class CLockStats
+{
+public:
+    // Waits under 1us, 10us, 100us, 1ms, 10ms, 100ms, 1s, and longer
+    enum { WAIT_BUCKETS = 8 };
+
+    uint64_t nAcquired;
+    uint64_t nContended;
+    int64_t nWaitMicros;
+    int64_t nMaxWaitMicros;
+    int64_t nHoldMicros;
+    int64_t nMaxHoldMicros;
+    uint64_t vWaitBuckets[WAIT_BUCKETS];
+
+    CLockStats()
+    {
+        SetNull();
+    }
+
+    void SetNull();
+    void Add(const CLockStats& stats);
+};
+
+class CLockStatsEntry;
+
+/** Wrapped boost mutex that can keep CLockStats, under the name it was
+ *  first locked by with fLockStats on */
+template<typename Mutex>
+class CStatsMutex : public Mutex
+{
+public:
+    // Only touched with the mutex held, or when it is going away
+    CLockStatsEntry* pstats;
+
+    CStatsMutex() : pstats(NULL) {}
+    ~CStatsMutex();
+};
 
 /** Wrapped boost mutex: supports recursive locking, but no waiting  */
-typedef boost::recursive_mutex CCriticalSection;
+typedef CStatsMutex<boost::recursive_mutex> CCriticalSection;
+
+/** Cheaper than CCriticalSection, for hot locks that one thread never takes
+ *  twice; lock with FAST_LOCK */
+typedef CStatsMutex<boost::mutex> CFastCriticalSection;
 
 /** Wrapped boost mutex: supports waiting but not recursive locking */
 typedef boost::mutex CWaitableCriticalSection;
 
+/** Wrapped boost mutex: many readers at once, or one writer; neither may
+ *  lock it twice */
+typedef boost::shared_mutex CSharedCriticalSection;
+
 #ifdef DEBUG_LOCKORDER
 void EnterCritical(const char* pszName, const char* pszFile, int nLine, void* cs, bool fTry = false);
 void LeaveCritical();
@@ -32,12 +84,50 @@ void static inline LeaveCritical() {}
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+int64_t GetLockStatsTime();
+void LockStatsAcquired(CLockStatsEntry*& pstats, const char* pszName, int64_t nWaitMicros, bool fContended);
+void LockStatsReleased(CLockStatsEntry* pstats, int64_t nHoldMicros);
+void LockStatsRetired(CLockStatsEntry* pstats);
+void GetLockStats(std::map<std::string, CLockStats>& mapStatsRet);
+void ResetLockStats();
+
+template<typename Mutex>
+CStatsMutex<Mutex>::~CStatsMutex()
+{
+    if (pstats)
+        LockStatsRetired(pstats);
+}
+
 /** Wrapper around boost::interprocess::scoped_lock */
 template<typename Mutex>
 class CMutexLock
 {
 private:
     boost::unique_lock<Mutex> lock;
+    // When the lock was taken, if that was counted in its CLockStats
+    int64_t nTimeLocked;
+
+    void EnterWithStats(const char* pszName)
+    {
+        int64_t nTimeStart = 0;
+        if (!lock.try_lock())
+        {
+            nTimeStart = GetLockStatsTime();
+            lock.lock();
+        }
+        nTimeLocked = GetLockStatsTime();
+        LockStatsAcquired(lock.mutex()->pstats, pszName, nTimeStart ? nTimeLocked - nTimeStart : 0, nTimeStart != 0);
+    }
+
+    void LeaveWithStats()
+    {
+        if (nTimeLocked)
+        {
+            LockStatsReleased(lock.mutex()->pstats, GetLockStatsTime() - nTimeLocked);
+            nTimeLocked = 0;
+        }
+    }
+
 public:
 
     void Enter(const char* pszName, const char* pszFile, int nLine)
@@ -45,6 +135,11 @@ public:
         if (!lock.owns_lock())
         {
             EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
+            if (fLockStats)
+            {
+                EnterWithStats(pszName);
+                return;
+            }
 #ifdef DEBUG_LOCKCONTENTION
             if (!lock.try_lock())
             {
@@ -61,6 +156,7 @@ public:
     {
         if (lock.owns_lock())
         {
+            LeaveWithStats();
             lock.unlock();
             LeaveCritical();
         }
@@ -74,11 +170,16 @@ public:
             lock.try_lock();
             if (!lock.owns_lock())
                 LeaveCritical();
+            else if (fLockStats)
+            {
+                nTimeLocked = GetLockStatsTime();
+                LockStatsAcquired(lock.mutex()->pstats, pszName, 0, false);
+            }
         }
         return lock.owns_lock();
     }
 
-    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock)
+    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock), nTimeLocked(0)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -89,7 +190,10 @@ public:
     ~CMutexLock()
     {
         if (lock.owns_lock())
+        {
+            LeaveWithStats();
             LeaveCritical();
+        }
     }
 
     operator bool()
@@ -104,10 +208,14 @@ public:
 };
 
 typedef CMutexLock<CCriticalSection> CCriticalBlock;
+typedef CMutexLock<CFastCriticalSection> CFastCriticalBlock;
 
 #define LOCK(cs) CCriticalBlock criticalblock(cs, #cs, __FILE__, __LINE__)
 #define LOCK2(cs1,cs2) CCriticalBlock criticalblock1(cs1, #cs1, __FILE__, __LINE__),criticalblock2(cs2, #cs2, __FILE__, __LINE__)
 #define TRY_LOCK(cs,name) CCriticalBlock name(cs, #cs, __FILE__, __LINE__, true)
+#define FAST_LOCK(cs) CFastCriticalBlock criticalblock(cs, #cs, __FILE__, __LINE__)
+#define SHARED_LOCK(cs) boost::shared_lock<CSharedCriticalSection> sharedblock(cs)
+#define EXCLUSIVE_LOCK(cs) boost::unique_lock<CSharedCriticalSection> exclusiveblock(cs)
 
 #define ENTER_CRITICAL_SECTION(cs) \
     { \
@@ -0,0 +1,268 @@
+#include <boost/test/unit_test.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include "db.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockindex_tests)
+
+BOOST_AUTO_TEST_CASE(blockindex_hasher)
+{
+    // Hashes that only differ in their top bits still spread out
+    MapBlockIndex mapIndex;
+    for (uint64 i = 0; i < 20000; i++)
+        mapIndex.insert(make_pair(uint256(i) << 192, (CBlockIndex*)NULL));
+    for (int i = 0; i < 20000; i++)
+        mapIndex.insert(make_pair(GetRandHash(), (CBlockIndex*)NULL));
+    BOOST_CHECK_EQUAL(mapIndex.size(), 40000U);
+    size_t nMaxBucket = 0;
+    for (size_t i = 0; i < mapIndex.bucket_count(); i++)
+        nMaxBucket = max(nMaxBucket, mapIndex.bucket_size(i));
+    BOOST_CHECK(nMaxBucket <= 16);
+
+    CBlockIndexHasher hasher;
+    uint256 hash = GetRandHash();
+    BOOST_CHECK_EQUAL(hasher(hash), hasher(uint256(hash)));
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_arena)
+{
+    // Entries follow one another, except where a new chunk starts
+    CBlockIndex* pindexLast = new (AllocBlockIndex()) CBlockIndex();
+    int nAdjacent = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        CBlockIndex* pindex = new (AllocBlockIndex()) CBlockIndex();
+        if (pindex == pindexLast + 1)
+            nAdjacent++;
+        pindexLast = pindex;
+    }
+    BOOST_CHECK(nAdjacent >= 99);
+}
+
+// A new block index entry after pprev, with its skip pointer set
+static CBlockIndex* MakeBlockIndex(CBlockIndex* pprev, uint256* phash)
+{
+    *phash = GetRandHash();
+    CBlockIndex* pindex = new (AllocBlockIndex()) CBlockIndex();
+    pindex->phashBlock = phash;
+    pindex->pprev = pprev;
+    pindex->nHeight = pprev ? pprev->nHeight + 1 : 0;
+    pindex->BuildSkip();
+    return pindex;
+}
+
+// Exposes the hashes a locator picked
+class CTestLocator : public CBlockLocator
+{
+public:
+    explicit CTestLocator(const CBlockIndex* pindex) : CBlockLocator(pindex) {}
+    const vector<uint256>& GetHave() const { return vHave; }
+};
+
+// The locator of pindex as found by stepping back through pprev
+static vector<uint256> WalkLocator(const CBlockIndex* pindex)
+{
+    vector<uint256> vHave;
+    int nStep = 1;
+    while (pindex)
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int i = 0; pindex && i < nStep; i++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    vHave.push_back(hashGenesisBlock);
+    return vHave;
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_byheight)
+{
+    // A best chain of 1000 blocks and a branch of 20 off height 500
+    vector<uint256> vHashes(1020);
+    vector<CBlockIndex*> vChain;
+    for (int i = 0; i < 1020; i++)
+        vChain.push_back(MakeBlockIndex(i == 1000 ? vChain[500] : (i > 0 ? vChain[i - 1] : NULL), &vHashes[i]));
+
+    vector<CBlockIndex*> vSaved;
+    vSaved.swap(vBlockIndexByHeight);
+    vBlockIndexByHeight.assign(vChain.begin(), vChain.begin() + 1000);
+
+    for (int i = 0; i < 1000; i++)
+        BOOST_CHECK(FindBlockByHeight(i) == vChain[i]);
+    BOOST_CHECK(FindBlockByHeight(-1) == NULL);
+    BOOST_CHECK(FindBlockByHeight(1000) == NULL);
+
+    // Jumping along the best chain picks the same blocks as walking
+    const int vTips[] = { 0, 1, 11, 12, 999, 1000, 1010, 1019 };
+    BOOST_FOREACH(int nTip, vTips)
+        BOOST_CHECK(CTestLocator(vChain[nTip]).GetHave() == WalkLocator(vChain[nTip]));
+
+    vBlockIndexByHeight.swap(vSaved);
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_ancestor)
+{
+    // A chain of 50000 blocks and a branch of 1000 off height 30000
+    vector<uint256> vHashes(51000);
+    vector<CBlockIndex*> vChain;
+    for (int i = 0; i < 51000; i++)
+        vChain.push_back(MakeBlockIndex(i == 50000 ? vChain[30000] : (i > 0 ? vChain[i - 1] : NULL), &vHashes[i]));
+
+    for (int i = 1; i < 51000; i++)
+    {
+        BOOST_CHECK(vChain[i]->pskip != NULL);
+        BOOST_CHECK(vChain[i]->pskip->nHeight < vChain[i]->nHeight);
+    }
+
+    for (int i = 0; i < 1000; i++)
+    {
+        int nTip = GetRand(51000);
+        CBlockIndex* pindexTip = vChain[nTip];
+        int nHeight = GetRand(pindexTip->nHeight + 1);
+        int nExpected = (nTip >= 50000 && nHeight > 30000 ? nHeight - 30001 + 50000 : nHeight);
+        BOOST_CHECK(pindexTip->GetAncestor(nHeight) == vChain[nExpected]);
+        BOOST_CHECK(pindexTip->GetAncestor(pindexTip->nHeight) == pindexTip);
+    }
+    BOOST_CHECK(vChain[100]->GetAncestor(101) == NULL);
+    BOOST_CHECK(vChain[100]->GetAncestor(-1) == NULL);
+
+    BOOST_CHECK(LastCommonAncestor(vChain[50999], vChain[49999]) == vChain[30000]);
+    BOOST_CHECK(LastCommonAncestor(vChain[20000], vChain[50500]) == vChain[20000]);
+    BOOST_CHECK(LastCommonAncestor(vChain[50500], vChain[50999]) == vChain[50500]);
+    uint256 hashOther;
+    BOOST_CHECK(LastCommonAncestor(vChain[100], MakeBlockIndex(NULL, &hashOther)) == NULL);
+}
+
+// The fork point as Reorganize used to find it, one pprev at a time
+static CBlockIndex* WalkCommonAncestor(CBlockIndex* pfork, CBlockIndex* plonger)
+{
+    while (pfork != plonger)
+    {
+        while (plonger->nHeight > pfork->nHeight)
+            plonger = plonger->pprev;
+        if (pfork == plonger)
+            break;
+        pfork = pfork->pprev;
+    }
+    return pfork;
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_benchmark)
+{
+    // Locators and fork points on a branch off a long chain, by skip
+    // pointers and by walking; run with --log_level=message to see the
+    // timings
+    const int nChain = 200000, nBranch = 100;
+    vector<uint256> vHashes(nChain + nBranch);
+    vector<CBlockIndex*> vChain;
+    for (int i = 0; i < nChain + nBranch; i++)
+        vChain.push_back(MakeBlockIndex(i == nChain ? vChain[nChain / 2] : (i > 0 ? vChain[i - 1] : NULL), &vHashes[i]));
+    CBlockIndex* pindexBranch = vChain.back();
+    CBlockIndex* pindexTip = vChain[nChain - 1];
+
+    BOOST_CHECK(CTestLocator(pindexBranch).GetHave() == WalkLocator(pindexBranch));
+    int64 nStart = GetTimeMicros();
+    for (int i = 0; i < 100; i++)
+        CTestLocator locator(pindexBranch);
+    int64 nSkipLocator = GetTimeMicros() - nStart;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < 100; i++)
+        WalkLocator(pindexBranch);
+    int64 nWalkLocator = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(LastCommonAncestor(pindexTip, pindexBranch) == vChain[nChain / 2]);
+    int64 nSkipFork = GetTimeMicros() - nStart;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(WalkCommonAncestor(pindexTip, pindexBranch) == vChain[nChain / 2]);
+    int64 nWalkFork = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("%d blocks, branch of %d off the middle, 100 rounds: locator %"PRI64d"us -> %"PRI64d"us, fork point %"PRI64d"us -> %"PRI64d"us",
+        nChain, nBranch, nWalkLocator, nSkipLocator, nWalkFork, nSkipFork));
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_snapshot)
+{
+    MapBlockIndex mapSaved;
+    mapSaved.swap(mapBlockIndex);
+    CBlockIndex* pindexGenesisSaved = pindexGenesisBlock;
+    uint256 hashBestChainSaved = hashBestChain;
+
+    // A best chain of 300 blocks and a branch of 10 off height 200
+    vector<CBlockIndex*> vChain;
+    for (int i = 0; i < 310; i++)
+    {
+        CBlockIndex* pindex = new (AllocBlockIndex()) CBlockIndex();
+        pindex->phashBlock = &(mapBlockIndex.insert(make_pair(GetRandHash(), pindex)).first->first);
+        pindex->pprev = (i == 300 ? vChain[200] : (i > 0 ? vChain[i - 1] : NULL));
+        if (pindex->pprev && i < 300)
+            pindex->pprev->pnext = pindex;
+        pindex->nHeight = pindex->pprev ? pindex->pprev->nHeight + 1 : 0;
+        pindex->nFile = 1;
+        pindex->nBlockPos = i * 1000;
+        pindex->nVersion = 2;
+        pindex->hashMerkleRoot = GetRandHash();
+        pindex->nTime = 1300000000 + i;
+        pindex->nBits = 0x1e0ffff0;
+        pindex->nNonce = i * 7;
+        pindex->bnChainWork = (pindex->pprev ? pindex->pprev->bnChainWork : 0) + pindex->GetBlockWork();
+        vChain.push_back(pindex);
+    }
+    hashBestChain = vChain[299]->GetBlockHash();
+
+    boost::filesystem::path pathSnapshot = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CBlockIndexSnapshot snapshot(pathSnapshot);
+    BOOST_CHECK(snapshot.Write(1234));
+    MapBlockIndex mapWritten;
+    mapWritten.swap(mapBlockIndex);
+
+    // Only the snapshot the database points at is taken
+    BOOST_CHECK(!snapshot.Read(hashBestChain, 1235));
+    BOOST_CHECK(!snapshot.Read(vChain[298]->GetBlockHash(), 1234));
+    BOOST_CHECK(mapBlockIndex.empty());
+    BOOST_CHECK(snapshot.Read(hashBestChain, 1234));
+
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), 310U);
+    BOOST_FOREACH(const CBlockIndex* pindexWritten, vChain)
+    {
+        MapBlockIndex::iterator mi = mapBlockIndex.find(pindexWritten->GetBlockHash());
+        BOOST_REQUIRE(mi != mapBlockIndex.end());
+        const CBlockIndex* pindex = mi->second;
+        BOOST_CHECK(pindex->phashBlock == &mi->first);
+        BOOST_CHECK(pindex->pprev ? pindex->pprev->GetBlockHash() == pindexWritten->pprev->GetBlockHash() : !pindexWritten->pprev);
+        BOOST_CHECK(pindex->pnext ? pindex->pnext->GetBlockHash() == pindexWritten->pnext->GetBlockHash() : !pindexWritten->pnext);
+        BOOST_CHECK_EQUAL(pindex->nFile, pindexWritten->nFile);
+        BOOST_CHECK_EQUAL(pindex->nBlockPos, pindexWritten->nBlockPos);
+        BOOST_CHECK_EQUAL(pindex->nHeight, pindexWritten->nHeight);
+        BOOST_CHECK(pindex->bnChainWork == pindexWritten->bnChainWork);
+        BOOST_CHECK(pindex->GetBlockHeader().GetHash() == pindexWritten->GetBlockHeader().GetHash());
+        BOOST_CHECK(pindex->GetAncestor(0)->GetBlockHash() == vChain[0]->GetBlockHash());
+    }
+
+    // A damaged file is turned away and leaves the index empty
+    FILE* file = fopen(pathSnapshot.string().c_str(), "r+b");
+    BOOST_REQUIRE(file);
+    fseek(file, -5, SEEK_END);
+    int c = fgetc(file);
+    fseek(file, -5, SEEK_END);
+    fputc(c ^ 1, file);
+    fclose(file);
+    mapBlockIndex.clear();
+    BOOST_CHECK(!snapshot.Read(hashBestChain, 1234));
+    BOOST_CHECK(mapBlockIndex.empty());
+
+    boost::filesystem::remove(pathSnapshot);
+    mapBlockIndex.swap(mapSaved);
+    pindexGenesisBlock = pindexGenesisSaved;
+    hashBestChain = hashBestChainSaved;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
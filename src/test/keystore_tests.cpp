@@ -0,0 +1,136 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "keystore.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(keystore_tests)
+
+static CScript PayToKeyID(const CKeyID& keyID)
+{
+    CScript script;
+    script.SetDestination(keyID);
+    return script;
+}
+
+BOOST_AUTO_TEST_CASE(keystore_filter)
+{
+    // Enough keys to make the filter grow a few times
+    CBasicKeyStore keystore;
+    vector<CKey> vKeys(600);
+    BOOST_FOREACH(CKey& key, vKeys)
+    {
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+    }
+    CScript redeemScript;
+    redeemScript.SetMultisig(1, vector<CKey>(vKeys.begin(), vKeys.begin() + 2));
+    keystore.AddCScript(redeemScript);
+
+    // No false negatives for any template
+    BOOST_FOREACH(const CKey& key, vKeys)
+    {
+        CKeyID keyID = key.GetPubKey().GetID();
+        BOOST_CHECK(keystore.MayHave(keyID));
+        BOOST_CHECK(IsMine(keystore, PayToKeyID(keyID)));
+        BOOST_CHECK(IsMine(keystore, CScript() << key.GetPubKey() << OP_CHECKSIG));
+    }
+    CScript scriptP2SH;
+    scriptP2SH.SetDestination(redeemScript.GetID());
+    BOOST_CHECK(IsMine(keystore, scriptP2SH));
+    BOOST_CHECK(IsMine(keystore, redeemScript));
+
+    // Hashes we don't have are turned away by the filter nearly every time
+    int nFalsePositives = 0;
+    for (int i = 0; i < 10000; i++)
+    {
+        uint256 hashRand = GetRandHash();
+        uint160 hash;
+        memcpy(hash.begin(), hashRand.begin(), 20);
+        CKeyID keyID(hash);
+        if (keystore.MayHave(keyID))
+            nFalsePositives++;
+        BOOST_CHECK(!IsMine(keystore, PayToKeyID(keyID)));
+    }
+    BOOST_CHECK(nFalsePositives < 100);
+
+    // Scripts Solver can't match are rejected without it
+    BOOST_CHECK(!IsMine(keystore, CScript()));
+    BOOST_CHECK(!IsMine(keystore, CScript() << OP_TRUE));
+    BOOST_CHECK(!IsMine(keystore, CScript() << vector<unsigned char>(1952, 1) << OP_CHECKMLDSASIG));
+
+    // An empty keystore owns nothing
+    CBasicKeyStore emptykeystore;
+    BOOST_CHECK(!emptykeystore.MayHave(vKeys[0].GetPubKey().GetID()));
+    BOOST_CHECK(!IsMine(emptykeystore, PayToKeyID(vKeys[0].GetPubKey().GetID())));
+}
+
+BOOST_AUTO_TEST_CASE(keystore_filter_crypted)
+{
+    // Crypted keys are in the filter as well
+    CCryptoKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    vector<unsigned char> vchCryptedSecret(48, 0);
+    BOOST_CHECK(keystore.AddCryptedKey(key.GetPubKey(), vchCryptedSecret));
+    BOOST_CHECK(keystore.MayHave(key.GetPubKey().GetID()));
+    BOOST_CHECK(IsMine(keystore, PayToKeyID(key.GetPubKey().GetID())));
+}
+
+// Exposes the protected encryption calls CWallet normally makes
+class CTestCryptoKeyStore : public CCryptoKeyStore
+{
+public:
+    bool EncryptKeys(CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::EncryptKeys(vMasterKeyIn); }
+    bool Unlock(const CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::Unlock(vMasterKeyIn); }
+};
+
+BOOST_AUTO_TEST_CASE(keystore_encrypt_keys)
+{
+    CTestCryptoKeyStore keystore;
+    vector<CKey> vKeys(300);
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+    {
+        vKeys[i].MakeNewKey(i % 2 == 0);
+        keystore.AddKey(vKeys[i]);
+    }
+
+    CKeyingMaterial vMasterKey(WALLET_CRYPTO_KEY_SIZE, 0x42);
+    BOOST_CHECK(keystore.EncryptKeys(vMasterKey));
+    BOOST_CHECK(keystore.IsCrypted());
+    BOOST_CHECK(!keystore.EncryptKeys(vMasterKey));
+    BOOST_CHECK(keystore.IsLocked());
+    BOOST_CHECK(keystore.Unlock(vMasterKey));
+
+    // Every key comes back as it was, the second time from the cache
+    for (int nPass = 0; nPass < 2; nPass++)
+    {
+        BOOST_FOREACH(const CKey& key, vKeys)
+        {
+            CKey keyOut;
+            BOOST_CHECK(keystore.GetKey(key.GetPubKey().GetID(), keyOut));
+            BOOST_CHECK(keyOut.GetPubKey() == key.GetPubKey());
+            bool fCompressed, fCompressedOut;
+            BOOST_CHECK(keyOut.GetSecret(fCompressedOut) == key.GetSecret(fCompressed));
+            BOOST_CHECK_EQUAL(fCompressedOut, fCompressed);
+        }
+    }
+
+    // Locking forgets the decrypted keys
+    CKey keyOut;
+    BOOST_CHECK(keystore.Lock());
+    BOOST_CHECK(!keystore.GetKey(vKeys[0].GetPubKey().GetID(), keyOut));
+    BOOST_CHECK(keystore.HaveKey(vKeys[0].GetPubKey().GetID()));
+
+    CKeyingMaterial vWrongKey(WALLET_CRYPTO_KEY_SIZE, 0x43);
+    BOOST_CHECK(!keystore.Unlock(vWrongKey));
+    BOOST_CHECK(keystore.IsLocked());
+    BOOST_CHECK(keystore.Unlock(vMasterKey));
+    BOOST_CHECK(keystore.GetKey(vKeys[1].GetPubKey().GetID(), keyOut));
+    BOOST_CHECK(keyOut.GetPubKey() == vKeys[1].GetPubKey());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
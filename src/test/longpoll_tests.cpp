@@ -0,0 +1,111 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+
+#include "main.h"
+
+BOOST_AUTO_TEST_SUITE(longpoll_tests)
+
+// Waiters are called on the notifying thread, so each check below can look
+// at the flag straight after the change that should (or shouldn't) set it
+static void LongPollDone(bool* pfDone)
+{
+    *pfDone = true;
+}
+
+static CTransaction MakeTx()
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    tx.vout[0].nValue = COIN;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(longpoll_fee_delta)
+{
+    mapArgs["-longpollfeedelta"] = "1";
+    std::string strLongPollId = GetTemplateLongPollId();
+
+    bool fDone = false;
+    uint64 nWaiter;
+    BOOST_CHECK(NotifyOnTemplateChange(strLongPollId, boost::bind(&LongPollDone, &fDone), nWaiter));
+    BOOST_CHECK(nWaiter != 0);
+    BOOST_CHECK(!fDone);
+
+    // Not enough new fees yet: the waiter stays parked
+    CTransaction tx1 = MakeTx();
+    mempool.addUnchecked(tx1, COIN / 2);
+    BOOST_CHECK(!fDone);
+
+    CTransaction tx2 = MakeTx();
+    mempool.addUnchecked(tx2, COIN / 2);
+    BOOST_CHECK(fDone);
+    BOOST_CHECK(GetTemplateLongPollId() != strLongPollId);
+    BOOST_CHECK_EQUAL(GetTemplateWaiterCount(), 0U);
+
+    mempool.remove(tx1);
+    mempool.remove(tx2);
+    mapArgs.erase("-longpollfeedelta");
+}
+
+BOOST_AUTO_TEST_CASE(longpoll_stale_id)
+{
+    // An id for another best chain is answered at once
+    std::string strLongPollId = GetTemplateLongPollId();
+    strLongPollId[0] = (strLongPollId[0] == '1' ? '2' : '1');
+    bool fDone = false;
+    uint64 nWaiter;
+    BOOST_CHECK(NotifyOnTemplateChange(strLongPollId, boost::bind(&LongPollDone, &fDone), nWaiter));
+    BOOST_CHECK(fDone);
+    BOOST_CHECK_EQUAL(nWaiter, 0U);
+
+    // Malformed ids are refused without a call
+    fDone = false;
+    BOOST_CHECK(!NotifyOnTemplateChange("", boost::bind(&LongPollDone, &fDone), nWaiter));
+    BOOST_CHECK(!NotifyOnTemplateChange("1234", boost::bind(&LongPollDone, &fDone), nWaiter));
+    BOOST_CHECK(!fDone);
+    BOOST_CHECK_EQUAL(GetTemplateWaiterCount(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(longpoll_cancel)
+{
+    // A poll that timed out (or whose client left) takes its waiter with
+    // it, however often the client polls again
+    mapArgs["-longpollfeedelta"] = "1";
+    bool fDone = false;
+    for (int i = 0; i < 10; i++)
+    {
+        uint64 nWaiter;
+        BOOST_CHECK(NotifyOnTemplateChange(GetTemplateLongPollId(), boost::bind(&LongPollDone, &fDone), nWaiter));
+        BOOST_CHECK_EQUAL(GetTemplateWaiterCount(), 1U);
+        CancelTemplateWaiter(nWaiter);
+        BOOST_CHECK_EQUAL(GetTemplateWaiterCount(), 0U);
+        // Cancelling again, as after a wake, does nothing
+        CancelTemplateWaiter(nWaiter);
+    }
+
+    // Cancelled waiters are not called
+    CTransaction tx = MakeTx();
+    mempool.addUnchecked(tx, COIN);
+    BOOST_CHECK(!fDone);
+
+    // Only the waiter asked for goes
+    bool fKept = false;
+    uint64 nWaiterKept, nWaiterGone;
+    BOOST_CHECK(NotifyOnTemplateChange(GetTemplateLongPollId(), boost::bind(&LongPollDone, &fKept), nWaiterKept));
+    BOOST_CHECK(NotifyOnTemplateChange(GetTemplateLongPollId(), boost::bind(&LongPollDone, &fDone), nWaiterGone));
+    CancelTemplateWaiter(nWaiterGone);
+    BOOST_CHECK_EQUAL(GetTemplateWaiterCount(), 1U);
+    NotifyTemplateChange();
+    BOOST_CHECK(fKept);
+    BOOST_CHECK(!fDone);
+    BOOST_CHECK_EQUAL(GetTemplateWaiterCount(), 0U);
+
+    mempool.remove(tx);
+    mapArgs.erase("-longpollfeedelta");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,9 +1,13 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
 
 #include "base58.h"
 #include "util.h"
+#include "main.h"
 #include "bitcoinrpc.h"
+#include "rpcjson.h"
 
 using namespace std;
 using namespace json_spirit;
@@ -66,4 +70,287 @@ BOOST_FIXTURE_TEST_CASE(rpc_addmultisig, TestNetFixture)
     BOOST_CHECK_THROW(addmultisig(createArgs(2, short2.c_str()), false), runtime_error);
 }
 
+class CStringRPCStream : public CRPCStream
+{
+public:
+    string str;
+    int nWrites;
+    int nMaxTxPerWrite;
+
+    CStringRPCStream() { nWrites = 0; nMaxTxPerWrite = 0; }
+    void Write(const string& s)
+    {
+        str += s;
+        nWrites++;
+        int nTx = 0;
+        for (size_t pos = s.find("\"txid\""); pos != string::npos; pos = s.find("\"txid\"", pos + 1))
+            nTx++;
+        nMaxTxPerWrite = max(nMaxTxPerWrite, nTx);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(rpc_getblock_stream)
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.nTime = 1317972665;
+    block.nBits = 0x1e0ffff0;
+    block.nNonce = 2084524493;
+    for (int i = 0; i < 20; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        if (i == 0)
+            tx.vin[0].scriptSig = CScript() << 486604799 << CBigNum(4);
+        else
+        {
+            tx.vin[0].prevout.hash = GetRandHash();
+            tx.vin[0].prevout.n = i;
+            tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72, i);
+        }
+        tx.vout.resize(2);
+        tx.vout[0].scriptPubKey.SetDestination(CKeyID(uint160(i)));
+        tx.vout[0].nValue = i * COIN;
+        tx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+        tx.vout[1].nValue = 12345678;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    uint256 hashPrev = GetRandHash();
+    CBlockIndex indexPrev;
+    indexPrev.phashBlock = &hashPrev;
+    CBlockIndex index(0, 0, block);
+    index.nHeight = 7;
+    index.pprev = &indexPrev;
+
+    const char* vDecompose[][2] = {
+        { NULL, NULL }, { "no", NULL }, { "hash", NULL }, { "hex", NULL },
+        { "obj", NULL }, { "obj", "no" }, { "obj", "hex" },
+    };
+    for (unsigned int i = 0; i < sizeof(vDecompose) / sizeof(vDecompose[0]); i++)
+    {
+        Object decompositions;
+        if (vDecompose[i][0])
+            decompositions.push_back(Pair("tx", vDecompose[i][0]));
+        if (vDecompose[i][1])
+            decompositions.push_back(Pair("script", vDecompose[i][1]));
+
+        CStringRPCStream stream;
+        blockToJSON(block, &index, decompositions, stream);
+        BOOST_CHECK_EQUAL(stream.str, write_string(Value(blockToJSON(block, &index, decompositions)), false));
+        BOOST_CHECK(stream.nWrites > 2);
+
+        // Transactions as objects go out one at a time, as they are made
+        if (vDecompose[i][0] && string(vDecompose[i][0]) == "obj")
+        {
+            BOOST_CHECK(stream.nWrites >= (int)block.vtx.size());
+            BOOST_CHECK_EQUAL(stream.nMaxTxPerWrite, 1);
+        }
+    }
+
+    // Transactions as objects are made as they are written, not held from
+    // when the writer gathered under the locks: addresses come out in the
+    // network's form at write time
+    {
+        Object decompositions;
+        decompositions.push_back(Pair("tx", "obj"));
+        decompositions.push_back(Pair("script", "obj"));
+        CBlock blockTaken(block);
+        boost::shared_ptr<CRPCStreamedResult> writer = blockJSONWriter(blockTaken, &index, decompositions);
+        BOOST_CHECK(blockTaken.vtx.empty());
+        string strMain = write_string(Value(blockToJSON(block, &index, decompositions)), false);
+        fTestNet = true;
+        CStringRPCStream stream;
+        writer->Write(stream);
+        string strTest = write_string(Value(blockToJSON(block, &index, decompositions)), false);
+        fTestNet = false;
+        BOOST_CHECK(strTest != strMain);
+        BOOST_CHECK_EQUAL(stream.str, strTest);
+        BOOST_CHECK_EQUAL(stream.nMaxTxPerWrite, 1);
+    }
+
+    // Bad decompositions fail before anything is written
+    Object decompositions;
+    decompositions.push_back(Pair("tx", "obj"));
+    decompositions.push_back(Pair("script", "hash"));
+    CStringRPCStream stream;
+    BOOST_CHECK_THROW(blockToJSON(block, &index, decompositions, stream), Object);
+    BOOST_CHECK(stream.str.empty());
+}
+
+// Holds cs_main until released; *pfLocked is cleared before cs_main is,
+// and a minute's safety bound keeps a call that does wait from hanging
+static void HoldMainLock(bool* pfLocked, bool* pfRelease)
+{
+    LOCK(cs_main);
+    *pfLocked = true;
+    for (int i = 0; i < 60000 && !*pfRelease; i++)
+        Sleep(1);
+    *pfLocked = false;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_chainonly)
+{
+    // Calls that only read the chain don't wait for cs_main: they return
+    // while the other thread still holds it
+    bool fLocked = false, fRelease = false;
+    boost::thread thread(HoldMainLock, &fLocked, &fRelease);
+    while (!fLocked)
+        Sleep(1);
+    Value v;
+    BOOST_CHECK_NO_THROW(v = tableRPC.execute("getblockcount", Array()));
+    BOOST_CHECK_EQUAL(v.get_int(), nBestHeight);
+    BOOST_CHECK_NO_THROW(tableRPC.execute("getrpcstats", Array()));
+    BOOST_CHECK(fLocked);
+    {
+        TRY_LOCK(cs_main, lockMain);
+        BOOST_CHECK(!lockMain);
+    }
+    fRelease = true;
+    thread.join();
+}
+
+static void FlipBestChain(CBlockIndex* pindexA, CBlockIndex* pindexB, int nTimes)
+{
+    for (int i = 0; i < nTimes; i++)
+    {
+        LOCK(cs_main);
+        SetBestChainTip(i % 2 ? pindexB : pindexA);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rpc_chainstate_reorg)
+{
+    // A trunk of 10 blocks, a light branch A up to height 29 and a heavier
+    // but shorter branch B up to height 14
+    vector<uint256> vHashes(40);
+    vector<CBlockIndex*> vIndex;
+    CBlockIndex* pindexFork = NULL;
+    CBlockIndex* pindexA = NULL;
+    CBlockIndex* pindexB = NULL;
+    for (int i = 0; i < 35; i++)
+    {
+        CBlockIndex* pindex = new CBlockIndex();
+        vHashes[i] = GetRandHash();
+        pindex->phashBlock = &vHashes[i];
+        pindex->pprev = (i == 30 ? pindexFork : (i > 0 ? vIndex.back() : NULL));
+        pindex->nHeight = pindex->pprev ? pindex->pprev->nHeight + 1 : 0;
+        pindex->bnChainWork = (pindex->pprev ? pindex->pprev->bnChainWork : 0) + (i >= 30 ? 100 : 1);
+        vIndex.push_back(pindex);
+        if (i == 9)
+            pindexFork = pindex;
+        if (i == 29)
+            pindexA = pindex;
+    }
+    pindexB = vIndex.back();
+    BOOST_CHECK_EQUAL(pindexB->nHeight, 14);
+
+    vector<CBlockIndex*> vSaved;
+    CBlockIndex* pindexSaved;
+    {
+        LOCK(cs_main);
+        vSaved = vBlockIndexByHeight;
+        pindexSaved = pindexBest;
+        SetBestChainTip(pindexA);
+    }
+
+    // Readers never see the links of one branch with the tip of the other
+    boost::thread thread(FlipBestChain, pindexA, pindexB, 2000);
+    bool fDone = false;
+    while (!fDone)
+    {
+        fDone = thread.timed_join(boost::posix_time::milliseconds(0));
+        SHARED_LOCK(cs_chainstate);
+        BOOST_REQUIRE(pindexBest == pindexA || pindexBest == pindexB);
+        BOOST_REQUIRE_EQUAL(nBestHeight, pindexBest->nHeight);
+        BOOST_REQUIRE(hashBestChain == pindexBest->GetBlockHash());
+        BOOST_REQUIRE(bnBestChainWork == pindexBest->bnChainWork);
+        BOOST_REQUIRE_EQUAL(vBlockIndexByHeight.size(), (size_t)nBestHeight + 1);
+        BOOST_REQUIRE(vBlockIndexByHeight.back() == pindexBest);
+        BOOST_REQUIRE(pindexBest->pnext == NULL);
+        BOOST_REQUIRE(pindexFork->pnext == vBlockIndexByHeight[pindexFork->nHeight + 1]);
+    }
+
+    // Ends on B: the heights past it are gone and A no longer links on
+    BOOST_CHECK(pindexBest == pindexB);
+    Value v;
+    BOOST_CHECK_NO_THROW(v = tableRPC.execute("getblockcount", Array()));
+    BOOST_CHECK_EQUAL(v.get_int(), 14);
+    Array params;
+    params.push_back(14);
+    BOOST_CHECK_NO_THROW(v = tableRPC.execute("getblockhash", params));
+    BOOST_CHECK_EQUAL(v.get_str(), pindexB->GetBlockHash().GetHex());
+    params[0] = 15;
+    BOOST_CHECK_THROW(tableRPC.execute("getblockhash", params), Object);
+    BOOST_CHECK(pindexFork->pnext == vIndex[30]);
+    BOOST_CHECK(vIndex[10]->pnext == NULL);
+
+    {
+        LOCK(cs_main);
+        if (pindexSaved)
+            SetBestChainTip(pindexSaved);
+        else
+        {
+            EXCLUSIVE_LOCK(cs_chainstate);
+            BOOST_FOREACH(CBlockIndex* pindex, vBlockIndexByHeight)
+                pindex->pnext = NULL;
+            vBlockIndexByHeight.clear();
+            pindexBest = NULL;
+            nBestHeight = -1;
+            hashBestChain = 0;
+            bnBestChainWork = 0;
+        }
+        BOOST_CHECK(vBlockIndexByHeight == vSaved);
+    }
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        delete pindex;
+}
+
+extern void ThreadRPCServer3(void* parg);
+
+static void BatchReplied(string* pstrReply, bool* pfReplied, const string& strReply)
+{
+    *pstrReply = strReply;
+    *pfReplied = true;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_batch_over_queue)
+{
+    // More read-only calls than -rpcworkqueue (64) holds: the calls the
+    // queue has no room for run on the calling thread, none are refused
+    boost::thread worker(ThreadRPCServer3, (void*)NULL);
+    Array vReq;
+    for (int i = 0; i < 100; i++)
+    {
+        Object req;
+        req.push_back(Pair("method", "getblockcount"));
+        req.push_back(Pair("params", Array()));
+        req.push_back(Pair("id", i));
+        vReq.push_back(req);
+    }
+    string strReply;
+    bool fReplied = false;
+    JSONRPCExecBatch(vReq, boost::bind(&BatchReplied, &strReply, &fReplied, _1));
+    for (int i = 0; i < 60000 && !fReplied; i++)
+        Sleep(1);
+    fShutdown = true;
+    worker.join();
+    fShutdown = false;
+
+    BOOST_REQUIRE(fReplied);
+    Value valReply;
+    BOOST_REQUIRE(ReadJSON(strReply, valReply));
+    BOOST_REQUIRE(valReply.type() == array_type);
+    const Array& vReply = valReply.get_array();
+    BOOST_REQUIRE_EQUAL(vReply.size(), vReq.size());
+    for (unsigned int i = 0; i < vReply.size(); i++)
+    {
+        const Object& reply = vReply[i].get_obj();
+        BOOST_CHECK(find_value(reply, "error").type() == null_type);
+        BOOST_CHECK_EQUAL(find_value(reply, "result").get_int(), nBestHeight);
+        BOOST_CHECK_EQUAL(find_value(reply, "id").get_int(), (int)i);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,223 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "rpcjson.h"
+#include "bitcoinrpc.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+BOOST_AUTO_TEST_SUITE(rpcjson_tests)
+
+static Value Amount(int64 n)
+{
+    return (double)n / (double)COIN;
+}
+
+// Shaped like getblock with decompositions {"tx":"obj","script":"obj"}
+static Value MakeBlockPayload(int nTx)
+{
+    Object block;
+    block.push_back(Pair("hash", GetRandHash().GetHex()));
+    block.push_back(Pair("confirmations", 12));
+    block.push_back(Pair("size", 123456));
+    block.push_back(Pair("height", 210000));
+    block.push_back(Pair("difficulty", 1234.56789012));
+    Array txs;
+    for (int i = 0; i < nTx; i++)
+    {
+        Object tx;
+        tx.push_back(Pair("txid", GetRandHash().GetHex()));
+        tx.push_back(Pair("version", 1));
+        tx.push_back(Pair("locktime", (boost::int64_t)0));
+        Array vin;
+        for (int j = 0; j < 2; j++)
+        {
+            Object in, prevout, scriptSig;
+            prevout.push_back(Pair("hash", GetRandHash().GetHex()));
+            prevout.push_back(Pair("n", (boost::int64_t)j));
+            in.push_back(Pair("prevout", prevout));
+            scriptSig.push_back(Pair("asm", "3045022100" + GetRandHash().GetHex() + " 02" + GetRandHash().GetHex()));
+            scriptSig.push_back(Pair("hex", "483045022100" + GetRandHash().GetHex() + GetRandHash().GetHex()));
+            in.push_back(Pair("scriptSig", scriptSig));
+            in.push_back(Pair("sequence", (boost::int64_t)4294967295U));
+            vin.push_back(in);
+        }
+        tx.push_back(Pair("vin", vin));
+        Array vout;
+        for (int j = 0; j < 2; j++)
+        {
+            Object out, scriptPubKey;
+            out.push_back(Pair("value", Amount(GetRand(2100000000000000LL))));
+            scriptPubKey.push_back(Pair("asm", "OP_DUP OP_HASH160 " + GetRandHash().GetHex().substr(24) + " OP_EQUALVERIFY OP_CHECKSIG"));
+            scriptPubKey.push_back(Pair("reqSigs", 1));
+            scriptPubKey.push_back(Pair("type", "pubkeyhash"));
+            Array addresses;
+            addresses.push_back("LKSu6Kg3wSZPu1m5qnR3cJvV2ZVdGmKGwS");
+            scriptPubKey.push_back(Pair("addresses", addresses));
+            out.push_back(Pair("scriptPubKey", scriptPubKey));
+            vout.push_back(out);
+        }
+        tx.push_back(Pair("vout", vout));
+        txs.push_back(tx);
+    }
+    block.push_back(Pair("tx", txs));
+    return block;
+}
+
+// Shaped like listtransactions
+static Value MakeListPayload(int nTx)
+{
+    Array list;
+    for (int i = 0; i < nTx; i++)
+    {
+        Object entry;
+        entry.push_back(Pair("account", strprintf("account \"%d\"\t\xc3\xa9", i % 7)));
+        entry.push_back(Pair("address", "LKSu6Kg3wSZPu1m5qnR3cJvV2ZVdGmKGwS"));
+        entry.push_back(Pair("category", i % 3 ? "receive" : "send"));
+        entry.push_back(Pair("amount", Amount((i % 3 ? 1 : -1) * GetRand(100 * COIN))));
+        if (i % 3 == 0)
+            entry.push_back(Pair("fee", Amount(-100000)));
+        entry.push_back(Pair("confirmations", i));
+        entry.push_back(Pair("generated", i % 11 == 0));
+        entry.push_back(Pair("blockhash", GetRandHash().GetHex()));
+        entry.push_back(Pair("blockindex", i % 40));
+        entry.push_back(Pair("txid", GetRandHash().GetHex()));
+        entry.push_back(Pair("time", (boost::int64_t)1317972665 + i));
+        entry.push_back(Pair("comment", Value::null));
+        list.push_back(entry);
+    }
+    return list;
+}
+
+BOOST_AUTO_TEST_CASE(rpcjson_write)
+{
+    // Every byte value, escaped or not as json_spirit does it
+    for (int c = 0; c < 256; c++)
+    {
+        Value v(string(1, (char)c) + "x");
+        BOOST_CHECK_EQUAL(WriteJSON(v), write_string(v, false));
+    }
+
+    Array values;
+    values.push_back(Value::null);
+    values.push_back(true);
+    values.push_back(false);
+    values.push_back(0);
+    values.push_back(-1);
+    values.push_back((boost::int64_t)0x7FFFFFFFFFFFFFFFLL);
+    values.push_back((boost::int64_t)(-0x7FFFFFFFFFFFFFFFLL - 1));
+    values.push_back((boost::uint64_t)0xFFFFFFFFFFFFFFFFULL);
+    values.push_back(0.0);
+    values.push_back(-0.5);
+    values.push_back(Amount(1));
+    values.push_back(Amount(-123456789));
+    values.push_back(Amount(21000000 * COIN));
+    values.push_back(1e300);
+    values.push_back("");
+    values.push_back(Object());
+    values.push_back(Array());
+    values.push_back(MakeListPayload(5));
+    values.push_back(MakeBlockPayload(2));
+    BOOST_FOREACH(const Value& v, values)
+    {
+        BOOST_CHECK_EQUAL(WriteJSON(v), write_string(v, false));
+        BOOST_CHECK_EQUAL(WriteJSON(v, true), write_string(v, true));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rpcjson_read)
+{
+    const char* vstrGood[] = {
+        "null", "true", "false", " \t\r\n 1 ", "-1", "+7", "0", "1.5", "-0.00000001", "1e3", "2E-2", ".5", "1.",
+        "9223372036854775807", "9223372036854775808", "18446744073709551615", "-9223372036854775808",
+        "\"\"", "\"a\\\"b\\\\c\\/d\\b\\f\\n\\r\\t\"", "\"\\x41\\x7a\"", "\"\\u00e9\\u0041\"", "\"\\q\"", "\"caf\xc3\xa9\"",
+        "[]", "{}", "[1,2,[3,[4]],{\"a\":{}}]", " { \"a\" : 1 , \"b\" : [ true , null ] } ",
+        "{\"method\":\"getblock\",\"params\":[\"00ff\",{\"tx\":\"obj\"}],\"id\":\"x\"}",
+        "{\"a\":1,\"a\":2}", "[1] trailing", "truex",
+    };
+    for (unsigned int i = 0; i < sizeof(vstrGood) / sizeof(vstrGood[0]); i++)
+    {
+        Value vOld, vNew;
+        BOOST_CHECK_MESSAGE(read_string(string(vstrGood[i]), vOld), vstrGood[i]);
+        BOOST_CHECK_MESSAGE(ReadJSON(vstrGood[i], vNew), vstrGood[i]);
+        BOOST_CHECK_MESSAGE(vOld == vNew && vOld.is_uint64() == vNew.is_uint64(), vstrGood[i]);
+    }
+
+    const char* vstrBad[] = {
+        "", " ", "[", "[1,", "[1 2]", "{\"a\" 1}", "{\"a\":}", "{a:1}", "tru", "-", "\"abc",
+        "18446744073709551616", "-9223372036854775809",
+    };
+    for (unsigned int i = 0; i < sizeof(vstrBad) / sizeof(vstrBad[0]); i++)
+    {
+        Value vOld, vNew;
+        BOOST_CHECK_MESSAGE(!read_string(string(vstrBad[i]), vOld), vstrBad[i]);
+        BOOST_CHECK_MESSAGE(!ReadJSON(vstrBad[i], vNew), vstrBad[i]);
+    }
+
+    // Where malformed input is read differently from json_spirit (see rpcjson.h)
+    const char* vstrBadEscape[] = { "\"\\u12\"", "\"\\u\"", "\"\\u12zz\"", "\"\\x4\"", "\"\\x4g\"" };
+    for (unsigned int i = 0; i < sizeof(vstrBadEscape) / sizeof(vstrBadEscape[0]); i++)
+    {
+        Value vOld, vNew;
+        BOOST_CHECK_MESSAGE(read_string(string(vstrBadEscape[i]), vOld), vstrBadEscape[i]);
+        BOOST_CHECK_MESSAGE(!ReadJSON(vstrBadEscape[i], vNew), vstrBadEscape[i]);
+    }
+    Value vReal;
+    BOOST_CHECK(ReadJSON("1.e", vReal) && vReal.type() == real_type && vReal.get_real() == 1.0);
+    BOOST_CHECK(ReadJSON("1.5e", vReal) && vReal.type() == real_type && vReal.get_real() == 1.5);
+    BOOST_CHECK(!ReadJSON("[1.e]", vReal));
+
+    // Non-ASCII bytes are written as \u00XX and read back as the same bytes
+    Value v;
+    BOOST_CHECK(ReadJSON(WriteJSON(Value("caf\xc3\xa9")), v));
+    BOOST_CHECK_EQUAL(v.get_str(), "caf\xc3\xa9");
+
+    // Deep nesting is refused rather than recursing without bound
+    BOOST_CHECK(ReadJSON(string(MAX_JSON_DEPTH, '[') + string(MAX_JSON_DEPTH, ']'), v));
+    BOOST_CHECK(!ReadJSON(string(100000, '['), v));
+}
+
+static void Benchmark(const char* pszName, const Value& value)
+{
+    string strOld = write_string(value, false);
+    int64 nStart = GetTimeMicros();
+    for (int i = 0; i < 3; i++)
+        strOld = write_string(value, false);
+    int64 nOldWrite = GetTimeMicros() - nStart;
+
+    string strNew;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < 3; i++)
+        strNew = WriteJSON(value);
+    int64 nNewWrite = GetTimeMicros() - nStart;
+    BOOST_CHECK(strOld == strNew);
+
+    Value vOld, vNew;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(read_string(strOld, vOld));
+    int64 nOldRead = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(ReadJSON(strNew, vNew));
+    int64 nNewRead = GetTimeMicros() - nStart;
+    // json_spirit may be an ulp off on reals, so compare the text
+    BOOST_CHECK(WriteJSON(vNew) == strOld);
+    BOOST_CHECK(WriteJSON(vOld) == strOld);
+
+    BOOST_TEST_MESSAGE(strprintf("%s (%u bytes, 3 rounds): write %"PRI64d"us -> %"PRI64d"us, read %"PRI64d"us -> %"PRI64d"us",
+        pszName, (unsigned int)strOld.size(), nOldWrite, nNewWrite, nOldRead, nNewRead));
+}
+
+BOOST_AUTO_TEST_CASE(rpcjson_benchmark)
+{
+    // Round-trips big payloads through json_spirit and the new code; run
+    // with --log_level=message to see the timings
+    Benchmark("getblock", MakeBlockPayload(2000));
+    Benchmark("listtransactions", MakeListPayload(10000));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
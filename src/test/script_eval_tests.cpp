@@ -0,0 +1,1427 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "script.h"
+#include "bignum.h"
+#include "util.h"
+
+using namespace std;
+
+// Checks the interpreter against a copy of EvalScript as it was before stack
+// values became views into the script and an arena, on random scripts.
+
+extern bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+extern bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                         bool fValidatePayToScriptHash, int nHashType);
+
+typedef vector<unsigned char> valtype;
+extern CBigNum CastToBigNum(const valtype& vch);
+extern bool CastToBool(const valtype& vch);
+extern void MakeSameSize(valtype& vch1, valtype& vch2);
+
+static const valtype vchFalse(0);
+static const valtype vchTrue(1, 1);
+static const CBigNum bnZero(0);
+static const CBigNum bnOne(1);
+static const int nMaxBigNumBits = 4096;
+
+#define stacktop(i)  (stack.at(stack.size()+(i)))
+#define altstacktop(i)  (altstack.at(altstack.size()+(i)))
+static inline void popstack(vector<valtype>& stack)
+{
+    if (stack.empty())
+        throw runtime_error("popstack() : stack empty");
+    stack.pop_back();
+}
+
+static bool ReferenceEvalScript(vector<valtype>& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    CAutoBN_CTX pctx;
+    CScript::const_iterator pc = script.begin();
+    CScript::const_iterator pend = script.end();
+    CScript::const_iterator pbegincodehash = script.begin();
+    opcodetype opcode;
+    valtype vchPushValue;
+    vector<bool> vfExec;
+    vector<valtype> altstack;
+    int nOpCount = 0;
+
+
+    try
+    {
+        while (pc < pend)
+        {
+            bool fExec = !count(vfExec.begin(), vfExec.end(), false);
+
+            //
+            // Read instruction
+            //
+            if (!script.GetOp(pc, opcode, vchPushValue))
+                return false;
+            // SATOSHI VISION: Increased push value size from 520 bytes to 10KB
+            if (vchPushValue.size() > 10240)
+                return false;
+            if (opcode > OP_16 && ++nOpCount > 201)
+                return false;
+
+            if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4)
+                stack.push_back(vchPushValue);
+            else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
+            switch (opcode)
+            {
+                //
+                // Push value
+                //
+                case OP_1NEGATE:
+                case OP_1:
+                case OP_2:
+                case OP_3:
+                case OP_4:
+                case OP_5:
+                case OP_6:
+                case OP_7:
+                case OP_8:
+                case OP_9:
+                case OP_10:
+                case OP_11:
+                case OP_12:
+                case OP_13:
+                case OP_14:
+                case OP_15:
+                case OP_16:
+                {
+                    // ( -- value)
+                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
+                    stack.push_back(bn.getvch());
+                }
+                break;
+
+
+                //
+                // Control
+                //
+                case OP_NOP:
+                case OP_NOP1: case OP_NOP2: case OP_NOP3:
+                // OP_NOP4 and OP_NOP5 are OP_CHECKMLDSASIG and OP_CHECKMLDSASIGVERIFY (Phase 3)
+                case OP_NOP6: case OP_NOP7: case OP_NOP8: case OP_NOP9: case OP_NOP10:
+                break;
+
+                case OP_IF:
+                case OP_NOTIF:
+                {
+                    // <expression> if [statements] [else [statements]] endif
+                    bool fValue = false;
+                    if (fExec)
+                    {
+                        if (stack.size() < 1)
+                            return false;
+                        valtype& vch = stacktop(-1);
+                        fValue = CastToBool(vch);
+                        if (opcode == OP_NOTIF)
+                            fValue = !fValue;
+                        popstack(stack);
+                    }
+                    vfExec.push_back(fValue);
+                }
+                break;
+
+                case OP_ELSE:
+                {
+                    if (vfExec.empty())
+                        return false;
+                    vfExec.back() = !vfExec.back();
+                }
+                break;
+
+                case OP_ENDIF:
+                {
+                    if (vfExec.empty())
+                        return false;
+                    vfExec.pop_back();
+                }
+                break;
+
+                case OP_VERIFY:
+                {
+                    // (true -- ) or
+                    // (false -- false) and return
+                    if (stack.size() < 1)
+                        return false;
+                    bool fValue = CastToBool(stacktop(-1));
+                    if (fValue)
+                        popstack(stack);
+                    else
+                        return false;
+                }
+                break;
+
+                case OP_RETURN:
+                {
+                    return false;
+                }
+                break;
+
+
+                //
+                // Stack ops
+                //
+                case OP_TOALTSTACK:
+                {
+                    if (stack.size() < 1)
+                        return false;
+                    altstack.push_back(stacktop(-1));
+                    popstack(stack);
+                }
+                break;
+
+                case OP_FROMALTSTACK:
+                {
+                    if (altstack.size() < 1)
+                        return false;
+                    stack.push_back(altstacktop(-1));
+                    popstack(altstack);
+                }
+                break;
+
+                case OP_2DROP:
+                {
+                    // (x1 x2 -- )
+                    if (stack.size() < 2)
+                        return false;
+                    popstack(stack);
+                    popstack(stack);
+                }
+                break;
+
+                case OP_2DUP:
+                {
+                    // (x1 x2 -- x1 x2 x1 x2)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype vch1 = stacktop(-2);
+                    valtype vch2 = stacktop(-1);
+                    stack.push_back(vch1);
+                    stack.push_back(vch2);
+                }
+                break;
+
+                case OP_3DUP:
+                {
+                    // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
+                    if (stack.size() < 3)
+                        return false;
+                    valtype vch1 = stacktop(-3);
+                    valtype vch2 = stacktop(-2);
+                    valtype vch3 = stacktop(-1);
+                    stack.push_back(vch1);
+                    stack.push_back(vch2);
+                    stack.push_back(vch3);
+                }
+                break;
+
+                case OP_2OVER:
+                {
+                    // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
+                    if (stack.size() < 4)
+                        return false;
+                    valtype vch1 = stacktop(-4);
+                    valtype vch2 = stacktop(-3);
+                    stack.push_back(vch1);
+                    stack.push_back(vch2);
+                }
+                break;
+
+                case OP_2ROT:
+                {
+                    // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
+                    if (stack.size() < 6)
+                        return false;
+                    valtype vch1 = stacktop(-6);
+                    valtype vch2 = stacktop(-5);
+                    stack.erase(stack.end()-6, stack.end()-4);
+                    stack.push_back(vch1);
+                    stack.push_back(vch2);
+                }
+                break;
+
+                case OP_2SWAP:
+                {
+                    // (x1 x2 x3 x4 -- x3 x4 x1 x2)
+                    if (stack.size() < 4)
+                        return false;
+                    swap(stacktop(-4), stacktop(-2));
+                    swap(stacktop(-3), stacktop(-1));
+                }
+                break;
+
+                case OP_IFDUP:
+                {
+                    // (x - 0 | x x)
+                    if (stack.size() < 1)
+                        return false;
+                    valtype vch = stacktop(-1);
+                    if (CastToBool(vch))
+                        stack.push_back(vch);
+                }
+                break;
+
+                case OP_DEPTH:
+                {
+                    // -- stacksize
+                    CBigNum bn(stack.size());
+                    stack.push_back(bn.getvch());
+                }
+                break;
+
+                case OP_DROP:
+                {
+                    // (x -- )
+                    if (stack.size() < 1)
+                        return false;
+                    popstack(stack);
+                }
+                break;
+
+                case OP_DUP:
+                {
+                    // (x -- x x)
+                    if (stack.size() < 1)
+                        return false;
+                    valtype vch = stacktop(-1);
+                    stack.push_back(vch);
+                }
+                break;
+
+                case OP_NIP:
+                {
+                    // (x1 x2 -- x2)
+                    if (stack.size() < 2)
+                        return false;
+                    stack.erase(stack.end() - 2);
+                }
+                break;
+
+                case OP_OVER:
+                {
+                    // (x1 x2 -- x1 x2 x1)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype vch = stacktop(-2);
+                    stack.push_back(vch);
+                }
+                break;
+
+                case OP_PICK:
+                case OP_ROLL:
+                {
+                    // (xn ... x2 x1 x0 n - xn ... x2 x1 x0 xn)
+                    // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
+                    if (stack.size() < 2)
+                        return false;
+                    int n = CastToBigNum(stacktop(-1)).getint();
+                    popstack(stack);
+                    if (n < 0 || n >= (int)stack.size())
+                        return false;
+                    valtype vch = stacktop(-n-1);
+                    if (opcode == OP_ROLL)
+                        stack.erase(stack.end()-n-1);
+                    stack.push_back(vch);
+                }
+                break;
+
+                case OP_ROT:
+                {
+                    // (x1 x2 x3 -- x2 x3 x1)
+                    //  x2 x1 x3  after first swap
+                    //  x2 x3 x1  after second swap
+                    if (stack.size() < 3)
+                        return false;
+                    swap(stacktop(-3), stacktop(-2));
+                    swap(stacktop(-2), stacktop(-1));
+                }
+                break;
+
+                case OP_SWAP:
+                {
+                    // (x1 x2 -- x2 x1)
+                    if (stack.size() < 2)
+                        return false;
+                    swap(stacktop(-2), stacktop(-1));
+                }
+                break;
+
+                case OP_TUCK:
+                {
+                    // (x1 x2 -- x2 x1 x2)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype vch = stacktop(-1);
+                    stack.insert(stack.end()-2, vch);
+                }
+                break;
+
+
+                //
+                // Splice ops
+                //
+                case OP_CAT:
+                {
+                    // (x1 x2 -- out)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype& vch1 = stacktop(-2);
+                    valtype& vch2 = stacktop(-1);
+                    // SECURITY: Check size BEFORE concatenating to prevent allocation failures
+                    if (vch1.size() + vch2.size() > 10240)
+                        return false;
+                    vch1.insert(vch1.end(), vch2.begin(), vch2.end());
+                    popstack(stack);
+                }
+                break;
+
+                case OP_SUBSTR:
+                {
+                    // (in begin size -- out)
+                    if (stack.size() < 3)
+                        return false;
+                    valtype& vch = stacktop(-3);
+                    int nBegin = CastToBigNum(stacktop(-2)).getint();
+                    int nEnd = nBegin + CastToBigNum(stacktop(-1)).getint();
+                    if (nBegin < 0 || nEnd < nBegin)
+                        return false;
+                    if (nBegin > (int)vch.size())
+                        nBegin = vch.size();
+                    if (nEnd > (int)vch.size())
+                        nEnd = vch.size();
+                    vch.erase(vch.begin() + nEnd, vch.end());
+                    vch.erase(vch.begin(), vch.begin() + nBegin);
+                    popstack(stack);
+                    popstack(stack);
+                }
+                break;
+
+                case OP_LEFT:
+                case OP_RIGHT:
+                {
+                    // (in size -- out)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype& vch = stacktop(-2);
+                    int nSize = CastToBigNum(stacktop(-1)).getint();
+                    if (nSize < 0)
+                        return false;
+                    if (nSize > (int)vch.size())
+                        nSize = vch.size();
+                    if (opcode == OP_LEFT)
+                        vch.erase(vch.begin() + nSize, vch.end());
+                    else
+                        vch.erase(vch.begin(), vch.end() - nSize);
+                    popstack(stack);
+                }
+                break;
+
+                case OP_SIZE:
+                {
+                    // (in -- in size)
+                    if (stack.size() < 1)
+                        return false;
+                    CBigNum bn(stacktop(-1).size());
+                    stack.push_back(bn.getvch());
+                }
+                break;
+
+
+                //
+                // Bitwise logic
+                //
+                case OP_INVERT:
+                {
+                    // (in - out)
+                    if (stack.size() < 1)
+                        return false;
+                    valtype& vch = stacktop(-1);
+                    for (unsigned int i = 0; i < vch.size(); i++)
+                        vch[i] = ~vch[i];
+                }
+                break;
+
+                case OP_AND:
+                case OP_OR:
+                case OP_XOR:
+                {
+                    // (x1 x2 - out)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype& vch1 = stacktop(-2);
+                    valtype& vch2 = stacktop(-1);
+                    MakeSameSize(vch1, vch2);
+                    if (opcode == OP_AND)
+                    {
+                        for (unsigned int i = 0; i < vch1.size(); i++)
+                            vch1[i] &= vch2[i];
+                    }
+                    else if (opcode == OP_OR)
+                    {
+                        for (unsigned int i = 0; i < vch1.size(); i++)
+                            vch1[i] |= vch2[i];
+                    }
+                    else if (opcode == OP_XOR)
+                    {
+                        for (unsigned int i = 0; i < vch1.size(); i++)
+                            vch1[i] ^= vch2[i];
+                    }
+                    popstack(stack);
+                }
+                break;
+
+                case OP_EQUAL:
+                case OP_EQUALVERIFY:
+                //case OP_NOTEQUAL: // use OP_NUMNOTEQUAL
+                {
+                    // (x1 x2 - bool)
+                    if (stack.size() < 2)
+                        return false;
+                    valtype& vch1 = stacktop(-2);
+                    valtype& vch2 = stacktop(-1);
+                    bool fEqual = (vch1 == vch2);
+                    // OP_NOTEQUAL is disabled because it would be too easy to say
+                    // something like n != 1 and have some wiseguy pass in 1 with extra
+                    // zero bytes after it (numerically, 0x01 == 0x0001 == 0x000001)
+                    //if (opcode == OP_NOTEQUAL)
+                    //    fEqual = !fEqual;
+                    popstack(stack);
+                    popstack(stack);
+                    stack.push_back(fEqual ? vchTrue : vchFalse);
+                    if (opcode == OP_EQUALVERIFY)
+                    {
+                        if (fEqual)
+                            popstack(stack);
+                        else
+                            return false;
+                    }
+                }
+                break;
+
+
+                //
+                // Numeric
+                //
+                case OP_1ADD:
+                case OP_1SUB:
+                case OP_2MUL:
+                case OP_2DIV:
+                case OP_NEGATE:
+                case OP_ABS:
+                case OP_NOT:
+                case OP_0NOTEQUAL:
+                {
+                    // (in -- out)
+                    if (stack.size() < 1)
+                        return false;
+                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    switch (opcode)
+                    {
+                    case OP_1ADD:       bn += bnOne; break;
+                    case OP_1SUB:       bn -= bnOne; break;
+                    case OP_2MUL:       bn <<= 1; break;
+                    case OP_2DIV:       bn >>= 1; break;
+                    case OP_NEGATE:     bn = -bn; break;
+                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
+                    case OP_NOT:        bn = (bn == bnZero); break;
+                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    default:            assert(!"invalid opcode"); break;
+                    }
+                    popstack(stack);
+                    stack.push_back(bn.getvch());
+                }
+                break;
+
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL:
+                case OP_DIV:
+                case OP_MOD:
+                case OP_LSHIFT:
+                case OP_RSHIFT:
+                case OP_BOOLAND:
+                case OP_BOOLOR:
+                case OP_NUMEQUAL:
+                case OP_NUMEQUALVERIFY:
+                case OP_NUMNOTEQUAL:
+                case OP_LESSTHAN:
+                case OP_GREATERTHAN:
+                case OP_LESSTHANOREQUAL:
+                case OP_GREATERTHANOREQUAL:
+                case OP_MIN:
+                case OP_MAX:
+                {
+                    // (x1 x2 -- out)
+                    if (stack.size() < 2)
+                        return false;
+                    CBigNum bn1 = CastToBigNum(stacktop(-2));
+                    CBigNum bn2 = CastToBigNum(stacktop(-1));
+                    CBigNum bn;
+                    
+                    // SECURITY: Check operand sizes for expensive operations
+                    // to prevent CPU DOS attacks (OP_MUL, OP_DIV, OP_MOD)
+                    if (opcode == OP_MUL || opcode == OP_DIV || opcode == OP_MOD) {
+                        if (bn1.bitSize() > nMaxBigNumBits || bn2.bitSize() > nMaxBigNumBits)
+                            return false;
+                    }
+                    
+                    switch (opcode)
+                    {
+                    case OP_ADD:
+                        bn = bn1 + bn2;
+                        break;
+
+                    case OP_SUB:
+                        bn = bn1 - bn2;
+                        break;
+
+                    case OP_MUL:
+                        if (!BN_mul(bn.bn, bn1.bn, bn2.bn, pctx))
+                            return false;
+                        break;
+
+                    case OP_DIV:
+                        if (!BN_div(bn.bn, NULL, bn1.bn, bn2.bn, pctx))
+                            return false;
+                        break;
+
+                    case OP_MOD:
+                        if (!BN_mod(bn.bn, bn1.bn, bn2.bn, pctx))
+                            return false;
+                        break;
+
+                    case OP_LSHIFT:
+                        if (bn2 < bnZero || bn2 > CBigNum(2048))
+                            return false;
+                        bn = bn1 << bn2.getulong();
+                        break;
+
+                    case OP_RSHIFT:
+                        if (bn2 < bnZero || bn2 > CBigNum(2048))
+                            return false;
+                        bn = bn1 >> bn2.getulong();
+                        break;
+
+                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
+                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
+                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
+                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
+                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
+                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
+                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
+                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                    case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
+                    case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+                    default:                     assert(!"invalid opcode"); break;
+                    }
+                    popstack(stack);
+                    popstack(stack);
+                    stack.push_back(bn.getvch());
+
+                    if (opcode == OP_NUMEQUALVERIFY)
+                    {
+                        if (CastToBool(stacktop(-1)))
+                            popstack(stack);
+                        else
+                            return false;
+                    }
+                }
+                break;
+
+                case OP_WITHIN:
+                {
+                    // (x min max -- out)
+                    if (stack.size() < 3)
+                        return false;
+                    CBigNum bn1 = CastToBigNum(stacktop(-3));
+                    CBigNum bn2 = CastToBigNum(stacktop(-2));
+                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    bool fValue = (bn2 <= bn1 && bn1 < bn3);
+                    popstack(stack);
+                    popstack(stack);
+                    popstack(stack);
+                    stack.push_back(fValue ? vchTrue : vchFalse);
+                }
+                break;
+
+
+                //
+                // Crypto
+                //
+                case OP_RIPEMD160:
+                case OP_SHA1:
+                case OP_SHA256:
+                case OP_HASH160:
+                case OP_HASH256:
+                {
+                    // (in -- hash)
+                    if (stack.size() < 1)
+                        return false;
+                    valtype& vch = stacktop(-1);
+                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    if (opcode == OP_RIPEMD160)
+                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                    else if (opcode == OP_SHA1)
+                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                    else if (opcode == OP_SHA256)
+                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                    else if (opcode == OP_HASH160)
+                    {
+                        uint160 hash160 = Hash160(vch);
+                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                    }
+                    else if (opcode == OP_HASH256)
+                    {
+                        uint256 hash = Hash(vch.begin(), vch.end());
+                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                    }
+                    popstack(stack);
+                    stack.push_back(vchHash);
+                }
+                break;
+
+                case OP_CODESEPARATOR:
+                {
+                    // Hash starts after the code separator
+                    pbegincodehash = pc;
+                }
+                break;
+
+                case OP_CHECKSIG:
+                case OP_CHECKSIGVERIFY:
+                {
+                    // (sig pubkey -- bool)
+                    if (stack.size() < 2)
+                        return false;
+
+                    valtype& vchSig    = stacktop(-2);
+                    valtype& vchPubKey = stacktop(-1);
+
+                    // Subset of script starting at the most recent codeseparator
+                    CScript scriptCode(pbegincodehash, pend);
+
+                    // Drop the signature, since there's no way for a signature to sign itself
+                    scriptCode.FindAndDelete(CScript(vchSig));
+
+                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+
+                    popstack(stack);
+                    popstack(stack);
+                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    if (opcode == OP_CHECKSIGVERIFY)
+                    {
+                        if (fSuccess)
+                            popstack(stack);
+                        else
+                            return false;
+                    }
+                }
+                break;
+
+                // Phase 3: Post-Quantum Signature Verification
+                case OP_CHECKMLDSASIG:
+                case OP_CHECKMLDSASIGVERIFY:
+                {
+                    // NOP, as in builds without ENABLE_MLDSA
+                }
+                break;
+
+                case OP_CHECKMULTISIG:
+                case OP_CHECKMULTISIGVERIFY:
+                {
+                    // ([sig ...] num_of_signatures [pubkey ...] num_of_pubkeys -- bool)
+
+                    int i = 1;
+                    if ((int)stack.size() < i)
+                        return false;
+
+                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    if (nKeysCount < 0 || nKeysCount > 20)
+                        return false;
+                    nOpCount += nKeysCount;
+                    if (nOpCount > 201)
+                        return false;
+                    int ikey = ++i;
+                    i += nKeysCount;
+                    if ((int)stack.size() < i)
+                        return false;
+
+                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    if (nSigsCount < 0 || nSigsCount > nKeysCount)
+                        return false;
+                    int isig = ++i;
+                    i += nSigsCount;
+                    if ((int)stack.size() < i)
+                        return false;
+
+                    // Subset of script starting at the most recent codeseparator
+                    CScript scriptCode(pbegincodehash, pend);
+
+                    // Drop the signatures, since there's no way for a signature to sign itself
+                    for (int k = 0; k < nSigsCount; k++)
+                    {
+                        valtype& vchSig = stacktop(-isig-k);
+                        scriptCode.FindAndDelete(CScript(vchSig));
+                    }
+
+                    bool fSuccess = true;
+                    while (fSuccess && nSigsCount > 0)
+                    {
+                        valtype& vchSig    = stacktop(-isig);
+                        valtype& vchPubKey = stacktop(-ikey);
+
+                        // Check signature
+                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType))
+                        {
+                            isig++;
+                            nSigsCount--;
+                        }
+                        ikey++;
+                        nKeysCount--;
+
+                        // If there are more signatures left than keys left,
+                        // then too many signatures have failed
+                        if (nSigsCount > nKeysCount)
+                            fSuccess = false;
+                    }
+
+                    while (i-- > 0)
+                        popstack(stack);
+                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+
+                    if (opcode == OP_CHECKMULTISIGVERIFY)
+                    {
+                        if (fSuccess)
+                            popstack(stack);
+                        else
+                            return false;
+                    }
+                }
+                break;
+
+                default:
+                    return false;
+            }
+
+            // Size limits
+            if (stack.size() + altstack.size() > 1000)
+                return false;
+        }
+    }
+    catch (...)
+    {
+        return false;
+    }
+
+
+    if (!vfExec.empty())
+        return false;
+
+    return true;
+}
+
+static bool ReferenceVerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                                  bool fValidatePayToScriptHash, int nHashType)
+{
+    vector<valtype> stack, stackCopy;
+    if (!ReferenceEvalScript(stack, scriptSig, txTo, nIn, nHashType))
+        return false;
+    if (fValidatePayToScriptHash)
+        stackCopy = stack;
+    if (!ReferenceEvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+        return false;
+    if (stack.empty())
+        return false;
+    if (CastToBool(stack.back()) == false)
+        return false;
+    if (fValidatePayToScriptHash && scriptPubKey.IsPayToScriptHash())
+    {
+        if (!scriptSig.IsPushOnly())
+            return false;
+        const valtype& pubKeySerialized = stackCopy.back();
+        CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
+        popstack(stackCopy);
+        if (!ReferenceEvalScript(stackCopy, pubKey2, txTo, nIn, nHashType))
+            return false;
+        if (stackCopy.empty())
+            return false;
+        return CastToBool(stackCopy.back());
+    }
+    return true;
+}
+
+// SignatureHash as it was, copying the transaction to blank parts of it out
+static uint256 ReferenceSignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    if (nIn >= txTo.vin.size())
+        return 1;
+    CTransaction txTmp(txTo);
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+        txTmp.vin[i].scriptSig = CScript();
+    txTmp.vin[nIn].scriptSig = scriptCode;
+    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    {
+        txTmp.vout.clear();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    {
+        unsigned int nOut = nIn;
+        if (nOut >= txTmp.vout.size())
+            return 1;
+        txTmp.vout.resize(nOut+1);
+        for (unsigned int i = 0; i < nOut; i++)
+            txTmp.vout[i].SetNull();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+    if (nHashType & SIGHASH_ANYONECANPAY)
+    {
+        txTmp.vin[0] = txTmp.vin[nIn];
+        txTmp.vin.resize(1);
+    }
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTmp << nHashType;
+    return Hash(ss.begin(), ss.end());
+}
+
+BOOST_AUTO_TEST_SUITE(script_eval_tests)
+
+// Reproducible from the seed printed with any failure
+class CFuzzRand
+{
+public:
+    uint64 nState;
+
+    CFuzzRand(uint64 nSeed) : nState(nSeed ? nSeed : 1) { }
+
+    unsigned int Next(unsigned int nMax)
+    {
+        nState ^= nState << 13;
+        nState ^= nState >> 7;
+        nState ^= nState << 17;
+        return (unsigned int)(nState % nMax);
+    }
+};
+
+static valtype RandomBytes(CFuzzRand& rand, unsigned int nSize)
+{
+    valtype vch(nSize);
+    for (unsigned int i = 0; i < nSize; i++)
+        vch[i] = rand.Next(4) ? rand.Next(4) : rand.Next(256);
+    return vch;
+}
+
+static CScript RandomScript(CFuzzRand& rand)
+{
+    CScript script;
+    unsigned int nOps = rand.Next(40);
+    for (unsigned int i = 0; i < nOps; i++)
+    {
+        unsigned int nKind = rand.Next(10);
+        if (nKind < 3)
+        {
+            // Mostly short values, so the numeric ops get numbers
+            unsigned int nSize = rand.Next(8) ? rand.Next(6) : rand.Next(600);
+            script << RandomBytes(rand, nSize);
+        }
+        else if (nKind < 5)
+        {
+            script << (opcodetype)(OP_1 + rand.Next(16));
+        }
+        else if (nKind < 9)
+        {
+            opcodetype opcode = (opcodetype)(OP_NOP + rand.Next(OP_NOP10 - OP_NOP + 1));
+            // ML-DSA opcodes only differ from NOPs when it is compiled in
+            if (opcode == OP_CHECKMLDSASIG || opcode == OP_CHECKMLDSASIGVERIFY)
+                opcode = OP_NOP;
+            script << opcode;
+        }
+        else
+        {
+            // Raw bytes: truncated pushes, invalid opcodes
+            unsigned char ch = rand.Next(256);
+            if (ch == OP_CHECKMLDSASIG || ch == OP_CHECKMLDSASIGVERIFY)
+                ch = OP_NOP;
+            script.insert(script.end(), ch);
+        }
+    }
+    return script;
+}
+
+static CTransaction DummyTransaction()
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(script_eval_differential)
+{
+    CTransaction tx = DummyTransaction();
+    uint64 nSeed = GetRand(std::numeric_limits<uint64>::max());
+    CFuzzRand rand(nSeed);
+    int nSucceeded = 0;
+    for (int i = 0; i < 20000; i++)
+    {
+        vector<valtype> stackStart;
+        unsigned int nStart = rand.Next(5);
+        for (unsigned int j = 0; j < nStart; j++)
+            stackStart.push_back(RandomBytes(rand, rand.Next(6)));
+        CScript script = RandomScript(rand);
+
+        vector<valtype> stack(stackStart), stackRef(stackStart);
+        bool fResult = EvalScript(stack, script, tx, 0, 0);
+        bool fRefResult = ReferenceEvalScript(stackRef, script, tx, 0, 0);
+        BOOST_CHECK_MESSAGE(fResult == fRefResult && stack == stackRef,
+            strprintf("seed %"PRI64u" script %s", nSeed, HexStr(script.begin(), script.end()).c_str()));
+        if (fResult)
+            nSucceeded++;
+    }
+    // Enough scripts get to the end to exercise the final stack
+    BOOST_CHECK(nSucceeded > 1000);
+}
+
+BOOST_AUTO_TEST_CASE(script_eval_verify_differential)
+{
+    CTransaction tx = DummyTransaction();
+    uint64 nSeed = GetRand(std::numeric_limits<uint64>::max());
+    CFuzzRand rand(nSeed);
+    for (int i = 0; i < 5000; i++)
+    {
+        CScript scriptSig, scriptPubKey;
+        if (rand.Next(2))
+        {
+            // Pay-to-script-hash, the redeem script reading what scriptSig pushed
+            CScript redeemScript = RandomScript(rand);
+            unsigned int nArgs = rand.Next(4);
+            for (unsigned int j = 0; j < nArgs; j++)
+                scriptSig << RandomBytes(rand, rand.Next(6));
+            scriptSig << valtype(redeemScript.begin(), redeemScript.end());
+            scriptPubKey.SetDestination(redeemScript.GetID());
+        }
+        else
+        {
+            scriptSig = RandomScript(rand);
+            scriptPubKey = RandomScript(rand);
+        }
+
+        for (int fP2SH = 0; fP2SH < 2; fP2SH++)
+            BOOST_CHECK_MESSAGE(VerifyScript(scriptSig, scriptPubKey, tx, 0, fP2SH, 0) ==
+                                ReferenceVerifyScript(scriptSig, scriptPubKey, tx, 0, fP2SH, 0),
+                strprintf("seed %"PRI64u" scriptSig %s scriptPubKey %s", nSeed,
+                          HexStr(scriptSig.begin(), scriptSig.end()).c_str(),
+                          HexStr(scriptPubKey.begin(), scriptPubKey.end()).c_str()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_eval_shared_values)
+{
+    // Copies of a value on the stack share its bytes; changing one must
+    // leave the others as they were
+    CTransaction tx = DummyTransaction();
+    valtype vch(3, 0x0f);
+    CScript script;
+    script << vch << OP_DUP << OP_INVERT << OP_OVER << OP_OVER << OP_CAT << OP_2 << OP_PICK << OP_1 << OP_LEFT;
+    vector<valtype> stack, stackRef;
+    BOOST_CHECK(EvalScript(stack, script, tx, 0, 0));
+    BOOST_CHECK(ReferenceEvalScript(stackRef, script, tx, 0, 0));
+    BOOST_CHECK(stack == stackRef);
+    BOOST_CHECK_EQUAL(stack.size(), 4U);
+    BOOST_CHECK(stack[0] == vch);
+    BOOST_CHECK(stack[1] == valtype(3, 0xf0));
+
+    // Values from the stack we were given survive it being replaced
+    stack.assign(1, valtype(10, 0x01));
+    stackRef = stack;
+    script = CScript() << OP_DUP << OP_SIZE << OP_SWAP << OP_DROP;
+    BOOST_CHECK(EvalScript(stack, script, tx, 0, 0));
+    BOOST_CHECK(ReferenceEvalScript(stackRef, script, tx, 0, 0));
+    BOOST_CHECK(stack == stackRef);
+
+    // Results too big for the first arena block, then for later ones
+    script = CScript() << valtype(3000, 0x5a);
+    for (int i = 0; i < 45; i++)
+        script << OP_DUP << OP_DUP << OP_CAT << OP_SWAP;
+    stack.clear();
+    stackRef.clear();
+    BOOST_CHECK(EvalScript(stack, script, tx, 0, 0));
+    BOOST_CHECK(ReferenceEvalScript(stackRef, script, tx, 0, 0));
+    BOOST_CHECK(stack == stackRef);
+    BOOST_CHECK_EQUAL(stack.size(), 46U);
+}
+
+BOOST_AUTO_TEST_CASE(script_num_encoding)
+{
+    // Encodes as CBigNum does
+    vector<int64> vValues;
+    for (int i = 0; i < 64; i++)
+    {
+        int64 n = (int64)1 << i;
+        vValues.push_back(n);
+        vValues.push_back(n - 1);
+        vValues.push_back(n + 1);
+    }
+    for (int i = 0; i < 1000; i++)
+        vValues.push_back(GetRand(std::numeric_limits<uint64>::max()));
+    unsigned int nValues = vValues.size();
+    for (unsigned int i = 0; i < nValues; i++)
+        vValues.push_back(-vValues[i]);
+    vValues.push_back(std::numeric_limits<int64>::max());
+    vValues.push_back(std::numeric_limits<int64>::min() + 1);
+    BOOST_FOREACH(int64 n, vValues)
+        BOOST_CHECK_MESSAGE(CScriptNum(n).getvch() == CBigNum(n).getvch(), strprintf("%"PRI64d, n));
+
+    // Decodes as CastToBigNum does, non-minimal encodings and negative zero included
+    vector<valtype> vvch;
+    vvch.push_back(valtype());
+    for (int i = 0; i < 256; i++)
+    {
+        vvch.push_back(valtype(1, i));
+        vvch.push_back(valtype(2, i));
+        vvch.push_back(valtype(3, i));
+        vvch.push_back(valtype(4, i));
+        valtype vch(4, 0);
+        vch[3] = i;
+        vvch.push_back(vch);
+    }
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64 nRand = GetRand(std::numeric_limits<uint64>::max());
+        vvch.push_back(valtype((unsigned char*)&nRand, (unsigned char*)&nRand + 1 + i % 4));
+    }
+    BOOST_FOREACH(const valtype& vch, vvch)
+    {
+        CBigNum bn = CastToBigNum(vch);
+        CScriptNum num(vch);
+        BOOST_CHECK_MESSAGE(num.getvch() == bn.getvch() && num.getint() == bn.getint(), HexStr(vch));
+    }
+    BOOST_CHECK_THROW(CScriptNum(valtype(5, 1)), runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(script_eval_arithmetic)
+{
+    // Every numeric opcode on edge-case operands, against the CBigNum interpreter
+    CTransaction tx = DummyTransaction();
+    vector<valtype> vOperands;
+    int64 vn[] = { 0, 1, 2, 7, 8, 31, 32, 33, 62, 63, 64, 127, 128, 255, 256, 1000, 2048, 2049, 32767, 32768,
+                   65535, 65536, 0x7fffff, 0x800000, 0xffffff, 0x1000000, 0x7fffffff };
+    for (unsigned int i = 0; i < sizeof(vn) / sizeof(vn[0]); i++)
+    {
+        vOperands.push_back(CBigNum(vn[i]).getvch());
+        vOperands.push_back(CBigNum(-vn[i]).getvch());
+    }
+    // Negative zero, non-minimal encodings, and too long to be a number
+    vOperands.push_back(valtype(1, 0x80));
+    vOperands.push_back(valtype(4, 0));
+    valtype vchPadded(3, 0);
+    vchPadded[0] = 5;
+    vchPadded[2] = 0x80;
+    vOperands.push_back(vchPadded);
+    vOperands.push_back(valtype(5, 1));
+
+    opcodetype vUnary[] = { OP_1ADD, OP_1SUB, OP_2MUL, OP_2DIV, OP_NEGATE, OP_ABS, OP_NOT, OP_0NOTEQUAL,
+                            OP_PICK, OP_ROLL, OP_LEFT, OP_RIGHT, OP_IFDUP, OP_VERIFY };
+    opcodetype vBinary[] = { OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_LSHIFT, OP_RSHIFT, OP_BOOLAND,
+                             OP_BOOLOR, OP_NUMEQUAL, OP_NUMEQUALVERIFY, OP_NUMNOTEQUAL, OP_LESSTHAN,
+                             OP_GREATERTHAN, OP_LESSTHANOREQUAL, OP_GREATERTHANOREQUAL, OP_MIN, OP_MAX,
+                             OP_SUBSTR };
+    vector<CScript> vScripts;
+    for (unsigned int i = 0; i < vOperands.size(); i++)
+    {
+        for (unsigned int k = 0; k < sizeof(vUnary) / sizeof(vUnary[0]); k++)
+            vScripts.push_back(CScript() << OP_1 << vOperands[i] << vUnary[k]);
+        for (unsigned int j = 0; j < vOperands.size(); j++)
+        {
+            for (unsigned int k = 0; k < sizeof(vBinary) / sizeof(vBinary[0]); k++)
+                vScripts.push_back(CScript() << OP_1 << vOperands[i] << vOperands[j] << vBinary[k]);
+            vScripts.push_back(CScript() << vOperands[i] << vOperands[j] << vOperands[(i + j) % vOperands.size()] << OP_WITHIN);
+        }
+    }
+    // Results of one operation fed to the next
+    vScripts.push_back(CScript() << 0x7fffffff << OP_DUP << OP_MUL << OP_1ADD);
+    vScripts.push_back(CScript() << -0x7fffffff << OP_DUP << OP_MUL << OP_DUP << OP_ADD);
+    vScripts.push_back(CScript() << -0x7fffffff << 2048 << OP_LSHIFT << OP_SIZE);
+    vScripts.push_back(CScript() << OP_16 << OP_16 << OP_LSHIFT << OP_DUP << OP_MUL);
+    // Zero shifted by an int64's width or more
+    vScripts.push_back(CScript() << OP_0 << 64 << OP_LSHIFT);
+    vScripts.push_back(CScript() << OP_0 << 100 << OP_LSHIFT);
+    vScripts.push_back(CScript() << OP_0 << 2048 << OP_LSHIFT);
+    vScripts.push_back(CScript() << OP_1 << OP_DEPTH << OP_DEPTH << OP_ADD);
+
+    BOOST_FOREACH(const CScript& script, vScripts)
+    {
+        vector<valtype> stack, stackRef;
+        bool fResult = EvalScript(stack, script, tx, 0, 0);
+        bool fRefResult = ReferenceEvalScript(stackRef, script, tx, 0, 0);
+        BOOST_CHECK_MESSAGE(fResult == fRefResult && stack == stackRef, script.ToString());
+    }
+}
+
+// Nested IF/NOTIF/ELSE/ENDIF, with now and then a stray ELSE, a branch left
+// open, or something in a branch that fails even when not executed
+static void RandomBranches(CFuzzRand& rand, CScript& script, int nDepth)
+{
+    unsigned int nParts = rand.Next(6);
+    for (unsigned int i = 0; i < nParts; i++)
+    {
+        switch (rand.Next(10))
+        {
+        case 0:
+        case 1:
+            if (nDepth > 4)
+                break;
+            script << (rand.Next(2) ? OP_IF : OP_NOTIF);
+            RandomBranches(rand, script, nDepth + 1);
+            for (unsigned int j = rand.Next(4); j > 1; j--)
+            {
+                script << OP_ELSE;
+                RandomBranches(rand, script, nDepth + 1);
+            }
+            if (rand.Next(30))
+                script << OP_ENDIF;
+            break;
+        case 2:
+            script << (rand.Next(2) ? OP_0 : OP_1);
+            break;
+        case 3:
+            script << RandomBytes(rand, rand.Next(100) ? rand.Next(100) : 10241);
+            break;
+        case 4:
+            // Enough counted opcodes to reach the limit in a few branches
+            for (unsigned int j = rand.Next(80); j > 0; j--)
+                script << OP_NOP;
+            break;
+        case 5:
+            script << (rand.Next(20) ? OP_DUP : rand.Next(2) ? OP_VERIF : OP_ELSE);
+            break;
+        default:
+            script << (opcodetype)(OP_NOP + rand.Next(OP_NOP10 - OP_NOP + 1));
+            break;
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_eval_branches)
+{
+    // Branches that aren't taken are jumped over; check that against the
+    // interpreter that walked through them, cached and uncached
+    CTransaction tx = DummyTransaction();
+    uint64 nSeed = GetRand(std::numeric_limits<uint64>::max());
+    CFuzzRand rand(nSeed);
+    for (int i = 0; i < 5000; i++)
+    {
+        CScript script;
+        RandomBranches(rand, script, 0);
+        if (script.size() > 0 && (script.back() == OP_CHECKMLDSASIG || script.back() == OP_CHECKMLDSASIGVERIFY))
+            script.back() = OP_NOP;
+        CScript scriptSig;
+        vector<valtype> stackStart;
+        for (unsigned int j = rand.Next(8); j > 0; j--)
+        {
+            valtype vch = rand.Next(2) ? vchTrue : vchFalse;
+            stackStart.push_back(vch);
+            scriptSig << vch;
+        }
+
+        vector<valtype> stack(stackStart), stackRef(stackStart);
+        bool fResult = EvalScript(stack, script, tx, 0, 0);
+        bool fRefResult = ReferenceEvalScript(stackRef, script, tx, 0, 0);
+        BOOST_CHECK_MESSAGE(fResult == fRefResult && stack == stackRef,
+            strprintf("seed %"PRI64u" script %s", nSeed, HexStr(script.begin(), script.end()).c_str()));
+        for (int j = 0; j < 2; j++)
+            BOOST_CHECK_MESSAGE(VerifyScript(scriptSig, script, tx, 0, true, 0) == ReferenceVerifyScript(scriptSig, script, tx, 0, true, 0),
+                strprintf("seed %"PRI64u" script %s", nSeed, HexStr(script.begin(), script.end()).c_str()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_cache_solver)
+{
+    // Scripts big enough to be cached give the same answers every time
+    vector<CKey> vKeys(3);
+    BOOST_FOREACH(CKey& key, vKeys)
+        key.MakeNewKey(false);
+    CScript scriptMultisig;
+    scriptMultisig.SetMultisig(2, vKeys);
+    CScript scriptBad = scriptMultisig;
+    scriptBad[0] = OP_4;
+    CScript scriptLong = CScript() << valtype(200, 1) << OP_DROP << OP_2 << OP_CHECKMULTISIG << OP_CHECKSIG;
+
+    for (int i = 0; i < 2; i++)
+    {
+        txnouttype whichType;
+        vector<valtype> vSolutions;
+        BOOST_CHECK(Solver(scriptMultisig, whichType, vSolutions));
+        BOOST_CHECK_EQUAL(whichType, TX_MULTISIG);
+        BOOST_CHECK_EQUAL(vSolutions.size(), 5U);
+        BOOST_CHECK(vSolutions[1] == vKeys[0].GetPubKey().Raw());
+        BOOST_CHECK(IsStandard(scriptMultisig));
+        BOOST_CHECK_EQUAL(scriptMultisig.GetSigOpCount(true, true), 3U);
+        BOOST_CHECK_EQUAL(scriptMultisig.GetSigOpCount(false, true), 20U);
+
+        // m > n: matched the template but refused
+        BOOST_CHECK(!Solver(scriptBad, whichType, vSolutions));
+        BOOST_CHECK(!IsStandard(scriptBad));
+
+        BOOST_CHECK(!Solver(scriptLong, whichType, vSolutions));
+        BOOST_CHECK_EQUAL(whichType, TX_NONSTANDARD);
+        BOOST_CHECK(vSolutions.empty());
+        BOOST_CHECK_EQUAL(scriptLong.GetSigOpCount(true, true), 3U);
+        BOOST_CHECK_EQUAL(scriptLong.GetSigOpCount(false, true), 21U);
+        BOOST_CHECK_EQUAL(scriptLong.GetSigOpCount(true), 3U);
+        BOOST_CHECK_EQUAL(scriptLong.GetSigOpCount(false), 21U);
+
+        // Pay-to-script-hash counts the redeem script's sigops
+        CScript scriptP2SH;
+        scriptP2SH.SetDestination(scriptMultisig.GetID());
+        CScript scriptSig = CScript() << OP_0 << valtype(scriptMultisig.begin(), scriptMultisig.end());
+        BOOST_CHECK_EQUAL(scriptP2SH.GetSigOpCount(scriptSig), 3U);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_sighash_differential)
+{
+    uint64 nSeed = GetRand(std::numeric_limits<uint64>::max());
+    CFuzzRand rand(nSeed);
+    for (int i = 0; i < 5000; i++)
+    {
+        CTransaction tx;
+        tx.nVersion = rand.Next(3);
+        tx.nLockTime = rand.Next(2) ? 0 : rand.Next(1000000);
+        tx.vin.resize(1 + rand.Next(4));
+        BOOST_FOREACH(CTxIn& txin, tx.vin)
+        {
+            txin.prevout = COutPoint(GetRandHash(), rand.Next(4));
+            txin.scriptSig = RandomScript(rand);
+            txin.nSequence = rand.Next(2) ? std::numeric_limits<unsigned int>::max() : rand.Next(100);
+        }
+        tx.vout.resize(rand.Next(5));
+        BOOST_FOREACH(CTxOut& txout, tx.vout)
+        {
+            txout.nValue = rand.Next(100000000);
+            txout.scriptPubKey = RandomScript(rand);
+        }
+
+        // Code separators anywhere, to be taken out
+        CScript scriptCode;
+        unsigned int nParts = rand.Next(4);
+        for (unsigned int j = 0; j < nParts; j++)
+            scriptCode += RandomScript(rand) << OP_CODESEPARATOR;
+        scriptCode += RandomScript(rand);
+
+        // Out of range inputs and SIGHASH_SINGLE outputs now and then
+        unsigned int nIn = rand.Next(tx.vin.size() + 1);
+        int nHashType = rand.Next(4) ? (rand.Next(4) | (rand.Next(2) ? SIGHASH_ANYONECANPAY : 0)) : (int)rand.Next(0x7fffffff);
+        if (rand.Next(8) == 0)
+            nHashType = -nHashType;
+        BOOST_CHECK_MESSAGE(SignatureHash(scriptCode, tx, nIn, nHashType) == ReferenceSignatureHash(scriptCode, tx, nIn, nHashType),
+            strprintf("seed %"PRI64u" nIn %u nHashType %d", nSeed, nIn, nHashType));
+    }
+}
+
+static valtype SignWith(CKey& key, const CScript& scriptCode, const CTransaction& tx, int nHashType)
+{
+    valtype vchSig;
+    BOOST_CHECK(key.Sign(ReferenceSignatureHash(scriptCode, tx, 0, nHashType), vchSig));
+    vchSig.push_back((unsigned char)nHashType);
+    return vchSig;
+}
+
+BOOST_AUTO_TEST_CASE(script_checksig_scriptcode)
+{
+    // Signatures pushed by the script they are checked in, behind and
+    // inside branches with code separators, are not part of what they sign
+    CTransaction tx = DummyTransaction();
+    tx.vin.resize(2);
+    tx.vout.resize(2);
+    vector<CKey> vKeys(2);
+    BOOST_FOREACH(CKey& key, vKeys)
+        key.MakeNewKey(true);
+
+    CScript scriptMultisig;
+    scriptMultisig.SetMultisig(2, vKeys);
+    CScript scriptSigned = CScript() << OP_DROP << OP_0 << OP_IF << OP_ENDIF << OP_DROP;
+    scriptSigned += scriptMultisig;
+    valtype vchSig1 = SignWith(vKeys[0], scriptSigned, tx, SIGHASH_ALL);
+    valtype vchSig2 = SignWith(vKeys[1], scriptSigned, tx, SIGHASH_NONE);
+
+    CScript scriptPubKey = CScript() << valtype(100, 7) << OP_DROP << OP_CODESEPARATOR << vchSig2 << OP_DROP
+                                     << OP_0 << OP_IF << OP_CODESEPARATOR << OP_ENDIF << vchSig1 << OP_DROP;
+    scriptPubKey += scriptMultisig;
+    CScript scriptSig = CScript() << OP_0 << vchSig1 << vchSig2;
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, tx, 0, true, 0));
+    BOOST_CHECK(ReferenceVerifyScript(scriptSig, scriptPubKey, tx, 0, true, 0));
+
+    // Out of order
+    CScript scriptSigSwapped = CScript() << OP_0 << vchSig2 << vchSig1;
+    BOOST_CHECK(!VerifyScript(scriptSigSwapped, scriptPubKey, tx, 0, true, 0));
+    BOOST_CHECK(!ReferenceVerifyScript(scriptSigSwapped, scriptPubKey, tx, 0, true, 0));
+
+    // A push of the signature that isn't encoded the way CScript(vchSig)
+    // encodes it stays in, so what was signed doesn't match
+    CScript scriptSingle = CScript() << OP_DROP << vKeys[0].GetPubKey() << OP_CHECKSIG;
+    valtype vchSig3 = SignWith(vKeys[0], scriptSingle, tx, SIGHASH_ALL);
+    CScript scriptOdd;
+    scriptOdd.insert(scriptOdd.end(), OP_PUSHDATA1);
+    scriptOdd.insert(scriptOdd.end(), (unsigned char)vchSig3.size());
+    scriptOdd.insert(scriptOdd.end(), vchSig3.begin(), vchSig3.end());
+    BOOST_CHECK(!VerifyScript(CScript() << vchSig3, scriptOdd + scriptSingle, tx, 0, true, 0));
+    BOOST_CHECK(!ReferenceVerifyScript(CScript() << vchSig3, scriptOdd + scriptSingle, tx, 0, true, 0));
+    BOOST_CHECK(VerifyScript(CScript() << vchSig3, (CScript() << vchSig3) + scriptSingle, tx, 0, true, 0));
+
+    valtype vchSig4 = SignWith(vKeys[0], scriptSingle, tx, SIGHASH_ALL | SIGHASH_ANYONECANPAY);
+    CScript scriptPubKey4 = (CScript() << vchSig4) + scriptSingle;
+    BOOST_CHECK(VerifyScript(CScript() << vchSig4, scriptPubKey4, tx, 0, true, 0));
+    BOOST_CHECK(ReferenceVerifyScript(CScript() << vchSig4, scriptPubKey4, tx, 0, true, 0));
+}
+
+BOOST_AUTO_TEST_CASE(script_profile)
+{
+    // Every instruction run is charged to its opcode, including the one a
+    // script fails on, and values made on the stack count their bytes
+    CTransaction txFrom = DummyTransaction();
+    txFrom.vout[0].scriptPubKey = CScript() << OP_DUP << OP_CAT << OP_SIZE << OP_8 << OP_EQUALVERIFY << OP_DROP << OP_1;
+    CTransaction txTo = DummyTransaction();
+    txTo.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+    txTo.vin[0].scriptSig = CScript() << valtype(4, 0xaa);
+
+    CScriptProfile profile;
+    BOOST_CHECK(VerifySignature(txFrom, txTo, 0, true, 0, &profile));
+    BOOST_CHECK_EQUAL(profile.nScripts, 2U);
+    BOOST_CHECK_EQUAL(profile.GetOps(), 8U);
+    BOOST_CHECK_EQUAL(profile.vCount[4], 1U);
+    BOOST_CHECK_EQUAL(profile.vCount[OP_CAT], 1U);
+    BOOST_CHECK_EQUAL(profile.vBytes[OP_CAT], 8U);
+    BOOST_CHECK_EQUAL(profile.vBytes[OP_SIZE], 1U);
+    BOOST_CHECK_EQUAL(profile.GetBytes(), 9U);
+    BOOST_CHECK(profile.GetMicros() >= 0);
+
+    txTo.vin[0].scriptSig = CScript() << valtype(3, 0xaa);
+    CScriptProfile profileFailed;
+    BOOST_CHECK(!VerifySignature(txFrom, txTo, 0, true, 0, &profileFailed));
+    BOOST_CHECK_EQUAL(profileFailed.GetOps(), 6U);
+    BOOST_CHECK_EQUAL(profileFailed.vCount[OP_EQUALVERIFY], 1U);
+    BOOST_CHECK_EQUAL(profileFailed.vCount[OP_DROP], 0U);
+
+    profile.Add(profileFailed);
+    BOOST_CHECK_EQUAL(profile.nScripts, 4U);
+    BOOST_CHECK_EQUAL(profile.GetOps(), 14U);
+    BOOST_CHECK_EQUAL(profile.vCount[OP_CAT], 2U);
+    profile.SetNull();
+    BOOST_CHECK_EQUAL(profile.GetOps(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,115 @@
+#include <boost/test/unit_test.hpp>
+#include <limits>
+
+#include "main.h"
+#include "stratum.h"
+
+BOOST_AUTO_TEST_SUITE(stratum_tests)
+
+static CBlock MakeTemplate(unsigned int nTx)
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = 1700000000;
+    block.nBits = 0x1e0ffff0;
+
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    txCoinbase.vout[0].nValue = 50 * COIN;
+    block.vtx.push_back(txCoinbase);
+
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = i;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        tx.vout[0].nValue = i;
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(stratum_coinbase_split)
+{
+    std::vector<unsigned char> vchExtraNonce1 = ParseHex("0a0b0c0d");
+    std::vector<unsigned char> vchExtraNonce2 = ParseHex("01020304");
+
+    for (unsigned int nTx = 0; nTx < 6; nTx++)
+    {
+        CStratumJob job;
+        BOOST_REQUIRE(job.SetTemplate(MakeTemplate(nTx), NULL, "1"));
+
+        CTransaction txCoinbase;
+        BOOST_REQUIRE(job.BuildCoinbase(vchExtraNonce1, vchExtraNonce2, txCoinbase));
+        BOOST_CHECK(txCoinbase.IsCoinBase());
+        BOOST_CHECK(txCoinbase.vout == job.block.vtx[0].vout);
+
+        // The extranonces land inside the reserved scriptSig push
+        std::vector<unsigned char> vchExtraNonce(vchExtraNonce1);
+        vchExtraNonce.insert(vchExtraNonce.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+        const CScript& scriptSig = txCoinbase.vin[0].scriptSig;
+        BOOST_CHECK(std::search(scriptSig.begin(), scriptSig.end(), vchExtraNonce.begin(), vchExtraNonce.end()) != scriptSig.end());
+
+        // A miner's merkle root from the branch must match the full tree
+        CBlock block;
+        BOOST_REQUIRE(job.BuildBlock(vchExtraNonce1, vchExtraNonce2, job.block.nTime + 1, 12345, block));
+        BOOST_CHECK_EQUAL(block.vtx.size(), nTx + 1);
+        BOOST_CHECK(block.hashMerkleRoot == block.BuildMerkleTree());
+        BOOST_CHECK_EQUAL(block.nNonce, 12345U);
+        BOOST_CHECK(block.hashPrevBlock == job.block.hashPrevBlock);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stratum_bad_extranonce)
+{
+    CStratumJob job;
+    BOOST_REQUIRE(job.SetTemplate(MakeTemplate(2), NULL, "1"));
+
+    CTransaction txCoinbase;
+    BOOST_CHECK(!job.BuildCoinbase(ParseHex("0a0b0c"), ParseHex("01020304"), txCoinbase));
+    BOOST_CHECK(!job.BuildCoinbase(ParseHex("0a0b0c0d"), ParseHex("0102030405"), txCoinbase));
+}
+
+BOOST_AUTO_TEST_CASE(stratum_difficulty_target)
+{
+    BOOST_CHECK(StratumDifficultyToTarget(1) == CBigNum().SetCompact(0x1f00ffff).getuint256());
+    BOOST_CHECK(StratumDifficultyToTarget(2) == CBigNum().SetCompact(0x1e7fff80).getuint256());
+    BOOST_CHECK(StratumDifficultyToTarget(0.5) > StratumDifficultyToTarget(1));
+    // Tiny difficulties are clamped instead of overflowing 256 bits
+    BOOST_CHECK(StratumDifficultyToTarget(0) == StratumDifficultyToTarget(1.0 / 65536));
+    BOOST_CHECK(StratumDifficultyToTarget(1e300) == StratumDifficultyToTarget(MAX_STRATUM_DIFFICULTY));
+}
+
+BOOST_AUTO_TEST_CASE(stratum_suggest_difficulty)
+{
+    double dDifficulty = 0;
+    BOOST_CHECK(StratumClampDifficulty(8, 4, dDifficulty));
+    BOOST_CHECK_EQUAL(dDifficulty, 8);
+
+    // Not below the operator's minimum
+    BOOST_CHECK(StratumClampDifficulty(1.0 / 65536, 4, dDifficulty));
+    BOOST_CHECK_EQUAL(dDifficulty, 4);
+    BOOST_CHECK(StratumClampDifficulty(-1, 4, dDifficulty));
+    BOOST_CHECK_EQUAL(dDifficulty, 4);
+
+    // Not above the maximum, which still makes a usable target
+    BOOST_CHECK(StratumClampDifficulty(1e300, 4, dDifficulty));
+    BOOST_CHECK_EQUAL(dDifficulty, MAX_STRATUM_DIFFICULTY);
+    BOOST_CHECK(StratumDifficultyToTarget(dDifficulty) != 0);
+
+    // What ReadJSON makes of 1e999, and NaN, are turned away
+    dDifficulty = 4;
+    BOOST_CHECK(!StratumClampDifficulty(std::numeric_limits<double>::infinity(), 4, dDifficulty));
+    BOOST_CHECK(!StratumClampDifficulty(-std::numeric_limits<double>::infinity(), 4, dDifficulty));
+    BOOST_CHECK(!StratumClampDifficulty(std::numeric_limits<double>::quiet_NaN(), 4, dDifficulty));
+    BOOST_CHECK_EQUAL(dDifficulty, 4);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,92 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "sync.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(sync_tests)
+
+static CLockStats GetStats(const string& strName)
+{
+    map<string, CLockStats> mapStats;
+    GetLockStats(mapStats);
+    return mapStats[strName];
+}
+
+static void HoldLock(CFastCriticalSection* pcs_synctest_fast, bool* pfLocked)
+{
+    FAST_LOCK(*pcs_synctest_fast);
+    *pfLocked = true;
+    Sleep(50);
+}
+
+BOOST_AUTO_TEST_CASE(sync_lockstats)
+{
+    fLockStats = true;
+
+    // Recursive locks count each time they are taken; TRY_LOCK counts too
+    CCriticalSection cs_synctest;
+    {
+        LOCK(cs_synctest);
+        {
+            LOCK(cs_synctest);
+            TRY_LOCK(cs_synctest, lockTry);
+            BOOST_CHECK(lockTry ? true : false);
+        }
+    }
+    CLockStats stats = GetStats("cs_synctest");
+    BOOST_CHECK_EQUAL(stats.nAcquired, 3U);
+    BOOST_CHECK_EQUAL(stats.nContended, 0U);
+    BOOST_CHECK_EQUAL(stats.vWaitBuckets[0], 3U);
+
+    // Waiting for another thread shows up as contention, in a bucket of
+    // 1ms or more
+    CFastCriticalSection cs_synctest_fast;
+    bool fLocked = false;
+    {
+        // Named here rather than by the other thread
+        FAST_LOCK(cs_synctest_fast);
+    }
+    boost::thread thread(HoldLock, &cs_synctest_fast, &fLocked);
+    while (true)
+    {
+        {
+            FAST_LOCK(cs_synctest_fast);
+            if (fLocked)
+                break;
+        }
+        Sleep(1);
+    }
+    thread.join();
+    stats = GetStats("cs_synctest_fast");
+    BOOST_CHECK(stats.nContended >= 1);
+    BOOST_CHECK(stats.nMaxWaitMicros >= 1000);
+    BOOST_CHECK(stats.nMaxHoldMicros >= 1000);
+    uint64 nLongWaits = 0;
+    for (int i = 4; i < CLockStats::WAIT_BUCKETS; i++)
+        nLongWaits += stats.vWaitBuckets[i];
+    BOOST_CHECK(nLongWaits >= 1);
+
+    // Locks that go away keep their numbers, under the same name
+    for (int i = 0; i < 2; i++)
+    {
+        CCriticalSection cs_synctest_gone;
+        LOCK(cs_synctest_gone);
+    }
+    BOOST_CHECK_EQUAL(GetStats("cs_synctest_gone").nAcquired, 2U);
+
+    // With stats off nothing is counted
+    fLockStats = false;
+    {
+        LOCK(cs_synctest);
+    }
+    BOOST_CHECK_EQUAL(GetStats("cs_synctest").nAcquired, 3U);
+
+    ResetLockStats();
+    BOOST_CHECK_EQUAL(GetStats("cs_synctest").nAcquired, 0U);
+    BOOST_CHECK_EQUAL(GetStats("cs_synctest_gone").nAcquired, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -292,4 +292,214 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(wallet_orderpos_serialization)
+{
+    CAccountingEntry acentry;
+    acentry.strAccount = "a";
+    acentry.nCreditDebit = -5 * CENT;
+    acentry.nTime = 1317972665;
+    acentry.strOtherAccount = "b";
+    acentry.strComment = "moving";
+
+    // Without a position it serializes exactly as before
+    CDataStream ssLegacy(SER_DISK, CLIENT_VERSION);
+    ssLegacy << acentry;
+    BOOST_CHECK_EQUAL(acentry.strComment, "moving");
+    CAccountingEntry acentryLegacy;
+    ssLegacy >> acentryLegacy;
+    BOOST_CHECK_EQUAL(acentryLegacy.strComment, "moving");
+    BOOST_CHECK_EQUAL(acentryLegacy.nOrderPos, -1);
+
+    // With one, it rides behind a NUL in the comment
+    acentry.nOrderPos = 42;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << acentry;
+    BOOST_CHECK_EQUAL(acentry.strComment, "moving");
+    BOOST_CHECK(acentry.mapValue.empty());
+    CAccountingEntry acentryRead;
+    ss >> acentryRead;
+    BOOST_CHECK_EQUAL(acentryRead.strComment, "moving");
+    BOOST_CHECK_EQUAL(acentryRead.nOrderPos, 42);
+    BOOST_CHECK_EQUAL(acentryRead.nCreditDebit, -5 * CENT);
+    BOOST_CHECK(acentryRead.mapValue.empty());
+
+    CTransaction tx;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    CWalletTx wtx(&wallet, tx);
+    wtx.mapValue["comment"] = "c";
+    CDataStream ssTx(SER_DISK, CLIENT_VERSION);
+    ssTx << wtx;
+    CWalletTx wtxRead;
+    ssTx >> wtxRead;
+    BOOST_CHECK_EQUAL(wtxRead.nOrderPos, -1);
+
+    wtx.nOrderPos = 7;
+    ssTx << wtx;
+    ssTx >> wtxRead;
+    BOOST_CHECK_EQUAL(wtxRead.nOrderPos, 7);
+    BOOST_CHECK_EQUAL(wtxRead.mapValue.size(), 1U);
+    BOOST_CHECK_EQUAL(wtx.mapValue.size(), 1U);
+}
+
+static void AddPaymentTo(CWallet& w, const CKeyID& keyID, int64 nValue)
+{
+    static int i;
+    CTransaction tx;
+    tx.nLockTime = i++;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey.SetDestination(keyID);
+    CWalletTx& wtx = w.mapWallet[tx.GetHash()];
+    wtx = CWalletTx(&w, tx);
+    wtx.BindWallet(&w);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_balance_cache)
+{
+    uint256 hashBestChainOld = hashBestChain;
+    hashBestChain = GetRandHash();
+
+    CWallet w;
+    CKey key;
+    key.MakeNewKey(true);
+    w.AddKey(key);
+    CKeyID keyID = key.GetPubKey().GetID();
+
+    AddPaymentTo(w, keyID, COIN);
+    BOOST_CHECK_EQUAL(w.GetBalance(), 0);
+    BOOST_CHECK_EQUAL(w.GetUnconfirmedBalance(), COIN);
+    BOOST_CHECK_EQUAL(w.GetImmatureBalance(), 0);
+    BOOST_CHECK_EQUAL(w.GetAccountBalance("", 0), COIN);
+    BOOST_CHECK_EQUAL(w.GetAccountBalance("", 1), 0);
+    BOOST_CHECK_EQUAL(w.GetAccountBalance("*", 0), COIN);
+    BOOST_CHECK_EQUAL(w.GetAccountBalance("other", 0), 0);
+
+    // Labelling the address moves the receive to its account
+    w.SetAddressBookName(keyID, "acct");
+    BOOST_CHECK_EQUAL(w.GetAccountBalance("acct", 0), COIN);
+    BOOST_CHECK_EQUAL(w.GetAccountBalance("", 0), 0);
+    BOOST_CHECK_EQUAL(w.GetAccountBalance("*", 0), COIN);
+    BOOST_CHECK_EQUAL(w.GetUnconfirmedBalance(), COIN);
+
+    // Changing mapWallet behind the wallet's back is not noticed until
+    // the cache is dropped or the best chain moves
+    AddPaymentTo(w, keyID, 2 * COIN);
+    BOOST_CHECK_EQUAL(w.GetUnconfirmedBalance(), COIN);
+    BOOST_CHECK_EQUAL(w.GetAccountBalance("acct", 0), COIN);
+    w.InvalidateBalances();
+    BOOST_CHECK_EQUAL(w.GetUnconfirmedBalance(), 3 * COIN);
+    BOOST_CHECK_EQUAL(w.GetAccountBalance("acct", 0), 3 * COIN);
+
+    AddPaymentTo(w, keyID, 4 * COIN);
+    hashBestChain = GetRandHash();
+    BOOST_CHECK_EQUAL(w.GetUnconfirmedBalance(), 7 * COIN);
+    BOOST_CHECK_EQUAL(w.GetAccountBalance("*", 0), 7 * COIN);
+
+    hashBestChain = hashBestChainOld;
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_exact)
+{
+    CoinSet setCoinsRet;
+    int64 nValueRet;
+
+    // 3+4 is the only exact subset, but 5 is closer to the approximation's
+    // first guess; the branch and bound search finds 3+4 every time
+    for (int i = 0; i < RUN_TESTS; i++)
+    {
+        empty_wallet();
+        add_coin(5*CENT);
+        add_coin(4*CENT);
+        add_coin(3*CENT);
+        add_coin(2*CENT + CENT/2);
+        BOOST_CHECK(wallet.SelectCoinsMinConf(7 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 7 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+    }
+
+    // A big wallet of odd amounts.  There is an exact subset, but not one
+    // the search is likely to hit; run with --log_level=message to see how
+    // long the search takes
+    empty_wallet();
+    int64 nTarget = 0;
+    for (int i = 0; i < 100000; i++)
+    {
+        int64 nValue = CENT + GetRand(COIN);
+        add_coin(nValue);
+        if (i % 9973 == 0)
+            nTarget += nValue;
+    }
+    int64 nStart = GetTimeMillis();
+    BOOST_CHECK(wallet.SelectCoinsMinConf(nTarget, 1, 1, vCoins, setCoinsRet, nValueRet));
+    int64 nElapsed = GetTimeMillis() - nStart;
+    BOOST_CHECK_GE(nValueRet, nTarget);
+    BOOST_CHECK(nValueRet == nTarget || nValueRet >= nTarget + CENT);
+    BOOST_TEST_MESSAGE(strprintf("SelectCoinsMinConf over %u coins: %"PRI64d"ms, %u inputs",
+        (unsigned int)vCoins.size(), nElapsed, (unsigned int)setCoinsRet.size()));
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(wallet_spendable_index)
+{
+    CWallet w;
+    CKey key;
+    key.MakeNewKey(true);
+    w.AddKey(key);
+    CKeyID keyID = key.GetPubKey().GetID();
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+
+    AddPaymentTo(w, keyID, 3 * COIN);
+    AddPaymentTo(w, keyID, COIN);
+    AddPaymentTo(w, keyOther.GetPubKey().GetID(), 2 * COIN);
+    w.RebuildSpendable();
+    BOOST_CHECK_EQUAL(w.setSpendable.size(), 2U);
+    BOOST_CHECK_EQUAL(w.setSpendable.begin()->first, COIN);
+    BOOST_CHECK_EQUAL(w.setSpendable.rbegin()->first, 3 * COIN);
+
+    const CWalletTx* pwtx = w.setSpendable.begin()->second.first;
+    CWalletTx& wtx = w.mapWallet[pwtx->GetHash()];
+    wtx.MarkSpent(0);
+    w.UpdateSpendable(wtx);
+    BOOST_CHECK_EQUAL(w.setSpendable.size(), 1U);
+    BOOST_CHECK_EQUAL(w.setSpendable.begin()->first, 3 * COIN);
+
+    w.UpdateSpendable(*w.setSpendable.begin()->second.first, true);
+    BOOST_CHECK(w.setSpendable.empty());
+}
+
+BOOST_AUTO_TEST_CASE(wallet_keypool_fill)
+{
+    mapArgs["-keypool"] = "500";
+    CWallet w;
+
+    int64 nStart = GetTimeMillis();
+    BOOST_CHECK(w.TopUpKeyPool());
+    BOOST_TEST_MESSAGE(strprintf("TopUpKeyPool of 501 keys: %"PRI64d"ms", GetTimeMillis() - nStart));
+    BOOST_CHECK_EQUAL(w.setKeyPool.size(), 501U);
+    BOOST_CHECK_EQUAL(*w.setKeyPool.begin(), 1);
+    BOOST_CHECK_EQUAL(*w.setKeyPool.rbegin(), 501);
+    std::set<CKeyID> setKeys;
+    w.GetKeys(setKeys);
+    BOOST_CHECK_EQUAL(setKeys.size(), 501U);
+
+    // Already full: nothing to do
+    BOOST_CHECK(w.TopUpKeyPool());
+    BOOST_CHECK_EQUAL(w.setKeyPool.size(), 501U);
+
+    // Topped up from where the pool ends
+    w.setKeyPool.erase(w.setKeyPool.begin());
+    w.setKeyPool.erase(w.setKeyPool.begin());
+    BOOST_CHECK(w.TopUpKeyPool());
+    BOOST_CHECK_EQUAL(w.setKeyPool.size(), 501U);
+    BOOST_CHECK_EQUAL(*w.setKeyPool.rbegin(), 503);
+
+    BOOST_CHECK(w.NewKeyPool());
+    BOOST_CHECK_EQUAL(w.setKeyPool.size(), 500U);
+    w.GetKeys(setKeys);
+    BOOST_CHECK_EQUAL(setKeys.size(), 1003U);
+    mapArgs.erase("-keypool");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
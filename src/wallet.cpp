@@ -10,6 +10,8 @@
 #include "ui_interface.h"
 #include "base58.h"
 
+#include <boost/thread.hpp>
+
 using namespace std;
 
 
@@ -75,6 +77,8 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    InvalidateBalances();
+    RebuildSpendable();
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -310,6 +314,8 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                     printf("WalletUpdateSpent found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    balanceCache.SetNull();
+                    UpdateSpendable(wtx);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -323,7 +329,61 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        balanceCache.SetNull();
+        RebuildSpendable();
+    }
+}
+
+void CWallet::UpdateSpendable(const CWalletTx& wtx, bool fErase)
+{
+    LOCK(cs_wallet);
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        pair<int64, pair<const CWalletTx*, unsigned int> > coin = make_pair(wtx.vout[i].nValue, make_pair(&wtx, i));
+        if (!fErase && !wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+            setSpendable.insert(coin);
+        else
+            setSpendable.erase(coin);
+    }
+}
+
+void CWallet::RebuildSpendable()
+{
+    LOCK(cs_wallet);
+    setSpendable.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateSpendable((*it).second);
+}
+
+int64 CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
+{
+    int64 nRet = nOrderPosNext++;
+    if (fFileBacked)
+    {
+        if (pwalletdb)
+            pwalletdb->WriteOrderPosNext(nOrderPosNext);
+        else
+            CWalletDB(strWalletFile).WriteOrderPosNext(nOrderPosNext);
     }
+    return nRet;
+}
+
+bool CWallet::AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb)
+{
+    LOCK(cs_wallet);
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    if (!walletdb.WriteAccountingEntry(entry))
+    {
+        laccentries.pop_back();
+        return false;
+    }
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+
+    // Moves don't depend on confirmations, so the account tallies can take them as they are
+    for (map<int, map<string, int64> >::iterator it = balanceCache.mapAccounts.begin(); it != balanceCache.mapAccounts.end(); ++it)
+        (*it).second[entry.strAccount] += entry.nCreditDebit;
+    return true;
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
@@ -337,7 +397,11 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         wtx.BindWallet(this);
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
+        {
             wtx.nTimeReceived = GetAdjustedTime();
+            wtx.nOrderPos = IncOrderPosNext();
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+        }
 
         bool fUpdated = false;
         if (!fInsertedNew)
@@ -365,6 +429,12 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().substr(0,10).c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
+        if (fInsertedNew || fUpdated)
+        {
+            balanceCache.SetNull();
+            UpdateSpendable(wtx);
+        }
+
         // Write to disk
         if (fInsertedNew || fUpdated)
             if (!wtx.WriteToDisk())
@@ -425,8 +495,21 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(mi->second.nOrderPos);
+            for (TxItems::iterator it = range.first; it != range.second; ++it)
+                if (it->second.first == &mi->second)
+                {
+                    wtxOrdered.erase(it);
+                    break;
+                }
+            UpdateSpendable(mi->second, true);
+            mapWallet.erase(mi);
+            balanceCache.SetNull();
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return true;
 }
@@ -680,31 +763,219 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+// Keys and scripts of a wallet copied out for the rescan workers, so they can
+// run IsMine on block outputs without cs_wallet.  It only answers "do we have
+// this key/script": secrets are never copied, crypted or not.
+class CRescanKeyStore : public CKeyStore
+{
+public:
+    set<CKeyID> setKeys;
+    ScriptMap mapScripts;
+    CKeyIDFilter filter;
+
+    bool AddKey(const CKey& key) { return false; }
+    bool HaveKey(const CKeyID &address) const { return setKeys.count(address) > 0; }
+    bool GetKey(const CKeyID &address, CKey& keyOut) const { return false; }
+    void GetKeys(set<CKeyID> &setAddress) const { setAddress = setKeys; }
+    bool AddCScript(const CScript& redeemScript) { return false; }
+    bool HaveCScript(const CScriptID &hash) const { return mapScripts.count(hash) > 0; }
+    bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const
+    {
+        ScriptMap::const_iterator mi = mapScripts.find(hash);
+        if (mi == mapScripts.end())
+            return false;
+        redeemScriptOut = (*mi).second;
+        return true;
+    }
+    bool MayHave(const uint160& hash) const { return filter.contains(hash); }
+};
+
+// One batch of blocks being read and filtered by the rescan workers
+struct CRescanBatch
+{
+    CCriticalSection cs;
+    const CRescanKeyStore* pkeystore;
+    vector<CBlockIndex*> vIndex;
+    vector<CBlock> vBlock;
+    // vMatch[i][j]: some output of vBlock[i].vtx[j] pays to us
+    vector<vector<bool> > vMatch;
+    unsigned int nNext;
+};
+
+static void RescanWorker(CRescanBatch* pbatch)
+{
+    loop
+    {
+        unsigned int i;
+        {
+            LOCK(pbatch->cs);
+            if (pbatch->nNext >= pbatch->vIndex.size())
+                return;
+            i = pbatch->nNext++;
+        }
+        CBlock& block = pbatch->vBlock[i];
+        block.ReadFromDisk(pbatch->vIndex[i], true);
+        vector<bool>& vMatch = pbatch->vMatch[i];
+        vMatch.assign(block.vtx.size(), false);
+        for (unsigned int j = 0; j < block.vtx.size(); j++)
+            BOOST_FOREACH(const CTxOut& txout, block.vtx[j].vout)
+                if (::IsMine(*pbatch->pkeystore, txout.scriptPubKey))
+                {
+                    vMatch[j] = true;
+                    break;
+                }
+    }
+}
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+//
+// Blocks are read and their outputs matched against a snapshot of our keys
+// by -rescanthreads workers, a batch at a time; the matches are then added
+// in chain order, taking the locks once per block.  Progress is checkpointed
+// to the wallet so a rescan cut short by shutdown resumes on the next start.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
+    static const unsigned int nBatchSize = 128;
     int ret = 0;
 
+    int nThreads = GetArg("-rescanthreads", boost::thread::hardware_concurrency());
+    nThreads = max(1, min(nThreads, 16));
+
+    CRescanKeyStore keystore;
+    {
+        LOCK2(cs_wallet, cs_KeyStore);
+        GetKeys(keystore.setKeys);
+        keystore.mapScripts = mapScripts;
+        keystore.filter = filter;
+
+        rescanProgress.SetNull();
+        rescanProgress.fRunning = true;
+        rescanProgress.nStartHeight = rescanProgress.nHeight = pindexStart ? pindexStart->nHeight : -1;
+        rescanProgress.nStopHeight = nBestHeight;
+        rescanProgress.nStartTime = GetTime();
+    }
+
+    int64 nLastCheckpoint = GetTime();
     CBlockIndex* pindex = pindexStart;
+    while (pindex && !fShutdown)
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        CRescanBatch batch;
+        batch.pkeystore = &keystore;
+        batch.nNext = 0;
         {
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            LOCK(cs_main);
+            // A reorganize since the last batch moved us off the main chain:
+            // step back to the fork and carry on from there
+            if (!pindex->IsInMainChain())
+                pindex = LastCommonAncestor(pindex, pindexBest);
+            for (; pindex && batch.vIndex.size() < nBatchSize; pindex = pindex->pnext)
+                batch.vIndex.push_back(pindex);
+        }
+        batch.vBlock.resize(batch.vIndex.size());
+        batch.vMatch.resize(batch.vIndex.size());
+
+        boost::thread_group workers;
+        for (int i = 1; i < nThreads; i++)
+            workers.create_thread(boost::bind(&RescanWorker, &batch));
+        RescanWorker(&batch);
+        workers.join_all();
+
+        for (unsigned int i = 0; i < batch.vBlock.size(); i++)
+        {
+            const CBlock& block = batch.vBlock[i];
+            LOCK2(cs_main, cs_wallet);
+            for (unsigned int j = 0; j < block.vtx.size(); j++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                const CTransaction& tx = block.vtx[j];
+                // Outputs were matched by the workers; whether it spends one of
+                // ours depends on what earlier blocks added, so check it here
+                bool fCandidate = batch.vMatch[i][j] || (fUpdate && mapWallet.count(tx.GetHash()));
+                for (unsigned int k = 0; !fCandidate && k < tx.vin.size(); k++)
+                    fCandidate = mapWallet.count(tx.vin[k].prevout.hash) > 0;
+                if (fCandidate && AddToWalletIfInvolvingMe(tx, &block, fUpdate))
                     ret++;
             }
-            pindex = pindex->pnext;
+            rescanProgress.nHeight = batch.vIndex[i]->nHeight;
+            rescanProgress.nStopHeight = max(rescanProgress.nStopHeight, nBestHeight);
+            rescanProgress.nFound = ret;
+        }
+
+        if (fFileBacked && pindex && GetTime() - nLastCheckpoint >= 10)
+        {
+            LOCK(cs_main);
+            CWalletDB(strWalletFile).WriteRescanBlock(CBlockLocator(batch.vIndex.back()));
+            nLastCheckpoint = GetTime();
         }
     }
+
+    if (fFileBacked && !fShutdown)
+        CWalletDB(strWalletFile).EraseRescanBlock();
+
+    {
+        LOCK(cs_wallet);
+        rescanProgress.fRunning = false;
+    }
     return ret;
 }
 
+void ThreadRescan(void* parg)
+{
+    CWallet* pwallet = (CWallet*)parg;
+    loop
+    {
+        CBlockIndex* pindexStart;
+        {
+            LOCK(pwallet->cs_wallet);
+            pindexStart = pwallet->pindexRescanNext;
+            pwallet->pindexRescanNext = NULL;
+            if (!pindexStart || fShutdown)
+            {
+                pwallet->fRescanThread = false;
+                return;
+            }
+        }
+        pwallet->ScanForWalletTransactions(pindexStart, true);
+        if (fShutdown)
+            continue;
+        // Takes cs_wallet itself, and for any rescan drops it between batches
+        pwallet->ReacceptWalletTransactions();
+    }
+}
+
+void CWallet::StartRescan(CBlockIndex* pindexStart)
+{
+    LOCK(cs_wallet);
+    if (fShutdown)
+        return;
+    // A pass already queued from earlier in the chain covers this one too
+    if (pindexRescanNext && pindexRescanNext->nHeight <= pindexStart->nHeight)
+        return;
+    pindexRescanNext = pindexStart;
+    if (fRescanThread)
+        return;
+    fRescanThread = true;
+    if (!CreateThread(ThreadRescan, this))
+    {
+        printf("Error: CreateThread(ThreadRescan) failed\n");
+        fRescanThread = false;
+    }
+}
+
+void CWallet::WaitForThreads()
+{
+    loop
+    {
+        {
+            LOCK(cs_wallet);
+            if (!fRescanThread && !fTopUpThread)
+                return;
+        }
+        Sleep(20);
+    }
+}
+
 int CWallet::ScanForWalletTransaction(const uint256& hashTx)
 {
     CTransaction tx;
@@ -720,50 +991,55 @@ void CWallet::ReacceptWalletTransactions()
     bool fRepeat = true;
     while (fRepeat)
     {
-        LOCK(cs_wallet);
         fRepeat = false;
         vector<CDiskTxPos> vMissingTx;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
         {
-            CWalletTx& wtx = item.second;
-            if (wtx.IsCoinBase() && wtx.IsSpent(0))
-                continue;
-
-            CTxIndex txindex;
-            bool fUpdated = false;
-            if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
+            LOCK(cs_wallet);
+            BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             {
-                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
-                if (txindex.vSpent.size() != wtx.vout.size())
-                {
-                    printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %d != wtx.vout.size() %d\n", txindex.vSpent.size(), wtx.vout.size());
+                CWalletTx& wtx = item.second;
+                if (wtx.IsCoinBase() && wtx.IsSpent(0))
                     continue;
-                }
-                for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+
+                CTxIndex txindex;
+                bool fUpdated = false;
+                if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
                 {
-                    if (wtx.IsSpent(i))
+                    // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
+                    if (txindex.vSpent.size() != wtx.vout.size())
+                    {
+                        printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %d != wtx.vout.size() %d\n", txindex.vSpent.size(), wtx.vout.size());
                         continue;
-                    if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                    }
+                    for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+                    {
+                        if (wtx.IsSpent(i))
+                            continue;
+                        if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                        {
+                            wtx.MarkSpent(i);
+                            fUpdated = true;
+                            vMissingTx.push_back(txindex.vSpent[i]);
+                        }
+                    }
+                    if (fUpdated)
                     {
-                        wtx.MarkSpent(i);
-                        fUpdated = true;
-                        vMissingTx.push_back(txindex.vSpent[i]);
+                        printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
+                        wtx.MarkDirty();
+                        wtx.WriteToDisk();
+                        balanceCache.SetNull();
+                        UpdateSpendable(wtx);
                     }
                 }
-                if (fUpdated)
+                else
                 {
-                    printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
-                    wtx.MarkDirty();
-                    wtx.WriteToDisk();
+                    // Reaccept any txes of ours that aren't already in a block
+                    if (!wtx.IsCoinBase())
+                        wtx.AcceptWalletTransaction(txdb, false);
                 }
             }
-            else
-            {
-                // Reaccept any txes of ours that aren't already in a block
-                if (!wtx.IsCoinBase())
-                    wtx.AcceptWalletTransaction(txdb, false);
-            }
         }
+        // The rescan takes cs_main, so it must run without cs_wallet held
         if (!vMissingTx.empty())
         {
             // TODO: optimize this to scan just part of the block chain?
@@ -853,50 +1129,123 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64 CWallet::GetBalance() const
+// Throw away tallies made against another best chain.  Wallets holding a
+// time-locked transaction that is not final yet are tallied afresh on every
+// call, as that can change without a new block (see TallyAccountBalances).
+bool CWallet::CheckBalanceCache() const
 {
-    int64 nTotal = 0;
+    if (balanceCache.hashTip != hashBestChain)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsFinal() && pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+        balanceCache.SetNull();
+        balanceCache.hashTip = hashBestChain;
     }
-
-    return nTotal;
+    return balanceCache.hashTip != 0;
 }
 
-int64 CWallet::GetUnconfirmedBalance() const
+void CWallet::TallyBalances() const
 {
-    int64 nTotal = 0;
+    int64 nBalance = 0, nUnconfirmed = 0, nImmature = 0;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const CWalletTx* pcoin = &(*it).second;
+        if (pcoin->IsFinal() && pcoin->IsConfirmed())
+            nBalance += pcoin->GetAvailableCredit();
+        else
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
+            if (!pcoin->IsFinal() && pcoin->nLockTime >= LOCKTIME_THRESHOLD)
+                balanceCache.hashTip = 0;
+            nUnconfirmed += pcoin->GetAvailableCredit();
         }
+        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() >= 2)
+            nImmature += GetCredit(*pcoin);
     }
-    return nTotal;
+    balanceCache.nBalance = nBalance;
+    balanceCache.nUnconfirmed = nUnconfirmed;
+    balanceCache.nImmature = nImmature;
+    balanceCache.fTotals = true;
 }
 
-int64 CWallet::GetImmatureBalance() const
+void CWallet::TallyAccountBalances(int nMinDepth) const
 {
-    int64 nTotal = 0;
+    map<string, int64>& mapBalances = balanceCache.mapAccounts[nMinDepth];
+    int64& nAll = balanceCache.mapAll[nMinDepth];
+    mapBalances.clear();
+    nAll = 0;
+
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const CWalletTx& wtx = (*it).second;
+        if (!wtx.IsFinal())
+        {
+            if (wtx.nLockTime >= LOCKTIME_THRESHOLD)
+                balanceCache.hashTip = 0;
+            continue;
+        }
+
+        int64 nGeneratedImmature, nGeneratedMature, nFee;
+        string strSentAccount;
+        list<pair<CTxDestination, int64> > listReceived;
+        list<pair<CTxDestination, int64> > listSent;
+        wtx.GetAmounts(nGeneratedImmature, nGeneratedMature, listReceived, listSent, nFee, strSentAccount);
+
+        int64 nSent = 0;
+        BOOST_FOREACH(const PAIRTYPE(CTxDestination, int64)& s, listSent)
+            nSent += s.second;
+        mapBalances[strSentAccount] -= nSent + nFee;
+        mapBalances[""] += nGeneratedMature;
+        nAll += nGeneratedMature - nSent - nFee;
+
+        if (!listReceived.empty() && wtx.GetDepthInMainChain() >= nMinDepth)
         {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.GetDepthInMainChain() >= 2)
-                nTotal += GetCredit(pcoin);
+            BOOST_FOREACH(const PAIRTYPE(CTxDestination, int64)& r, listReceived)
+            {
+                map<CTxDestination, string>::const_iterator mi = mapAddressBook.find(r.first);
+                mapBalances[mi != mapAddressBook.end() ? (*mi).second : string("")] += r.second;
+                nAll += r.second;
+            }
         }
     }
-    return nTotal;
+
+    // Internal accounting entries
+    BOOST_FOREACH(const CAccountingEntry& entry, laccentries)
+        mapBalances[entry.strAccount] += entry.nCreditDebit;
+}
+
+int64 CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    if (!CheckBalanceCache() || !balanceCache.fTotals)
+        TallyBalances();
+    return balanceCache.nBalance;
+}
+
+int64 CWallet::GetUnconfirmedBalance() const
+{
+    LOCK(cs_wallet);
+    if (!CheckBalanceCache() || !balanceCache.fTotals)
+        TallyBalances();
+    return balanceCache.nUnconfirmed;
+}
+
+int64 CWallet::GetImmatureBalance() const
+{
+    LOCK(cs_wallet);
+    if (!CheckBalanceCache() || !balanceCache.fTotals)
+        TallyBalances();
+    return balanceCache.nImmature;
+}
+
+int64 CWallet::GetAccountBalance(const string& strAccount, int nMinDepth) const
+{
+    LOCK(cs_wallet);
+    if (!CheckBalanceCache() || !balanceCache.mapAll.count(nMinDepth))
+        TallyAccountBalances(nMinDepth);
+
+    if (strAccount == "*")
+        return balanceCache.mapAll[nMinDepth];
+    const map<string, int64>& mapBalances = balanceCache.mapAccounts[nMinDepth];
+    map<string, int64>::const_iterator mi = mapBalances.find(strAccount);
+    return (mi != mapBalances.end() ? (*mi).second : 0);
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -906,9 +1255,14 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins) const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        // setSpendable is sorted by value, so dust is all at the front.
+        // If output is less than minimum value, then don't include transaction.
+        // This is to help deal with dust spam clogging up create transactions.
+        SpendableIndex::const_iterator it = setSpendable.lower_bound(make_pair(nMinimumInputValue, make_pair((const CWalletTx*)NULL, 0U)));
+        vCoins.reserve(std::distance(it, setSpendable.end()));
+        for (; it != setSpendable.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second.first;
 
             if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
                 continue;
@@ -916,16 +1270,12 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins) const
             if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
                 continue;
 
-            // If output is less than minimum value, then don't include transaction.
-            // This is to help deal with dust spam clogging up create transactions.
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue)
-                    vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
+            vCoins.push_back(COutput(pcoin, (*it).second.second, pcoin->GetDepthInMainChain()));
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >vValue, int64 nTotalLower, int64 nTargetValue,
+static void ApproximateBestSubset(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTotalLower, int64 nTargetValue,
                                   vector<char>& vfBest, int64& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -963,7 +1313,56 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
     }
 }
 
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+// Branch and bound search for a subset of vValue (sorted largest first)
+// adding up to exactly nTargetValue, which needs no change output at all.
+// Gives up after nMaxTries steps and leaves it to ApproximateBestSubset.
+static bool SelectCoinsExact(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTargetValue,
+                             vector<char>& vfBest, int nMaxTries = 100000)
+{
+    // vnRemaining[i] is what coins i.. could still add
+    vector<int64> vnRemaining(vValue.size() + 1, 0);
+    for (unsigned int i = vValue.size(); i > 0; i--)
+        vnRemaining[i-1] = vnRemaining[i] + vValue[i-1].first;
+
+    vector<char> vfIncluded(vValue.size(), false);
+    int64 nTotal = 0;
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < nMaxTries; nTries++)
+    {
+        if (nTotal == nTargetValue)
+        {
+            vfBest = vfIncluded;
+            return true;
+        }
+
+        if (nTotal > nTargetValue || nTotal + vnRemaining[i] < nTargetValue)
+        {
+            // Backtrack: drop the last coin taken and carry on without it
+            while (i > 0 && !vfIncluded[i-1])
+                i--;
+            if (i == 0)
+                return false;
+            i--;
+            vfIncluded[i] = false;
+            nTotal -= vValue[i].first;
+            i++;
+            continue;
+        }
+
+        // Taking a coin equal to one just left out would only repeat that branch
+        if (i > 0 && !vfIncluded[i-1] && vValue[i].first == vValue[i-1].first)
+        {
+            i++;
+            continue;
+        }
+        vfIncluded[i] = true;
+        nTotal += vValue[i].first;
+        i++;
+    }
+    return false;
+}
+
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
     setCoinsRet.clear();
@@ -973,12 +1372,16 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
     pair<int64, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
     coinLowestLarger.first = std::numeric_limits<int64>::max();
     coinLowestLarger.second.first = NULL;
+    pair<int64, pair<const CWalletTx*,unsigned int> > coinExact;
+    coinExact.second.first = NULL;
     vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
     int64 nTotalLower = 0;
+    int nLowestLarger = 0, nExact = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    BOOST_FOREACH(COutput output, vCoins)
+    // Ties between single coins are broken at random here, and between
+    // equal coins in vValue below, so there is no need to copy and
+    // shuffle vCoins itself
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
@@ -992,9 +1395,8 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
 
         if (n == nTargetValue)
         {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
+            if (GetRandInt(++nExact) == 0)
+                coinExact = coin;
         }
         else if (n < nTargetValue + CENT)
         {
@@ -1002,11 +1404,23 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
             nTotalLower += n;
         }
         else if (n < coinLowestLarger.first)
+        {
+            coinLowestLarger = coin;
+            nLowestLarger = 1;
+        }
+        else if (n == coinLowestLarger.first && GetRandInt(++nLowestLarger) == 0)
         {
             coinLowestLarger = coin;
         }
     }
 
+    if (coinExact.second.first)
+    {
+        setCoinsRet.insert(coinExact.second);
+        nValueRet += coinExact.first;
+        return true;
+    }
+
     if (nTotalLower == nTargetValue)
     {
         for (unsigned int i = 0; i < vValue.size(); ++i)
@@ -1026,14 +1440,55 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
+    // Largest first, in random order among equal values.  Shuffling just
+    // the runs of equal coins saves an RNG call per coin.
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    for (unsigned int i = 0, j; i < vValue.size(); i = j)
+    {
+        for (j = i + 1; j < vValue.size() && vValue[j].first == vValue[i].first; j++)
+            ;
+        if (j - i > 1)
+            random_shuffle(vValue.begin() + i, vValue.begin() + j, GetRandInt);
+    }
     vector<char> vfBest;
     int64 nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+    // An exact subset beats anything else
+    if (SelectCoinsExact(vValue, nTargetValue, vfBest))
+    {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+        return true;
+    }
+
+    // Each round of the approximation is a pass over vValue, so a wallet
+    // with a great many small coins only offers its largest ones: enough
+    // to cover the target and a cent of change twice over.
+    if (vValue.size() > 1000)
+    {
+        int64 nTotal = 0;
+        unsigned int nKeep = 0;
+        while (nKeep < vValue.size() && nTotal < 2 * (nTargetValue + CENT))
+            nTotal += vValue[nKeep++].first;
+        nKeep = std::max(nKeep, 1000U);
+        if (nKeep < vValue.size())
+        {
+            vValue.resize(nKeep);
+            nTotalLower = 0;
+            for (unsigned int i = 0; i < vValue.size(); i++)
+                nTotalLower += vValue[i].first;
+        }
+    }
+
+    // Solve subset sum by stochastic approximation
+    int nIterations = std::max(10, std::min(1000, (int)(2000000 / vValue.size())));
+    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nIterations);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, nIterations);
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1226,8 +1681,10 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateSpendable(coin);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
+            balanceCache.SetNull();
 
             if (fFileBacked)
                 delete pwalletdb;
@@ -1333,6 +1790,7 @@ bool CWallet::SetAddressBookName(const CTxDestination& address, const string& st
 {
     std::map<CTxDestination, std::string>::iterator mi = mapAddressBook.find(address);
     mapAddressBook[address] = strName;
+    InvalidateBalances();
     NotifyAddressBookChanged(this, address, strName, ::IsMine(*this, address), (mi == mapAddressBook.end()) ? CT_NEW : CT_UPDATED);
     if (!fFileBacked)
         return false;
@@ -1342,6 +1800,7 @@ bool CWallet::SetAddressBookName(const CTxDestination& address, const string& st
 bool CWallet::DelAddressBookName(const CTxDestination& address)
 {
     mapAddressBook.erase(address);
+    InvalidateBalances();
     NotifyAddressBookChanged(this, address, "", ::IsMine(*this, address), CT_DELETED);
     if (!fFileBacked)
         return false;
@@ -1395,6 +1854,52 @@ bool GetWalletFile(CWallet* pwallet, string &strWalletFileOut)
     return true;
 }
 
+// Key generation for keypool refills, spread over the cores.  Each worker
+// also derives the public key, so none of the EC work is left for the
+// caller to do under cs_wallet.
+struct CKeyBatch
+{
+    CCriticalSection cs;
+    vector<CKey>& vKeys;
+    vector<CPubKey>& vPubKeys;
+    bool fCompressed;
+    unsigned int nNext;
+
+    CKeyBatch(vector<CKey>& vKeysIn, vector<CPubKey>& vPubKeysIn, bool fCompressedIn) :
+        vKeys(vKeysIn), vPubKeys(vPubKeysIn), fCompressed(fCompressedIn), nNext(0) { }
+};
+
+static void MakeNewKeysWorker(CKeyBatch* pbatch)
+{
+    loop
+    {
+        unsigned int i;
+        {
+            LOCK(pbatch->cs);
+            if (pbatch->nNext >= pbatch->vKeys.size())
+                return;
+            i = pbatch->nNext++;
+        }
+        pbatch->vKeys[i].MakeNewKey(pbatch->fCompressed);
+        pbatch->vPubKeys[i] = pbatch->vKeys[i].GetPubKey();
+    }
+}
+
+static void MakeNewKeys(vector<CKey>& vKeys, vector<CPubKey>& vPubKeys, bool fCompressed)
+{
+    RandAddSeedPerfmon();
+    vPubKeys.resize(vKeys.size());
+    CKeyBatch batch(vKeys, vPubKeys, fCompressed);
+
+    // Thread startup isn't worth it for the odd key
+    int nThreads = min((int)boost::thread::hardware_concurrency(), (int)vKeys.size() / 16);
+    boost::thread_group workers;
+    for (int i = 1; i < nThreads; i++)
+        workers.create_thread(boost::bind(&MakeNewKeysWorker, &batch));
+    MakeNewKeysWorker(&batch);
+    workers.join_all();
+}
+
 //
 // Mark old keypool keys as used,
 // and generate all new keys
@@ -1403,52 +1908,151 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
-        CWalletDB walletdb(strWalletFile);
-        BOOST_FOREACH(int64 nIndex, setKeyPool)
-            walletdb.ErasePool(nIndex);
+        if (fFileBacked)
+        {
+            CWalletDB walletdb(strWalletFile);
+            BOOST_FOREACH(int64 nIndex, setKeyPool)
+                walletdb.ErasePool(nIndex);
+        }
         setKeyPool.clear();
 
         if (IsLocked())
             return false;
-
-        int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64 nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
-        printf("CWallet::NewKeyPool wrote %"PRI64d" new keys\n", nKeys);
     }
+
+    int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
+    if (!FillKeyPool(nKeys))
+        return false;
+    printf("CWallet::NewKeyPool wrote %"PRI64d" new keys\n", nKeys);
     return true;
 }
 
 bool CWallet::TopUpKeyPool()
 {
+    unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
+    return FillKeyPool(nTargetSize + 1);
+}
+
+// Bring the key pool up to nSize keys.  The keys are generated on worker
+// threads without cs_wallet, then encrypted if need be and written to the
+// wallet in one transaction.
+bool CWallet::FillKeyPool(unsigned int nSize)
+{
+    unsigned int nKeys;
+    bool fCompressed;
     {
         LOCK(cs_wallet);
-
         if (IsLocked())
             return false;
+        if (setKeyPool.size() >= nSize)
+            return true;
+        nKeys = nSize - setKeyPool.size();
+        fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    }
 
-        CWalletDB walletdb(strWalletFile);
+    vector<CKey> vKeys(nKeys);
+    vector<CPubKey> vPubKeys;
+    MakeNewKeys(vKeys, vPubKeys, fCompressed);
 
-        // Top up key pool
-        unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
-        while (setKeyPool.size() < (nTargetSize + 1))
+    {
+        LOCK(cs_wallet);
+        // Locked while we were generating: nothing to encrypt them with
+        if (IsLocked() || fShutdown)
+            return false;
+
+        // Another fill may have run meanwhile; add only what is still missing
+        if (setKeyPool.size() >= nSize)
+            return true;
+        if (nSize - setKeyPool.size() < vKeys.size())
         {
+            nKeys = nSize - setKeyPool.size();
+            vKeys.resize(nKeys);
+            vPubKeys.resize(nKeys);
+        }
+
+        CWalletDB* pwalletdb = NULL;
+        if (fFileBacked)
+        {
+            pwalletdb = new CWalletDB(strWalletFile);
+            if (!pwalletdb->TxnBegin())
+            {
+                delete pwalletdb;
+                return false;
+            }
+        }
+
+        // Compressed public keys were introduced in version 0.6.0
+        if (fCompressed)
+            SetMinVersion(FEATURE_COMPRPUBKEY, pwalletdb);
+
+        // Crypted keys are written by AddCryptedKey, which goes through
+        // pwalletdbEncryption when it is set; point it at our transaction
+        CWalletDB* pwalletdbPrev = pwalletdbEncryption;
+        if (pwalletdb)
+            pwalletdbEncryption = pwalletdb;
+        bool fOk = true;
+        for (unsigned int i = 0; fOk && i < vKeys.size(); i++)
+        {
+            fOk = CCryptoKeyStore::AddKey(vKeys[i]);
+            if (fOk && pwalletdb && !IsCrypted())
+                fOk = pwalletdb->WriteKey(vPubKeys[i], vKeys[i].GetPrivKey());
+            if (!fOk)
+                break;
+
             int64 nEnd = 1;
             if (!setKeyPool.empty())
                 nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %"PRI64d", size=%d\n", nEnd, setKeyPool.size());
+            if (pwalletdb && !pwalletdb->WritePool(nEnd, CKeyPool(vPubKeys[i])))
+                fOk = false;
+            else
+                setKeyPool.insert(nEnd);
+        }
+        pwalletdbEncryption = pwalletdbPrev;
+
+        if (pwalletdb)
+        {
+            if (fOk)
+                fOk = pwalletdb->TxnCommit();
+            else
+                pwalletdb->TxnAbort();
+            delete pwalletdb;
         }
+        if (!fOk)
+            throw runtime_error("FillKeyPool() : writing generated keys failed");
+        printf("keypool added %u keys, size=%d\n", nKeys, setKeyPool.size());
     }
     return true;
 }
 
+void ThreadTopUpKeyPool(void* parg)
+{
+    CWallet* pwallet = (CWallet*)parg;
+    try
+    {
+        pwallet->TopUpKeyPool();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadTopUpKeyPool()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadTopUpKeyPool()");
+    }
+    LOCK(pwallet->cs_wallet);
+    pwallet->fTopUpThread = false;
+}
+
+void CWallet::StartTopUpKeyPool()
+{
+    LOCK(cs_wallet);
+    if (fTopUpThread || IsLocked() || fShutdown)
+        return;
+    fTopUpThread = true;
+    if (!CreateThread(ThreadTopUpKeyPool, this))
+    {
+        printf("Error: CreateThread(ThreadTopUpKeyPool) failed\n");
+        fTopUpThread = false;
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -1456,8 +2060,12 @@ void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
+        // Only make the caller wait for new keys when the pool has run
+        // dry; otherwise it is refilled in the background
+        if (setKeyPool.empty())
             TopUpKeyPool();
+        else
+            StartTopUpKeyPool();
 
         // Get the oldest key
         if(setKeyPool.empty())
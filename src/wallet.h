@@ -16,6 +16,7 @@ class CWalletTx;
 class CReserveKey;
 class CWalletDB;
 class COutput;
+class CAccountingEntry;
 
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
@@ -56,6 +57,65 @@ public:
     )
 };
 
+/** Balance tallies for one wallet state and chain tip.
+ * Rebuilt in a single pass over mapWallet the first time they are asked for
+ * after the wallet or the best chain changed, so polling getbalance/getinfo
+ * between blocks costs a lookup instead of a walk over the whole wallet.
+ */
+class CBalanceCache
+{
+public:
+    uint256 hashTip;        // best chain the tallies hold for
+    bool fTotals;           // nBalance, nUnconfirmed and nImmature are filled in
+    int64 nBalance;
+    int64 nUnconfirmed;
+    int64 nImmature;
+    // by nMinDepth: balance of each account, and of the wallet as getbalance "*" counts it
+    std::map<int, std::map<std::string, int64> > mapAccounts;
+    std::map<int, int64> mapAll;
+
+    CBalanceCache()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        hashTip = 0;
+        fTotals = false;
+        nBalance = 0;
+        nUnconfirmed = 0;
+        nImmature = 0;
+        mapAccounts.clear();
+        mapAll.clear();
+    }
+};
+
+/** Where a wallet rescan has got to, for getrescaninfo */
+class CRescanProgress
+{
+public:
+    bool fRunning;
+    int nStartHeight;
+    int nHeight;
+    int nStopHeight;
+    int nFound;
+    int64 nStartTime;
+
+    CRescanProgress()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        fRunning = false;
+        nStartHeight = nHeight = nStopHeight = -1;
+        nFound = 0;
+        nStartTime = 0;
+    }
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -73,6 +133,14 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // guarded by cs_wallet
+    mutable CBalanceCache balanceCache;
+    bool CheckBalanceCache() const;
+    void TallyBalances() const;
+    void TallyAccountBalances(int nMinDepth) const;
+
+    bool FillKeyPool(unsigned int nSize);
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -93,6 +161,10 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        nOrderPosNext = 0;
+        pindexRescanNext = NULL;
+        fRescanThread = false;
+        fTopUpThread = false;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -102,11 +174,37 @@ public:
         fFileBacked = true;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        nOrderPosNext = 0;
+        pindexRescanNext = NULL;
+        fRescanThread = false;
+        fTopUpThread = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
+
+    // Unspent outputs paying to us, by value.  Kept in step with mapWallet by
+    // UpdateSpendable; depth and finality are checked when coins are selected.
+    typedef std::set<std::pair<int64, std::pair<const CWalletTx*, unsigned int> > > SpendableIndex;
+    SpendableIndex setSpendable;
+
+    // Wallet transactions and accounting entries by nOrderPos, so the
+    // listing RPCs can walk them newest-first without sorting the wallet.
+    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
+    typedef std::multimap<int64, TxPair > TxItems;
+    TxItems wtxOrdered;
+    std::list<CAccountingEntry> laccentries;
+    int64 nOrderPosNext;
+
     std::map<uint256, int> mapRequestCount;
 
+    // Rescan state, guarded by cs_wallet.  pindexRescanNext is where the
+    // background rescan thread starts its next pass, NULL if none is queued.
+    CRescanProgress rescanProgress;
+    CBlockIndex* pindexRescanNext;
+    bool fRescanThread;
+    // A background keypool refill is running; guarded by cs_wallet
+    bool fTopUpThread;
+
     std::map<CTxDestination, std::string> mapAddressBook;
 
     CPubKey vchDefaultKey;
@@ -114,7 +212,7 @@ public:
     // check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
-    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
 
     // keystore implementation
     // Generate a new key
@@ -138,17 +236,34 @@ public:
     bool EncryptWallet(const SecureString& strWalletPassphrase);
 
     void MarkDirty();
+    void UpdateSpendable(const CWalletTx& wtx, bool fErase = false);
+    void RebuildSpendable();
+    // Take the next position in the ordered transaction list, persisting the counter
+    int64 IncOrderPosNext(CWalletDB *pwalletdb = NULL);
+    bool AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb);
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    // Queue a rescan from pindexStart on the background rescan thread
+    void StartRescan(CBlockIndex* pindexStart);
+    // Wait for the background threads to finish; call once fShutdown is set
+    void WaitForThreads();
     int ScanForWalletTransaction(const uint256& hashTx);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
     int64 GetBalance() const;
     int64 GetUnconfirmedBalance() const;
     int64 GetImmatureBalance() const;
+    // Balance of strAccount, or of the whole wallet for "*", counting receives with at least nMinDepth confirmations
+    int64 GetAccountBalance(const std::string& strAccount, int nMinDepth) const;
+    // Drop the cached balances; call after anything that changes what the wallet owns
+    void InvalidateBalances() const
+    {
+        LOCK(cs_wallet);
+        balanceCache.SetNull();
+    }
     bool CreateTransaction(const std::vector<std::pair<CScript, int64> >& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet);
     bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
@@ -157,6 +272,8 @@ public:
 
     bool NewKeyPool();
     bool TopUpKeyPool();
+    // Refill the key pool on a background thread
+    void StartTopUpKeyPool();
     int64 AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool);
     void KeepKey(int64 nIndex);
@@ -307,6 +424,24 @@ public:
 };
 
 
+static void ReadOrderPos(int64& nOrderPos, std::map<std::string, std::string>& mapValue)
+{
+    if (!mapValue.count("n"))
+    {
+        nOrderPos = -1; // assigned by CWalletDB::ReorderTransactions
+        return;
+    }
+    nOrderPos = atoi64(mapValue["n"].c_str());
+}
+
+static void WriteOrderPos(const int64& nOrderPos, std::map<std::string, std::string>& mapValue)
+{
+    if (nOrderPos == -1)
+        return;
+    mapValue["n"] = i64tostr(nOrderPos);
+}
+
+
 /** A transaction with a bunch of additional info that only the owner cares about. 
  * It includes any unrecorded transactions needed to link it back to the block chain.
  */
@@ -324,6 +459,7 @@ public:
     char fFromMe;
     std::string strFromAccount;
     std::vector<char> vfSpent; // which outputs are already spent
+    int64 nOrderPos;  // position in ordered transaction list
 
     // memory only
     mutable bool fDebitCached;
@@ -366,6 +502,7 @@ public:
         fFromMe = false;
         strFromAccount.clear();
         vfSpent.clear();
+        nOrderPos = -1;
         fDebitCached = false;
         fCreditCached = false;
         fAvailableCreditCached = false;
@@ -395,6 +532,8 @@ public:
                     fSpent = true;
             }
             pthis->mapValue["spent"] = str;
+
+            WriteOrderPos(pthis->nOrderPos, pthis->mapValue);
         }
 
         nSerSize += SerReadWrite(s, *(CMerkleTx*)this, nType, nVersion,ser_action);
@@ -415,11 +554,14 @@ public:
                     pthis->vfSpent.push_back(c != '0');
             else
                 pthis->vfSpent.assign(vout.size(), fSpent);
+
+            ReadOrderPos(pthis->nOrderPos, pthis->mapValue);
         }
 
         pthis->mapValue.erase("fromaccount");
         pthis->mapValue.erase("version");
         pthis->mapValue.erase("spent");
+        pthis->mapValue.erase("n");
     )
 
     // marks certain txout's as spent
@@ -708,6 +850,9 @@ public:
     int64 nTime;
     std::string strOtherAccount;
     std::string strComment;
+    std::map<std::string, std::string> mapValue;
+    int64 nOrderPos;  // position in ordered transaction list
+    uint64 nEntryNo;  // counter in the database key, memory only
 
     CAccountingEntry()
     {
@@ -721,18 +866,60 @@ public:
         strAccount.clear();
         strOtherAccount.clear();
         strComment.clear();
+        mapValue.clear();
+        nOrderPos = -1;
+        nEntryNo = 0;
+        _ssExtra.clear();
     }
 
+    // Older clients have no field for mapValue, so it travels after a NUL
+    // at the end of strComment; they just show a slightly odd comment.
     IMPLEMENT_SERIALIZE
     (
+        CAccountingEntry& me = *const_cast<CAccountingEntry*>(this);
         if (!(nType & SER_GETHASH))
             READWRITE(nVersion);
         // Note: strAccount is serialized as part of the key, not here.
         READWRITE(nCreditDebit);
         READWRITE(nTime);
         READWRITE(strOtherAccount);
+
+        if (!fRead)
+        {
+            WriteOrderPos(nOrderPos, me.mapValue);
+
+            if (!(mapValue.empty() && _ssExtra.empty()))
+            {
+                CDataStream ss(nType, nVersion);
+                ss.insert(ss.begin(), '\0');
+                ss << mapValue;
+                ss.insert(ss.end(), _ssExtra.begin(), _ssExtra.end());
+                me.strComment.append(ss.str());
+            }
+        }
+
         READWRITE(strComment);
+
+        size_t nSepPos = strComment.find("\0", 0, 1);
+        if (fRead)
+        {
+            me.mapValue.clear();
+            if (std::string::npos != nSepPos)
+            {
+                CDataStream ss(std::vector<char>(strComment.begin() + nSepPos + 1, strComment.end()), nType, nVersion);
+                ss >> me.mapValue;
+                me._ssExtra = std::vector<char>(ss.begin(), ss.end());
+            }
+            ReadOrderPos(me.nOrderPos, me.mapValue);
+        }
+        if (std::string::npos != nSepPos)
+            me.strComment.erase(nSepPos);
+
+        me.mapValue.erase("n");
     )
+
+private:
+    std::vector<char> _ssExtra;
 };
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
@@ -7,6 +7,7 @@
 #include "walletdb.h"
 #include "wallet.h"
 #include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace boost;
@@ -43,9 +44,16 @@ bool CWalletDB::WriteAccount(const string& strAccount, const CAccount& account)
     return Write(make_pair(string("acc"), strAccount), account);
 }
 
-bool CWalletDB::WriteAccountingEntry(const CAccountingEntry& acentry)
+bool CWalletDB::WriteAccountingEntry(const uint64 nAccEntryNum, const CAccountingEntry& acentry)
 {
-    return Write(boost::make_tuple(string("acentry"), acentry.strAccount, ++nAccountingEntryNumber), acentry);
+    nWalletDBUpdated++;
+    return Write(boost::make_tuple(string("acentry"), acentry.strAccount, nAccEntryNum), acentry);
+}
+
+bool CWalletDB::WriteAccountingEntry(CAccountingEntry& acentry)
+{
+    acentry.nEntryNo = ++nAccountingEntryNumber;
+    return WriteAccountingEntry(acentry.nEntryNo, acentry);
 }
 
 int64 CWalletDB::GetAccountCreditDebit(const string& strAccount)
@@ -94,6 +102,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
         ssKey >> acentry.strAccount;
         if (!fAllAccounts && acentry.strAccount != strAccount)
             break;
+        ssKey >> acentry.nEntryNo;
 
         ssValue >> acentry;
         entries.push_back(acentry);
@@ -103,12 +112,185 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 }
 
 
+// Wallets written before nOrderPos existed, or by an older client since,
+// have entries without a position: slot those in by time, shifting the
+// positions after them, and write back whatever moved.
+int CWalletDB::ReorderTransactions(CWallet* pwallet)
+{
+    typedef CWallet::TxPair TxPair;
+    typedef CWallet::TxItems TxItems;
+    TxItems txByTime;
+
+    for (map<uint256, CWalletTx>::iterator it = pwallet->mapWallet.begin(); it != pwallet->mapWallet.end(); ++it)
+    {
+        CWalletTx* wtx = &((*it).second);
+        txByTime.insert(make_pair(wtx->GetTxTime(), TxPair(wtx, (CAccountingEntry*)0)));
+    }
+    BOOST_FOREACH(CAccountingEntry& entry, pwallet->laccentries)
+    {
+        txByTime.insert(make_pair(entry.nTime, TxPair((CWalletTx*)0, &entry)));
+    }
+
+    int64& nOrderPosNext = pwallet->nOrderPosNext;
+    nOrderPosNext = 0;
+    vector<int64> nOrderPosOffsets;
+    for (TxItems::iterator it = txByTime.begin(); it != txByTime.end(); ++it)
+    {
+        CWalletTx *const pwtx = (*it).second.first;
+        CAccountingEntry *const pacentry = (*it).second.second;
+        int64& nOrderPos = (pwtx != 0) ? pwtx->nOrderPos : pacentry->nOrderPos;
+
+        if (nOrderPos == -1)
+        {
+            nOrderPos = nOrderPosNext++;
+            nOrderPosOffsets.push_back(nOrderPos);
+        }
+        else
+        {
+            int64 nOrderPosOff = 0;
+            BOOST_FOREACH(const int64& nOffsetStart, nOrderPosOffsets)
+            {
+                if (nOrderPos >= nOffsetStart)
+                    ++nOrderPosOff;
+            }
+            nOrderPos += nOrderPosOff;
+            nOrderPosNext = std::max(nOrderPosNext, nOrderPos + 1);
+
+            if (!nOrderPosOff)
+                continue;
+        }
+
+        // The position changed, so write it back
+        if (pwtx)
+        {
+            if (!WriteTx(pwtx->GetHash(), *pwtx))
+                return DB_LOAD_FAIL;
+        }
+        else if (!WriteAccountingEntry(pacentry->nEntryNo, *pacentry))
+            return DB_LOAD_FAIL;
+    }
+    if (!WriteOrderPosNext(nOrderPosNext))
+        return DB_LOAD_FAIL;
+
+    return DB_LOAD_OK;
+}
+
+// Transaction and key records are decoded on worker threads a chunk at a
+// time, then merged into the wallet in cursor order.  The other record
+// types are cheap and are still handled at the cursor.
+static const unsigned int nLoadChunkSize = 16384;
+
+struct CWalletTxRecord
+{
+    CDataStream ssValue;
+    uint256 hash;
+    CWalletTx* pwtx;
+    bool fUpgraded;
+    bool fError;
+
+    CWalletTxRecord() : ssValue(SER_DISK, CLIENT_VERSION), pwtx(NULL), fUpgraded(false), fError(false) { }
+};
+
+struct CWalletKeyRecord
+{
+    CDataStream ssValue;
+    vector<unsigned char> vchPubKey;
+    bool fWalletKey;
+    CKey key;
+    const char* pszError;
+
+    CWalletKeyRecord() : ssValue(SER_DISK, CLIENT_VERSION), fWalletKey(false), pszError(NULL) { }
+};
+
+static void DecodeTxRecord(CWalletTxRecord& rec)
+{
+    rec.fUpgraded = rec.fError = false;
+    try
+    {
+        CWalletTx& wtx = *rec.pwtx;
+        rec.ssValue >> wtx;
+
+        if (wtx.GetHash() != rec.hash)
+            printf("Error in wallet.dat, hash mismatch\n");
+
+        // Undo serialize changes in 31600
+        if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+        {
+            if (!rec.ssValue.empty())
+            {
+                char fTmp;
+                char fUnused;
+                rec.ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+                printf("LoadWallet() upgrading tx ver=%d %d '%s' %s\n", wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), rec.hash.ToString().c_str());
+                wtx.fTimeReceivedIsTxTime = fTmp;
+            }
+            else
+            {
+                printf("LoadWallet() repairing tx ver=%d %s\n", wtx.fTimeReceivedIsTxTime, rec.hash.ToString().c_str());
+                wtx.fTimeReceivedIsTxTime = 0;
+            }
+            rec.fUpgraded = true;
+        }
+    }
+    catch (std::exception& e) {
+        rec.fError = true;
+    }
+    rec.ssValue.clear();
+}
+
+static void DecodeKeyRecord(CWalletKeyRecord& rec)
+{
+    rec.pszError = NULL;
+    try
+    {
+        CPrivKey pkey;
+        if (rec.fWalletKey)
+        {
+            CWalletKey wkey;
+            rec.ssValue >> wkey;
+            pkey = wkey.vchPrivKey;
+        }
+        else
+            rec.ssValue >> pkey;
+        rec.key.SetPubKey(rec.vchPubKey);
+        rec.key.SetPrivKey(pkey);
+        if (rec.key.GetPubKey() != rec.vchPubKey)
+            rec.pszError = rec.fWalletKey ? "CWalletKey pubkey inconsistency" : "CPrivKey pubkey inconsistency";
+        else if (!rec.key.IsValid())
+            rec.pszError = rec.fWalletKey ? "invalid CWalletKey" : "invalid CPrivKey";
+    }
+    catch (std::exception& e) {
+        rec.pszError = "unreadable key";
+    }
+    rec.ssValue.clear();
+}
+
+template<typename T>
+static void DecodeRecordsWorker(vector<T>* pvRecords, void (*pfnDecode)(T&), unsigned int nFirst, unsigned int nStride)
+{
+    for (unsigned int i = nFirst; i < pvRecords->size(); i += nStride)
+        pfnDecode((*pvRecords)[i]);
+}
+
+// Decode every record in vRecords, spread over the cores
+template<typename T>
+static void DecodeRecords(vector<T>& vRecords, void (*pfnDecode)(T&))
+{
+    unsigned int nThreads = max(1U, min(boost::thread::hardware_concurrency(), (unsigned int)vRecords.size() / 64));
+    boost::thread_group workers;
+    for (unsigned int i = 1; i < nThreads; i++)
+        workers.create_thread(boost::bind(&DecodeRecordsWorker<T>, &vRecords, pfnDecode, i, nThreads));
+    DecodeRecordsWorker(&vRecords, pfnDecode, 0, nThreads);
+    workers.join_all();
+}
+
 int CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
     int nFileVersion = 0;
     vector<uint256> vWalletUpgrade;
     bool fIsEncrypted = false;
+    bool fAnyUnordered = false;
 
     //// todo: shouldn't we catch exceptions and try to recover and continue?
     {
@@ -129,20 +311,70 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
+        vector<CWalletTxRecord> vTxRecords;
+        vector<CWalletKeyRecord> vKeyRecords;
+        vTxRecords.reserve(nLoadChunkSize);
+        vKeyRecords.reserve(nLoadChunkSize);
+        unsigned int nTxRecords = 0, nKeyRecords = 0, nOtherRecords = 0;
+        int64 nTxTime = 0, nKeyTime = 0, nStart = GetTimeMillis();
         loop
         {
             // Read next record
             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
             int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
+            if (ret != 0 && ret != DB_NOTFOUND)
             {
                 printf("Error reading next record from wallet database\n");
                 return DB_CORRUPT;
             }
 
+            // Decode and merge a full chunk, or what is left at the end
+            if (vTxRecords.size() >= nLoadChunkSize || (ret == DB_NOTFOUND && !vTxRecords.empty()))
+            {
+                int64 nTxStart = GetTimeMillis();
+                DecodeRecords(vTxRecords, &DecodeTxRecord);
+                BOOST_FOREACH(const CWalletTxRecord& rec, vTxRecords)
+                {
+                    if (rec.fError)
+                    {
+                        printf("Error reading wallet database: unreadable tx %s\n", rec.hash.ToString().c_str());
+                        return DB_CORRUPT;
+                    }
+                    rec.pwtx->BindWallet(pwallet);
+                    if (rec.fUpgraded)
+                        vWalletUpgrade.push_back(rec.hash);
+                    if (rec.pwtx->nOrderPos == -1)
+                        fAnyUnordered = true;
+                }
+                nTxRecords += vTxRecords.size();
+                vTxRecords.clear();
+                nTxTime += GetTimeMillis() - nTxStart;
+            }
+            if (vKeyRecords.size() >= nLoadChunkSize || (ret == DB_NOTFOUND && !vKeyRecords.empty()))
+            {
+                int64 nKeyStart = GetTimeMillis();
+                DecodeRecords(vKeyRecords, &DecodeKeyRecord);
+                BOOST_FOREACH(const CWalletKeyRecord& rec, vKeyRecords)
+                {
+                    if (rec.pszError)
+                    {
+                        printf("Error reading wallet database: %s\n", rec.pszError);
+                        return DB_CORRUPT;
+                    }
+                    if (!pwallet->LoadKey(rec.key))
+                    {
+                        printf("Error reading wallet database: LoadKey failed\n");
+                        return DB_CORRUPT;
+                    }
+                }
+                nKeyRecords += vKeyRecords.size();
+                vKeyRecords.clear();
+                nKeyTime += GetTimeMillis() - nKeyStart;
+            }
+            if (ret == DB_NOTFOUND)
+                break;
+
             // Unserialize
             // Taking advantage of the fact that pair serialization
             // is just the two items serialized one after the other
@@ -156,41 +388,12 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
             }
             else if (strType == "tx")
             {
-                uint256 hash;
-                ssKey >> hash;
-                CWalletTx& wtx = pwallet->mapWallet[hash];
-                ssValue >> wtx;
-                wtx.BindWallet(pwallet);
-
-                if (wtx.GetHash() != hash)
-                    printf("Error in wallet.dat, hash mismatch\n");
-
-                // Undo serialize changes in 31600
-                if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-                {
-                    if (!ssValue.empty())
-                    {
-                        char fTmp;
-                        char fUnused;
-                        ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                        printf("LoadWallet() upgrading tx ver=%d %d '%s' %s\n", wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                        wtx.fTimeReceivedIsTxTime = fTmp;
-                    }
-                    else
-                    {
-                        printf("LoadWallet() repairing tx ver=%d %s\n", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                        wtx.fTimeReceivedIsTxTime = 0;
-                    }
-                    vWalletUpgrade.push_back(hash);
-                }
-
-                //// debug print
-                //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
-                //printf(" %12"PRI64d"  %s  %s  %s\n",
-                //    wtx.vout[0].nValue,
-                //    DateTimeStrFormat("%x %H:%M:%S", wtx.GetBlockTime()).c_str(),
-                //    wtx.hashBlock.ToString().substr(0,20).c_str(),
-                //    wtx.mapValue["message"].c_str());
+                vTxRecords.push_back(CWalletTxRecord());
+                CWalletTxRecord& rec = vTxRecords.back();
+                ssKey >> rec.hash;
+                rec.ssValue = ssValue;
+                // Map nodes don't move, so the workers can fill them in place
+                rec.pwtx = &pwallet->mapWallet[rec.hash];
             }
             else if (strType == "acentry")
             {
@@ -200,51 +403,26 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
                 ssKey >> nNumber;
                 if (nNumber > nAccountingEntryNumber)
                     nAccountingEntryNumber = nNumber;
+
+                pwallet->laccentries.push_back(CAccountingEntry());
+                CAccountingEntry& acentry = pwallet->laccentries.back();
+                ssValue >> acentry;
+                acentry.strAccount = strAccount;
+                acentry.nEntryNo = nNumber;
+                if (acentry.nOrderPos == -1)
+                    fAnyUnordered = true;
+            }
+            else if (strType == "orderposnext")
+            {
+                ssValue >> pwallet->nOrderPosNext;
             }
             else if (strType == "key" || strType == "wkey")
             {
-                vector<unsigned char> vchPubKey;
-                ssKey >> vchPubKey;
-                CKey key;
-                if (strType == "key")
-                {
-                    CPrivKey pkey;
-                    ssValue >> pkey;
-                    key.SetPubKey(vchPubKey);
-                    key.SetPrivKey(pkey);
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        printf("Error reading wallet database: CPrivKey pubkey inconsistency\n");
-                        return DB_CORRUPT;
-                    }
-                    if (!key.IsValid())
-                    {
-                        printf("Error reading wallet database: invalid CPrivKey\n");
-                        return DB_CORRUPT;
-                    }
-                }
-                else
-                {
-                    CWalletKey wkey;
-                    ssValue >> wkey;
-                    key.SetPubKey(vchPubKey);
-                    key.SetPrivKey(wkey.vchPrivKey);
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        printf("Error reading wallet database: CWalletKey pubkey inconsistency\n");
-                        return DB_CORRUPT;
-                    }
-                    if (!key.IsValid())
-                    {
-                        printf("Error reading wallet database: invalid CWalletKey\n");
-                        return DB_CORRUPT;
-                    }
-                }
-                if (!pwallet->LoadKey(key))
-                {
-                    printf("Error reading wallet database: LoadKey failed\n");
-                    return DB_CORRUPT;
-                }
+                vKeyRecords.push_back(CWalletKeyRecord());
+                CWalletKeyRecord& rec = vKeyRecords.back();
+                ssKey >> rec.vchPubKey;
+                rec.fWalletKey = (strType == "wkey");
+                rec.ssValue = ssValue;
             }
             else if (strType == "mkey")
             {
@@ -302,8 +480,30 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
                     return DB_CORRUPT;
                 }
             }
+            if (strType != "tx" && strType != "key" && strType != "wkey")
+                nOtherRecords++;
         }
         pcursor->close();
+        printf("LoadWallet: %u tx records in %"PRI64d"ms, %u key records in %"PRI64d"ms, %u other records and cursor in %"PRI64d"ms\n",
+               nTxRecords, nTxTime, nKeyRecords, nKeyTime, nOtherRecords, GetTimeMillis() - nStart - nTxTime - nKeyTime);
+
+        if (fAnyUnordered)
+        {
+            int nResult = ReorderTransactions(pwallet);
+            if (nResult != DB_LOAD_OK)
+                return nResult;
+        }
+
+        pwallet->wtxOrdered.clear();
+        for (map<uint256, CWalletTx>::iterator it = pwallet->mapWallet.begin(); it != pwallet->mapWallet.end(); ++it)
+        {
+            CWalletTx* wtx = &((*it).second);
+            pwallet->wtxOrdered.insert(make_pair(wtx->nOrderPos, CWallet::TxPair(wtx, (CAccountingEntry*)0)));
+        }
+        BOOST_FOREACH(CAccountingEntry& entry, pwallet->laccentries)
+            pwallet->wtxOrdered.insert(make_pair(entry.nOrderPos, CWallet::TxPair((CWalletTx*)0, &entry)));
+
+        pwallet->RebuildSpendable();
     }
 
     BOOST_FOREACH(uint256 hash, vWalletUpgrade)
@@ -116,6 +116,24 @@ public:
         return Read(std::string("bestblock"), locator);
     }
 
+    // Last block an unfinished rescan got through, so it can resume after a restart
+    bool WriteRescanBlock(const CBlockLocator& locator)
+    {
+        nWalletDBUpdated++;
+        return Write(std::string("rescanblock"), locator);
+    }
+
+    bool ReadRescanBlock(CBlockLocator& locator)
+    {
+        return Read(std::string("rescanblock"), locator);
+    }
+
+    bool EraseRescanBlock()
+    {
+        nWalletDBUpdated++;
+        return Erase(std::string("rescanblock"));
+    }
+
     bool ReadDefaultKey(std::vector<unsigned char>& vchPubKey)
     {
         vchPubKey.clear();
@@ -169,12 +187,23 @@ public:
         return Write(std::string("minversion"), nVersion);
     }
 
+    bool WriteOrderPosNext(int64 nOrderPosNext)
+    {
+        nWalletDBUpdated++;
+        return Write(std::string("orderposnext"), nOrderPosNext);
+    }
+
     bool ReadAccount(const std::string& strAccount, CAccount& account);
     bool WriteAccount(const std::string& strAccount, const CAccount& account);
-    bool WriteAccountingEntry(const CAccountingEntry& acentry);
+private:
+    bool WriteAccountingEntry(const uint64 nAccEntryNum, const CAccountingEntry& acentry);
+public:
+    // Writes a new entry and records its database counter in acentry.nEntryNo
+    bool WriteAccountingEntry(CAccountingEntry& acentry);
     int64 GetAccountCreditDebit(const std::string& strAccount);
     void ListAccountCreditDebit(const std::string& strAccount, std::list<CAccountingEntry>& acentries);
 
+    int ReorderTransactions(CWallet* pwallet);
     int LoadWallet(CWallet* pwallet);
 };
 